@@ -8,140 +8,345 @@
 #include "analyzer.h"
 #include "utils.h"
 #include "proc_stat_utils.h"
+#include "cpu_freq.h"
+#include "cpu_states.h"
 #include "printer.h"
+#include "rolling_stats.h"
+#include "archiver.h"
+#include "exporter.h"
+#include "server.h"
+#include "output.h"
+#include "sample_format.h"
+#include "stage.h"
+#include "stats.h"
 #include "thread_utils.h"
-#include "watchdog.h"
+#include "shm_writer.h"
+#include "logger.h"
+
+/* Must be a power of two */
+#define ANALYZER_QUEUE_DEPTH 8
+
+typedef struct {
+    /* CLOCK_REALTIME, only for display and export */
+    long long timestamp_ns;
+    /* Steady time the rolling windows are keyed on, see analyzer_queue_commit_slot() */
+    long long monotonic_ns;
+    int n_cpu_entries;
+    /* Only the producer changes the capacity, while it owns the slot */
+    int max_cpu_entries;
+    ProcStatCpuEntry *cpu_entries;
+    /* Set by analyzer_queue_slot_frequencies(), frequencies then matches cpu_entries */
+    bool has_frequencies;
+    CpuFrequency *frequencies;
+} AnalyzerQueueSlot;
 
 typedef struct {
     AnalyzerArgs *args;
-    ProcStatCpuEntry *cpu_entries_arr[2];
-    int n_cpu_entries_arr[2];
-    int cpu_entries_next_index;
+    AnalyzerQueue *queue;
+    ArchiverQueue *archiver_queue;
+    /* The oldest unreleased slot has already been forwarded to the Archiver */
+    bool oldest_sample_archived;
+    ExporterQueue *exporter_queue;
+    ServerQueue *server_queue;
+    OutputQueue *output_queue;
+    /* The latest sample had more entries than the shared memory segment holds */
+    bool shm_segment_too_small;
     int n_cpu_usage;
+    /* Capacity of cpu_usage, cpu_names and summaries */
+    int max_cpu_entries;
     double *cpu_usage;
+    /* Frequency-weighted cpu_usage, only valid if has_freq_usage */
+    bool has_freq_usage;
+    double *freq_usage;
     char (*cpu_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE];
+    RollingStats stats;
+    /* Window-major, see rolling_stats_summarize() */
+    RollingStatsSummary *summaries;
+    /* Only used if AnalyzerArgs.use_cpu_states, state_counters[current_state_counters] holds the latest sample */
+    bool has_state_counters;
+    int current_state_counters;
+    CpuStateCounters state_counters[2];
+    CpuStateBreakdown states;
 } AnalyzerPrivateState;
 
-static struct {
-    bool analyzer_initialized;
-    int max_cpu_entries;
-    ProcStatCpuEntry *cpu_entries;
-    int n_cpu_entries;
-    bool new_data_submitted;
-} shared;
+static Stage analyzer_stage = STAGE_INITIALIZER;
 
-static pthread_mutex_t analyzer_lock = PTHREAD_MUTEX_INITIALIZER;
+static void
+analyzer_queue_slot_init(void *slot_arg, const void *max_cpu_entries_arg)
+{
+    AnalyzerQueueSlot *slot = slot_arg;
+    int max_cpu_entries = *(const int *)max_cpu_entries_arg;
 
-static pthread_cond_t cond_on_analyzer_initialized = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t cond_on_data_submitted = PTHREAD_COND_INITIALIZER;
+    slot->max_cpu_entries = max_cpu_entries;
+    slot->cpu_entries = emalloc((size_t)max_cpu_entries * sizeof(slot->cpu_entries[0]));
+    slot->frequencies = emalloc((size_t)max_cpu_entries * sizeof(slot->frequencies[0]));
+}
 
-static bool
-analyzer_retrieve_submitted_data(AnalyzerPrivateState *priv)
+static void
+analyzer_queue_slot_destroy(void *slot_arg)
 {
-    bool succ;
+    AnalyzerQueueSlot *slot = slot_arg;
 
-    int iret = pthread_mutex_lock(&analyzer_lock);
-    assert(iret == 0);
-    pthread_cleanup_push(cleanup_mutex_unlock, &analyzer_lock);
+    free(slot->cpu_entries);
+    free(slot->frequencies);
+}
 
-    if (!shared.new_data_submitted) {
-        cond_wait_seconds(&cond_on_data_submitted, &analyzer_lock, 1);
+static void
+analyzer_archive_sample(AnalyzerPrivateState *priv, AnalyzerQueueSlot *slot)
+{
+    if (!priv->archiver_queue) {
+        priv->archiver_queue = archiver_queue_attach();
     }
 
-    if (!shared.new_data_submitted) {
-        succ = false;
-    } else {
-        succ = true;
+    /* Drops are counted and reported by the Archiver */
+    archiver_queue_submit(priv->archiver_queue, slot->timestamp_ns, slot->n_cpu_entries, slot->cpu_entries);
+}
+
+static size_t
+analyzer_summaries_size(AnalyzerPrivateState *priv, int n_cpu_entries)
+{
+    /* At least one element so that the buffer is never empty */
+    size_t n = (size_t)priv->args->windows.n_windows * (size_t)n_cpu_entries;
+    return (n > 0 ? n : 1) * sizeof(priv->summaries[0]);
+}
+
+/*
+ * Make room for the usage of n_cpu_entries entries, more CPUs might have come online.
+ */
+static void
+analyzer_reserve_cpu_entries(AnalyzerPrivateState *priv, int n_cpu_entries)
+{
+    if (n_cpu_entries <= priv->max_cpu_entries) {
+        return;
+    }
+
+    priv->cpu_usage = erealloc(priv->cpu_usage, (size_t)n_cpu_entries * sizeof(priv->cpu_usage[0]));
+    priv->freq_usage = erealloc(priv->freq_usage, (size_t)n_cpu_entries * sizeof(priv->freq_usage[0]));
+    priv->cpu_names = erealloc(priv->cpu_names, (size_t)n_cpu_entries * sizeof(priv->cpu_names[0]));
+    priv->summaries = erealloc(priv->summaries, analyzer_summaries_size(priv, n_cpu_entries));
+    priv->max_cpu_entries = n_cpu_entries;
+}
+
+static bool
+analyzer_same_cpus(const AnalyzerQueueSlot *previous, const AnalyzerQueueSlot *current)
+{
+    if (previous->n_cpu_entries != current->n_cpu_entries) {
+        return false;
+    }
+    for (int i = 0; i < current->n_cpu_entries; i++) {
+        if (strcmp(previous->cpu_entries[i].cpu_name, current->cpu_entries[i].cpu_name) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
 
-        shared.new_data_submitted = false;
+/*
+ * Per-state breakdown between the previous and the current sample. The counters of a sample are
+ * transposed once and kept for the next pair, only the very first previous sample is loaded here.
+ */
+static void
+analyzer_calculate_cpu_states(AnalyzerPrivateState *priv, AnalyzerQueueSlot *previous, AnalyzerQueueSlot *current)
+{
+    CpuStateCounters *previous_counters = &priv->state_counters[priv->current_state_counters];
+    if (!priv->has_state_counters) {
+        cpu_state_counters_load(previous_counters, previous->n_cpu_entries, previous->cpu_entries);
+        priv->has_state_counters = true;
+    }
 
-        ProcStatCpuEntry *dest = priv->cpu_entries_arr[priv->cpu_entries_next_index];
-        memcpy(dest, shared.cpu_entries, (size_t)shared.n_cpu_entries * sizeof(shared.cpu_entries[0]));
-        priv->n_cpu_entries_arr[priv->cpu_entries_next_index] = shared.n_cpu_entries;
+    priv->current_state_counters ^= 1;
+    CpuStateCounters *current_counters = &priv->state_counters[priv->current_state_counters];
+    cpu_state_counters_load(current_counters, current->n_cpu_entries, current->cpu_entries);
 
-        priv->cpu_entries_next_index ^= 1;
+    /*
+     * The breakdown pairs entries by position, which only holds if the set of online CPUs didn't change.
+     * Otherwise it starts over like the usage does: no time elapsed in any state.
+     */
+    if (!analyzer_same_cpus(previous, current)) {
+        previous_counters = current_counters;
     }
 
-    pthread_cleanup_pop(1);
-    return succ;
+    cpu_state_breakdown_calculate(&priv->states, previous_counters, current_counters);
+}
+
+/*
+ * Submit the usage of the latest sample to a stage taking UsageSample slots, attaching to its queue on first use.
+ * Drops are counted and reported by that stage.
+ */
+static void
+analyzer_export_usage(AnalyzerPrivateState *priv, StageQueue **queue, StageQueue * (*queue_attach)(void), long long timestamp_ns,
+        const CpuStateBreakdown *states)
+{
+    if (!*queue) {
+        *queue = queue_attach();
+    }
+    usage_sample_submit(*queue, timestamp_ns, priv->n_cpu_usage, priv->cpu_names, priv->cpu_usage,
+            priv->has_freq_usage ? priv->freq_usage : NULL, states);
 }
 
 static void
 analyzer_process_data(AnalyzerPrivateState *priv)
 {
-    if (priv->n_cpu_entries_arr[0] != priv->n_cpu_entries_arr[1]) {
+    StageQueue *queue = priv->queue;
+
+    if (priv->args->use_archiver && !priv->oldest_sample_archived && stage_queue_n_readable(queue) > 0) {
+        analyzer_archive_sample(priv, stage_queue_peek(queue, 0));
+        priv->oldest_sample_archived = true;
+    }
+
+    /*
+     * The oldest unreleased slot holds the previous sample and is kept around until
+     * the next sample arrives. The very first sample has nothing to be paired with.
+     */
+    if (stage_queue_n_readable(queue) < 2) {
         return;
     }
 
-    ProcStatCpuEntry *previous = priv->cpu_entries_arr[priv->cpu_entries_next_index];
-    ProcStatCpuEntry *current = priv->cpu_entries_arr[priv->cpu_entries_next_index ^ 1];
+    AnalyzerQueueSlot *previous = stage_queue_peek(queue, 0);
+    AnalyzerQueueSlot *current = stage_queue_peek(queue, 1);
 
-    bool bret = calculate_cpu_usage(priv->n_cpu_entries_arr[0], previous, current, priv->cpu_usage);
-    assert(bret);
+    if (priv->args->use_archiver) {
+        analyzer_archive_sample(priv, current);
+    }
+
+    analyzer_reserve_cpu_entries(priv, current->n_cpu_entries);
+
+    /*
+     * At high sampling rates some entries might not advance between samples, they keep their last usage.
+     * That's only meaningful if the position still holds the same CPU, otherwise the set of online CPUs
+     * changed and the usage starts over.
+     */
+    for (int i = 0; i < current->n_cpu_entries; i++) {
+        if (i >= priv->n_cpu_usage || strcmp(priv->cpu_names[i], current->cpu_entries[i].cpu_name) != 0) {
+            priv->cpu_usage[i] = 0;
+            memcpy(priv->cpu_names[i], current->cpu_entries[i].cpu_name, sizeof(current->cpu_entries[0].cpu_name));
+            rolling_stats_reset_entry(&priv->stats, i);
+        }
+    }
+
+    calculate_cpu_usage_by_id(previous->n_cpu_entries, previous->cpu_entries,
+            current->n_cpu_entries, current->cpu_entries, priv->cpu_usage);
 
-    priv->n_cpu_usage = priv->n_cpu_entries_arr[0];
+    priv->n_cpu_usage = current->n_cpu_entries;
+
+    /* The frequency is sampled at the end of the interval, which is as close as it gets */
+    priv->has_freq_usage = false;
+    if (current->has_frequencies) {
+        cpu_freq_weight_usage(priv->n_cpu_usage, current->frequencies, priv->cpu_usage, priv->freq_usage);
+        /* The average is unknown only if no frequency is known at all, e.g. in virtual machines */
+        priv->has_freq_usage = priv->freq_usage[0] >= 0;
+    }
+
+    const CpuStateBreakdown *states = NULL;
+    if (priv->args->use_cpu_states) {
+        analyzer_calculate_cpu_states(priv, previous, current);
+        states = &priv->states;
+    }
 
-    for (int i = 0; i < priv->n_cpu_usage; i++) {
-        memcpy(priv->cpu_names[i], current[i].cpu_name, sizeof(current[0].cpu_name));
+    RollingStatsSummary *summaries = NULL;
+    if (priv->args->windows.n_windows > 0) {
+        rolling_stats_add(&priv->stats, current->monotonic_ns, priv->n_cpu_usage, priv->cpu_usage);
+        rolling_stats_summarize(&priv->stats, priv->n_cpu_usage, priv->summaries);
+        summaries = priv->summaries;
     }
 
-    printer_submit_data(priv->n_cpu_usage, priv->cpu_names, priv->cpu_usage);
+    if (priv->args->shm_writer) {
+        bool bret = shm_writer_publish(priv->args->shm_writer, current->timestamp_ns, priv->n_cpu_usage, priv->cpu_names,
+                priv->cpu_usage, priv->has_freq_usage ? priv->freq_usage : NULL);
+        if (!bret && !priv->shm_segment_too_small) {
+            ELOG("%d CPU entries don't fit into the shared memory segment, such samples aren't published", priv->n_cpu_usage);
+        }
+        priv->shm_segment_too_small = !bret;
+    }
+
+    if (priv->args->use_printer) {
+        printer_submit_data(priv->n_cpu_usage, priv->cpu_names, priv->cpu_usage, priv->has_freq_usage ? priv->freq_usage : NULL,
+                summaries, states);
+    }
+
+    if (priv->args->use_exporter) {
+        /* The metrics file only has the usage */
+        analyzer_export_usage(priv, &priv->exporter_queue, exporter_queue_attach, current->timestamp_ns, NULL);
+    }
+
+    if (priv->args->use_output) {
+        analyzer_export_usage(priv, &priv->output_queue, output_queue_attach, current->timestamp_ns, states);
+    }
+
+    if (priv->args->use_server) {
+        analyzer_export_usage(priv, &priv->server_queue, server_queue_attach, current->timestamp_ns, states);
+    }
+
+    stage_queue_release(queue);
 }
 
 static void
 analyzer_deinit(void *arg)
 {
-    int iret = pthread_mutex_lock(&analyzer_lock);
-    assert(iret == 0);
-    pthread_cleanup_push(cleanup_mutex_unlock, &analyzer_lock);
-
     AnalyzerPrivateState *priv = arg;
 
+    stage_close(&analyzer_stage, priv->queue);
+
+    if (priv->archiver_queue) {
+        archiver_queue_detach(priv->archiver_queue);
+    }
+
+    if (priv->exporter_queue) {
+        exporter_queue_detach(priv->exporter_queue);
+    }
+
+    if (priv->server_queue) {
+        server_queue_detach(priv->server_queue);
+    }
+
+    if (priv->output_queue) {
+        output_queue_detach(priv->output_queue);
+    }
+
+    shm_writer_close(priv->args->shm_writer);
+
     free(priv->args);
-    free(priv->cpu_entries_arr[0]);
-    free(priv->cpu_entries_arr[1]);
     free(priv->cpu_usage);
+    free(priv->freq_usage);
     free(priv->cpu_names);
+    free(priv->summaries);
+    rolling_stats_destroy(&priv->stats);
+    cpu_state_counters_free(&priv->state_counters[0]);
+    cpu_state_counters_free(&priv->state_counters[1]);
+    cpu_state_breakdown_free(&priv->states);
 
     free(priv);
-
-    free(shared.cpu_entries);
-
-    memset(&shared, 0, sizeof(shared));
-
-    pthread_cleanup_pop(1);
 }
 
 static AnalyzerPrivateState *
 analyzer_init(void *arg)
 {
-    AnalyzerPrivateState *priv;
-
-    int iret = pthread_mutex_lock(&analyzer_lock);
-    assert(iret == 0);
-    pthread_cleanup_push(cleanup_mutex_unlock, &analyzer_lock);
-
-    priv = ecalloc(1, sizeof(*priv));
-    memset(&shared, 0, sizeof(shared));
+    AnalyzerPrivateState *priv = ecalloc(1, sizeof(*priv));
 
     priv->args = arg;
 
     int max_cpu_entries = priv->args->max_cpu_entries;
 
-    priv->cpu_entries_arr[0] = emalloc((size_t)max_cpu_entries * sizeof(priv->cpu_entries_arr[0][0]));
-    priv->cpu_entries_arr[1] = emalloc((size_t)max_cpu_entries * sizeof(priv->cpu_entries_arr[1][0]));
-    priv->cpu_usage = emalloc((size_t)max_cpu_entries * sizeof(priv->cpu_usage[0]));
+    priv->max_cpu_entries = max_cpu_entries;
+    priv->cpu_usage = ecalloc((size_t)max_cpu_entries, sizeof(priv->cpu_usage[0]));
+    priv->freq_usage = emalloc((size_t)max_cpu_entries * sizeof(priv->freq_usage[0]));
     priv->cpu_names = emalloc((size_t)max_cpu_entries * sizeof(priv->cpu_names[0]));
-
-    shared.max_cpu_entries = max_cpu_entries;
-    shared.cpu_entries = emalloc((size_t)max_cpu_entries * sizeof(shared.cpu_entries[0]));
-
-    shared.analyzer_initialized = true;
-
-    iret = pthread_cond_signal(&cond_on_analyzer_initialized);
-    assert(iret == 0);
-
-    pthread_cleanup_pop(1);
+    priv->summaries = emalloc(analyzer_summaries_size(priv, max_cpu_entries));
+    rolling_stats_init(&priv->stats, &priv->args->windows);
+
+    StageConfig config = {
+        .name = "Analyzer",
+        .depth = ANALYZER_QUEUE_DEPTH,
+        .slot_size = sizeof(AnalyzerQueueSlot),
+        .backpressure = priv->args->backpressure,
+        .slot_init = analyzer_queue_slot_init,
+        .slot_init_arg = &max_cpu_entries,
+        .slot_destroy = analyzer_queue_slot_destroy,
+        .use_watchdog = priv->args->use_watchdog,
+        .dropped_counter = STATS_COUNTER_ANALYZER_SAMPLES_DROPPED,
+        .depth_gauge = STATS_GAUGE_ANALYZER_QUEUE_DEPTH,
+    };
+    priv->queue = stage_open(&analyzer_stage, &config);
 
     return priv;
 }
@@ -150,13 +355,11 @@ static void
 analyzer_loop(AnalyzerPrivateState *priv)
 {
     while (1) {
-        bool did_retrieve_data = analyzer_retrieve_submitted_data(priv);
+        bool did_retrieve_data = stage_queue_wait(priv->queue, 1);
         if (did_retrieve_data) {
+            long long analyze_start_ns = stats_timer_start();
             analyzer_process_data(priv);
-        }
-
-        if (priv->args->use_watchdog) {
-            watchdog_signal_active("Analyzer");
+            stats_timer_stop(STATS_TIMER_ANALYZE, analyze_start_ns);
         }
     }
 }
@@ -177,26 +380,115 @@ analyzer_run(void *arg)
     pthread_exit(NULL);
 }
 
+AnalyzerQueue *
+analyzer_queue_attach(void)
+{
+    return stage_attach(&analyzer_stage);
+}
+
+void
+analyzer_queue_detach(AnalyzerQueue *queue)
+{
+    stage_detach(&analyzer_stage, queue);
+}
+
+ProcStatCpuEntry *
+analyzer_queue_acquire_slot(AnalyzerQueue *queue, int max_cpu_entries[static 1])
+{
+    AnalyzerQueueSlot *slot = stage_queue_acquire(queue);
+    if (!slot) {
+        return NULL;
+    }
+
+    slot->has_frequencies = false;
+    *max_cpu_entries = slot->max_cpu_entries;
+
+    return slot->cpu_entries;
+}
+
+/*
+ * The slot returned by analyzer_queue_acquire_slot(), acquiring it again returns the same one.
+ */
+static AnalyzerQueueSlot *
+analyzer_queue_acquired_slot(AnalyzerQueue *queue)
+{
+    AnalyzerQueueSlot *slot = stage_queue_acquire(queue);
+    assert(slot);
+    return slot;
+}
+
+ProcStatCpuEntry *
+analyzer_queue_grow_slot(AnalyzerQueue *queue, int min_cpu_entries, int max_cpu_entries[static 1])
+{
+    AnalyzerQueueSlot *slot = analyzer_queue_acquired_slot(queue);
+
+    if (min_cpu_entries > slot->max_cpu_entries) {
+        /* The consumer can't see the slot until it's committed, so it's safe to reallocate it */
+        slot->cpu_entries = erealloc(slot->cpu_entries, (size_t)min_cpu_entries * sizeof(slot->cpu_entries[0]));
+        slot->frequencies = erealloc(slot->frequencies, (size_t)min_cpu_entries * sizeof(slot->frequencies[0]));
+        slot->max_cpu_entries = min_cpu_entries;
+    }
+
+    *max_cpu_entries = slot->max_cpu_entries;
+
+    return slot->cpu_entries;
+}
+
+CpuFrequency *
+analyzer_queue_slot_frequencies(AnalyzerQueue *queue)
+{
+    AnalyzerQueueSlot *slot = analyzer_queue_acquired_slot(queue);
+
+    slot->has_frequencies = true;
+
+    return slot->frequencies;
+}
+
+void
+analyzer_queue_commit_slot(AnalyzerQueue *queue, int n_cpu_entries, long long timestamp_ns, long long monotonic_ns)
+{
+    AnalyzerQueueSlot *slot = analyzer_queue_acquired_slot(queue);
+    assert(n_cpu_entries <= slot->max_cpu_entries);
+
+    slot->timestamp_ns = timestamp_ns;
+    slot->monotonic_ns = monotonic_ns;
+    slot->n_cpu_entries = n_cpu_entries;
+
+    stage_queue_commit(queue);
+}
+
+StageMetrics
+analyzer_queue_metrics(AnalyzerQueue *queue)
+{
+    return stage_queue_metrics(queue);
+}
+
+static void
+analyzer_queue_cleanup_detach(void *queue)
+{
+    analyzer_queue_detach(queue);
+}
+
 bool
 analyzer_submit_data(int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries])
 {
     bool succ;
 
-    int iret = pthread_mutex_lock(&analyzer_lock);
-    assert(iret == 0);
-    pthread_cleanup_push(cleanup_mutex_unlock, &analyzer_lock);
+    AnalyzerQueue *queue = analyzer_queue_attach();
+    pthread_cleanup_push(analyzer_queue_cleanup_detach, queue);
 
-    ensure_initialized(&shared.analyzer_initialized, &cond_on_analyzer_initialized, &analyzer_lock);
+    int max_cpu_entries;
+    ProcStatCpuEntry *slot = analyzer_queue_acquire_slot(queue, &max_cpu_entries);
 
-    if (n_cpu_entries > shared.max_cpu_entries) {
+    if (!slot) {
         succ = false;
     } else {
+        if (n_cpu_entries > max_cpu_entries) {
+            slot = analyzer_queue_grow_slot(queue, n_cpu_entries, &max_cpu_entries);
+        }
         succ = true;
-        memcpy(shared.cpu_entries, cpu_entries, (size_t)n_cpu_entries * sizeof(cpu_entries[0]));
-        shared.n_cpu_entries = n_cpu_entries;
-        shared.new_data_submitted = true;
-
-        pthread_cond_signal(&cond_on_data_submitted);
+        memcpy(slot, cpu_entries, (size_t)n_cpu_entries * sizeof(cpu_entries[0]));
+        analyzer_queue_commit_slot(queue, n_cpu_entries, clock_now_ns(CLOCK_REALTIME), clock_now_ns(CLOCK_MONOTONIC));
     }
 
     pthread_cleanup_pop(1);
@@ -2,14 +2,95 @@
 #define ANALYZER_H
 
 #include "proc_stat_utils.h"
+#include "cpu_freq.h"
+#include "rolling_stats.h"
+#include "stage.h"
+#include "shm_writer.h"
 
 typedef struct {
+    /* Initial capacity of the buffers, they grow when more CPUs come online */
     int max_cpu_entries;
+    /* Rolling statistics of the usage sent to the Printer along with every sample, can be empty */
+    RollingStatsWindows windows;
+    /* Calculate the per-state breakdown (cpu_states.h) of every sample, for the Printer, the Output and the Server */
+    bool use_cpu_states;
+    /* Send the usage of every sample to the Printer thread, which must be running */
+    bool use_printer;
+    /* Forward every sample to the Archiver thread, which must be running */
+    bool use_archiver;
+    /* Send the usage of every sample to the Exporter thread, which must be running */
+    bool use_exporter;
+    /* Send the usage of every sample to the Output thread, which must be running */
+    bool use_output;
+    /* Send the usage of every sample to the Server thread, which must be running */
+    bool use_server;
+    /* If not NULL the usage of every sample is also published to this segment, Analyzer takes ownership of it */
+    ShmWriter *shm_writer;
+    /* What producers do when the input queue is full, e.g. wait when replaying as fast as possible */
+    StageBackpressure backpressure;
     bool use_watchdog;
 } AnalyzerArgs;
 
 void * analyzer_run(void *arg);
 
+/*
+ * Input queue of the Analyzer, a stage queue (stage.h) of preallocated snapshot slots,
+ * so only one thread at a time may submit data to the Analyzer.
+ */
+typedef StageQueue AnalyzerQueue;
+
+/*
+ * Attach to the Analyzer's input queue as its producer.
+ * Blocks until the Analyzer thread is initialized.
+ * The returned queue stays valid until analyzer_queue_detach() is called, even if
+ * the Analyzer thread exits in the meantime.
+ */
+AnalyzerQueue * analyzer_queue_attach(void);
+
+void analyzer_queue_detach(AnalyzerQueue *queue);
+
+/*
+ * Get the next free slot of the queue so that it can be filled in place.
+ * max_cpu_entries is set to the number of entries the slot can hold.
+ * If the queue is full, i.e. the Analyzer hasn't caught up yet, either waits for a free slot or
+ * returns NULL and counts the sample as dropped, depending on AnalyzerArgs.backpressure.
+ * Calling this function again before analyzer_queue_commit_slot() returns the same slot.
+ */
+ProcStatCpuEntry * analyzer_queue_acquire_slot(AnalyzerQueue *queue, int max_cpu_entries[static 1]);
+
+/*
+ * Enlarge the slot returned by analyzer_queue_acquire_slot() so that it holds at least min_cpu_entries
+ * entries, for snapshots that don't fit into it.
+ * max_cpu_entries is set to the new capacity. Returns the slot, which might have moved.
+ */
+ProcStatCpuEntry * analyzer_queue_grow_slot(AnalyzerQueue *queue, int min_cpu_entries, int max_cpu_entries[static 1]);
+
+/*
+ * Frequencies of the CPUs of the slot returned by analyzer_queue_acquire_slot(), to be filled in place,
+ * one per entry of the slot. Only slots for which this function was called carry frequencies.
+ */
+CpuFrequency * analyzer_queue_slot_frequencies(AnalyzerQueue *queue);
+
+/*
+ * Hand the slot returned by analyzer_queue_acquire_slot() over to the Analyzer.
+ * timestamp_ns is the CLOCK_REALTIME time at which the sample was taken, it's only displayed and exported.
+ * monotonic_ns is the CLOCK_MONOTONIC time of the same sample, the rolling statistics are windowed on it
+ * so that a wall clock step (NTP, settimeofday) doesn't empty or freeze the windows.
+ */
+void analyzer_queue_commit_slot(AnalyzerQueue *queue, int n_cpu_entries, long long timestamp_ns, long long monotonic_ns);
+
+/*
+ * Samples submitted and dropped since the Analyzer started.
+ */
+StageMetrics analyzer_queue_metrics(AnalyzerQueue *queue);
+
+/*
+ * Copy cpu_entries into the Analyzer's input queue.
+ * Convenience wrapper around the functions above for producers that don't fill the slots in place.
+ * The sample is timestamped with the current time.
+ * Blocks until the Analyzer thread is initialized.
+ * Returns false if the sample was dropped because the queue was full.
+ */
 bool analyzer_submit_data(int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries]);
 
 #endif /* ANALYZER_H */
@@ -0,0 +1,177 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "archiver.h"
+#include "utils.h"
+#include "proc_stat_utils.h"
+#include "history.h"
+#include "stage.h"
+#include "stats.h"
+#include "logger.h"
+
+/* Must be a power of two. Deep enough to ride out slow disk writes at the highest sampling rate. */
+#define ARCHIVER_QUEUE_DEPTH 64
+
+typedef struct {
+    long long timestamp_ns;
+    int n_cpu_entries;
+    /* Only the producer changes the capacity, while it owns the slot */
+    int max_cpu_entries;
+    ProcStatCpuEntry *cpu_entries;
+} ArchiverQueueSlot;
+
+typedef struct {
+    ArchiverArgs *args;
+    ArchiverQueue *queue;
+    bool too_many_cpus_reported;
+} ArchiverPrivateState;
+
+static Stage archiver_stage = STAGE_INITIALIZER;
+
+static void
+archiver_queue_slot_init(void *slot_arg, const void *max_cpu_entries_arg)
+{
+    ArchiverQueueSlot *slot = slot_arg;
+    int max_cpu_entries = *(const int *)max_cpu_entries_arg;
+
+    slot->max_cpu_entries = max_cpu_entries;
+    slot->cpu_entries = emalloc((size_t)max_cpu_entries * sizeof(slot->cpu_entries[0]));
+}
+
+static void
+archiver_queue_slot_destroy(void *slot_arg)
+{
+    ArchiverQueueSlot *slot = slot_arg;
+
+    free(slot->cpu_entries);
+}
+
+/*
+ * Write out everything that is in the queue.
+ */
+static void
+archiver_write_submitted_data(ArchiverPrivateState *priv)
+{
+    while (stage_queue_n_readable(priv->queue) > 0) {
+        ArchiverQueueSlot *slot = stage_queue_peek(priv->queue, 0);
+
+        if (priv->args->history && slot->n_cpu_entries > history_writer_max_cpu_entries(priv->args->history)) {
+            /* The history file was created for fewer CPUs than are online now */
+            if (!priv->too_many_cpus_reported) {
+                ELOG("Snapshot has more CPUs than the history file supports, skipping such snapshots");
+                priv->too_many_cpus_reported = true;
+            }
+        } else if (priv->args->history) {
+            bool bret = history_writer_append(priv->args->history, slot->timestamp_ns, slot->n_cpu_entries, slot->cpu_entries);
+            if (!bret) {
+                ELOG("Failed to append to the history, archiving stopped");
+                history_writer_close(priv->args->history);
+                priv->args->history = NULL;
+            }
+        }
+
+        stage_queue_release(priv->queue);
+    }
+}
+
+static void
+archiver_deinit(void *arg)
+{
+    ArchiverPrivateState *priv = arg;
+
+    stage_close(&archiver_stage, priv->queue);
+
+    history_writer_close(priv->args->history);
+    free(priv->args);
+
+    free(priv);
+}
+
+static ArchiverPrivateState *
+archiver_init(void *arg)
+{
+    ArchiverPrivateState *priv = ecalloc(1, sizeof(*priv));
+
+    priv->args = arg;
+
+    StageConfig config = {
+        .name = "Archiver",
+        .depth = ARCHIVER_QUEUE_DEPTH,
+        .slot_size = sizeof(ArchiverQueueSlot),
+        .backpressure = STAGE_BACKPRESSURE_DROP,
+        .slot_init = archiver_queue_slot_init,
+        .slot_init_arg = &priv->args->max_cpu_entries,
+        .slot_destroy = archiver_queue_slot_destroy,
+        .use_watchdog = priv->args->use_watchdog,
+        .dropped_counter = STATS_COUNTER_ARCHIVER_SAMPLES_DROPPED,
+        .depth_gauge = STATS_GAUGE_ARCHIVER_QUEUE_DEPTH,
+    };
+    priv->queue = stage_open(&archiver_stage, &config);
+
+    return priv;
+}
+
+static void
+archiver_loop(ArchiverPrivateState *priv)
+{
+    while (1) {
+        bool did_retrieve_data = stage_queue_wait(priv->queue, 1);
+        if (did_retrieve_data) {
+            archiver_write_submitted_data(priv);
+        }
+    }
+}
+
+void *
+archiver_run(void *arg)
+{
+    assert(arg);
+
+    ArchiverPrivateState *priv = archiver_init(arg);
+
+    pthread_cleanup_push(archiver_deinit, priv);
+
+    archiver_loop(priv);
+
+    pthread_cleanup_pop(1);
+
+    pthread_exit(NULL);
+}
+
+ArchiverQueue *
+archiver_queue_attach(void)
+{
+    return stage_attach(&archiver_stage);
+}
+
+void
+archiver_queue_detach(ArchiverQueue *queue)
+{
+    stage_detach(&archiver_stage, queue);
+}
+
+bool
+archiver_queue_submit(ArchiverQueue *queue, long long timestamp_ns, int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries])
+{
+    ArchiverQueueSlot *slot = stage_queue_acquire(queue);
+    if (!slot) {
+        return false;
+    }
+
+    if (n_cpu_entries > slot->max_cpu_entries) {
+        /* The consumer can't see the slot until it's committed, so it's safe to reallocate it */
+        slot->cpu_entries = erealloc(slot->cpu_entries, (size_t)n_cpu_entries * sizeof(slot->cpu_entries[0]));
+        slot->max_cpu_entries = n_cpu_entries;
+    }
+    slot->timestamp_ns = timestamp_ns;
+    slot->n_cpu_entries = n_cpu_entries;
+    memcpy(slot->cpu_entries, cpu_entries, (size_t)n_cpu_entries * sizeof(cpu_entries[0]));
+
+    stage_queue_commit(queue);
+
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef ARCHIVER_H
+#define ARCHIVER_H
+
+#include "history.h"
+#include "stage.h"
+
+typedef struct {
+    /* Archiver takes ownership of the history */
+    HistoryWriter *history;
+    /* Initial capacity of the queue slots, they grow when more CPUs come online */
+    int max_cpu_entries;
+    bool use_watchdog;
+} ArchiverArgs;
+
+/*
+ * Thread that appends the snapshots submitted to its queue to a history file,
+ * so that the threads producing them never wait for the disk.
+ */
+void * archiver_run(void *arg);
+
+/*
+ * Input queue of the Archiver, a stage queue (stage.h) of preallocated snapshot slots,
+ * so only one thread at a time may submit data to the Archiver.
+ */
+typedef StageQueue ArchiverQueue;
+
+/*
+ * Attach to the Archiver's input queue as its producer.
+ * Blocks until the Archiver thread is initialized.
+ * The returned queue stays valid until archiver_queue_detach() is called, even if
+ * the Archiver thread exits in the meantime.
+ */
+ArchiverQueue * archiver_queue_attach(void);
+
+void archiver_queue_detach(ArchiverQueue *queue);
+
+/*
+ * Copy a snapshot into the queue. Never blocks.
+ * Returns false if the queue is full (the snapshot is then counted as dropped).
+ */
+bool archiver_queue_submit(ArchiverQueue *queue, long long timestamp_ns, int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries]);
+
+#endif /* ARCHIVER_H */
@@ -0,0 +1,1448 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/sysinfo.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#include "utils.h"
+#include "proc_stat_utils.h"
+#include "cpu_states.h"
+#include "cpu_freq.h"
+#include "rolling_stats.h"
+#include "process_scanner.h"
+#include "thread_utils.h"
+#include "analyzer.h"
+#include "history.h"
+#include "server.h"
+#include "sample_format.h"
+#include "output.h"
+#include "shm_writer.h"
+#include "shm_reader.h"
+#include "printer.h"
+#include "screen.h"
+#include "layout.h"
+#include "logger.h"
+#include "watchdog.h"
+#include "stats.h"
+
+/*
+ * Every benchmark is run with a doubling number of iterations until a single run
+ * takes at least this long. Only the last run is reported.
+ */
+#define BENCH_MIN_DURATION_NS (250LL * 1000 * 1000)
+
+/*
+ * Run the benchmarked operation the specified number of times.
+ */
+typedef void (*BenchFunction)(void *ctx, long iterations);
+
+static const char *bench_filter;
+
+static bool
+bench_enabled(const char *name)
+{
+    return !bench_filter || strstr(name, bench_filter);
+}
+
+/*
+ * Results are printed one per line as space separated key=value pairs:
+ *  bench=NAME threads=N iterations=N ns_per_op=X ops_per_sec=X [extra fields]
+ * Existing keys are never renamed or reordered, so the output can be compared between releases.
+ */
+static void
+bench_report(const char *name, int n_threads, long iterations, long long elapsed_ns, const char *extra)
+{
+    double ns_per_op = (double)elapsed_ns / (double)iterations;
+    printf("bench=%s threads=%d iterations=%ld ns_per_op=%.1f ops_per_sec=%.0f%s%s\n",
+            name, n_threads, iterations, ns_per_op, 1e9 / ns_per_op, extra ? " " : "", extra ? extra : "");
+    fflush(stdout);
+}
+
+static long
+bench_calibrate(BenchFunction fn, void *ctx, long long elapsed_ns[static 1])
+{
+    long iterations = 1;
+    while (1) {
+        long long start_ns = clock_now_ns(CLOCK_MONOTONIC);
+        fn(ctx, iterations);
+        *elapsed_ns = clock_now_ns(CLOCK_MONOTONIC) - start_ns;
+
+        if (*elapsed_ns >= BENCH_MIN_DURATION_NS) {
+            return iterations;
+        }
+        iterations *= 2;
+    }
+}
+
+static void
+bench_run(const char *name, BenchFunction fn, void *ctx)
+{
+    if (!bench_enabled(name)) {
+        return;
+    }
+
+    long long elapsed_ns;
+    long iterations = bench_calibrate(fn, ctx, &elapsed_ns);
+    bench_report(name, 1, iterations, elapsed_ns, NULL);
+}
+
+/*
+ * Redirect stdout to /dev/null, returns the descriptor to pass to stdout_restore().
+ */
+static int
+stdout_silence(void)
+{
+    fflush(stdout);
+    int saved_fd = dup(STDOUT_FILENO);
+    assert(saved_fd >= 0);
+    int null_fd = open("/dev/null", O_WRONLY);
+    assert(null_fd >= 0);
+    int iret = dup2(null_fd, STDOUT_FILENO);
+    assert(iret >= 0);
+    iret = close(null_fd);
+    assert(iret == 0);
+    return saved_fd;
+}
+
+static void
+stdout_restore(int saved_fd)
+{
+    fflush(stdout);
+    int iret = dup2(saved_fd, STDOUT_FILENO);
+    assert(iret >= 0);
+    iret = close(saved_fd);
+    assert(iret == 0);
+}
+
+typedef struct {
+    int max_cpu_entries;
+    FILE *proc_stat_file;
+    int proc_stat_fd;
+    ProcStatBuffer proc_stat_buffer;
+    ProcStatCpuEntry *cpu_entries;
+    ProcStatCpuEntry *previous_cpu_entries;
+    int n_cpu_entries;
+    double *cpu_usage;
+    char (*cpu_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE];
+} BenchData;
+
+static void
+bench_parse_file(void *ctx, long iterations)
+{
+    BenchData *data = ctx;
+    for (long i = 0; i < iterations; i++) {
+        int ret = read_and_parse_proc_stat_file(data->proc_stat_file, data->max_cpu_entries, data->cpu_entries);
+        assert(ret > 1);
+        (void)(ret);
+    }
+}
+
+static void
+bench_parse_fd(void *ctx, long iterations)
+{
+    BenchData *data = ctx;
+    for (long i = 0; i < iterations; i++) {
+        int ret = read_and_parse_proc_stat_fd(data->proc_stat_fd, &data->proc_stat_buffer, data->max_cpu_entries, data->cpu_entries);
+        assert(ret > 1);
+        (void)(ret);
+    }
+}
+
+static void
+bench_calculate(void *ctx, long iterations)
+{
+    BenchData *data = ctx;
+    for (long i = 0; i < iterations; i++) {
+        calculate_cpu_usage(data->n_cpu_entries, data->previous_cpu_entries, data->cpu_entries, data->cpu_usage);
+    }
+}
+
+static void
+bench_print(void *ctx, long iterations)
+{
+    BenchData *data = ctx;
+    for (long i = 0; i < iterations; i++) {
+        print_cpu_usage(data->n_cpu_entries, data->cpu_names, data->cpu_usage);
+    }
+    fflush(stdout);
+}
+
+static void
+bench_analyzer_submit(void *ctx, long iterations)
+{
+    BenchData *data = ctx;
+    for (long i = 0; i < iterations; i++) {
+        /* Retry until accepted so that the result reflects the throughput of the whole Analyzer->Printer path */
+        while (!analyzer_submit_data(data->n_cpu_entries, data->cpu_entries)) {
+            sched_yield();
+        }
+        /* Make sure consecutive samples differ */
+        data->cpu_entries[0].user++;
+        data->cpu_entries[0].idle++;
+    }
+}
+
+static void
+bench_printer_submit(void *ctx, long iterations)
+{
+    BenchData *data = ctx;
+    for (long i = 0; i < iterations; i++) {
+        printer_submit_data(data->n_cpu_entries, data->cpu_names, data->cpu_usage, NULL, NULL, NULL);
+    }
+}
+
+static void
+bench_pipeline_stages(BenchData *data)
+{
+    /*
+     * The handoff benchmarks need the consuming threads running.
+     * Their output goes to /dev/null, as does the benchmark's during the measurement.
+     */
+    bool run_analyzer = bench_enabled("analyzer_submit_data");
+    bool run_printer = bench_enabled("printer_submit_data");
+    if (!run_analyzer && !run_printer) {
+        return;
+    }
+
+    AnalyzerArgs *analyzer_args = ecalloc(1, sizeof(*analyzer_args));
+    analyzer_args->max_cpu_entries = data->max_cpu_entries;
+    analyzer_args->use_printer = true;
+
+    PrinterArgs *printer_args = ecalloc(1, sizeof(*printer_args));
+    printer_args->max_cpu_entries = data->max_cpu_entries;
+
+    pthread_t analyzer;
+    pthread_t printer;
+
+    int saved_stdout = stdout_silence();
+
+    int iret = pthread_create(&analyzer, NULL, analyzer_run, analyzer_args);
+    assert(iret == 0);
+    iret = pthread_create(&printer, NULL, printer_run, printer_args);
+    assert(iret == 0);
+
+    long long analyzer_elapsed_ns = 0;
+    long analyzer_iterations = 0;
+    unsigned long n_dropped = 0;
+    if (run_analyzer) {
+        AnalyzerQueue *queue = analyzer_queue_attach();
+        analyzer_iterations = bench_calibrate(bench_analyzer_submit, data, &analyzer_elapsed_ns);
+        n_dropped = analyzer_queue_metrics(queue).n_dropped;
+        analyzer_queue_detach(queue);
+    }
+
+    long long printer_elapsed_ns = 0;
+    long printer_iterations = 0;
+    if (run_printer) {
+        printer_iterations = bench_calibrate(bench_printer_submit, data, &printer_elapsed_ns);
+    }
+
+    iret = pthread_cancel(analyzer);
+    assert(iret == 0);
+    iret = pthread_cancel(printer);
+    assert(iret == 0);
+    iret = pthread_join(analyzer, NULL);
+    assert(iret == 0);
+    iret = pthread_join(printer, NULL);
+    assert(iret == 0);
+
+    stdout_restore(saved_stdout);
+
+    if (run_analyzer) {
+        char extra[64];
+        snprintf(extra, sizeof(extra), "queue_full=%lu", n_dropped);
+        bench_report("analyzer_submit_data", 1, analyzer_iterations, analyzer_elapsed_ns, extra);
+    }
+    if (run_printer) {
+        bench_report("printer_submit_data", 1, printer_iterations, printer_elapsed_ns, NULL);
+    }
+}
+
+typedef struct {
+    int n_cpu_entries;
+    char (*cpu_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE];
+    double *cpu_usage;
+    Screen screen;
+    Layout layout;
+    int terminal_rows;
+    int terminal_cols;
+    unsigned seed;
+} RenderBenchContext;
+
+static void
+bench_render_context_init(RenderBenchContext rctx[static 1], int n_cores)
+{
+    memset(rctx, 0, sizeof(*rctx));
+    rctx->n_cpu_entries = n_cores + 1;
+    rctx->cpu_names = emalloc((size_t)rctx->n_cpu_entries * sizeof(rctx->cpu_names[0]));
+    rctx->cpu_usage = ecalloc((size_t)rctx->n_cpu_entries, sizeof(rctx->cpu_usage[0]));
+    for (int i = 0; i < rctx->n_cpu_entries; i++) {
+        snprintf(rctx->cpu_names[i], sizeof(rctx->cpu_names[i]), i == 0 ? "cpu" : "cpu%d", i - 1);
+    }
+    screen_init(&rctx->screen, 0, 0);
+    rctx->seed = 1;
+}
+
+static void
+bench_render_context_destroy(RenderBenchContext rctx[static 1])
+{
+    screen_destroy(&rctx->screen);
+    free(rctx->cpu_names);
+    free(rctx->cpu_usage);
+}
+
+/*
+ * Change the usage of about a tenth of the CPUs, like a mostly idle many-core machine does between frames.
+ */
+static void
+bench_render_update_usage(RenderBenchContext *rctx)
+{
+    for (int i = 0; i < rctx->n_cpu_entries / 10; i++) {
+        rctx->seed = rctx->seed * 1103515245u + 12345u;
+        rctx->cpu_usage[(rctx->seed >> 8) % (unsigned)rctx->n_cpu_entries] = (double)(rctx->seed % 1000) / 10;
+    }
+}
+
+static void
+bench_render_print(void *ctx, long iterations)
+{
+    RenderBenchContext *rctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        bench_render_update_usage(rctx);
+        print_cpu_usage(rctx->n_cpu_entries, rctx->cpu_names, rctx->cpu_usage);
+    }
+    fflush(stdout);
+}
+
+static void
+bench_render_screen(void *ctx, long iterations)
+{
+    RenderBenchContext *rctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        bench_render_update_usage(rctx);
+        layout_draw(&rctx->screen, rctx->layout, rctx->terminal_rows, rctx->terminal_cols,
+                rctx->n_cpu_entries, rctx->cpu_names, rctx->cpu_usage, NULL, NULL, NULL, NULL);
+        bool bret = screen_flush(&rctx->screen, STDOUT_FILENO);
+        assert(bret);
+        (void)(bret);
+    }
+}
+
+/*
+ * Average size of the output of a frame with the context's layout.
+ */
+static double
+bench_render_bytes_per_frame(RenderBenchContext *rctx)
+{
+    int n_frames = 100;
+    size_t n_bytes = 0;
+    for (int i = 0; i < n_frames; i++) {
+        bench_render_update_usage(rctx);
+        layout_draw(&rctx->screen, rctx->layout, rctx->terminal_rows, rctx->terminal_cols,
+                rctx->n_cpu_entries, rctx->cpu_names, rctx->cpu_usage, NULL, NULL, NULL, NULL);
+        size_t length;
+        screen_compose(&rctx->screen, &length);
+        n_bytes += length;
+    }
+    return (double)n_bytes / n_frames;
+}
+
+/*
+ * Render frames with the given layout to /dev/null, excluding the initial full redraw.
+ * Reports the time per frame and the average size of a frame's output.
+ */
+static void
+bench_render_layout(const char *name, int n_cores, Layout layout, int terminal_rows, int terminal_cols)
+{
+    if (!bench_enabled(name)) {
+        return;
+    }
+
+    RenderBenchContext rctx;
+    bench_render_context_init(&rctx, n_cores);
+    rctx.layout = layout;
+    rctx.terminal_rows = terminal_rows;
+    rctx.terminal_cols = terminal_cols;
+
+    int saved_stdout = stdout_silence();
+    bench_render_screen(&rctx, 1);
+    long long elapsed_ns;
+    long iterations = bench_calibrate(bench_render_screen, &rctx, &elapsed_ns);
+    stdout_restore(saved_stdout);
+
+    char extra[64];
+    snprintf(extra, sizeof(extra), "bytes_per_frame=%.0f", bench_render_bytes_per_frame(&rctx));
+    bench_report(name, 1, iterations, elapsed_ns, extra);
+
+    bench_render_context_destroy(&rctx);
+}
+
+/*
+ * Terminal output of many-core machines: print_cpu_usage() redrawing everything with printf()
+ * versus the frame buffer sending only the changes, with the layouts sized for a 200x60 terminal.
+ */
+static void
+bench_render(void)
+{
+    if (bench_enabled("print_cpu_usage_256")) {
+        RenderBenchContext rctx;
+        bench_render_context_init(&rctx, 256);
+
+        int saved_stdout = stdout_silence();
+        long long elapsed_ns;
+        long iterations = bench_calibrate(bench_render_print, &rctx, &elapsed_ns);
+        stdout_restore(saved_stdout);
+        bench_report("print_cpu_usage_256", 1, iterations, elapsed_ns, NULL);
+
+        bench_render_context_destroy(&rctx);
+    }
+
+    /* Unlimited height with the default width, i.e. the same output as print_cpu_usage() */
+    bench_render_layout("screen_flush_256", 256, LAYOUT_BARS, 0, 0);
+
+    bench_render_layout("layout_bars_1024", 1024, LAYOUT_BARS, 60, 200);
+    bench_render_layout("layout_heatmap_1024", 1024, LAYOUT_HEATMAP, 60, 200);
+    bench_render_layout("layout_histogram_1024", 1024, LAYOUT_HISTOGRAM, 60, 200);
+    bench_render_layout("layout_top_1024", 1024, LAYOUT_TOP, 60, 200);
+    bench_render_layout("layout_auto_1024", 1024, LAYOUT_AUTO, 60, 200);
+    bench_render_layout("layout_auto_4096", 4096, LAYOUT_AUTO, 60, 200);
+}
+
+typedef struct {
+    int n_cpu_entries;
+    ProcStatCpuEntry *previous_cpu_entries;
+    ProcStatCpuEntry *cpu_entries;
+    double *cpu_usage;
+    CpuStateCounters previous_counters;
+    CpuStateCounters counters;
+    CpuStateBreakdown breakdown;
+} CpuStatesBenchContext;
+
+static void
+bench_cpu_states_aos(void *ctx, long iterations)
+{
+    CpuStatesBenchContext *sctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        calculate_cpu_usage(sctx->n_cpu_entries, sctx->previous_cpu_entries, sctx->cpu_entries, sctx->cpu_usage);
+    }
+}
+
+static void
+bench_cpu_states_load(void *ctx, long iterations)
+{
+    CpuStatesBenchContext *sctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        cpu_state_counters_load(&sctx->counters, sctx->n_cpu_entries, sctx->cpu_entries);
+    }
+}
+
+static void
+bench_cpu_states_soa(void *ctx, long iterations)
+{
+    CpuStatesBenchContext *sctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        cpu_state_breakdown_calculate(&sctx->breakdown, &sctx->previous_counters, &sctx->counters);
+    }
+}
+
+/*
+ * Usage calculation for a simulated machine with n_cores cores: the busy percentage computed
+ * by calculate_cpu_usage() over the array of structs, versus the per-state breakdown computed over
+ * a struct of arrays (reported separately from the transposition that fills it).
+ */
+static void
+bench_cpu_states(int n_cores)
+{
+    char aos_name[64];
+    char load_name[64];
+    char soa_name[64];
+    snprintf(aos_name, sizeof(aos_name), "calculate_cpu_usage_%d", n_cores);
+    snprintf(load_name, sizeof(load_name), "cpu_state_counters_load_%d", n_cores);
+    snprintf(soa_name, sizeof(soa_name), "cpu_state_breakdown_%d", n_cores);
+
+    if (!bench_enabled(aos_name) && !bench_enabled(load_name) && !bench_enabled(soa_name)) {
+        return;
+    }
+
+    CpuStatesBenchContext sctx = {0};
+    sctx.n_cpu_entries = n_cores + 1;
+    sctx.previous_cpu_entries = ecalloc((size_t)sctx.n_cpu_entries, sizeof(sctx.previous_cpu_entries[0]));
+    sctx.cpu_entries = ecalloc((size_t)sctx.n_cpu_entries, sizeof(sctx.cpu_entries[0]));
+    sctx.cpu_usage = ecalloc((size_t)sctx.n_cpu_entries, sizeof(sctx.cpu_usage[0]));
+
+    unsigned seed = 1;
+    for (int i = 0; i < sctx.n_cpu_entries; i++) {
+        ProcStatCpuEntry *prev = &sctx.previous_cpu_entries[i];
+        ProcStatCpuEntry *curr = &sctx.cpu_entries[i];
+        snprintf(curr->cpu_name, sizeof(curr->cpu_name), i == 0 ? "cpu" : "cpu%d", i - 1);
+        memcpy(prev->cpu_name, curr->cpu_name, sizeof(curr->cpu_name));
+
+        unsigned long *prev_counters[PROCSTATCPUENTRY_N_COUNTERS];
+        unsigned long *curr_counters[PROCSTATCPUENTRY_N_COUNTERS];
+        proc_stat_cpu_entry_counters(prev, prev_counters);
+        proc_stat_cpu_entry_counters(curr, curr_counters);
+        for (int j = 0; j < PROCSTATCPUENTRY_N_COUNTERS; j++) {
+            seed = seed * 1103515245u + 12345u;
+            *prev_counters[j] = 1000000 + (seed >> 8) % 100000;
+            *curr_counters[j] = *prev_counters[j] + (seed >> 4) % 100;
+        }
+    }
+
+    cpu_state_counters_load(&sctx.previous_counters, sctx.n_cpu_entries, sctx.previous_cpu_entries);
+    cpu_state_counters_load(&sctx.counters, sctx.n_cpu_entries, sctx.cpu_entries);
+
+    bench_run(aos_name, bench_cpu_states_aos, &sctx);
+    bench_run(load_name, bench_cpu_states_load, &sctx);
+    bench_run(soa_name, bench_cpu_states_soa, &sctx);
+
+    cpu_state_counters_free(&sctx.previous_counters);
+    cpu_state_counters_free(&sctx.counters);
+    cpu_state_breakdown_free(&sctx.breakdown);
+    free(sctx.previous_cpu_entries);
+    free(sctx.cpu_entries);
+    free(sctx.cpu_usage);
+}
+
+typedef struct {
+    int n_cpu_entries;
+    double *cpu_usage;
+    RollingStats stats;
+    RollingStatsSummary *summaries;
+    long long timestamp_ns;
+} RollingStatsBenchContext;
+
+static void
+bench_rolling_stats_add(void *ctx, long iterations)
+{
+    RollingStatsBenchContext *rctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        /* One sample per second, the sub-windows of the 10 s window keep rotating */
+        rctx->timestamp_ns += NSEC_PER_SEC;
+        rolling_stats_add(&rctx->stats, rctx->timestamp_ns, rctx->n_cpu_entries, rctx->cpu_usage);
+    }
+}
+
+static void
+bench_rolling_stats_summarize(void *ctx, long iterations)
+{
+    RollingStatsBenchContext *rctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        rolling_stats_summarize(&rctx->stats, rctx->n_cpu_entries, rctx->summaries);
+    }
+}
+
+/*
+ * Rolling statistics over the default windows for a simulated machine with n_cores cores,
+ * once the windows are full.
+ */
+static void
+bench_rolling_stats(int n_cores)
+{
+    char add_name[64];
+    char summarize_name[64];
+    snprintf(add_name, sizeof(add_name), "rolling_stats_add_%d", n_cores);
+    snprintf(summarize_name, sizeof(summarize_name), "rolling_stats_summarize_%d", n_cores);
+
+    if (!bench_enabled(add_name) && !bench_enabled(summarize_name)) {
+        return;
+    }
+
+    RollingStatsWindows windows;
+    bool ok = rolling_stats_parse_windows(ROLLING_STATS_DEFAULT_WINDOWS, &windows);
+    assert(ok);
+    (void)(ok);
+
+    RollingStatsBenchContext rctx = {0};
+    rctx.n_cpu_entries = n_cores + 1;
+    rctx.cpu_usage = ecalloc((size_t)rctx.n_cpu_entries, sizeof(rctx.cpu_usage[0]));
+    rctx.summaries = ecalloc((size_t)windows.n_windows * (size_t)rctx.n_cpu_entries, sizeof(rctx.summaries[0]));
+    rolling_stats_init(&rctx.stats, &windows);
+
+    unsigned seed = 1;
+    for (int k = 0; k < 300; k++) {
+        for (int i = 0; i < rctx.n_cpu_entries; i++) {
+            seed = seed * 1103515245u + 12345u;
+            rctx.cpu_usage[i] = (double)((seed >> 8) % 1001) / 10;
+        }
+        rctx.timestamp_ns += NSEC_PER_SEC;
+        rolling_stats_add(&rctx.stats, rctx.timestamp_ns, rctx.n_cpu_entries, rctx.cpu_usage);
+    }
+
+    bench_run(add_name, bench_rolling_stats_add, &rctx);
+    bench_run(summarize_name, bench_rolling_stats_summarize, &rctx);
+
+    rolling_stats_destroy(&rctx.stats);
+    free(rctx.summaries);
+    free(rctx.cpu_usage);
+}
+
+typedef struct {
+    CpuFreqReader *reader;
+    int n_cpu_entries;
+    ProcStatCpuEntry *cpu_entries;
+    CpuFrequency *frequencies;
+} CpuFreqBenchContext;
+
+static void
+bench_cpu_freq_read(void *ctx, long iterations)
+{
+    CpuFreqBenchContext *fctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        bool bret = cpu_freq_reader_read(fctx->reader, fctx->n_cpu_entries, fctx->cpu_entries, fctx->frequencies);
+        assert(bret);
+        (void)(bret);
+    }
+}
+
+static void
+bench_write_file(const char *path, const char *content)
+{
+    FILE *file = fopen(path, "w");
+    assert(file);
+    fputs(content, file);
+    int iret = fclose(file);
+    assert(iret == 0);
+    (void)(iret);
+}
+
+/*
+ * Sampling the frequency of n_cpus CPUs with each backend, on a fake sysfs tree of regular files
+ * since virtual machines usually have no cpufreq directories. Each report shows the system calls
+ * made per sample.
+ */
+static void
+bench_cpu_freq(int n_cpus)
+{
+    CpuFreqBackend backends[] = { CPU_FREQ_BACKEND_PREAD, CPU_FREQ_BACKEND_IO_URING };
+    char names[2][64];
+    for (int b = 0; b < 2; b++) {
+        snprintf(names[b], sizeof(names[b]), "cpu_freq_read_%s_%d", cpu_freq_backend_name(backends[b]), n_cpus);
+    }
+    if (!bench_enabled(names[0]) && !bench_enabled(names[1])) {
+        return;
+    }
+
+    char sysfs_path[] = "bench_cpufreq_XXXXXX";
+    char *sret = mkdtemp(sysfs_path);
+    assert(sret);
+    (void)(sret);
+
+    CpuFreqBenchContext fctx;
+    fctx.n_cpu_entries = n_cpus + 1;
+    fctx.cpu_entries = ecalloc((size_t)fctx.n_cpu_entries, sizeof(fctx.cpu_entries[0]));
+    fctx.frequencies = emalloc((size_t)fctx.n_cpu_entries * sizeof(fctx.frequencies[0]));
+    snprintf(fctx.cpu_entries[0].cpu_name, sizeof(fctx.cpu_entries[0].cpu_name), "cpu");
+    char path[256];
+    for (int i = 0; i < n_cpus; i++) {
+        snprintf(fctx.cpu_entries[i + 1].cpu_name, sizeof(fctx.cpu_entries[0].cpu_name), "cpu%d", i);
+        snprintf(path, sizeof(path), "%s/cpu%d", sysfs_path, i);
+        mkdir(path, 0700);
+        snprintf(path, sizeof(path), "%s/cpu%d/cpufreq", sysfs_path, i);
+        mkdir(path, 0700);
+        snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/scaling_cur_freq", sysfs_path, i);
+        bench_write_file(path, "2400000\n");
+        snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/cpuinfo_max_freq", sysfs_path, i);
+        bench_write_file(path, "3600000\n");
+    }
+
+    /* The descriptors of n_cpus files are kept open */
+    process_scanner_raise_fd_limit();
+
+    for (int b = 0; b < 2; b++) {
+        if (!bench_enabled(names[b])) {
+            continue;
+        }
+
+        fctx.reader = cpu_freq_reader_open(sysfs_path, backends[b]);
+        assert(fctx.reader);
+        if (cpu_freq_reader_backend(fctx.reader) != backends[b]) {
+            EPRINT("%s isn't available, skipping %s", cpu_freq_backend_name(backends[b]), names[b]);
+            cpu_freq_reader_close(fctx.reader);
+            continue;
+        }
+        /* The first sample opens the files */
+        bench_cpu_freq_read(&fctx, 1);
+
+        long long elapsed_ns;
+        long iterations = bench_calibrate(bench_cpu_freq_read, &fctx, &elapsed_ns);
+        char extra[64];
+        snprintf(extra, sizeof(extra), "cpus=%d syscalls=%d", n_cpus, cpu_freq_reader_n_syscalls(fctx.reader));
+        bench_report(names[b], 1, iterations, elapsed_ns, extra);
+
+        cpu_freq_reader_close(fctx.reader);
+    }
+
+    for (int i = 0; i < n_cpus; i++) {
+        snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/scaling_cur_freq", sysfs_path, i);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/cpuinfo_max_freq", sysfs_path, i);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/cpu%d/cpufreq", sysfs_path, i);
+        rmdir(path);
+        snprintf(path, sizeof(path), "%s/cpu%d", sysfs_path, i);
+        rmdir(path);
+    }
+    rmdir(sysfs_path);
+    free(fctx.cpu_entries);
+    free(fctx.frequencies);
+}
+
+typedef struct {
+    ProcessScanner *scanner;
+    ProcessUsage top[20];
+} ProcessScannerBenchContext;
+
+static void
+bench_process_scanner_scan(void *ctx, long iterations)
+{
+    ProcessScannerBenchContext *pctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        int n = process_scanner_scan(pctx->scanner, clock_now_ns(CLOCK_MONOTONIC), 20, pctx->top);
+        assert(n >= 0);
+        (void)(n);
+    }
+}
+
+static void
+bench_process_scanner_run(const char *name, const ProcessScannerOptions options[static 1], long long baseline_ns_per_op[static 1])
+{
+    if (!bench_enabled(name)) {
+        return;
+    }
+
+    ProcessScannerBenchContext pctx;
+    pctx.scanner = process_scanner_open("/proc", options);
+    assert(pctx.scanner);
+    /* The first scan opens the files that are kept open */
+    bench_process_scanner_scan(&pctx, 1);
+
+    long long elapsed_ns;
+    long iterations = bench_calibrate(bench_process_scanner_scan, &pctx, &elapsed_ns);
+
+    /* Speedup relative to the first run of the series (a single worker) */
+    long long ns_per_op = elapsed_ns / iterations;
+    if (*baseline_ns_per_op == 0) {
+        *baseline_ns_per_op = ns_per_op;
+    }
+    char extra[96];
+    snprintf(extra, sizeof(extra), "%s=%d speedup=%.2f", options->threads ? "tasks" : "processes",
+            process_scanner_n_tasks(pctx.scanner), (double)*baseline_ns_per_op / (double)ns_per_op);
+    bench_report(name, options->n_workers, iterations, elapsed_ns, extra);
+
+    process_scanner_close(pctx.scanner);
+}
+
+static void
+bench_kill_children(int n_children, pid_t children[n_children])
+{
+    for (int i = 0; i < n_children; i++) {
+        kill(children[i], SIGKILL);
+    }
+    for (int i = 0; i < n_children; i++) {
+        waitpid(children[i], NULL, 0);
+    }
+    free(children);
+}
+
+static int
+bench_count_tasks(bool threads)
+{
+    ProcessScannerOptions options = { .threads = threads, .n_workers = 1 };
+    ProcessScanner *scanner = process_scanner_open("/proc", &options);
+    assert(scanner);
+    ProcessUsage top[1];
+    process_scanner_scan(scanner, 0, 1, top);
+    int n_tasks = process_scanner_n_tasks(scanner);
+    process_scanner_close(scanner);
+    return n_tasks;
+}
+
+/*
+ * Scanning /proc on a host with (at least) n_processes processes, simulated by forking idle
+ * children: with the descriptors kept open, and with every file opened and closed on every scan.
+ */
+static void
+bench_process_scanner(int n_processes)
+{
+    char name[64];
+    char reopen_name[64];
+    snprintf(name, sizeof(name), "process_scanner_scan_%d", n_processes);
+    snprintf(reopen_name, sizeof(reopen_name), "process_scanner_scan_reopen_%d", n_processes);
+
+    if (!bench_enabled(name) && !bench_enabled(reopen_name)) {
+        return;
+    }
+
+    int max_open_fds = process_scanner_raise_fd_limit();
+    int n_children = n_processes - bench_count_tasks(false);
+
+    pid_t *children = ecalloc(n_children > 0 ? (size_t)n_children : 1, sizeof(children[0]));
+    int n_forked = 0;
+    for (; n_forked < n_children; n_forked++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            pause();
+            _exit(EXIT_SUCCESS);
+        }
+        if (pid < 0) {
+            EPRINT("fork() failed after %d children", n_forked);
+            break;
+        }
+        children[n_forked] = pid;
+    }
+
+    long long baseline_ns_per_op = 0;
+    ProcessScannerOptions options = { .n_workers = 1, .max_open_fds = max_open_fds };
+    bench_process_scanner_run(name, &options, &baseline_ns_per_op);
+    baseline_ns_per_op = 0;
+    options.max_open_fds = 0;
+    bench_process_scanner_run(reopen_name, &options, &baseline_ns_per_op);
+
+    bench_kill_children(n_forked, children);
+}
+
+static void *
+bench_idle_thread(void *arg)
+{
+    (void)(arg);
+    while (1) {
+        pause();
+    }
+    return NULL;
+}
+
+/*
+ * Scanning the threads of a host with (at least) n_threads threads, simulated by forking children
+ * with threads_per_child idle threads each, with 1 to 16 workers. Each report shows the speedup
+ * over a single worker, which can't exceed the number of CPUs available to the benchmark.
+ */
+static void
+bench_process_scanner_threads(int n_threads, int threads_per_child)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "process_scanner_threads_%d", n_threads);
+
+    if (!bench_enabled(name)) {
+        return;
+    }
+
+    int max_open_fds = process_scanner_raise_fd_limit();
+    int n_children = (n_threads - bench_count_tasks(true) + threads_per_child - 1) / threads_per_child;
+
+    pid_t *children = ecalloc(n_children > 0 ? (size_t)n_children : 1, sizeof(children[0]));
+    int n_forked = 0;
+    for (; n_forked < n_children; n_forked++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            /* The benchmark has no other threads at this point, creating threads in the child is safe */
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setstacksize(&attr, 64 * 1024);
+            for (int i = 1; i < threads_per_child; i++) {
+                pthread_t thread;
+                if (pthread_create(&thread, &attr, bench_idle_thread, NULL) != 0) {
+                    break;
+                }
+            }
+            bench_idle_thread(NULL);
+        }
+        if (pid < 0) {
+            EPRINT("fork() failed after %d children", n_forked);
+            break;
+        }
+        children[n_forked] = pid;
+    }
+
+    /* Wait until the children have created their threads */
+    long long deadline_ns = clock_now_ns(CLOCK_MONOTONIC) + 30 * NSEC_PER_SEC;
+    while (bench_count_tasks(true) < n_threads && clock_now_ns(CLOCK_MONOTONIC) < deadline_ns) {
+        struct timespec delay = { 0, 100 * 1000 * 1000 };
+        nanosleep(&delay, NULL);
+    }
+
+    long long baseline_ns_per_op = 0;
+    for (int n_workers = 1; n_workers <= 16; n_workers *= 2) {
+        ProcessScannerOptions options = { .threads = true, .n_workers = n_workers, .max_open_fds = max_open_fds };
+        bench_process_scanner_run(name, &options, &baseline_ns_per_op);
+    }
+
+    bench_kill_children(n_forked, children);
+}
+
+typedef struct {
+    BenchData *data;
+    HistoryWriter *writer;
+    long long timestamp_ns;
+    HistoryReader *reader;
+    long long first_timestamp_ns;
+    long long last_timestamp_ns;
+    unsigned seed;
+} HistoryBenchContext;
+
+static void
+bench_history_append(void *ctx, long iterations)
+{
+    HistoryBenchContext *hctx = ctx;
+    BenchData *data = hctx->data;
+    for (long i = 0; i < iterations; i++) {
+        bool bret = history_writer_append(hctx->writer, hctx->timestamp_ns, data->n_cpu_entries, data->cpu_entries);
+        assert(bret);
+        (void)(bret);
+        /* Simulate counters advancing between 10 ms samples */
+        hctx->timestamp_ns += 10 * 1000 * 1000;
+        for (int j = 0; j < data->n_cpu_entries; j++) {
+            data->cpu_entries[j].user += 1 + (unsigned long)(i + j) % 3;
+            data->cpu_entries[j].idle += 1;
+        }
+    }
+}
+
+static void
+bench_history_seek(void *ctx, long iterations)
+{
+    HistoryBenchContext *hctx = ctx;
+    long long range_ns = hctx->last_timestamp_ns - hctx->first_timestamp_ns + 1;
+    for (long i = 0; i < iterations; i++) {
+        hctx->seed = hctx->seed * 1103515245u + 12345u;
+        long long target_ns = hctx->first_timestamp_ns + (long long)(hctx->seed % 1000000u) * range_ns / 1000000;
+        bool bret = history_reader_seek(hctx->reader, target_ns);
+        assert(bret);
+        (void)(bret);
+    }
+}
+
+static void
+bench_history(BenchData *data)
+{
+    bool run_append = bench_enabled("history_writer_append");
+    bool run_seek = bench_enabled("history_reader_seek");
+    if (!run_append && !run_seek) {
+        return;
+    }
+
+    const char *file_name = "bench.hist";
+    HistoryBenchContext hctx = { .data = data, .timestamp_ns = 1700000000000000000LL, .seed = 1 };
+    ProcStatCpuEntry *saved_cpu_entries = emalloc((size_t)data->n_cpu_entries * sizeof(saved_cpu_entries[0]));
+    memcpy(saved_cpu_entries, data->cpu_entries, (size_t)data->n_cpu_entries * sizeof(saved_cpu_entries[0]));
+
+    hctx.writer = history_writer_open(file_name, data->max_cpu_entries);
+    assert(hctx.writer);
+
+    if (run_append) {
+        long long elapsed_ns;
+        long iterations = bench_calibrate(bench_history_append, &hctx, &elapsed_ns);
+
+        struct stat st;
+        int iret = stat(file_name, &st);
+        assert(iret == 0);
+        (void)(iret);
+        long n_written = (hctx.timestamp_ns - 1700000000000000000LL) / (10 * 1000 * 1000);
+
+        char extra[64];
+        snprintf(extra, sizeof(extra), "bytes_per_snapshot=%.1f", (double)st.st_size / (double)n_written);
+        bench_report("history_writer_append", 1, iterations, elapsed_ns, extra);
+    }
+
+    if (run_seek) {
+        /* At least a day's worth of 1 s samples */
+        while ((hctx.timestamp_ns - 1700000000000000000LL) / (10 * 1000 * 1000) < 24 * 60 * 60) {
+            bench_history_append(&hctx, 1);
+        }
+        hctx.reader = history_reader_open(file_name);
+        assert(hctx.reader);
+        bool bret = history_reader_time_range(hctx.reader, &hctx.first_timestamp_ns, &hctx.last_timestamp_ns);
+        assert(bret);
+        (void)(bret);
+
+        long long elapsed_ns;
+        long iterations = bench_calibrate(bench_history_seek, &hctx, &elapsed_ns);
+
+        char extra[64];
+        snprintf(extra, sizeof(extra), "snapshots=%lld", (hctx.timestamp_ns - 1700000000000000000LL) / (10 * 1000 * 1000));
+        bench_report("history_reader_seek", 1, iterations, elapsed_ns, extra);
+
+        history_reader_close(hctx.reader);
+    }
+
+    history_writer_close(hctx.writer);
+    unlink(file_name);
+
+    memcpy(data->cpu_entries, saved_cpu_entries, (size_t)data->n_cpu_entries * sizeof(saved_cpu_entries[0]));
+    free(saved_cpu_entries);
+}
+
+static void
+bench_stats_counter_add(void *ctx, long iterations)
+{
+    (void)(ctx);
+    for (long i = 0; i < iterations; i++) {
+        stats_counter_add(STATS_COUNTER_SCREEN_BYTES_WRITTEN, 1);
+    }
+}
+
+static void
+bench_stats_timer(void *ctx, long iterations)
+{
+    (void)(ctx);
+    for (long i = 0; i < iterations; i++) {
+        stats_timer_stop(STATS_TIMER_RENDER, stats_timer_start());
+    }
+}
+
+static void
+bench_watchdog_signal_active(void *ctx, long iterations)
+{
+    WatchdogHandle *handle = ctx;
+    for (long i = 0; i < iterations; i++) {
+        watchdog_signal_active(handle);
+    }
+}
+
+/*
+ * Heartbeat of a thread with n_watched threads registered, the calling thread registered last.
+ */
+static void
+bench_watchdog(int n_watched)
+{
+    if (!bench_enabled("watchdog_signal_active")) {
+        return;
+    }
+
+    WatchdogArgs *watchdog_args = ecalloc(1, sizeof(*watchdog_args));
+    /* The handles registered in place of other threads never report activity */
+    watchdog_args->timeout_seconds = 3600;
+
+    pthread_t watchdog;
+    int iret = pthread_create(&watchdog, NULL, watchdog_run, watchdog_args);
+    assert(iret == 0);
+
+    WatchdogHandle *handles[n_watched];
+    for (int i = 0; i < n_watched; i++) {
+        handles[i] = watchdog_register("Bench");
+    }
+
+    long long elapsed_ns;
+    long iterations = bench_calibrate(bench_watchdog_signal_active, handles[n_watched - 1], &elapsed_ns);
+
+    char extra[64];
+    snprintf(extra, sizeof(extra), "watched_threads=%d", n_watched);
+    bench_report("watchdog_signal_active", 1, iterations, elapsed_ns, extra);
+
+    for (int i = 0; i < n_watched; i++) {
+        watchdog_unregister(handles[i]);
+    }
+
+    iret = pthread_cancel(watchdog);
+    assert(iret == 0);
+    iret = pthread_join(watchdog, NULL);
+    assert(iret == 0);
+}
+
+typedef struct {
+    OutputFormat format;
+    int n_cpu_entries;
+    char (*cpu_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE];
+    double *cpu_usage;
+    double *freq_usage;
+    char *buffer;
+    unsigned long seq;
+    size_t length;
+} SampleFormatBenchContext;
+
+static void
+bench_sample_format_line(void *ctx, long iterations)
+{
+    SampleFormatBenchContext *sctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        sctx->seq++;
+        if (sctx->format == OUTPUT_FORMAT_JSONL) {
+            sctx->length = sample_format_json(sctx->buffer, sctx->seq, (long long)sctx->seq * NSEC_PER_SEC,
+                    sctx->n_cpu_entries, sctx->cpu_names, sctx->cpu_usage, sctx->freq_usage, NULL);
+        } else {
+            sctx->length = sample_format_csv(sctx->buffer, (long long)sctx->seq * NSEC_PER_SEC,
+                    sctx->n_cpu_entries, sctx->cpu_usage, sctx->freq_usage, NULL);
+        }
+    }
+}
+
+/*
+ * Formatting of a sample of a simulated machine with n_cores cores: the Server encodes every sample once
+ * whatever the number of clients (JSON), the Output thread formats every sample it writes.
+ */
+static void
+bench_sample_format(OutputFormat format, int n_cores)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "sample_format_%s_%d", format == OUTPUT_FORMAT_JSONL ? "json" : "csv", n_cores);
+
+    if (!bench_enabled(name)) {
+        return;
+    }
+
+    SampleFormatBenchContext sctx = {0};
+    sctx.format = format;
+    sctx.n_cpu_entries = n_cores + 1;
+    sctx.cpu_names = ecalloc((size_t)sctx.n_cpu_entries, sizeof(sctx.cpu_names[0]));
+    sctx.cpu_usage = ecalloc((size_t)sctx.n_cpu_entries, sizeof(sctx.cpu_usage[0]));
+    sctx.freq_usage = ecalloc((size_t)sctx.n_cpu_entries, sizeof(sctx.freq_usage[0]));
+    sctx.buffer = emalloc(sample_format_max_line_length(sctx.n_cpu_entries, false));
+
+    unsigned seed = 1;
+    for (int i = 0; i < sctx.n_cpu_entries; i++) {
+        snprintf(sctx.cpu_names[i], sizeof(sctx.cpu_names[i]), i == 0 ? "cpu" : "cpu%d", i - 1);
+        seed = seed * 1103515245u + 12345u;
+        sctx.cpu_usage[i] = (double)((seed >> 8) % 1001) / 10;
+        sctx.freq_usage[i] = sctx.cpu_usage[i] / 2;
+    }
+
+    long long elapsed_ns;
+    long iterations = bench_calibrate(bench_sample_format_line, &sctx, &elapsed_ns);
+
+    char extra[64];
+    snprintf(extra, sizeof(extra), "bytes_per_sample=%zu", sctx.length);
+    bench_report(name, 1, iterations, elapsed_ns, extra);
+
+    free(sctx.buffer);
+    free(sctx.freq_usage);
+    free(sctx.cpu_usage);
+    free(sctx.cpu_names);
+}
+
+typedef struct {
+    ShmWriter *writer;
+    ShmReader reader;
+    int n_cpu_entries;
+    char (*cpu_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE];
+    double *cpu_usage;
+    double *freq_usage;
+} ShmBenchContext;
+
+static void
+bench_shm_publish(void *ctx, long iterations)
+{
+    ShmBenchContext *sctx = ctx;
+    for (long i = 0; i < iterations; i++) {
+        shm_writer_publish(sctx->writer, i, sctx->n_cpu_entries, sctx->cpu_names, sctx->cpu_usage, sctx->freq_usage);
+    }
+}
+
+static void
+bench_shm_read(void *ctx, long iterations)
+{
+    ShmBenchContext *sctx = ctx;
+    ShmSample sample;
+    for (long i = 0; i < iterations; i++) {
+        bool bret = shm_reader_read(&sctx->reader, &sample, sctx->cpu_names, sctx->cpu_usage, sctx->freq_usage);
+        assert(bret);
+        (void)(bret);
+    }
+}
+
+/*
+ * Publishing a sample of a simulated machine with n_cores cores to shared memory, and reading it back
+ * (uncontended, the reader and the writer are the same thread).
+ */
+static void
+bench_shm(int n_cores)
+{
+    char publish_name[64];
+    char read_name[64];
+    snprintf(publish_name, sizeof(publish_name), "shm_writer_publish_%d", n_cores);
+    snprintf(read_name, sizeof(read_name), "shm_reader_read_%d", n_cores);
+
+    if (!bench_enabled(publish_name) && !bench_enabled(read_name)) {
+        return;
+    }
+
+    char segment_name[64];
+    snprintf(segment_name, sizeof(segment_name), "/cut_bench_shm_%d", (int)getpid());
+
+    ShmBenchContext sctx = {0};
+    sctx.n_cpu_entries = n_cores + 1;
+    sctx.writer = shm_writer_open(segment_name, sctx.n_cpu_entries);
+    if (!sctx.writer) {
+        fprintf(stderr, "bench_shm: shm_writer_open() failed, skipping\n");
+        return;
+    }
+    bool bret = shm_reader_open(&sctx.reader, segment_name);
+    assert(bret);
+    (void)(bret);
+
+    sctx.cpu_names = ecalloc((size_t)sctx.n_cpu_entries, sizeof(sctx.cpu_names[0]));
+    sctx.cpu_usage = ecalloc((size_t)sctx.n_cpu_entries, sizeof(sctx.cpu_usage[0]));
+    sctx.freq_usage = ecalloc((size_t)sctx.n_cpu_entries, sizeof(sctx.freq_usage[0]));
+    for (int i = 0; i < sctx.n_cpu_entries; i++) {
+        snprintf(sctx.cpu_names[i], sizeof(sctx.cpu_names[i]), i == 0 ? "cpu" : "cpu%d", i - 1);
+        sctx.cpu_usage[i] = i % 101;
+        sctx.freq_usage[i] = sctx.cpu_usage[i] / 2;
+    }
+
+    bench_run(publish_name, bench_shm_publish, &sctx);
+    bench_run(read_name, bench_shm_read, &sctx);
+
+    shm_reader_close(&sctx.reader);
+    shm_writer_close(sctx.writer);
+    free(sctx.freq_usage);
+    free(sctx.cpu_usage);
+    free(sctx.cpu_names);
+}
+
+typedef struct {
+    long iterations;
+    pthread_barrier_t *barrier;
+} LoggerBenchThreadArgs;
+
+static void *
+bench_logger_thread_run(void *arg)
+{
+    LoggerBenchThreadArgs *args = arg;
+
+    pthread_barrier_wait(args->barrier);
+
+    for (long i = 0; i < args->iterations; i++) {
+        logger_log_message("bench_logger_thread_run: benchmark message of typical length for the log");
+    }
+
+    pthread_exit(NULL);
+}
+
+static void
+bench_logger(int max_threads)
+{
+    if (!bench_enabled("logger_log_message")) {
+        return;
+    }
+
+    LoggerArgs *logger_args = ecalloc(1, sizeof(*logger_args));
+
+    pthread_t logger;
+    int iret = pthread_create(&logger, NULL, logger_run, logger_args);
+    assert(iret == 0);
+
+    for (int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        long iterations = 1024;
+        long long elapsed_ns;
+        unsigned long n_dropped;
+
+        while (1) {
+            pthread_t threads[n_threads];
+            pthread_barrier_t barrier;
+            iret = pthread_barrier_init(&barrier, NULL, (unsigned)n_threads + 1);
+            assert(iret == 0);
+
+            LoggerBenchThreadArgs thread_args = { .iterations = iterations, .barrier = &barrier };
+            for (int i = 0; i < n_threads; i++) {
+                iret = pthread_create(&threads[i], NULL, bench_logger_thread_run, &thread_args);
+                assert(iret == 0);
+            }
+
+            unsigned long n_dropped_before = logger_n_dropped_messages();
+            pthread_barrier_wait(&barrier);
+            long long start_ns = clock_now_ns(CLOCK_MONOTONIC);
+
+            for (int i = 0; i < n_threads; i++) {
+                iret = pthread_join(threads[i], NULL);
+                assert(iret == 0);
+            }
+
+            elapsed_ns = clock_now_ns(CLOCK_MONOTONIC) - start_ns;
+            n_dropped = logger_n_dropped_messages() - n_dropped_before;
+
+            iret = pthread_barrier_destroy(&barrier);
+            assert(iret == 0);
+
+            if (elapsed_ns >= BENCH_MIN_DURATION_NS) {
+                break;
+            }
+            iterations *= 2;
+
+            /* Let the Logger drain the queue before the next run */
+            sleep(1);
+        }
+
+        char extra[64];
+        snprintf(extra, sizeof(extra), "dropped=%lu", n_dropped);
+        bench_report("logger_log_message", n_threads, iterations * n_threads, elapsed_ns, extra);
+
+        sleep(1);
+    }
+
+    iret = pthread_cancel(logger);
+    assert(iret == 0);
+    iret = pthread_join(logger, NULL);
+    assert(iret == 0);
+}
+
+/*
+ * Messages submitted by bench_elog() between two pauses, few enough for the queue to take them all
+ */
+#define BENCH_ELOG_BURST 1000
+#define BENCH_ELOG_N_BURSTS 100
+
+static void
+bench_elog_burst(bool deferred, long first)
+{
+    for (long i = first; i < first + BENCH_ELOG_BURST; i++) {
+        if (deferred) {
+            ELOG("sample %ld of %s took %.3f ms", i, "bench", 1.5);
+        } else {
+            /* What ELOG() did before the formatting was left to the Logger */
+            char message[512];
+            snprintf(message, sizeof(message), "%s: sample %ld of %s took %.3f ms", __func__, i, "bench", 1.5);
+            logger_log_message(message);
+        }
+    }
+}
+
+/*
+ * Time the calling thread spends logging a formatted message, with the Logger keeping up.
+ */
+static void
+bench_elog(void)
+{
+    if (!bench_enabled("ELOG")) {
+        return;
+    }
+
+    LoggerArgs *logger_args = ecalloc(1, sizeof(*logger_args));
+
+    pthread_t logger;
+    int iret = pthread_create(&logger, NULL, logger_run, logger_args);
+    assert(iret == 0);
+
+    for (int deferred = 1; deferred >= 0; deferred--) {
+        long long elapsed_ns = 0;
+        unsigned long n_dropped_before = logger_n_dropped_messages();
+
+        for (int i = 0; i < BENCH_ELOG_N_BURSTS; i++) {
+            long long start_ns = clock_now_ns(CLOCK_MONOTONIC);
+            bench_elog_burst(deferred, (long)i * BENCH_ELOG_BURST);
+            elapsed_ns += clock_now_ns(CLOCK_MONOTONIC) - start_ns;
+
+            /* Let the Logger drain the queue */
+            struct timespec pause = { .tv_nsec = 2 * LOGGER_BATCH_INTERVAL_MS * 1000000L };
+            nanosleep(&pause, NULL);
+        }
+
+        char extra[64];
+        snprintf(extra, sizeof(extra), "dropped=%lu", logger_n_dropped_messages() - n_dropped_before);
+        bench_report(deferred ? "ELOG" : "ELOG_snprintf", 1, (long)BENCH_ELOG_BURST * BENCH_ELOG_N_BURSTS, elapsed_ns, extra);
+    }
+
+    iret = pthread_cancel(logger);
+    assert(iret == 0);
+    iret = pthread_join(logger, NULL);
+    assert(iret == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [benchmark name filter]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc == 2) {
+        bench_filter = argv[1];
+    }
+
+    /* Run in a temporary directory so that the log file doesn't clobber the user's */
+    char directory[] = "/tmp/cut_bench_XXXXXX";
+    if (!mkdtemp(directory) || chdir(directory) != 0) {
+        EPRINT("Failed to create a temporary directory");
+        return EXIT_FAILURE;
+    }
+
+    BenchData data = {0};
+    data.max_cpu_entries = get_nprocs_conf() + 1;
+    data.proc_stat_file = fopen("/proc/stat", "r");
+    assert(data.proc_stat_file);
+    data.proc_stat_fd = open("/proc/stat", O_RDONLY);
+    assert(data.proc_stat_fd >= 0);
+    data.cpu_entries = emalloc((size_t)data.max_cpu_entries * sizeof(data.cpu_entries[0]));
+    data.previous_cpu_entries = emalloc((size_t)data.max_cpu_entries * sizeof(data.previous_cpu_entries[0]));
+    data.cpu_usage = ecalloc((size_t)data.max_cpu_entries, sizeof(data.cpu_usage[0]));
+    data.cpu_names = emalloc((size_t)data.max_cpu_entries * sizeof(data.cpu_names[0]));
+
+    data.n_cpu_entries = read_and_parse_proc_stat_fd(data.proc_stat_fd, &data.proc_stat_buffer, data.max_cpu_entries, data.previous_cpu_entries);
+    assert(data.n_cpu_entries > 1);
+    struct timespec ts = { .tv_nsec = 100 * 1000 * 1000 };
+    nanosleep(&ts, NULL);
+    int n = read_and_parse_proc_stat_fd(data.proc_stat_fd, &data.proc_stat_buffer, data.max_cpu_entries, data.cpu_entries);
+    assert(n == data.n_cpu_entries);
+    (void)(n);
+    calculate_cpu_usage(data.n_cpu_entries, data.previous_cpu_entries, data.cpu_entries, data.cpu_usage);
+    for (int i = 0; i < data.n_cpu_entries; i++) {
+        memcpy(data.cpu_names[i], data.cpu_entries[i].cpu_name, sizeof(data.cpu_names[0]));
+    }
+
+    bench_run("read_and_parse_proc_stat_file", bench_parse_file, &data);
+    bench_run("read_and_parse_proc_stat_fd", bench_parse_fd, &data);
+    bench_run("calculate_cpu_usage", bench_calculate, &data);
+
+    bench_cpu_states(4096);
+    bench_rolling_stats(4096);
+    bench_cpu_freq(256);
+    bench_cpu_freq(4096);
+    bench_process_scanner(20000);
+    bench_process_scanner_threads(20000, 100);
+
+    if (bench_enabled("print_cpu_usage")) {
+        int saved_stdout = stdout_silence();
+        long long elapsed_ns;
+        long iterations = bench_calibrate(bench_print, &data, &elapsed_ns);
+        stdout_restore(saved_stdout);
+        bench_report("print_cpu_usage", 1, iterations, elapsed_ns, NULL);
+    }
+
+    bench_render();
+
+    bench_pipeline_stages(&data);
+
+    bench_history(&data);
+
+    bench_sample_format(OUTPUT_FORMAT_JSONL, 512);
+    bench_sample_format(OUTPUT_FORMAT_CSV, 512);
+
+    bench_shm(512);
+
+    bench_run("stats_counter_add", bench_stats_counter_add, NULL);
+    bench_run("stats_timer", bench_stats_timer, NULL);
+
+    bench_watchdog(1);
+    bench_watchdog(64);
+
+    int max_threads = 2 * get_nprocs();
+    if (max_threads < 4) {
+        max_threads = 4;
+    }
+    if (max_threads > 16) {
+        max_threads = 16;
+    }
+    bench_logger(max_threads);
+    bench_elog();
+
+    fclose(data.proc_stat_file);
+    close(data.proc_stat_fd);
+    proc_stat_buffer_free(&data.proc_stat_buffer);
+    free(data.cpu_entries);
+    free(data.previous_cpu_entries);
+    free(data.cpu_usage);
+    free(data.cpu_names);
+
+    unlink("log.txt");
+    if (chdir("/") == 0) {
+        rmdir(directory);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -5,21 +5,43 @@ gcc_flags="-Wall -Wextra -std=c99 -pedantic"
 clang_flags="-Weverything -Wno-declaration-after-statement -Wno-vla -Wno-extra-semi-stmt -Wno-missing-noreturn -Wno-padded -Wno-disabled-macro-expansion -std=c99 -pedantic"
 debug_flags="-g"
 op_flags="-O2"
-common_flags="-D_POSIX_C_SOURCE=1 -pthread"
+common_flags="-D_POSIX_C_SOURCE=200809L -pthread"
 linker_flags="-lm -lrt"
 
 source_files=(
     "proc_stat_utils.c"
+    "cpu_states.c"
+    "cpu_freq.c"
+    "process_scanner.c"
+    "spsc_ring.c"
+    "stage.c"
     "reader.c"
+    "process_reader.c"
+    "recording.c"
+    "replayer.c"
+    "history.c"
+    "archiver.c"
+    "sample_format.c"
+    "exporter.c"
+    "server.c"
+    "shm_writer.c"
+    "output.c"
+    "rolling_stats.c"
     "analyzer.c"
     "printer.c"
+    "screen.c"
+    "layout.c"
     "thread_utils.c"
+    "stats.c"
+    "log_format.c"
     "logger.c"
+    "latency_histogram.c"
     "watchdog.c"
 )
 
 debug=false
 tests=false
+bench=false
 print=false
 valgrind=false # use Valgrind when running tests
 
@@ -31,6 +53,9 @@ for arg in "$@"; do
         "--tests")
             tests=true
         ;;
+        "--bench")
+            bench=true
+        ;;
         "--print")
             print=true
         ;;
@@ -78,6 +103,7 @@ else
 fi
 
 $print_cmd $comp_cmd -o cut main.c "${source_files[@]}" $linker_flags
+$print_cmd $comp_cmd -o log_decode log_decode.c log_format.c $linker_flags
 
 if [ "$tests" == "true" ]; then
     $print_cmd $comp_cmd -Wno-unused-function -Wno-unused-variable -Werror -o tests tests.c "${source_files[@]}" $linker_flags
@@ -88,3 +114,9 @@ if [ "$tests" == "true" ]; then
         $print_cmd ./tests
     fi
 fi
+
+if [ "$bench" == "true" ]; then
+    $print_cmd $comp_cmd -o bench bench.c "${source_files[@]}" $linker_flags
+
+    $print_cmd ./bench
+fi
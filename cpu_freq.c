@@ -0,0 +1,487 @@
+/* syscall() */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "cpu_freq.h"
+#include "utils.h"
+
+/* Large enough for a frequency in kHz and its newline */
+#define CPU_FREQ_BUFFER_SIZE 24
+
+typedef struct {
+    /* Descriptor of scaling_cur_freq, -1 if it isn't open */
+    int fd;
+    unsigned long max_khz;
+    /* Sample from which opening the files is attempted again */
+    unsigned long reopen_at;
+    char buffer[CPU_FREQ_BUFFER_SIZE];
+} CpuFreqCpu;
+
+/*
+ * The parts of the io_uring rings that are used, see io_uring_setup(2)
+ */
+typedef struct {
+    int fd;
+    unsigned entries;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} CpuFreqRing;
+
+struct CpuFreqReader {
+    int sysfs_fd;
+    CpuFreqBackend backend;
+    CpuFreqRing ring;
+    /* Indexed by CPU id */
+    CpuFreqCpu *cpus;
+    int max_cpus;
+    /* CPU ids of the pending reads of a sample */
+    int *pending;
+    int max_pending;
+    unsigned long n_samples;
+    int n_syscalls;
+};
+
+static const struct {
+    const char *name;
+    CpuFreqBackend backend;
+} cpu_freq_backend_names[] = {
+    { "auto", CPU_FREQ_BACKEND_AUTO },
+    { "io_uring", CPU_FREQ_BACKEND_IO_URING },
+    { "pread", CPU_FREQ_BACKEND_PREAD },
+};
+
+bool
+cpu_freq_backend_from_name(const char *name, CpuFreqBackend backend[static 1])
+{
+    for (size_t i = 0; i < sizeof(cpu_freq_backend_names) / sizeof(cpu_freq_backend_names[0]); i++) {
+        if (strcmp(name, cpu_freq_backend_names[i].name) == 0) {
+            *backend = cpu_freq_backend_names[i].backend;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *
+cpu_freq_backend_name(CpuFreqBackend backend)
+{
+    for (size_t i = 0; i < sizeof(cpu_freq_backend_names) / sizeof(cpu_freq_backend_names[0]); i++) {
+        if (cpu_freq_backend_names[i].backend == backend) {
+            return cpu_freq_backend_names[i].name;
+        }
+    }
+    return "unknown";
+}
+
+static void
+cpu_freq_ring_destroy(CpuFreqRing ring[static 1])
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/*
+ * Returns false if the kernel doesn't support io_uring (or it's disabled).
+ */
+static bool
+cpu_freq_ring_init(CpuFreqRing ring[static 1], unsigned entries)
+{
+    memset(ring, 0, sizeof(*ring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    /* Since Linux 5.4 both rings share a single mapping */
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        cpu_freq_ring_destroy(ring);
+        return false;
+    }
+    if (single_mmap) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            cpu_freq_ring_destroy(ring);
+            return false;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        cpu_freq_ring_destroy(ring);
+        return false;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(void *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(void *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(void *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(void *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(void *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(void *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(void *)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+CpuFreqReader *
+cpu_freq_reader_open(const char *sysfs_cpu_path, CpuFreqBackend backend)
+{
+    int fd = open(sysfs_cpu_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    CpuFreqReader *reader = ecalloc(1, sizeof(*reader));
+    reader->sysfs_fd = fd;
+    reader->ring.fd = -1;
+    reader->backend = CPU_FREQ_BACKEND_PREAD;
+    if (backend != CPU_FREQ_BACKEND_PREAD && cpu_freq_ring_init(&reader->ring, CPU_FREQ_RING_ENTRIES)) {
+        reader->backend = CPU_FREQ_BACKEND_IO_URING;
+    }
+
+    return reader;
+}
+
+void
+cpu_freq_reader_close(CpuFreqReader *reader)
+{
+    if (!reader) {
+        return;
+    }
+
+    for (int i = 0; i < reader->max_cpus; i++) {
+        if (reader->cpus[i].fd >= 0) {
+            close(reader->cpus[i].fd);
+        }
+    }
+    cpu_freq_ring_destroy(&reader->ring);
+    close(reader->sysfs_fd);
+    free(reader->cpus);
+    free(reader->pending);
+    free(reader);
+}
+
+CpuFreqBackend
+cpu_freq_reader_backend(const CpuFreqReader *reader)
+{
+    return reader->backend;
+}
+
+int
+cpu_freq_reader_n_syscalls(const CpuFreqReader *reader)
+{
+    return reader->n_syscalls;
+}
+
+/*
+ * Returns -1 for anything but "cpuN".
+ */
+static int
+cpu_freq_cpu_id(const char *cpu_name)
+{
+    if (strncmp(cpu_name, "cpu", 3) != 0 || cpu_name[3] < '0' || cpu_name[3] > '9') {
+        return -1;
+    }
+    char *end;
+    long id = strtol(&cpu_name[3], &end, 10);
+    return *end == '\0' && id < PROC_STAT_MAX_CPU_ENTRIES ? (int)id : -1;
+}
+
+static CpuFreqCpu *
+cpu_freq_get_cpu(CpuFreqReader *reader, int id)
+{
+    if (id >= reader->max_cpus) {
+        int max_cpus = reader->max_cpus ? reader->max_cpus : 64;
+        while (max_cpus <= id) {
+            max_cpus *= 2;
+        }
+        reader->cpus = erealloc(reader->cpus, (size_t)max_cpus * sizeof(reader->cpus[0]));
+        for (int i = reader->max_cpus; i < max_cpus; i++) {
+            memset(&reader->cpus[i], 0, sizeof(reader->cpus[i]));
+            reader->cpus[i].fd = -1;
+        }
+        reader->max_cpus = max_cpus;
+    }
+    return &reader->cpus[id];
+}
+
+/*
+ * Parse the contents of a cpufreq file, 0 if it isn't a frequency.
+ */
+static unsigned long
+cpu_freq_parse_khz(const char *buffer)
+{
+    char *end;
+    errno = 0;
+    unsigned long khz = strtoul(buffer, &end, 10);
+    return end != buffer && errno == 0 && (*end == '\n' || *end == '\0') ? khz : 0;
+}
+
+static ssize_t
+cpu_freq_pread(int fd, char buffer[static CPU_FREQ_BUFFER_SIZE])
+{
+    ssize_t n;
+    do {
+        n = pread(fd, buffer, CPU_FREQ_BUFFER_SIZE - 1, 0);
+    } while (n < 0 && errno == EINTR);
+    buffer[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+/*
+ * Open scaling_cur_freq and read cpuinfo_max_freq of a CPU.
+ * Returns false if the CPU has no cpufreq directory, or it can't be read.
+ */
+static bool
+cpu_freq_open_cpu(CpuFreqReader *reader, int id, CpuFreqCpu cpu[static 1])
+{
+    char path[64];
+    snprintf(path, sizeof(path), "cpu%d/cpufreq/cpuinfo_max_freq", id);
+    int fd = openat(reader->sysfs_fd, path, O_RDONLY | O_CLOEXEC);
+    reader->n_syscalls++;
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t n = cpu_freq_pread(fd, cpu->buffer);
+    close(fd);
+    reader->n_syscalls += 2;
+    cpu->max_khz = n > 0 ? cpu_freq_parse_khz(cpu->buffer) : 0;
+    if (cpu->max_khz == 0) {
+        return false;
+    }
+
+    snprintf(path, sizeof(path), "cpu%d/cpufreq/scaling_cur_freq", id);
+    cpu->fd = openat(reader->sysfs_fd, path, O_RDONLY | O_CLOEXEC);
+    reader->n_syscalls++;
+    return cpu->fd >= 0;
+}
+
+/*
+ * Submit the reads of a batch of pending CPUs and wait for all of them to complete.
+ * The result of every read is left in the buffer of its CPU (empty on failure).
+ * Returns false if io_uring failed, none of the reads of the batch were then made.
+ */
+static bool
+cpu_freq_read_batch_io_uring(CpuFreqReader *reader, int n, const int ids[n])
+{
+    CpuFreqRing *ring = &reader->ring;
+    assert((unsigned)n <= ring->entries);
+
+    /* Only this thread produces submissions, the kernel only reads the tail */
+    unsigned tail = *ring->sq_tail;
+    unsigned mask = *ring->sq_mask;
+    for (int i = 0; i < n; i++) {
+        CpuFreqCpu *cpu = &reader->cpus[ids[i]];
+        unsigned index = tail & mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = cpu->fd;
+        sqe->addr = (uint64_t)(uintptr_t)cpu->buffer;
+        sqe->len = CPU_FREQ_BUFFER_SIZE - 1;
+        sqe->off = 0;
+        sqe->user_data = (uint64_t)i;
+        ring->sq_array[index] = index;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* Submit everything and wait for every completion at once */
+    int n_submitted = 0;
+    int n_completed = 0;
+    while (n_completed < n) {
+        long ret = syscall(SYS_io_uring_enter, ring->fd, (unsigned)(n - n_submitted), (unsigned)(n - n_completed),
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        reader->n_syscalls++;
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Reads still in flight only ever write the same file contents into the buffers */
+            return false;
+        }
+        n_submitted += (int)ret;
+
+        unsigned head = *ring->cq_head;
+        unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            CpuFreqCpu *cpu = &reader->cpus[ids[cqe->user_data]];
+            cpu->buffer[cqe->res > 0 ? cqe->res : 0] = '\0';
+            if (cqe->res == -EINVAL) {
+                /* The kernel predates IORING_OP_READ (Linux 5.6) */
+                reader->backend = CPU_FREQ_BACKEND_PREAD;
+            }
+            n_completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return true;
+}
+
+static void
+cpu_freq_read_pending(CpuFreqReader *reader, int n_pending)
+{
+    for (int start = 0; start < n_pending && reader->backend == CPU_FREQ_BACKEND_IO_URING; ) {
+        int n = n_pending - start < (int)reader->ring.entries ? n_pending - start : (int)reader->ring.entries;
+        if (!cpu_freq_read_batch_io_uring(reader, n, &reader->pending[start])) {
+            reader->backend = CPU_FREQ_BACKEND_PREAD;
+            break;
+        }
+        start += n;
+    }
+
+    if (reader->backend == CPU_FREQ_BACKEND_PREAD) {
+        /* Either the backend from the start or io_uring failed, read everything again */
+        for (int i = 0; i < n_pending; i++) {
+            CpuFreqCpu *cpu = &reader->cpus[reader->pending[i]];
+            cpu_freq_pread(cpu->fd, cpu->buffer);
+            reader->n_syscalls++;
+        }
+    }
+}
+
+bool
+cpu_freq_reader_read(CpuFreqReader *reader, int n_cpu_entries, const ProcStatCpuEntry cpu_entries[n_cpu_entries],
+        CpuFrequency frequencies[n_cpu_entries])
+{
+    reader->n_samples++;
+    reader->n_syscalls = 0;
+
+    if (n_cpu_entries > reader->max_pending) {
+        reader->max_pending = n_cpu_entries;
+        reader->pending = erealloc(reader->pending, (size_t)n_cpu_entries * sizeof(reader->pending[0]));
+    }
+
+    /* Open the files of CPUs seen for the first time (or again), the cpus array doesn't move afterwards */
+    int n_pending = 0;
+    for (int i = 0; i < n_cpu_entries; i++) {
+        int id = cpu_freq_cpu_id(cpu_entries[i].cpu_name);
+        if (id < 0) {
+            continue;
+        }
+        CpuFreqCpu *cpu = cpu_freq_get_cpu(reader, id);
+        if (cpu->fd < 0) {
+            if (reader->n_samples < cpu->reopen_at) {
+                continue;
+            }
+            if (!cpu_freq_open_cpu(reader, id, cpu)) {
+                cpu->reopen_at = reader->n_samples + CPU_FREQ_REOPEN_INTERVAL;
+                continue;
+            }
+        }
+        reader->pending[n_pending++] = id;
+    }
+
+    cpu_freq_read_pending(reader, n_pending);
+
+    unsigned long long sum_cur_khz = 0;
+    unsigned long long sum_max_khz = 0;
+    int n_known = 0;
+    for (int i = 0; i < n_cpu_entries; i++) {
+        frequencies[i].cur_khz = 0;
+        frequencies[i].max_khz = 0;
+
+        int id = cpu_freq_cpu_id(cpu_entries[i].cpu_name);
+        if (id < 0 || id >= reader->max_cpus || reader->cpus[id].fd < 0) {
+            continue;
+        }
+        CpuFreqCpu *cpu = &reader->cpus[id];
+        unsigned long cur_khz = cpu_freq_parse_khz(cpu->buffer);
+        if (cur_khz == 0) {
+            /* The CPU went offline, its cpufreq directory is gone */
+            close(cpu->fd);
+            cpu->fd = -1;
+            cpu->reopen_at = reader->n_samples + CPU_FREQ_REOPEN_INTERVAL;
+            continue;
+        }
+
+        frequencies[i].cur_khz = cur_khz;
+        frequencies[i].max_khz = cpu->max_khz;
+        sum_cur_khz += cur_khz;
+        sum_max_khz += cpu->max_khz;
+        n_known++;
+    }
+
+    if (n_known > 0 && n_cpu_entries > 0 && cpu_freq_cpu_id(cpu_entries[0].cpu_name) < 0) {
+        frequencies[0].cur_khz = (unsigned long)(sum_cur_khz / (unsigned)n_known);
+        frequencies[0].max_khz = (unsigned long)(sum_max_khz / (unsigned)n_known);
+    }
+
+    return n_known > 0;
+}
+
+void
+cpu_freq_weight_usage(int n_cpu_entries, const CpuFrequency frequencies[n_cpu_entries], const double cpu_usage[n_cpu_entries],
+        double weighted_usage[n_cpu_entries])
+{
+    double sum = 0;
+    int n_known = 0;
+    for (int i = 1; i < n_cpu_entries; i++) {
+        if (frequencies[i].cur_khz == 0 || frequencies[i].max_khz == 0) {
+            weighted_usage[i] = -1;
+            continue;
+        }
+        weighted_usage[i] = cpu_usage[i] * (double)frequencies[i].cur_khz / (double)frequencies[i].max_khz;
+        sum += weighted_usage[i];
+        n_known++;
+    }
+
+    if (n_cpu_entries > 0) {
+        weighted_usage[0] = n_known > 0 ? sum / n_known : -1;
+    }
+}
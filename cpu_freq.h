@@ -0,0 +1,84 @@
+#ifndef CPU_FREQ_H
+#define CPU_FREQ_H
+
+#include <stdbool.h>
+
+#include "proc_stat_utils.h"
+
+/*
+ * Current frequency of every CPU, from /sys/devices/system/cpu/cpuN/cpufreq/scaling_cur_freq.
+ *
+ * The scaling_cur_freq descriptor of every CPU is kept open and read from offset 0 on every sample,
+ * along with cpuinfo_max_freq once when it's opened. With the io_uring backend the reads of all the
+ * CPUs are batched into a single io_uring_enter() (one per CPU_FREQ_RING_ENTRIES CPUs), otherwise
+ * there's one pread() per CPU. io_uring is set up with raw system calls, there is no liburing dependency;
+ * if the kernel doesn't support it the pread() backend is used instead.
+ *
+ * CPUs without a cpufreq directory (virtual machines, offline CPUs) have a frequency of 0 (unknown).
+ * Opening their files is attempted again every CPU_FREQ_REOPEN_INTERVAL samples, in case they were
+ * brought online.
+ */
+
+#define CPU_FREQ_RING_ENTRIES 256
+#define CPU_FREQ_REOPEN_INTERVAL 64
+
+typedef enum {
+    /* io_uring if the kernel supports it, otherwise pread() */
+    CPU_FREQ_BACKEND_AUTO,
+    CPU_FREQ_BACKEND_IO_URING,
+    CPU_FREQ_BACKEND_PREAD,
+} CpuFreqBackend;
+
+typedef struct {
+    /* In kHz, 0 if unknown */
+    unsigned long cur_khz;
+    unsigned long max_khz;
+} CpuFrequency;
+
+typedef struct CpuFreqReader CpuFreqReader;
+
+/*
+ * Parse "auto", "io_uring" or "pread".
+ * Returns false if the name isn't recognized.
+ */
+bool cpu_freq_backend_from_name(const char *name, CpuFreqBackend backend[static 1]);
+
+const char * cpu_freq_backend_name(CpuFreqBackend backend);
+
+/*
+ * Open a reader of the cpuN directories in sysfs_cpu_path (normally "/sys/devices/system/cpu").
+ * With CPU_FREQ_BACKEND_IO_URING the pread() backend is still used if io_uring can't be set up.
+ * Returns NULL if the directory can't be opened.
+ */
+CpuFreqReader * cpu_freq_reader_open(const char *sysfs_cpu_path, CpuFreqBackend backend);
+
+void cpu_freq_reader_close(CpuFreqReader *reader);
+
+/*
+ * The backend actually in use, CPU_FREQ_BACKEND_IO_URING or CPU_FREQ_BACKEND_PREAD.
+ */
+CpuFreqBackend cpu_freq_reader_backend(const CpuFreqReader *reader);
+
+/*
+ * Read the frequency of the CPUs of a /proc/stat snapshot, frequencies[i] being the frequency of
+ * cpu_entries[i]. The first entry (the average) gets the average frequency of the CPUs whose
+ * frequency is known.
+ * Returns true if the frequency of at least one CPU is known.
+ */
+bool cpu_freq_reader_read(CpuFreqReader *reader, int n_cpu_entries, const ProcStatCpuEntry cpu_entries[n_cpu_entries],
+        CpuFrequency frequencies[n_cpu_entries]);
+
+/*
+ * Number of system calls made by the last cpu_freq_reader_read().
+ */
+int cpu_freq_reader_n_syscalls(const CpuFreqReader *reader);
+
+/*
+ * Frequency-weighted usage: usage scaled by the ratio of the current to the maximum frequency, i.e. the
+ * share of the CPU's peak capacity that was used. -1 for CPUs whose frequency is unknown.
+ * The first entry (the average) is the mean of the CPUs whose frequency is known.
+ */
+void cpu_freq_weight_usage(int n_cpu_entries, const CpuFrequency frequencies[n_cpu_entries], const double cpu_usage[n_cpu_entries],
+        double weighted_usage[n_cpu_entries]);
+
+#endif /* CPU_FREQ_H */
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "cpu_states.h"
+#include "utils.h"
+
+static const char *cpu_state_names[CPU_N_STATES] = {
+    [CPU_STATE_USER] = "user",
+    [CPU_STATE_NICE] = "nice",
+    [CPU_STATE_SYSTEM] = "system",
+    [CPU_STATE_IDLE] = "idle",
+    [CPU_STATE_IOWAIT] = "iowait",
+    [CPU_STATE_IRQ] = "irq",
+    [CPU_STATE_SOFTIRQ] = "softirq",
+    [CPU_STATE_STEAL] = "steal",
+    [CPU_STATE_GUEST] = "guest",
+    [CPU_STATE_GUEST_NICE] = "guest_nice",
+};
+
+const char *
+cpu_state_name(CpuState state)
+{
+    assert(state >= 0 && state < CPU_N_STATES);
+
+    return cpu_state_names[state];
+}
+
+static int
+cpu_states_padded_size(int n_cpu_entries)
+{
+    return (n_cpu_entries + CPU_STATES_BLOCK_SIZE - 1) / CPU_STATES_BLOCK_SIZE * CPU_STATES_BLOCK_SIZE;
+}
+
+void
+cpu_state_counters_free(CpuStateCounters counters[static 1])
+{
+    for (int s = 0; s < CPU_N_STATES; s++) {
+        free(counters->counters[s]);
+    }
+    memset(counters, 0, sizeof(*counters));
+}
+
+void
+cpu_state_counters_load(CpuStateCounters counters[static 1], int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries])
+{
+    int padded_size = cpu_states_padded_size(n_cpu_entries);
+
+    if (padded_size > counters->capacity) {
+        for (int s = 0; s < CPU_N_STATES; s++) {
+            counters->counters[s] = erealloc(counters->counters[s], (size_t)padded_size * sizeof(counters->counters[s][0]));
+        }
+        counters->capacity = padded_size;
+    }
+
+    uint32_t *restrict user = counters->counters[CPU_STATE_USER];
+    uint32_t *restrict nice = counters->counters[CPU_STATE_NICE];
+    uint32_t *restrict system = counters->counters[CPU_STATE_SYSTEM];
+    uint32_t *restrict idle = counters->counters[CPU_STATE_IDLE];
+    uint32_t *restrict iowait = counters->counters[CPU_STATE_IOWAIT];
+    uint32_t *restrict irq = counters->counters[CPU_STATE_IRQ];
+    uint32_t *restrict softirq = counters->counters[CPU_STATE_SOFTIRQ];
+    uint32_t *restrict steal = counters->counters[CPU_STATE_STEAL];
+    uint32_t *restrict guest = counters->counters[CPU_STATE_GUEST];
+    uint32_t *restrict guest_nice = counters->counters[CPU_STATE_GUEST_NICE];
+
+    /* Each entry is read once, front to back, and every array is written sequentially */
+    for (int i = 0; i < n_cpu_entries; i++) {
+        const ProcStatCpuEntry *ce = &cpu_entries[i];
+        user[i] = (uint32_t)ce->user;
+        nice[i] = (uint32_t)ce->nice;
+        system[i] = (uint32_t)ce->system;
+        idle[i] = (uint32_t)ce->idle;
+        iowait[i] = (uint32_t)ce->iowait;
+        irq[i] = (uint32_t)ce->irq;
+        softirq[i] = (uint32_t)ce->softirq;
+        steal[i] = (uint32_t)ce->steal;
+        guest[i] = (uint32_t)ce->guest;
+        guest_nice[i] = (uint32_t)ce->guest_nice;
+    }
+
+    /* The padding never shows any elapsed time */
+    for (int s = 0; s < CPU_N_STATES; s++) {
+        memset(&counters->counters[s][n_cpu_entries], 0, (size_t)(padded_size - n_cpu_entries) * sizeof(counters->counters[s][0]));
+    }
+
+    counters->n_cpu_entries = n_cpu_entries;
+}
+
+void
+cpu_state_breakdown_free(CpuStateBreakdown breakdown[static 1])
+{
+    for (int s = 0; s < CPU_N_STATES; s++) {
+        free(breakdown->percentage[s]);
+    }
+    memset(breakdown, 0, sizeof(*breakdown));
+}
+
+static void
+cpu_state_breakdown_reserve(CpuStateBreakdown breakdown[static 1], int n_cpu_entries)
+{
+    int padded_size = cpu_states_padded_size(n_cpu_entries);
+
+    if (padded_size > breakdown->capacity) {
+        for (int s = 0; s < CPU_N_STATES; s++) {
+            breakdown->percentage[s] = erealloc(breakdown->percentage[s], (size_t)padded_size * sizeof(breakdown->percentage[s][0]));
+        }
+        breakdown->capacity = padded_size;
+    }
+}
+
+void
+cpu_state_breakdown_copy(CpuStateBreakdown dst[static 1], const CpuStateBreakdown src[static 1])
+{
+    cpu_state_breakdown_reserve(dst, src->n_cpu_entries);
+
+    for (int s = 0; s < CPU_N_STATES; s++) {
+        memcpy(dst->percentage[s], src->percentage[s], (size_t)src->n_cpu_entries * sizeof(src->percentage[s][0]));
+    }
+
+    dst->n_cpu_entries = src->n_cpu_entries;
+}
+
+/*
+ * Breakdown of the CPU_STATES_BLOCK_SIZE entries starting at offset.
+ * Every loop has a constant trip count and works on whole blocks, so it is vectorized without
+ * a scalar remainder even at -O2.
+ */
+static void
+cpu_state_breakdown_calculate_block(CpuStateBreakdown *restrict breakdown, const CpuStateCounters *restrict previous,
+        const CpuStateCounters *restrict current, int offset)
+{
+    float delta[CPU_N_STATES][CPU_STATES_BLOCK_SIZE];
+
+    for (int s = 0; s < CPU_N_STATES; s++) {
+        const uint32_t *restrict prev = &previous->counters[s][offset];
+        const uint32_t *restrict curr = &current->counters[s][offset];
+
+        for (int k = 0; k < CPU_STATES_BLOCK_SIZE; k++) {
+            /*
+             * Counters that went backwards (e.g. reset while the CPU was offline) wrap around to a negative value,
+             * which is masked to 0 without a branch
+             */
+            int32_t d = (int32_t)(curr[k] - prev[k]);
+            delta[s][k] = (float)(d & ~(d >> 31));
+        }
+    }
+
+    float scale[CPU_STATES_BLOCK_SIZE];
+
+    for (int k = 0; k < CPU_STATES_BLOCK_SIZE; k++) {
+        /* Guest time is already included in user and nice */
+        float total = delta[CPU_STATE_USER][k] + delta[CPU_STATE_NICE][k] + delta[CPU_STATE_SYSTEM][k]
+            + delta[CPU_STATE_IDLE][k] + delta[CPU_STATE_IOWAIT][k] + delta[CPU_STATE_IRQ][k]
+            + delta[CPU_STATE_SOFTIRQ][k] + delta[CPU_STATE_STEAL][k];
+        /* If no time elapsed all deltas are 0, dividing by 1 instead keeps the loop free of branches */
+        scale[k] = 100.0f / (total + (float)(total == 0.0f));
+    }
+
+    for (int s = 0; s < CPU_N_STATES; s++) {
+        float *restrict percentage = &breakdown->percentage[s][offset];
+
+        for (int k = 0; k < CPU_STATES_BLOCK_SIZE; k++) {
+            percentage[k] = delta[s][k] * scale[k];
+        }
+    }
+}
+
+void
+cpu_state_breakdown_calculate(CpuStateBreakdown breakdown[static 1], const CpuStateCounters previous[static 1], const CpuStateCounters current[static 1])
+{
+    assert(previous->n_cpu_entries == current->n_cpu_entries);
+
+    int padded_size = cpu_states_padded_size(current->n_cpu_entries);
+    cpu_state_breakdown_reserve(breakdown, current->n_cpu_entries);
+
+    for (int offset = 0; offset < padded_size; offset += CPU_STATES_BLOCK_SIZE) {
+        cpu_state_breakdown_calculate_block(breakdown, previous, current, offset);
+    }
+
+    breakdown->n_cpu_entries = current->n_cpu_entries;
+}
@@ -0,0 +1,87 @@
+#ifndef CPU_STATES_H
+#define CPU_STATES_H
+
+#include <stdint.h>
+
+#include "proc_stat_utils.h"
+
+/*
+ * Per-state CPU time breakdown: the share of each /proc/stat counter in the time that elapsed
+ * between two samples, for every entry.
+ *
+ * The samples are kept as a struct of arrays (one array per counter) so that the breakdown is
+ * computed by loops over contiguous arrays of the same type, which the compiler vectorizes.
+ * Only the low 32 bits of the counters are stored: the differences between two samples are computed
+ * modulo 2^32, which is exact as long as less than 2^32 ticks elapse between them.
+ */
+
+/* Same order as the counters in /proc/stat */
+typedef enum {
+    CPU_STATE_USER,
+    CPU_STATE_NICE,
+    CPU_STATE_SYSTEM,
+    CPU_STATE_IDLE,
+    CPU_STATE_IOWAIT,
+    CPU_STATE_IRQ,
+    CPU_STATE_SOFTIRQ,
+    CPU_STATE_STEAL,
+    CPU_STATE_GUEST,
+    CPU_STATE_GUEST_NICE,
+    CPU_N_STATES,
+} CpuState;
+
+/*
+ * The arrays are padded to a multiple of this many entries, so that the loops have no remainder.
+ */
+#define CPU_STATES_BLOCK_SIZE 8
+
+/*
+ * Name of a state as used in /proc/stat documentation ("user", "iowait", ...).
+ */
+const char * cpu_state_name(CpuState state);
+
+/*
+ * Counters of a /proc/stat sample, transposed.
+ * Zero-initialize before first use and release with cpu_state_counters_free().
+ */
+typedef struct {
+    int n_cpu_entries;
+    int capacity;
+    uint32_t *counters[CPU_N_STATES];
+} CpuStateCounters;
+
+void cpu_state_counters_free(CpuStateCounters counters[static 1]);
+
+/*
+ * Transpose the counters of cpu_entries into counters, growing its arrays as needed.
+ */
+void cpu_state_counters_load(CpuStateCounters counters[static 1], int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries]);
+
+/*
+ * Percentage of the elapsed time spent in each state, for every entry.
+ * Zero-initialize before first use and release with cpu_state_breakdown_free().
+ */
+typedef struct {
+    int n_cpu_entries;
+    int capacity;
+    float *percentage[CPU_N_STATES];
+} CpuStateBreakdown;
+
+void cpu_state_breakdown_free(CpuStateBreakdown breakdown[static 1]);
+
+/*
+ * Copy the percentages of src into dst, growing its arrays as needed.
+ */
+void cpu_state_breakdown_copy(CpuStateBreakdown dst[static 1], const CpuStateBreakdown src[static 1]);
+
+/*
+ * Calculate the per-state breakdown between two samples of the same CPUs (entries are paired by position).
+ *
+ * The states other than guest and guest_nice add up to 100%. The guest time is already included
+ * in user (and guest_nice in nice) by the kernel, so they are reported as shares of the same total.
+ * Entries for which no time elapsed get 0% in every state. A counter that went backwards (it was reset
+ * while the CPU was offline) counts as no time spent in its state.
+ */
+void cpu_state_breakdown_calculate(CpuStateBreakdown breakdown[static 1], const CpuStateCounters previous[static 1], const CpuStateCounters current[static 1]);
+
+#endif /* CPU_STATES_H */
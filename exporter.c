@@ -0,0 +1,274 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "exporter.h"
+#include "sample_format.h"
+#include "utils.h"
+#include "stage.h"
+#include "stats.h"
+#include "logger.h"
+
+/* Must be a power of two. Only the newest sample is exported, the queue just absorbs slow writes. */
+#define EXPORTER_QUEUE_DEPTH 4
+
+/* Upper limit on the length of the metrics that don't depend on the number of CPUs */
+#define EXPORTER_MAX_FIXED_LENGTH 2048
+/* Upper limit on the length of a metric line of one CPU */
+#define EXPORTER_MAX_LINE_LENGTH 128
+
+typedef struct {
+    ExporterArgs *args;
+    ExporterQueue *queue;
+    /* path with ".tmp" appended */
+    char *temporary_path;
+    /* Reused for every sample, grows only when more CPUs come online */
+    char *buffer;
+    size_t buffer_size;
+    unsigned long n_samples;
+    bool write_failed;
+} ExporterPrivateState;
+
+static Stage exporter_stage = STAGE_INITIALIZER;
+
+size_t
+exporter_max_metrics_length(int n_cpu_entries)
+{
+    /* Usage and frequency-weighted usage of every CPU */
+    return EXPORTER_MAX_FIXED_LENGTH + 2 * (size_t)n_cpu_entries * EXPORTER_MAX_LINE_LENGTH;
+}
+
+/*
+ * The CPU label of an entry of /proc/stat, "cpu3" is exported as "3" like node_exporter does.
+ */
+static const char *
+exporter_cpu_label(const char *cpu_name)
+{
+    return strncmp(cpu_name, "cpu", 3) == 0 && cpu_name[3] != '\0' ? &cpu_name[3] : cpu_name;
+}
+
+static char *
+exporter_append(char *p, size_t max_length, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int iret = vsnprintf(p, max_length, format, args);
+    va_end(args);
+
+    assert(iret >= 0 && (size_t)iret < max_length);
+
+    return p + iret;
+}
+
+size_t
+exporter_format_metrics(char *buffer, long long timestamp_ns, unsigned long n_samples, int n_cpu_entries,
+        char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage)
+{
+    assert(n_cpu_entries >= 1);
+
+    char *p = buffer;
+
+    p = exporter_append(p, EXPORTER_MAX_FIXED_LENGTH / 4,
+            "# HELP cut_cpu_aggregate_usage_ratio Share of the last sampling interval all CPUs together were busy.\n"
+            "# TYPE cut_cpu_aggregate_usage_ratio gauge\n"
+            "cut_cpu_aggregate_usage_ratio %.4f\n",
+            cpu_usage[0] / 100);
+
+    p = exporter_append(p, EXPORTER_MAX_FIXED_LENGTH / 8,
+            "# HELP cut_cpu_usage_ratio Share of the last sampling interval the CPU was busy.\n"
+            "# TYPE cut_cpu_usage_ratio gauge\n");
+    for (int i = 1; i < n_cpu_entries; i++) {
+        p = exporter_append(p, EXPORTER_MAX_LINE_LENGTH, "cut_cpu_usage_ratio{cpu=\"%s\"} %.4f\n",
+                exporter_cpu_label(cpu_names[i]), cpu_usage[i] / 100);
+    }
+
+    if (freq_usage && freq_usage[0] >= 0) {
+        p = exporter_append(p, EXPORTER_MAX_FIXED_LENGTH / 4,
+                "# HELP cut_cpu_aggregate_frequency_weighted_usage_ratio Aggregate usage scaled by the CPUs' current to maximum frequency.\n"
+                "# TYPE cut_cpu_aggregate_frequency_weighted_usage_ratio gauge\n"
+                "cut_cpu_aggregate_frequency_weighted_usage_ratio %.4f\n",
+                freq_usage[0] / 100);
+
+        p = exporter_append(p, EXPORTER_MAX_FIXED_LENGTH / 8,
+                "# HELP cut_cpu_frequency_weighted_usage_ratio Usage scaled by the CPU's current to maximum frequency.\n"
+                "# TYPE cut_cpu_frequency_weighted_usage_ratio gauge\n");
+        for (int i = 1; i < n_cpu_entries; i++) {
+            if (freq_usage[i] >= 0) {
+                p = exporter_append(p, EXPORTER_MAX_LINE_LENGTH, "cut_cpu_frequency_weighted_usage_ratio{cpu=\"%s\"} %.4f\n",
+                        exporter_cpu_label(cpu_names[i]), freq_usage[i] / 100);
+            }
+        }
+    }
+
+    p = exporter_append(p, EXPORTER_MAX_FIXED_LENGTH / 4,
+            "# HELP cut_last_sample_timestamp_seconds Time at which the exported sample was taken.\n"
+            "# TYPE cut_last_sample_timestamp_seconds gauge\n"
+            "cut_last_sample_timestamp_seconds %lld.%03lld\n"
+            "# HELP cut_samples_total Samples exported since cut started.\n"
+            "# TYPE cut_samples_total counter\n"
+            "cut_samples_total %lu\n",
+            timestamp_ns / NSEC_PER_SEC, timestamp_ns % NSEC_PER_SEC / (1000 * 1000), n_samples);
+
+    return (size_t)(p - buffer);
+}
+
+static bool
+exporter_write_file(ExporterPrivateState *priv, size_t length)
+{
+    int fd = open(priv->temporary_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    const char *p = priv->buffer;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return false;
+        }
+        p += n;
+        length -= (size_t)n;
+    }
+
+    if (close(fd) != 0) {
+        return false;
+    }
+
+    return rename(priv->temporary_path, priv->args->path) == 0;
+}
+
+/*
+ * Export the newest sample in the queue, the older ones are superseded by it.
+ */
+static void
+exporter_export_submitted_data(ExporterPrivateState *priv)
+{
+    unsigned n_readable = stage_queue_n_readable(priv->queue);
+    if (n_readable == 0) {
+        return;
+    }
+
+    UsageSample *slot = stage_queue_peek(priv->queue, n_readable - 1);
+    priv->n_samples += n_readable;
+
+    size_t max_length = exporter_max_metrics_length(slot->n_cpu_entries);
+    if (max_length > priv->buffer_size) {
+        priv->buffer = erealloc(priv->buffer, max_length);
+        priv->buffer_size = max_length;
+    }
+
+    size_t length = exporter_format_metrics(priv->buffer, slot->timestamp_ns, priv->n_samples, slot->n_cpu_entries,
+            slot->cpu_names, slot->cpu_usage, slot->has_freq_usage ? slot->freq_usage : NULL);
+
+    for (unsigned i = 0; i < n_readable; i++) {
+        stage_queue_release(priv->queue);
+    }
+
+    bool bret = exporter_write_file(priv, length);
+    if (bret) {
+        stats_counter_add(STATS_COUNTER_EXPORTER_BYTES_WRITTEN, length);
+    } else if (!priv->write_failed) {
+        ELOG("Failed to write the metrics file (%s): %s", priv->args->path, strerror(errno));
+    }
+    priv->write_failed = !bret;
+}
+
+static void
+exporter_deinit(void *arg)
+{
+    ExporterPrivateState *priv = arg;
+
+    stage_close(&exporter_stage, priv->queue);
+
+    free(priv->args->path);
+    free(priv->args);
+    free(priv->temporary_path);
+    free(priv->buffer);
+
+    free(priv);
+}
+
+static ExporterPrivateState *
+exporter_init(void *arg)
+{
+    ExporterPrivateState *priv = ecalloc(1, sizeof(*priv));
+
+    priv->args = arg;
+
+    assert(priv->args->path);
+
+    size_t path_length = strlen(priv->args->path);
+    priv->temporary_path = emalloc(path_length + sizeof(".tmp"));
+    memcpy(priv->temporary_path, priv->args->path, path_length);
+    memcpy(&priv->temporary_path[path_length], ".tmp", sizeof(".tmp"));
+
+    priv->buffer_size = exporter_max_metrics_length(priv->args->max_cpu_entries);
+    priv->buffer = emalloc(priv->buffer_size);
+
+    StageConfig config = {
+        .name = "Exporter",
+        .depth = EXPORTER_QUEUE_DEPTH,
+        .slot_size = sizeof(UsageSample),
+        .backpressure = STAGE_BACKPRESSURE_DROP,
+        .slot_init = usage_sample_slot_init,
+        .slot_init_arg = &priv->args->max_cpu_entries,
+        .slot_destroy = usage_sample_slot_destroy,
+        .use_watchdog = priv->args->use_watchdog,
+        .dropped_counter = STATS_COUNTER_EXPORTER_SAMPLES_DROPPED,
+        .depth_gauge = STATS_GAUGE_EXPORTER_QUEUE_DEPTH,
+    };
+    priv->queue = stage_open(&exporter_stage, &config);
+
+    return priv;
+}
+
+static void
+exporter_loop(ExporterPrivateState *priv)
+{
+    while (1) {
+        bool did_retrieve_data = stage_queue_wait(priv->queue, 1);
+        if (did_retrieve_data) {
+            exporter_export_submitted_data(priv);
+        }
+    }
+}
+
+void *
+exporter_run(void *arg)
+{
+    assert(arg);
+
+    ExporterPrivateState *priv = exporter_init(arg);
+
+    pthread_cleanup_push(exporter_deinit, priv);
+
+    exporter_loop(priv);
+
+    pthread_cleanup_pop(1);
+
+    pthread_exit(NULL);
+}
+
+ExporterQueue *
+exporter_queue_attach(void)
+{
+    return stage_attach(&exporter_stage);
+}
+
+void
+exporter_queue_detach(ExporterQueue *queue)
+{
+    stage_detach(&exporter_stage, queue);
+}
@@ -0,0 +1,59 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <stddef.h>
+
+#include "proc_stat_utils.h"
+#include "stage.h"
+
+typedef struct {
+    /*
+     * File that is replaced with the metrics of every sample, e.g. in the directory of
+     * node_exporter's textfile collector (which only reads files ending in ".prom").
+     * Exporter takes ownership of the string.
+     */
+    char *path;
+    /* Initial capacity of the queue slots and the output buffer, they grow when more CPUs come online */
+    int max_cpu_entries;
+    bool use_watchdog;
+} ExporterArgs;
+
+/*
+ * Thread that writes the CPU usage of every sample submitted to its queue in the Prometheus
+ * text exposition format. The file is written next to its final path and renamed over it,
+ * so readers always see a complete sample.
+ */
+void * exporter_run(void *arg);
+
+/*
+ * Input queue of the Exporter, a stage queue (stage.h) of preallocated UsageSample slots (sample_format.h)
+ * filled by usage_sample_submit(), so only one thread at a time may submit data to the Exporter.
+ * Submitting never blocks, samples are dropped when the queue is full.
+ */
+typedef StageQueue ExporterQueue;
+
+/*
+ * Attach to the Exporter's input queue as its producer.
+ * Blocks until the Exporter thread is initialized.
+ * The returned queue stays valid until exporter_queue_detach() is called, even if
+ * the Exporter thread exits in the meantime.
+ */
+ExporterQueue * exporter_queue_attach(void);
+
+void exporter_queue_detach(ExporterQueue *queue);
+
+/*
+ * Upper limit on the length of the metrics of a sample with n_cpu_entries entries.
+ */
+size_t exporter_max_metrics_length(int n_cpu_entries);
+
+/*
+ * Format the metrics of a sample in the Prometheus text exposition format into buffer, which must
+ * hold at least exporter_max_metrics_length(n_cpu_entries) bytes. Entry 0 is the aggregate of all CPUs.
+ * Usage is exported as a ratio (0 to 1). Returns the length of the text.
+ */
+size_t exporter_format_metrics(char *buffer, long long timestamp_ns, unsigned long n_samples, int n_cpu_entries,
+        char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage);
+
+#endif /* EXPORTER_H */
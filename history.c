@@ -0,0 +1,739 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "history.h"
+#include "proc_stat_utils.h"
+#include "varint.h"
+#include "utils.h"
+#include "stats.h"
+
+#define HISTORY_VERSION 1
+#define HISTORY_MIN_BLOCK_SIZE (64 * 1024)
+
+static const unsigned char history_magic[8] = { 'C', 'U', 'T', 'H', 'I', 'S', 'T', 0 };
+
+typedef struct {
+    long long first_timestamp_ns;
+    long long last_timestamp_ns;
+    uint32_t n_records;
+    uint32_t used_bytes;
+} HistoryBlockHeader;
+
+struct HistoryWriter {
+    int fd;
+    int max_cpu_entries;
+    size_t block_size;
+    /* Number of blocks in the file, including the current one */
+    size_t n_blocks;
+    /* Bytes used in the current block including its header, 0 if there is no current block yet */
+    size_t block_used;
+    HistoryBlockHeader block_header;
+    long long previous_timestamp_ns;
+    int n_previous_cpu_entries;
+    ProcStatCpuEntry *previous_cpu_entries;
+    unsigned char *record_buffer;
+};
+
+struct HistoryReader {
+    const unsigned char *map;
+    size_t map_size;
+    size_t block_size;
+    int max_cpu_entries;
+    /* Number of non-empty blocks */
+    size_t n_blocks;
+    /* Iterator: position of the next record to decode */
+    size_t block_index;
+    uint32_t record_index;
+    const unsigned char *p;
+    /* Iterator: the last decoded record, the base for the deltas of the next one */
+    long long timestamp_ns;
+    int n_cpu_entries;
+    ProcStatCpuEntry *cpu_entries;
+    uint64_t *cpu_ids;
+    /* The last decoded record hasn't been returned by history_reader_next() yet */
+    bool pending;
+};
+
+static void
+store_le32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static void
+store_le64(unsigned char *p, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint32_t
+load_le32(const unsigned char *p)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+static uint64_t
+load_le64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+static void
+history_store_block_header(unsigned char out[static HISTORY_BLOCK_HEADER_SIZE], const HistoryBlockHeader header[static 1])
+{
+    memset(out, 0, HISTORY_BLOCK_HEADER_SIZE);
+    store_le64(&out[0], (uint64_t)header->first_timestamp_ns);
+    store_le64(&out[8], (uint64_t)header->last_timestamp_ns);
+    store_le32(&out[16], header->n_records);
+    store_le32(&out[20], header->used_bytes);
+}
+
+static void
+history_load_block_header(const unsigned char in[static HISTORY_BLOCK_HEADER_SIZE], HistoryBlockHeader header[static 1])
+{
+    header->first_timestamp_ns = (long long)load_le64(&in[0]);
+    header->last_timestamp_ns = (long long)load_le64(&in[8]);
+    header->n_records = load_le32(&in[16]);
+    header->used_bytes = load_le32(&in[20]);
+}
+
+/*
+ * Upper bound of the size of a record with max_cpu_entries entries.
+ */
+static size_t
+history_max_record_size(int max_cpu_entries)
+{
+    return 2 * VARINT_MAX_LENGTH + (size_t)max_cpu_entries * (1 + PROCSTATCPUENTRY_N_COUNTERS) * VARINT_MAX_LENGTH;
+}
+
+/*
+ * Blocks must be able to hold at least one record of the largest size.
+ */
+static size_t
+history_block_size(int max_cpu_entries)
+{
+    size_t block_size = HISTORY_MIN_BLOCK_SIZE;
+    while (block_size < HISTORY_BLOCK_HEADER_SIZE + history_max_record_size(max_cpu_entries)) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+/*
+ * Map "cpu" to 0 and "cpuN" to N + 1.
+ */
+static bool
+history_cpu_name_to_id(const char *cpu_name, uint64_t id[static 1])
+{
+    if (strncmp(cpu_name, "cpu", 3) != 0) {
+        return false;
+    }
+    const char *p = &cpu_name[3];
+    if (*p == '\0') {
+        *id = 0;
+        return true;
+    }
+
+    uint64_t n = 0;
+    for (; *p; p++) {
+        if (*p < '0' || *p > '9' || n > 100000000) {
+            return false;
+        }
+        n = n * 10 + (uint64_t)(*p - '0');
+    }
+    *id = n + 1;
+    return true;
+}
+
+static bool
+history_cpu_id_to_name(uint64_t id, char cpu_name[static PROCSTATCPUENTRY_CPU_NAME_SIZE])
+{
+    if (id == 0) {
+        strcpy(cpu_name, "cpu");
+        return true;
+    }
+    int n = snprintf(cpu_name, PROCSTATCPUENTRY_CPU_NAME_SIZE, "cpu%llu", (unsigned long long)(id - 1));
+    return n > 0 && n < PROCSTATCPUENTRY_CPU_NAME_SIZE;
+}
+
+/*
+ * The entry at the same position in the previous record, if it's for the same CPU.
+ */
+static ProcStatCpuEntry *
+history_delta_base(int n_previous_cpu_entries, ProcStatCpuEntry *previous_cpu_entries, int i, const char *cpu_name)
+{
+    if (i >= n_previous_cpu_entries || strcmp(previous_cpu_entries[i].cpu_name, cpu_name) != 0) {
+        return NULL;
+    }
+    return &previous_cpu_entries[i];
+}
+
+static bool
+pwrite_all(int fd, const void *data, size_t size, off_t offset)
+{
+    const unsigned char *p = data;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        stats_counter_add(STATS_COUNTER_HISTORY_BYTES_WRITTEN, (unsigned long)n);
+        p += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool
+pread_all(int fd, void *data, size_t size, off_t offset)
+{
+    unsigned char *p = data;
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return true;
+}
+
+static off_t
+history_block_offset(size_t block_size, size_t block_index)
+{
+    return (off_t)(HISTORY_FILE_HEADER_SIZE + block_index * block_size);
+}
+
+/*
+ * Number of blocks with at least one record, these always come before the empty ones.
+ */
+static size_t
+history_count_used_blocks(size_t n_blocks, bool (*is_used)(void *ctx, size_t block_index), void *ctx)
+{
+    size_t lo = 0;
+    size_t hi = n_blocks;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (is_used(ctx, mid)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool
+history_writer_is_block_used(void *ctx, size_t block_index)
+{
+    HistoryWriter *writer = ctx;
+    unsigned char raw[HISTORY_BLOCK_HEADER_SIZE];
+    if (!pread_all(writer->fd, raw, sizeof(raw), history_block_offset(writer->block_size, block_index))) {
+        return false;
+    }
+    HistoryBlockHeader header;
+    history_load_block_header(raw, &header);
+    return header.n_records > 0;
+}
+
+/*
+ * Validate the header of an existing file, or write one to an empty file.
+ */
+static bool
+history_writer_prepare_file(HistoryWriter *writer)
+{
+    struct stat st;
+    if (fstat(writer->fd, &st) != 0) {
+        return false;
+    }
+
+    unsigned char header[HISTORY_FILE_HEADER_SIZE];
+
+    if (st.st_size == 0) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, history_magic, sizeof(history_magic));
+        store_le32(&header[8], HISTORY_VERSION);
+        store_le32(&header[12], (uint32_t)writer->block_size);
+        store_le32(&header[16], (uint32_t)writer->max_cpu_entries);
+        writer->n_blocks = 0;
+        return pwrite_all(writer->fd, header, sizeof(header), 0);
+    }
+
+    if (st.st_size < HISTORY_FILE_HEADER_SIZE || !pread_all(writer->fd, header, sizeof(header), 0)
+            || memcmp(header, history_magic, sizeof(history_magic)) != 0
+            || load_le32(&header[8]) != HISTORY_VERSION
+            || load_le32(&header[16]) < (uint32_t)writer->max_cpu_entries
+            || load_le32(&header[12]) < HISTORY_MIN_BLOCK_SIZE) {
+        return false;
+    }
+
+    /* Keep the geometry of the existing file */
+    writer->max_cpu_entries = (int)load_le32(&header[16]);
+    writer->block_size = load_le32(&header[12]);
+    if (writer->block_size < history_block_size(writer->max_cpu_entries)) {
+        return false;
+    }
+
+    /* A trailing empty block (e.g. after a crash) gets reused */
+    size_t n_blocks = (size_t)(st.st_size - HISTORY_FILE_HEADER_SIZE) / writer->block_size;
+    writer->n_blocks = history_count_used_blocks(n_blocks, history_writer_is_block_used, writer);
+
+    return true;
+}
+
+HistoryWriter *
+history_writer_open(const char *file_name, int max_cpu_entries)
+{
+    assert(file_name);
+    assert(max_cpu_entries > 0);
+
+    int fd = open(file_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    HistoryWriter *writer = ecalloc(1, sizeof(*writer));
+    writer->fd = fd;
+    writer->max_cpu_entries = max_cpu_entries;
+    writer->block_size = history_block_size(max_cpu_entries);
+
+    if (!history_writer_prepare_file(writer)) {
+        close(fd);
+        free(writer);
+        return NULL;
+    }
+
+    writer->previous_cpu_entries = emalloc((size_t)writer->max_cpu_entries * sizeof(writer->previous_cpu_entries[0]));
+    writer->record_buffer = emalloc(history_max_record_size(writer->max_cpu_entries));
+
+    return writer;
+}
+
+/*
+ * Returns the size of the encoded record, or 0 if an entry has an unexpected name.
+ */
+static size_t
+history_encode_record(HistoryWriter *writer, long long timestamp_ns, int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries])
+{
+    unsigned char *p = writer->record_buffer;
+
+    p += varint_encode(zigzag_encode(timestamp_ns - writer->previous_timestamp_ns), p);
+    p += varint_encode((uint64_t)n_cpu_entries, p);
+
+    for (int i = 0; i < n_cpu_entries; i++) {
+        ProcStatCpuEntry *ce = &cpu_entries[i];
+
+        uint64_t cpu_id;
+        if (!history_cpu_name_to_id(ce->cpu_name, &cpu_id)) {
+            return 0;
+        }
+        p += varint_encode(cpu_id, p);
+
+        unsigned long *counters[PROCSTATCPUENTRY_N_COUNTERS];
+        proc_stat_cpu_entry_counters(ce, counters);
+
+        unsigned long *base_counters[PROCSTATCPUENTRY_N_COUNTERS];
+        ProcStatCpuEntry *base = history_delta_base(writer->n_previous_cpu_entries, writer->previous_cpu_entries, i, ce->cpu_name);
+        if (base) {
+            proc_stat_cpu_entry_counters(base, base_counters);
+        }
+
+        for (int j = 0; j < PROCSTATCPUENTRY_N_COUNTERS; j++) {
+            uint64_t base_value = base ? *base_counters[j] : 0;
+            p += varint_encode(zigzag_encode((int64_t)(*counters[j] - base_value)), p);
+        }
+    }
+
+    return (size_t)(p - writer->record_buffer);
+}
+
+/*
+ * Extend the file by one zeroed block and make it the current one.
+ * Its first record is a key frame.
+ */
+static bool
+history_writer_start_block(HistoryWriter *writer, long long timestamp_ns)
+{
+    off_t end = history_block_offset(writer->block_size, writer->n_blocks + 1);
+    if (ftruncate(writer->fd, end) != 0) {
+        return false;
+    }
+
+    writer->n_blocks++;
+    writer->block_used = HISTORY_BLOCK_HEADER_SIZE;
+    memset(&writer->block_header, 0, sizeof(writer->block_header));
+    writer->block_header.first_timestamp_ns = timestamp_ns;
+    writer->previous_timestamp_ns = timestamp_ns;
+    writer->n_previous_cpu_entries = 0;
+
+    return true;
+}
+
+bool
+history_writer_append(HistoryWriter *writer, long long timestamp_ns, int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries])
+{
+    assert(writer);
+
+    if (n_cpu_entries > writer->max_cpu_entries) {
+        return false;
+    }
+
+    if (writer->block_used == 0 && !history_writer_start_block(writer, timestamp_ns)) {
+        return false;
+    }
+
+    size_t record_size = history_encode_record(writer, timestamp_ns, n_cpu_entries, cpu_entries);
+    if (record_size == 0) {
+        return false;
+    }
+
+    if (writer->block_used + record_size > writer->block_size) {
+        if (!history_writer_start_block(writer, timestamp_ns)) {
+            return false;
+        }
+        record_size = history_encode_record(writer, timestamp_ns, n_cpu_entries, cpu_entries);
+        assert(writer->block_used + record_size <= writer->block_size);
+    }
+
+    off_t block_offset = history_block_offset(writer->block_size, writer->n_blocks - 1);
+
+    /* The record goes in first, so a concurrent reader never sees a header that counts a missing record */
+    if (!pwrite_all(writer->fd, writer->record_buffer, record_size, block_offset + (off_t)writer->block_used)) {
+        return false;
+    }
+
+    HistoryBlockHeader header = writer->block_header;
+    header.last_timestamp_ns = timestamp_ns;
+    header.n_records++;
+    header.used_bytes = (uint32_t)(writer->block_used + record_size - HISTORY_BLOCK_HEADER_SIZE);
+
+    unsigned char raw_header[HISTORY_BLOCK_HEADER_SIZE];
+    history_store_block_header(raw_header, &header);
+    if (!pwrite_all(writer->fd, raw_header, sizeof(raw_header), block_offset)) {
+        return false;
+    }
+
+    writer->block_header = header;
+    writer->block_used += record_size;
+    writer->previous_timestamp_ns = timestamp_ns;
+    writer->n_previous_cpu_entries = n_cpu_entries;
+    memcpy(writer->previous_cpu_entries, cpu_entries, (size_t)n_cpu_entries * sizeof(cpu_entries[0]));
+
+    return true;
+}
+
+int
+history_writer_max_cpu_entries(HistoryWriter *writer)
+{
+    assert(writer);
+
+    return writer->max_cpu_entries;
+}
+
+void
+history_writer_close(HistoryWriter *writer)
+{
+    if (!writer) {
+        return;
+    }
+
+    close(writer->fd);
+    free(writer->previous_cpu_entries);
+    free(writer->record_buffer);
+    free(writer);
+}
+
+static const unsigned char *
+history_reader_block(HistoryReader *reader, size_t block_index)
+{
+    return &reader->map[history_block_offset(reader->block_size, block_index)];
+}
+
+static void
+history_reader_block_header(HistoryReader *reader, size_t block_index, HistoryBlockHeader header[static 1])
+{
+    history_load_block_header(history_reader_block(reader, block_index), header);
+}
+
+static bool
+history_reader_is_block_used(void *ctx, size_t block_index)
+{
+    HistoryBlockHeader header;
+    history_reader_block_header(ctx, block_index, &header);
+    return header.n_records > 0;
+}
+
+static void
+history_reader_rewind_to_block(HistoryReader *reader, size_t block_index)
+{
+    reader->block_index = block_index;
+    reader->record_index = 0;
+    reader->n_cpu_entries = 0;
+    reader->pending = false;
+
+    if (block_index < reader->n_blocks) {
+        HistoryBlockHeader header;
+        history_reader_block_header(reader, block_index, &header);
+        reader->p = &history_reader_block(reader, block_index)[HISTORY_BLOCK_HEADER_SIZE];
+        reader->timestamp_ns = header.first_timestamp_ns;
+    }
+}
+
+HistoryReader *
+history_reader_open(const char *file_name)
+{
+    assert(file_name);
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < HISTORY_FILE_HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t map_size = (size_t)st.st_size;
+    void *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const unsigned char *header = map;
+    uint32_t block_size = load_le32(&header[12]);
+    uint32_t max_cpu_entries = load_le32(&header[16]);
+
+    if (memcmp(header, history_magic, sizeof(history_magic)) != 0
+            || load_le32(&header[8]) != HISTORY_VERSION
+            || max_cpu_entries == 0 || max_cpu_entries > 1024 * 1024
+            || block_size < history_block_size((int)max_cpu_entries)) {
+        munmap(map, map_size);
+        return NULL;
+    }
+
+    HistoryReader *reader = ecalloc(1, sizeof(*reader));
+    reader->map = map;
+    reader->map_size = map_size;
+    reader->block_size = block_size;
+    reader->max_cpu_entries = (int)max_cpu_entries;
+    reader->cpu_entries = emalloc((size_t)max_cpu_entries * sizeof(reader->cpu_entries[0]));
+    reader->cpu_ids = emalloc((size_t)max_cpu_entries * sizeof(reader->cpu_ids[0]));
+
+    size_t n_blocks = (map_size - HISTORY_FILE_HEADER_SIZE) / block_size;
+    reader->n_blocks = history_count_used_blocks(n_blocks, history_reader_is_block_used, reader);
+
+    history_reader_rewind_to_block(reader, 0);
+
+    return reader;
+}
+
+int
+history_reader_max_cpu_entries(HistoryReader *reader)
+{
+    assert(reader);
+    return reader->max_cpu_entries;
+}
+
+bool
+history_reader_time_range(HistoryReader *reader, long long first_timestamp_ns[static 1], long long last_timestamp_ns[static 1])
+{
+    assert(reader);
+
+    if (reader->n_blocks == 0) {
+        return false;
+    }
+
+    HistoryBlockHeader header;
+    history_reader_block_header(reader, 0, &header);
+    *first_timestamp_ns = header.first_timestamp_ns;
+    history_reader_block_header(reader, reader->n_blocks - 1, &header);
+    *last_timestamp_ns = header.last_timestamp_ns;
+
+    return true;
+}
+
+/*
+ * Decode the next record into the reader's own state.
+ * Returns 1 on success, 0 at the end of the history and -1 if the file is corrupted.
+ */
+static int
+history_reader_decode_next(HistoryReader *reader)
+{
+    HistoryBlockHeader header;
+
+    while (1) {
+        if (reader->block_index >= reader->n_blocks) {
+            return 0;
+        }
+        history_reader_block_header(reader, reader->block_index, &header);
+        if (reader->record_index < header.n_records) {
+            break;
+        }
+        history_reader_rewind_to_block(reader, reader->block_index + 1);
+    }
+
+    const unsigned char *block_data = &history_reader_block(reader, reader->block_index)[HISTORY_BLOCK_HEADER_SIZE];
+    if (header.used_bytes > reader->block_size - HISTORY_BLOCK_HEADER_SIZE) {
+        return -1;
+    }
+    const unsigned char *p = reader->p;
+    const unsigned char *end = &block_data[header.used_bytes];
+
+    uint64_t timestamp_delta;
+    uint64_t n_cpu_entries;
+    p = varint_decode(p, end, &timestamp_delta);
+    if (!p || !(p = varint_decode(p, end, &n_cpu_entries)) || n_cpu_entries > (uint64_t)reader->max_cpu_entries) {
+        return -1;
+    }
+
+    /* Entries are decoded in place, the previous values at the same position are the delta bases */
+    for (int i = 0; i < (int)n_cpu_entries; i++) {
+        ProcStatCpuEntry *ce = &reader->cpu_entries[i];
+
+        uint64_t cpu_id;
+        p = varint_decode(p, end, &cpu_id);
+        if (!p) {
+            return -1;
+        }
+
+        bool has_base = i < reader->n_cpu_entries && reader->cpu_ids[i] == cpu_id;
+        if (!has_base) {
+            memset(ce->cpu_name, 0, sizeof(ce->cpu_name));
+            if (!history_cpu_id_to_name(cpu_id, ce->cpu_name)) {
+                return -1;
+            }
+            reader->cpu_ids[i] = cpu_id;
+        }
+
+        unsigned long *counters[PROCSTATCPUENTRY_N_COUNTERS];
+        proc_stat_cpu_entry_counters(ce, counters);
+
+        for (int j = 0; j < PROCSTATCPUENTRY_N_COUNTERS; j++) {
+            uint64_t delta;
+            p = varint_decode(p, end, &delta);
+            if (!p) {
+                return -1;
+            }
+            uint64_t base_value = has_base ? *counters[j] : 0;
+            *counters[j] = (unsigned long)(base_value + (uint64_t)zigzag_decode(delta));
+        }
+    }
+
+    reader->timestamp_ns += zigzag_decode(timestamp_delta);
+    reader->n_cpu_entries = (int)n_cpu_entries;
+    reader->p = p;
+    reader->record_index++;
+
+    return 1;
+}
+
+bool
+history_reader_seek(HistoryReader *reader, long long timestamp_ns)
+{
+    assert(reader);
+
+    /* Find the last block starting at or before timestamp_ns */
+    size_t lo = 0;
+    size_t hi = reader->n_blocks;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        HistoryBlockHeader header;
+        history_reader_block_header(reader, mid, &header);
+        if (header.first_timestamp_ns <= timestamp_ns) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t block_index = lo > 0 ? lo - 1 : 0;
+
+    if (block_index < reader->n_blocks) {
+        HistoryBlockHeader header;
+        history_reader_block_header(reader, block_index, &header);
+        if (header.last_timestamp_ns < timestamp_ns) {
+            block_index++;
+        }
+    }
+
+    history_reader_rewind_to_block(reader, block_index);
+
+    while (1) {
+        int ret = history_reader_decode_next(reader);
+        if (ret <= 0) {
+            reader->block_index = reader->n_blocks;
+            return false;
+        }
+        if (reader->timestamp_ns >= timestamp_ns) {
+            reader->pending = true;
+            return true;
+        }
+    }
+}
+
+int
+history_reader_next(HistoryReader *reader, long long timestamp_ns[static 1], ProcStatCpuEntry *cpu_entries)
+{
+    assert(reader);
+    assert(cpu_entries);
+
+    if (reader->pending) {
+        reader->pending = false;
+    } else {
+        int ret = history_reader_decode_next(reader);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+
+    memcpy(cpu_entries, reader->cpu_entries, (size_t)reader->n_cpu_entries * sizeof(cpu_entries[0]));
+    *timestamp_ns = reader->timestamp_ns;
+
+    return reader->n_cpu_entries;
+}
+
+void
+history_reader_close(HistoryReader *reader)
+{
+    if (!reader) {
+        return;
+    }
+
+    munmap((void *)reader->map, reader->map_size);
+    free(reader->cpu_entries);
+    free(reader->cpu_ids);
+    free(reader);
+}
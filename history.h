@@ -0,0 +1,100 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+
+#include "proc_stat_utils.h"
+
+/*
+ * Append-only history of raw /proc/stat CPU snapshots, designed to be read through mmap().
+ *
+ * File format (fixed-width integers are little-endian):
+ *  file header, HISTORY_FILE_HEADER_SIZE bytes:
+ *      8 magic bytes "CUTHIST\0", u32 version, u32 block_size, u32 max_cpu_entries, zero padding
+ *  blocks of block_size bytes each, the file always ends on a block boundary:
+ *      block header, HISTORY_BLOCK_HEADER_SIZE bytes:
+ *          i64 first_timestamp_ns, i64 last_timestamp_ns, u32 n_records, u32 used_bytes (after the header),
+ *          zero padding
+ *      n_records records (all integers are varints, see varint.h):
+ *          timestamp: zigzag encoded nanoseconds (CLOCK_REALTIME) since the previous record of the
+ *              block, or since first_timestamp_ns for the first one
+ *          n_cpu_entries
+ *          for each entry:
+ *              cpu id: 0 for the "cpu" average entry, N + 1 for "cpuN"
+ *              10 counters (user ... guest_nice), each one zigzag encoded as the difference from the
+ *              same counter of the entry at the same position in the previous record of the block,
+ *              or from 0 if there is no such entry or its cpu id differs
+ *
+ * Every block starts with a key frame, so the block headers double as a sparse time index:
+ * seeking is a binary search over the block headers followed by decoding at most one block.
+ * Blocks that have no records yet (n_records == 0) can only appear at the end of the file.
+ */
+
+#define HISTORY_FILE_HEADER_SIZE 64
+#define HISTORY_BLOCK_HEADER_SIZE 32
+
+typedef struct HistoryWriter HistoryWriter;
+typedef struct HistoryReader HistoryReader;
+
+/*
+ * Open a history file for appending, creating it if it doesn't exist.
+ * max_cpu_entries is the maximum number of entries a snapshot appended to it can contain.
+ * Snapshots appended to an existing file start a new block after the existing ones.
+ * Returns NULL on failure, or if the existing file isn't a history or was created for
+ * fewer entries per snapshot.
+ */
+HistoryWriter * history_writer_open(const char *file_name, int max_cpu_entries);
+
+/*
+ * Append a snapshot. The data is handed to the kernel right away (but not synced),
+ * so it is visible to readers that map the file.
+ * Timestamps are expected to be (mostly) increasing, seeking relies on it.
+ * Returns false on failure or if an entry's name isn't "cpu" or "cpuN".
+ */
+bool history_writer_append(HistoryWriter *writer, long long timestamp_ns, int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries]);
+
+/*
+ * Maximum number of entries a snapshot appended to the file can contain.
+ * Can be more than requested when opening an existing file.
+ */
+int history_writer_max_cpu_entries(HistoryWriter *writer);
+
+void history_writer_close(HistoryWriter *writer);
+
+/*
+ * Map a history file for reading.
+ * Only blocks that existed when the file was opened are visible, records appended later
+ * to the last of them might be visible too.
+ * Returns NULL if the file can't be opened or isn't a history.
+ */
+HistoryReader * history_reader_open(const char *file_name);
+
+/*
+ * The maximum number of entries of a snapshot in the history.
+ */
+int history_reader_max_cpu_entries(HistoryReader *reader);
+
+/*
+ * Timestamps of the first and the last snapshots in the history.
+ * Returns false if the history is empty.
+ */
+bool history_reader_time_range(HistoryReader *reader, long long first_timestamp_ns[static 1], long long last_timestamp_ns[static 1]);
+
+/*
+ * Position the reader so that the next call to history_reader_next() returns the first snapshot
+ * with a timestamp not earlier than timestamp_ns.
+ * Takes O(log(number of blocks)) block header lookups plus decoding part of one block.
+ * Returns false if there is no such snapshot (or the file is corrupted), the reader is then at the end.
+ */
+bool history_reader_seek(HistoryReader *reader, long long timestamp_ns);
+
+/*
+ * Read the next snapshot into cpu_entries (which must hold history_reader_max_cpu_entries() entries).
+ * A newly opened reader starts at the first snapshot.
+ * Returns the number of entries read, 0 at the end of the history and -1 if the file is corrupted.
+ */
+int history_reader_next(HistoryReader *reader, long long timestamp_ns[static 1], ProcStatCpuEntry *cpu_entries);
+
+void history_reader_close(HistoryReader *reader);
+
+#endif /* HISTORY_H */
@@ -0,0 +1,127 @@
+#include <math.h>
+#include <assert.h>
+
+#include "latency_histogram.h"
+
+#define NSEC_PER_USEC 1000LL
+
+static int
+latency_histogram_bucket(long long duration_ns)
+{
+    unsigned long long us = duration_ns > 0 ? (unsigned long long)duration_ns / NSEC_PER_USEC : 0;
+    if (us >= 1ULL << LATENCY_HISTOGRAM_MAX_BITS) {
+        return LATENCY_HISTOGRAM_N_BUCKETS - 1;
+    }
+    if (us < LATENCY_HISTOGRAM_SUB_BUCKETS) {
+        return (int)us;
+    }
+
+    /* Index of the power of two range, the first one above the linear buckets is 1 */
+    int msb = 63 - __builtin_clzll(us);
+    int range = msb - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1;
+    int sub_bucket = (int)(us >> (range - 1)) - LATENCY_HISTOGRAM_SUB_BUCKETS;
+
+    return range * LATENCY_HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+long long
+latency_histogram_bucket_lower_ns(int i)
+{
+    assert(i >= 0 && i < LATENCY_HISTOGRAM_N_BUCKETS);
+
+    if (i < LATENCY_HISTOGRAM_SUB_BUCKETS) {
+        return i * NSEC_PER_USEC;
+    }
+
+    int range = i / LATENCY_HISTOGRAM_SUB_BUCKETS;
+    int sub_bucket = i % LATENCY_HISTOGRAM_SUB_BUCKETS;
+
+    return ((long long)(LATENCY_HISTOGRAM_SUB_BUCKETS + sub_bucket) << (range - 1)) * NSEC_PER_USEC;
+}
+
+long long
+latency_histogram_bucket_upper_ns(int i)
+{
+    assert(i >= 0 && i < LATENCY_HISTOGRAM_N_BUCKETS);
+
+    if (i < LATENCY_HISTOGRAM_SUB_BUCKETS) {
+        return (i + 1) * NSEC_PER_USEC;
+    }
+
+    int range = i / LATENCY_HISTOGRAM_SUB_BUCKETS;
+
+    return latency_histogram_bucket_lower_ns(i) + (1LL << (range - 1)) * NSEC_PER_USEC;
+}
+
+void
+latency_histogram_record(LatencyHistogram histogram[static 1], long long duration_ns)
+{
+    unsigned long *count = &histogram->counts[latency_histogram_bucket(duration_ns)];
+
+    /* Single writer, so no read-modify-write is needed */
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+void
+latency_histogram_load(const LatencyHistogram histogram[static 1], LatencyHistogram out[static 1])
+{
+    for (int i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; i++) {
+        out->counts[i] = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+    }
+}
+
+void
+latency_histogram_subtract(LatencyHistogram histogram[static 1], const LatencyHistogram older[static 1])
+{
+    for (int i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; i++) {
+        histogram->counts[i] -= older->counts[i];
+    }
+}
+
+unsigned long
+latency_histogram_n_recorded(const LatencyHistogram histogram[static 1])
+{
+    unsigned long n = 0;
+    for (int i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; i++) {
+        n += histogram->counts[i];
+    }
+    return n;
+}
+
+long long
+latency_histogram_percentile_ns(const LatencyHistogram histogram[static 1], double fraction)
+{
+    assert(fraction >= 0 && fraction <= 1);
+
+    unsigned long n = latency_histogram_n_recorded(histogram);
+    if (n == 0) {
+        return 0;
+    }
+
+    /* Rank of the duration, 1-based */
+    unsigned long rank = (unsigned long)ceil(fraction * (double)n);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    unsigned long cumulative = 0;
+    for (int i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; i++) {
+        cumulative += histogram->counts[i];
+        if (cumulative >= rank) {
+            return latency_histogram_bucket_upper_ns(i);
+        }
+    }
+
+    return latency_histogram_max_ns(histogram);
+}
+
+long long
+latency_histogram_max_ns(const LatencyHistogram histogram[static 1])
+{
+    for (int i = LATENCY_HISTOGRAM_N_BUCKETS - 1; i >= 0; i--) {
+        if (histogram->counts[i] > 0) {
+            return latency_histogram_bucket_upper_ns(i);
+        }
+    }
+    return 0;
+}
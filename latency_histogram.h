@@ -0,0 +1,62 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+/*
+ * Log-bucketed (HDR-style) histogram of durations, recorded in microseconds.
+ *
+ * Durations shorter than LATENCY_HISTOGRAM_SUB_BUCKETS us get a bucket each. Every power of two range
+ * above that ([16, 32) us, [32, 64) us, ...) is split into LATENCY_HISTOGRAM_SUB_BUCKETS equal buckets,
+ * so a bucket is never wider than 1/16 (6.25%) of the durations it holds. Durations of
+ * 2^LATENCY_HISTOGRAM_MAX_BITS us (about 19 hours) and longer go into the last bucket.
+ * Recording is O(1) and memory is fixed.
+ *
+ * A histogram is recorded by a single thread, any thread may read it concurrently with
+ * latency_histogram_load(), counters are accessed atomically.
+ */
+
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 4
+#define LATENCY_HISTOGRAM_SUB_BUCKETS (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+#define LATENCY_HISTOGRAM_MAX_BITS 36
+#define LATENCY_HISTOGRAM_N_BUCKETS ((LATENCY_HISTOGRAM_MAX_BITS - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) * LATENCY_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+    unsigned long counts[LATENCY_HISTOGRAM_N_BUCKETS];
+} LatencyHistogram;
+
+/*
+ * Count a duration, negative durations are counted as 0.
+ * Must only be called by the thread that records the histogram.
+ */
+void latency_histogram_record(LatencyHistogram histogram[static 1], long long duration_ns);
+
+/*
+ * Copy the current counts of a histogram that might be being recorded by another thread.
+ */
+void latency_histogram_load(const LatencyHistogram histogram[static 1], LatencyHistogram out[static 1]);
+
+/*
+ * Subtract an older copy of the same histogram, leaving the durations recorded since.
+ */
+void latency_histogram_subtract(LatencyHistogram histogram[static 1], const LatencyHistogram older[static 1]);
+
+unsigned long latency_histogram_n_recorded(const LatencyHistogram histogram[static 1]);
+
+/*
+ * Smallest duration (bucket upper bound) that at least the specified fraction (0 to 1) of the
+ * recorded durations doesn't exceed. 0 if the histogram is empty.
+ */
+long long latency_histogram_percentile_ns(const LatencyHistogram histogram[static 1], double fraction);
+
+/*
+ * Upper bound of the longest recorded duration's bucket, 0 if the histogram is empty.
+ */
+long long latency_histogram_max_ns(const LatencyHistogram histogram[static 1]);
+
+/*
+ * Bucket i holds the durations in [latency_histogram_bucket_lower_ns(i), latency_histogram_bucket_upper_ns(i)).
+ */
+long long latency_histogram_bucket_lower_ns(int i);
+
+long long latency_histogram_bucket_upper_ns(int i);
+
+#endif /* LATENCY_HISTOGRAM_H */
@@ -0,0 +1,715 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <tgmath.h>
+
+#include "layout.h"
+#include "proc_stat_utils.h"
+#include "cpu_states.h"
+#include "screen.h"
+
+/* A bar entry: name, "[", bar, "]", " 100.0%" */
+#define LAYOUT_NAME_WIDTH 8
+#define LAYOUT_BAR_WIDTH 20
+#define LAYOUT_PERCENTAGE_WIDTH 7
+#define LAYOUT_ENTRY_WIDTH (LAYOUT_NAME_WIDTH + LAYOUT_BAR_WIDTH + 2 + LAYOUT_PERCENTAGE_WIDTH)
+/* Frequency-weighted usage appended to bar entries: " @", " 100.0%" */
+#define LAYOUT_FREQ_WIDTH (2 + LAYOUT_PERCENTAGE_WIDTH)
+/* Distance between the starts of two columns of bar entries */
+#define LAYOUT_ENTRY_STRIDE 48
+
+#define LAYOUT_HEATMAP_LABEL_WIDTH 6
+#define LAYOUT_HISTOGRAM_N_BUCKETS 10
+#define LAYOUT_HISTOGRAM_LABEL_WIDTH 9
+#define LAYOUT_HISTOGRAM_COUNT_WIDTH 7
+/* Number of busiest cores shown by the top layout when the terminal height is unlimited */
+#define LAYOUT_TOP_DEFAULT_ROWS 10
+/* Stats table: "%6.1f" values, groups of columns per window separated by a gap */
+#define LAYOUT_STATS_VALUE_WIDTH 6
+#define LAYOUT_STATS_GROUP_GAP 3
+#define LAYOUT_STATS_HEADER_ROWS 2
+/* States table: "%7.1f" values, wider where the state name is longer */
+#define LAYOUT_STATES_VALUE_WIDTH 7
+/* Process table: "%7d" pid, "%7.1f%%" usage (more than 100% for multithreaded processes), command */
+#define LAYOUT_PROCESSES_PID_WIDTH 7
+#define LAYOUT_PROCESSES_USAGE_WIDTH 8
+
+static const struct {
+    const char *name;
+    Layout layout;
+} layout_names[] = {
+    { "auto", LAYOUT_AUTO },
+    { "bars", LAYOUT_BARS },
+    { "heatmap", LAYOUT_HEATMAP },
+    { "histogram", LAYOUT_HISTOGRAM },
+    { "top", LAYOUT_TOP },
+    { "stats", LAYOUT_STATS },
+    { "states", LAYOUT_STATES },
+    { "procs", LAYOUT_PROCESSES },
+    { "threads", LAYOUT_THREADS },
+};
+
+/* Columns of the stats table, in the order shown when the terminal is wide enough for all of them */
+typedef enum {
+    LAYOUT_STATS_MEAN,
+    LAYOUT_STATS_P50,
+    LAYOUT_STATS_P95,
+    LAYOUT_STATS_P99,
+    LAYOUT_STATS_MIN,
+    LAYOUT_STATS_MAX,
+    LAYOUT_STATS_N_COLUMNS,
+} LayoutStatsColumn;
+
+static const char *layout_stats_column_names[LAYOUT_STATS_N_COLUMNS] = {
+    [LAYOUT_STATS_MEAN] = "mean",
+    [LAYOUT_STATS_P50] = "p50",
+    [LAYOUT_STATS_P95] = "p95",
+    [LAYOUT_STATS_P99] = "p99",
+    [LAYOUT_STATS_MIN] = "min",
+    [LAYOUT_STATS_MAX] = "max",
+};
+
+/* Columns shown when the terminal is too narrow for all of them */
+static const LayoutStatsColumn layout_stats_compact_columns[] = { LAYOUT_STATS_MEAN, LAYOUT_STATS_P95, LAYOUT_STATS_MAX };
+
+/* Heatmap shades from idle to busy, with the usage below which each one is used */
+static const struct {
+    uint32_t code_point;
+    double below;
+} heatmap_shades[] = {
+    { 0x00b7, 5 },   /* · */
+    { 0x2591, 30 },  /* ░ */
+    { 0x2592, 55 },  /* ▒ */
+    { 0x2593, 80 },  /* ▓ */
+    { 0x2588, 1e9 }, /* █ */
+};
+
+typedef struct {
+    Screen *screen;
+    int n_rows;
+    int n_cols;
+    int n_cpu_entries;
+    char (*cpu_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE];
+    double *cpu_usage;
+    /* NULL if the frequencies are unknown */
+    const double *freq_usage;
+    /* Width of a bar entry, with or without the frequency-weighted usage */
+    int entry_width;
+    const LayoutStats *stats;
+    const CpuStateBreakdown *states;
+    const LayoutProcesses *processes;
+} LayoutContext;
+
+bool
+layout_from_name(const char *name, Layout layout[static 1])
+{
+    for (size_t i = 0; i < sizeof(layout_names) / sizeof(layout_names[0]); i++) {
+        if (strcmp(name, layout_names[i].name) == 0) {
+            *layout = layout_names[i].layout;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Equivalent of snprintf(out, 8, " %5.1f%%", percentage) for the range [0, 999.9], without the cost of printf.
+ */
+static void
+layout_format_percentage(double percentage, char out[static 8])
+{
+    if (!(percentage >= 0)) {
+        percentage = 0;
+    }
+    if (percentage > 999.9) {
+        percentage = 999.9;
+    }
+
+    int tenths = (int)lround(percentage * 10);
+
+    out[0] = ' ';
+    out[1] = tenths >= 1000 ? (char)('0' + tenths / 1000) : ' ';
+    out[2] = tenths >= 100 ? (char)('0' + tenths / 100 % 10) : ' ';
+    out[3] = (char)('0' + tenths / 10 % 10);
+    out[4] = '.';
+    out[5] = (char)('0' + tenths % 10);
+    out[6] = '%';
+    out[7] = '\0';
+}
+
+/*
+ * Right-align the number part of a "cpuN" name in the given width.
+ */
+static void
+layout_draw_cpu_number(Screen screen[static 1], int row, int col, int width, const char *cpu_name)
+{
+    const char *number = strncmp(cpu_name, "cpu", 3) == 0 ? &cpu_name[3] : cpu_name;
+    int length = (int)strlen(number);
+    screen_put_text(screen, row, col + (length < width ? width - length : 0), number);
+}
+
+static void
+layout_draw_entry(Screen screen[static 1], int row, int col, const char *cpu_name, double percentage)
+{
+    int n_filled = (int)lround(percentage / 5);
+    if (n_filled < 0) {
+        n_filled = 0;
+    }
+    if (n_filled > LAYOUT_BAR_WIDTH) {
+        n_filled = LAYOUT_BAR_WIDTH;
+    }
+
+    char percentage_text[8];
+    layout_format_percentage(percentage, percentage_text);
+
+    screen_put_text(screen, row, col, cpu_name);
+    col += LAYOUT_NAME_WIDTH;
+    screen_put_text(screen, row, col, "[");
+    screen_fill(screen, row, col + 1, n_filled, '|');
+    screen_put_text(screen, row, col + 1 + LAYOUT_BAR_WIDTH, "]");
+    screen_put_text(screen, row, col + 2 + LAYOUT_BAR_WIDTH, percentage_text);
+}
+
+/*
+ * A bar entry of cpu_usage[i], followed by freq_usage[i] if the frequencies are known
+ * (left blank for the CPUs whose frequency isn't).
+ */
+static void
+layout_draw_cpu_entry(LayoutContext ctx[static 1], int row, int col, const char *cpu_name, int i)
+{
+    layout_draw_entry(ctx->screen, row, col, cpu_name, ctx->cpu_usage[i]);
+
+    if (ctx->freq_usage && ctx->freq_usage[i] >= 0) {
+        char percentage_text[8];
+        layout_format_percentage(ctx->freq_usage[i], percentage_text);
+        screen_put_text(ctx->screen, row, col + LAYOUT_ENTRY_WIDTH, " @");
+        screen_put_text(ctx->screen, row, col + LAYOUT_ENTRY_WIDTH + 2, percentage_text);
+    }
+}
+
+static int
+layout_n_entry_columns(LayoutContext ctx[static 1])
+{
+    if (ctx->n_cols < ctx->entry_width) {
+        return 1;
+    }
+    return (ctx->n_cols - ctx->entry_width) / LAYOUT_ENTRY_STRIDE + 1;
+}
+
+/*
+ * The line with the average usage, followed by the number of cores if show_n_cores is set.
+ */
+static int
+layout_draw_average(LayoutContext ctx[static 1], int row, bool show_n_cores)
+{
+    layout_draw_cpu_entry(ctx, row, 0, "Avg.", 0);
+    if (show_n_cores) {
+        screen_printf(ctx->screen, row, ctx->entry_width, "   %d cores", ctx->n_cpu_entries - 1);
+    }
+    return row + 1;
+}
+
+static int
+layout_bars_height(LayoutContext ctx[static 1])
+{
+    int n_columns = layout_n_entry_columns(ctx);
+    return (ctx->n_cpu_entries - 1 + n_columns - 1) / n_columns;
+}
+
+static int
+layout_draw_bars(LayoutContext ctx[static 1], int row)
+{
+    int n_columns = layout_n_entry_columns(ctx);
+
+    for (int i = 1; i < ctx->n_cpu_entries; i++) {
+        int entry_row = row + (i - 1) / n_columns;
+        int entry_col = (i - 1) % n_columns * LAYOUT_ENTRY_STRIDE;
+        layout_draw_cpu_entry(ctx, entry_row, entry_col, ctx->cpu_names[i], i);
+    }
+
+    return row + layout_bars_height(ctx);
+}
+
+static int
+layout_heatmap_cells_per_row(LayoutContext ctx[static 1])
+{
+    int n = ctx->n_cols - LAYOUT_HEATMAP_LABEL_WIDTH;
+    return n > 0 ? n : 1;
+}
+
+static int
+layout_heatmap_height(LayoutContext ctx[static 1])
+{
+    int per_row = layout_heatmap_cells_per_row(ctx);
+    /* One more row for the legend */
+    return (ctx->n_cpu_entries - 1 + per_row - 1) / per_row + 1;
+}
+
+static uint32_t
+layout_heatmap_shade(double percentage)
+{
+    size_t i = 0;
+    while (percentage >= heatmap_shades[i].below) {
+        i++;
+    }
+    return heatmap_shades[i].code_point;
+}
+
+static int
+layout_draw_heatmap(LayoutContext ctx[static 1], int row)
+{
+    Screen *screen = ctx->screen;
+    int per_row = layout_heatmap_cells_per_row(ctx);
+
+    int col = 0;
+    for (size_t i = 0; i < sizeof(heatmap_shades) / sizeof(heatmap_shades[0]); i++) {
+        screen_fill(screen, row, col, 1, heatmap_shades[i].code_point);
+        if (i + 1 < sizeof(heatmap_shades) / sizeof(heatmap_shades[0])) {
+            col = screen_printf(screen, row, col + 1, " <%.0f%%   ", heatmap_shades[i].below);
+        } else {
+            screen_printf(screen, row, col + 1, " >=%.0f%%", heatmap_shades[i - 1].below);
+        }
+    }
+    row++;
+
+    /* Each row is labeled with the number of its first core */
+    for (int i = 1; i < ctx->n_cpu_entries; i += per_row, row++) {
+        layout_draw_cpu_number(screen, row, 0, LAYOUT_HEATMAP_LABEL_WIDTH - 1, ctx->cpu_names[i]);
+
+        int n = ctx->n_cpu_entries - i < per_row ? ctx->n_cpu_entries - i : per_row;
+        if (row < 0 || row >= screen->n_rows) {
+            continue;
+        }
+        uint32_t *cells = &screen->cells[row * screen->n_cols + LAYOUT_HEATMAP_LABEL_WIDTH];
+        for (int j = 0; j < n && LAYOUT_HEATMAP_LABEL_WIDTH + j < screen->n_cols; j++) {
+            cells[j] = layout_heatmap_shade(ctx->cpu_usage[i + j]);
+        }
+    }
+
+    return row;
+}
+
+static int
+layout_histogram_height(void)
+{
+    return 1 + LAYOUT_HISTOGRAM_N_BUCKETS;
+}
+
+static int
+layout_draw_histogram(LayoutContext ctx[static 1], int row)
+{
+    Screen *screen = ctx->screen;
+
+    int counts[LAYOUT_HISTOGRAM_N_BUCKETS] = { 0 };
+    for (int i = 1; i < ctx->n_cpu_entries; i++) {
+        int bucket = (int)(ctx->cpu_usage[i] / (100 / LAYOUT_HISTOGRAM_N_BUCKETS));
+        if (bucket < 0) {
+            bucket = 0;
+        }
+        if (bucket >= LAYOUT_HISTOGRAM_N_BUCKETS) {
+            bucket = LAYOUT_HISTOGRAM_N_BUCKETS - 1;
+        }
+        counts[bucket]++;
+    }
+
+    int max_count = 1;
+    for (int b = 0; b < LAYOUT_HISTOGRAM_N_BUCKETS; b++) {
+        if (counts[b] > max_count) {
+            max_count = counts[b];
+        }
+    }
+
+    int bar_width = ctx->n_cols - LAYOUT_HISTOGRAM_LABEL_WIDTH - LAYOUT_HISTOGRAM_COUNT_WIDTH;
+    if (bar_width < 1) {
+        bar_width = 1;
+    }
+
+    screen_put_text(screen, row++, 0, "Cores by usage");
+
+    /* Busiest bucket first, like the top layout */
+    for (int b = LAYOUT_HISTOGRAM_N_BUCKETS - 1; b >= 0; b--, row++) {
+        int bucket_width = 100 / LAYOUT_HISTOGRAM_N_BUCKETS;
+        screen_printf(screen, row, 0, "%3d-%d%%", b * bucket_width, (b + 1) * bucket_width);
+
+        /* Round up so that non-empty buckets are always visible */
+        int n_filled = (int)(((long)counts[b] * bar_width + max_count - 1) / max_count);
+        screen_fill(screen, row, LAYOUT_HISTOGRAM_LABEL_WIDTH, n_filled, '#');
+        screen_printf(screen, row, LAYOUT_HISTOGRAM_LABEL_WIDTH + n_filled, " %d", counts[b]);
+    }
+
+    return row;
+}
+
+static void
+layout_top_sift_up(double *cpu_usage, int *heap, int k)
+{
+    while (k > 0) {
+        int parent = (k - 1) / 2;
+        if (cpu_usage[heap[parent]] <= cpu_usage[heap[k]]) {
+            break;
+        }
+        int tmp = heap[parent];
+        heap[parent] = heap[k];
+        heap[k] = tmp;
+        k = parent;
+    }
+}
+
+static void
+layout_top_sift_down(double *cpu_usage, int *heap, int n, int k)
+{
+    while (1) {
+        int smallest = k;
+        int left = 2 * k + 1;
+        int right = left + 1;
+        if (left < n && cpu_usage[heap[left]] < cpu_usage[heap[smallest]]) {
+            smallest = left;
+        }
+        if (right < n && cpu_usage[heap[right]] < cpu_usage[heap[smallest]]) {
+            smallest = right;
+        }
+        if (smallest == k) {
+            return;
+        }
+        int tmp = heap[smallest];
+        heap[smallest] = heap[k];
+        heap[k] = tmp;
+        k = smallest;
+    }
+}
+
+/*
+ * Draw the busiest cores into the rows [row, end_row), with a title line.
+ */
+static int
+layout_draw_top(LayoutContext ctx[static 1], int row, int end_row)
+{
+    int n_columns = layout_n_entry_columns(ctx);
+    int n_top = (end_row - row - 1) * n_columns;
+    if (n_top > ctx->n_cpu_entries - 1) {
+        n_top = ctx->n_cpu_entries - 1;
+    }
+    if (n_top <= 0) {
+        return row;
+    }
+
+    /*
+     * Indices of the busiest cores: a min-heap of the n_top busiest ones seen so far,
+     * sorted in descending order of usage at the end (heapsort).
+     */
+    int top[n_top];
+    int n_found = 0;
+    for (int i = 1; i < ctx->n_cpu_entries; i++) {
+        if (n_found < n_top) {
+            top[n_found++] = i;
+            layout_top_sift_up(ctx->cpu_usage, top, n_found - 1);
+        } else if (ctx->cpu_usage[i] > ctx->cpu_usage[top[0]]) {
+            top[0] = i;
+            layout_top_sift_down(ctx->cpu_usage, top, n_top, 0);
+        }
+    }
+    for (int n = n_top - 1; n > 0; n--) {
+        int tmp = top[0];
+        top[0] = top[n];
+        top[n] = tmp;
+        layout_top_sift_down(ctx->cpu_usage, top, n, 0);
+    }
+
+    screen_put_text(ctx->screen, row++, 0, "Busiest cores");
+
+    /* Column-major, so that the order reads top to bottom */
+    int n_rows = (n_top + n_columns - 1) / n_columns;
+    for (int k = 0; k < n_top; k++) {
+        int i = top[k];
+        layout_draw_cpu_entry(ctx, row + k % n_rows, k / n_rows * LAYOUT_ENTRY_STRIDE, ctx->cpu_names[i], i);
+    }
+
+    return row + n_rows;
+}
+
+static float
+layout_stats_value(const RollingStatsSummary summary[static 1], LayoutStatsColumn column)
+{
+    switch (column) {
+    case LAYOUT_STATS_MEAN:
+        return summary->mean;
+    case LAYOUT_STATS_P50:
+        return summary->p50;
+    case LAYOUT_STATS_P95:
+        return summary->p95;
+    case LAYOUT_STATS_P99:
+        return summary->p99;
+    case LAYOUT_STATS_MIN:
+        return summary->min;
+    default:
+        return summary->max;
+    }
+}
+
+static int
+layout_stats_height(LayoutContext ctx[static 1])
+{
+    if (!ctx->stats) {
+        return 1;
+    }
+    return LAYOUT_STATS_HEADER_ROWS + ctx->n_cpu_entries;
+}
+
+/*
+ * A table with a row per entry (the average first): the current usage, then the statistics of each window.
+ * All the columns are shown if the terminal is wide enough, otherwise only mean, p95 and max.
+ */
+static int
+layout_draw_stats(LayoutContext ctx[static 1], int row)
+{
+    Screen *screen = ctx->screen;
+    const LayoutStats *stats = ctx->stats;
+
+    if (!stats) {
+        screen_put_text(screen, row, 0, "No rolling statistics");
+        return row + 1;
+    }
+
+    int n_windows = stats->windows->n_windows;
+
+    LayoutStatsColumn columns[LAYOUT_STATS_N_COLUMNS];
+    int n_columns = LAYOUT_STATS_N_COLUMNS;
+    for (int c = 0; c < n_columns; c++) {
+        columns[c] = (LayoutStatsColumn)c;
+    }
+    int full_width = LAYOUT_NAME_WIDTH + LAYOUT_STATS_VALUE_WIDTH
+        + n_windows * (LAYOUT_STATS_GROUP_GAP + LAYOUT_STATS_N_COLUMNS * LAYOUT_STATS_VALUE_WIDTH);
+    if (full_width > ctx->n_cols) {
+        n_columns = (int)(sizeof(layout_stats_compact_columns) / sizeof(layout_stats_compact_columns[0]));
+        memcpy(columns, layout_stats_compact_columns, sizeof(layout_stats_compact_columns));
+    }
+    int group_width = LAYOUT_STATS_GROUP_GAP + n_columns * LAYOUT_STATS_VALUE_WIDTH;
+    int first_group_col = LAYOUT_NAME_WIDTH + LAYOUT_STATS_VALUE_WIDTH;
+
+    /* Window lengths, then the column names */
+    screen_printf(screen, row + 1, LAYOUT_NAME_WIDTH, "%*s", LAYOUT_STATS_VALUE_WIDTH, "now");
+    for (int w = 0; w < n_windows; w++) {
+        int col = first_group_col + w * group_width + LAYOUT_STATS_GROUP_GAP;
+        char window[16];
+        rolling_stats_format_window(stats->windows->window_ns[w], window);
+        screen_printf(screen, row, col, "last %s", window);
+        for (int c = 0; c < n_columns; c++) {
+            screen_printf(screen, row + 1, col + c * LAYOUT_STATS_VALUE_WIDTH, "%*s",
+                    LAYOUT_STATS_VALUE_WIDTH, layout_stats_column_names[columns[c]]);
+        }
+    }
+    row += LAYOUT_STATS_HEADER_ROWS;
+
+    for (int i = 0; i < ctx->n_cpu_entries && row < screen->n_rows; i++, row++) {
+        screen_put_text(screen, row, 0, i == 0 ? "Avg." : ctx->cpu_names[i]);
+        screen_printf(screen, row, LAYOUT_NAME_WIDTH, "%*.1f", LAYOUT_STATS_VALUE_WIDTH, ctx->cpu_usage[i]);
+
+        for (int w = 0; w < n_windows; w++) {
+            const RollingStatsSummary *summary = &stats->summaries[w * ctx->n_cpu_entries + i];
+            int col = first_group_col + w * group_width + LAYOUT_STATS_GROUP_GAP;
+            for (int c = 0; c < n_columns; c++, col += LAYOUT_STATS_VALUE_WIDTH) {
+                if (summary->n_samples == 0) {
+                    screen_printf(screen, row, col, "%*s", LAYOUT_STATS_VALUE_WIDTH, "-");
+                } else {
+                    screen_printf(screen, row, col, "%*.1f", LAYOUT_STATS_VALUE_WIDTH, (double)layout_stats_value(summary, columns[c]));
+                }
+            }
+        }
+    }
+
+    return row;
+}
+
+static int
+layout_states_height(LayoutContext ctx[static 1])
+{
+    if (!ctx->states) {
+        return 1;
+    }
+    return 1 + ctx->n_cpu_entries;
+}
+
+/*
+ * A table with a row per entry (the average first): the share of the elapsed time spent in every state.
+ */
+static int
+layout_draw_states(LayoutContext ctx[static 1], int row)
+{
+    Screen *screen = ctx->screen;
+    const CpuStateBreakdown *states = ctx->states;
+
+    if (!states) {
+        screen_put_text(screen, row, 0, "No per-state breakdown");
+        return row + 1;
+    }
+
+    int widths[CPU_N_STATES];
+    int col = LAYOUT_NAME_WIDTH;
+    for (int s = 0; s < CPU_N_STATES; s++) {
+        const char *name = cpu_state_name((CpuState)s);
+        int name_width = (int)strlen(name) + 1;
+        widths[s] = name_width > LAYOUT_STATES_VALUE_WIDTH ? name_width : LAYOUT_STATES_VALUE_WIDTH;
+        col = screen_printf(screen, row, col, "%*s", widths[s], name);
+    }
+    row++;
+
+    for (int i = 0; i < ctx->n_cpu_entries && i < states->n_cpu_entries && row < screen->n_rows; i++, row++) {
+        screen_put_text(screen, row, 0, i == 0 ? "Avg." : ctx->cpu_names[i]);
+        col = LAYOUT_NAME_WIDTH;
+        for (int s = 0; s < CPU_N_STATES; s++) {
+            col = screen_printf(screen, row, col, "%*.1f", widths[s], (double)states->percentage[s][i]);
+        }
+    }
+
+    return row;
+}
+
+static int
+layout_processes_height(LayoutContext ctx[static 1])
+{
+    if (!ctx->processes) {
+        return 1;
+    }
+    return 1 + ctx->processes->n_processes;
+}
+
+/*
+ * A table of the busiest processes: pid, usage (100% is one CPU) and command name.
+ * Threads have their tid in front of the pid of their process.
+ */
+static int
+layout_draw_processes(LayoutContext ctx[static 1], int row, bool threads)
+{
+    Screen *screen = ctx->screen;
+    const LayoutProcesses *processes = ctx->processes;
+
+    if (!processes) {
+        screen_put_text(screen, row, 0, threads ? "No thread data" : "No process data");
+        return row + 1;
+    }
+
+    if (threads) {
+        screen_printf(screen, row++, 0, "%*s%*s%*s  %s", LAYOUT_PROCESSES_PID_WIDTH, "TID",
+                LAYOUT_PROCESSES_PID_WIDTH, "PID", LAYOUT_PROCESSES_USAGE_WIDTH + 1, "CPU%", "COMMAND");
+    } else {
+        screen_printf(screen, row++, 0, "%*s%*s  %s", LAYOUT_PROCESSES_PID_WIDTH, "PID",
+                LAYOUT_PROCESSES_USAGE_WIDTH + 1, "CPU%", "COMMAND");
+    }
+
+    for (int i = 0; i < processes->n_processes && row < screen->n_rows; i++, row++) {
+        const ProcessUsage *process = &processes->processes[i];
+        if (threads) {
+            screen_printf(screen, row, 0, "%*d%*d%*.1f%%  %s", LAYOUT_PROCESSES_PID_WIDTH, process->tid,
+                    LAYOUT_PROCESSES_PID_WIDTH, process->pid, LAYOUT_PROCESSES_USAGE_WIDTH, process->cpu_usage,
+                    process->comm);
+        } else {
+            screen_printf(screen, row, 0, "%*d%*.1f%%  %s", LAYOUT_PROCESSES_PID_WIDTH, process->pid,
+                    LAYOUT_PROCESSES_USAGE_WIDTH, process->cpu_usage, process->comm);
+        }
+    }
+
+    return row;
+}
+
+void
+layout_draw(Screen screen[static 1], Layout layout, int terminal_rows, int terminal_cols,
+        int n_cpu_entries, char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage, const LayoutStats *stats, const CpuStateBreakdown *states, const LayoutProcesses *processes)
+{
+    if (n_cpu_entries < 2) {
+        return;
+    }
+
+    int entry_width = LAYOUT_ENTRY_WIDTH + (freq_usage ? LAYOUT_FREQ_WIDTH : 0);
+    assert(entry_width <= LAYOUT_ENTRY_STRIDE);
+
+    LayoutContext ctx = {
+        .screen = screen,
+        .n_cols = terminal_cols > 0 ? terminal_cols : LAYOUT_ENTRY_STRIDE + entry_width,
+        .n_cpu_entries = n_cpu_entries,
+        .cpu_names = cpu_names,
+        .cpu_usage = cpu_usage,
+        .freq_usage = freq_usage,
+        .entry_width = entry_width,
+        .stats = stats,
+        .states = states,
+        .processes = processes,
+    };
+
+    int max_rows = terminal_rows > 1 ? terminal_rows - 1 : 0;
+
+    if (layout == LAYOUT_AUTO) {
+        layout = (max_rows == 0 || 1 + layout_bars_height(&ctx) <= max_rows) ? LAYOUT_BARS : LAYOUT_AUTO;
+    }
+
+    int n_rows;
+    switch (layout) {
+    case LAYOUT_BARS:
+        n_rows = 1 + layout_bars_height(&ctx);
+        break;
+    case LAYOUT_HEATMAP:
+        n_rows = 1 + layout_heatmap_height(&ctx);
+        break;
+    case LAYOUT_HISTOGRAM:
+        n_rows = 1 + layout_histogram_height();
+        break;
+    case LAYOUT_TOP:
+        n_rows = max_rows > 0 ? max_rows : 2 + LAYOUT_TOP_DEFAULT_ROWS;
+        break;
+    case LAYOUT_STATS:
+        n_rows = 1 + layout_stats_height(&ctx);
+        break;
+    case LAYOUT_STATES:
+        n_rows = 1 + layout_states_height(&ctx);
+        break;
+    case LAYOUT_PROCESSES:
+    case LAYOUT_THREADS:
+        n_rows = 1 + layout_processes_height(&ctx);
+        break;
+    default:
+        n_rows = max_rows;
+        break;
+    }
+    if (max_rows > 0 && n_rows > max_rows) {
+        n_rows = max_rows;
+    }
+    ctx.n_rows = n_rows;
+
+    screen_resize(screen, n_rows, ctx.n_cols);
+    screen_clear(screen);
+
+    int row = layout_draw_average(&ctx, 0, layout != LAYOUT_BARS);
+
+    switch (layout) {
+    case LAYOUT_BARS:
+        layout_draw_bars(&ctx, row);
+        break;
+    case LAYOUT_HEATMAP:
+        layout_draw_heatmap(&ctx, row);
+        break;
+    case LAYOUT_HISTOGRAM:
+        layout_draw_histogram(&ctx, row);
+        break;
+    case LAYOUT_TOP:
+        layout_draw_top(&ctx, row, n_rows);
+        break;
+    case LAYOUT_STATS:
+        layout_draw_stats(&ctx, row);
+        break;
+    case LAYOUT_STATES:
+        layout_draw_states(&ctx, row);
+        break;
+    case LAYOUT_PROCESSES:
+    case LAYOUT_THREADS:
+        layout_draw_processes(&ctx, row, layout == LAYOUT_THREADS);
+        break;
+    default:
+        /* Too many cores for bars: the overview of all of them, then the busiest ones in the remaining rows */
+        row = layout_draw_heatmap(&ctx, row + 1);
+        row = layout_draw_histogram(&ctx, row + 1);
+        layout_draw_top(&ctx, row + 1, n_rows);
+        break;
+    }
+}
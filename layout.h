@@ -0,0 +1,75 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdbool.h>
+
+#include "proc_stat_utils.h"
+#include "cpu_states.h"
+#include "screen.h"
+#include "rolling_stats.h"
+#include "process_scanner.h"
+
+/*
+ * Ways of displaying CPU usage. All of them start with a line showing the average usage.
+ *
+ *  bars:      a usage bar per core, in as many columns as fit the terminal width
+ *  heatmap:   one cell per core, shaded by usage with block characters
+ *  histogram: number of cores in each 10% usage bucket
+ *  top:       the busiest cores, as many as fit the terminal height
+ *  stats:     a table of the rolling statistics of every window, as many cores as fit the terminal height
+ *  states:    a table of the time spent in each state (user, system, iowait, ...), as many cores as fit the terminal height
+ *  procs:     the busiest processes, as many as fit the terminal height
+ *  threads:   the busiest threads with the process they belong to, as many as fit the terminal height
+ *  auto:      bars if they fit the terminal, otherwise heatmap, histogram and top stacked
+ */
+typedef enum {
+    LAYOUT_AUTO,
+    LAYOUT_BARS,
+    LAYOUT_HEATMAP,
+    LAYOUT_HISTOGRAM,
+    LAYOUT_TOP,
+    LAYOUT_STATS,
+    LAYOUT_STATES,
+    LAYOUT_PROCESSES,
+    LAYOUT_THREADS,
+} Layout;
+
+/*
+ * Rolling statistics shown by the stats layout.
+ * summaries is window-major, see rolling_stats_summarize().
+ */
+typedef struct {
+    const RollingStatsWindows *windows;
+    const RollingStatsSummary *summaries;
+} LayoutStats;
+
+/*
+ * Busiest processes (or threads) shown by the procs (threads) layout, busiest first.
+ */
+typedef struct {
+    int n_processes;
+    const ProcessUsage *processes;
+} LayoutProcesses;
+
+/*
+ * Parse a layout name as listed above.
+ * Returns false if the name isn't recognized.
+ */
+bool layout_from_name(const char *name, Layout layout[static 1]);
+
+/*
+ * Draw CPU usage into a frame buffer for a terminal of the given size.
+ * The screen is resized to the rows the layout needs, at most terminal_rows - 1 so that the
+ * cursor line below the frame doesn't scroll the terminal.
+ * terminal_rows <= 0 means the height is unlimited (e.g. the output isn't a terminal).
+ * freq_usage is the frequency-weighted usage shown next to the bar entries (negative for CPUs whose
+ * frequency is unknown), or NULL if there are no frequencies.
+ * stats can be NULL if there are no rolling statistics, states if there is no per-state breakdown,
+ * processes if there is no process data.
+ * If n_cpu_entries is less than 2 the function doesn't do anything.
+ */
+void layout_draw(Screen screen[static 1], Layout layout, int terminal_rows, int terminal_cols,
+        int n_cpu_entries, char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage, const LayoutStats *stats, const CpuStateBreakdown *states, const LayoutProcesses *processes);
+
+#endif /* LAYOUT_H */
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "log_format.h"
+
+/*
+ * Write binary log files (cut --log-format binary) as text, one line per message.
+ */
+
+static void
+print_usage(const char *program_name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] FILE...\n"
+            "\n"
+            "Write the messages of binary log files to stdout, in the order of the files.\n"
+            "\n"
+            "Options:\n"
+            "  --timestamps    Prefix every message with its local date and time\n"
+            "  --help          Show this help\n",
+            program_name);
+}
+
+int
+main(int argc, char **argv)
+{
+    bool timestamps = false;
+    int first_file = 1;
+
+    for (; first_file < argc && argv[first_file][0] == '-'; first_file++) {
+        const char *arg = argv[first_file];
+        if (strcmp(arg, "--timestamps") == 0 || strcmp(arg, "-t") == 0) {
+            timestamps = true;
+        } else if (strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        } else {
+            EPRINT("Unknown option: %s", arg);
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (first_file == argc) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int status = EXIT_SUCCESS;
+
+    for (int i = first_file; i < argc; i++) {
+        FILE *in = fopen(argv[i], "rb");
+        if (!in) {
+            EPRINT("Failed to open %s: %s", argv[i], strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        if (!log_file_decode(in, stdout, timestamps)) {
+            EPRINT("%s isn't a binary log file or is corrupted", argv[i]);
+            status = EXIT_FAILURE;
+        }
+
+        fclose(in);
+    }
+
+    return status;
+}
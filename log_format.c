@@ -0,0 +1,597 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "log_format.h"
+#include "utils.h"
+#include "thread_utils.h"
+
+/* Longest line log_file_decode() writes, longer messages are truncated */
+#define LOG_FILE_MAX_LINE_LENGTH (64 * 1024)
+/* Longer records are considered corrupted */
+#define LOG_FILE_MAX_RECORD_LENGTH (1024 * 1024)
+/* Higher ids are considered corrupted */
+#define LOG_FILE_MAX_FORMAT_ID (1024 * 1024)
+
+/* Upper limit on a literal width or precision */
+#define LOG_FORMAT_MAX_FIELD_WIDTH 99999
+
+/*
+ * Conversion specification, e.g. %-*.3lu
+ */
+typedef struct {
+    char flags[8];
+    /* -1 if none, -2 for '*' */
+    int width;
+    int precision;
+    char length[3];
+    char conversion;
+    unsigned char type;
+} LogConversion;
+
+static bool
+log_format_parse_field(const char **p, int field[static 1])
+{
+    if (**p == '*') {
+        (*p)++;
+        *field = -2;
+        return true;
+    }
+
+    int value = 0;
+    while (**p >= '0' && **p <= '9') {
+        value = value * 10 + (**p - '0');
+        if (value > LOG_FORMAT_MAX_FIELD_WIDTH) {
+            return false;
+        }
+        (*p)++;
+    }
+    *field = value;
+    return true;
+}
+
+/*
+ * Parse the conversion specification that follows a '%' (other than "%%") and advance *p past it.
+ * Returns false if it can't be deferred.
+ */
+static bool
+log_format_parse_conversion(const char **p, LogConversion conv[static 1])
+{
+    size_t n_flags = strspn(*p, "-+ #0");
+    if (n_flags >= sizeof(conv->flags)) {
+        return false;
+    }
+    memcpy(conv->flags, *p, n_flags);
+    conv->flags[n_flags] = '\0';
+    *p += n_flags;
+
+    conv->width = -1;
+    if (**p == '*' || (**p >= '0' && **p <= '9')) {
+        if (!log_format_parse_field(p, &conv->width)) {
+            return false;
+        }
+    }
+
+    conv->precision = -1;
+    if (**p == '.') {
+        (*p)++;
+        if (!log_format_parse_field(p, &conv->precision)) {
+            return false;
+        }
+    }
+
+    size_t n_length = 0;
+    if (((*p)[0] == 'h' && (*p)[1] == 'h') || ((*p)[0] == 'l' && (*p)[1] == 'l')) {
+        n_length = 2;
+    } else if (**p != '\0' && strchr("hlzjtL", **p)) {
+        n_length = 1;
+    }
+    memcpy(conv->length, *p, n_length);
+    conv->length[n_length] = '\0';
+    *p += n_length;
+
+    conv->conversion = **p;
+    if (conv->conversion == '\0') {
+        return false;
+    }
+    (*p)++;
+
+    const char *length = conv->length;
+    bool no_length = length[0] == '\0' || strcmp(length, "h") == 0 || strcmp(length, "hh") == 0;
+
+    switch (conv->conversion) {
+    case 'd':
+    case 'i':
+        if (no_length) {
+            conv->type = LOG_ARG_INT;
+        } else if (strcmp(length, "l") == 0) {
+            conv->type = LOG_ARG_LONG;
+        } else if (strcmp(length, "ll") == 0) {
+            conv->type = LOG_ARG_LLONG;
+        } else if (strcmp(length, "z") == 0) {
+            conv->type = LOG_ARG_SSIZE;
+        } else if (strcmp(length, "j") == 0) {
+            conv->type = LOG_ARG_INTMAX;
+        } else if (strcmp(length, "t") == 0) {
+            conv->type = LOG_ARG_PTRDIFF;
+        } else {
+            return false;
+        }
+        return true;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        if (no_length) {
+            conv->type = LOG_ARG_UINT;
+        } else if (strcmp(length, "l") == 0) {
+            conv->type = LOG_ARG_ULONG;
+        } else if (strcmp(length, "ll") == 0) {
+            conv->type = LOG_ARG_ULLONG;
+        } else if (strcmp(length, "z") == 0) {
+            conv->type = LOG_ARG_SIZE;
+        } else if (strcmp(length, "j") == 0) {
+            conv->type = LOG_ARG_UINTMAX;
+        } else if (strcmp(length, "t") == 0) {
+            conv->type = LOG_ARG_PTRDIFF;
+        } else {
+            return false;
+        }
+        return true;
+    case 'c':
+        conv->type = LOG_ARG_INT;
+        return length[0] == '\0';
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        conv->type = LOG_ARG_DOUBLE;
+        return length[0] == '\0' || strcmp(length, "l") == 0;
+    case 's':
+        conv->type = LOG_ARG_STRING;
+        return length[0] == '\0';
+    case 'p':
+        conv->type = LOG_ARG_POINTER;
+        return length[0] == '\0';
+    default:
+        /* %n, or not a conversion */
+        return false;
+    }
+}
+
+bool
+log_format_parse(const char *format, int n_args[static 1], unsigned char arg_types[LOG_FORMAT_MAX_ARGS])
+{
+    int n = 0;
+
+    for (const char *p = format; *p != '\0';) {
+        if (*p++ != '%') {
+            continue;
+        }
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+
+        LogConversion conv;
+        if (!log_format_parse_conversion(&p, &conv)) {
+            return false;
+        }
+
+        int n_needed = 1 + (conv.width == -2) + (conv.precision == -2);
+        if (n + n_needed > LOG_FORMAT_MAX_ARGS) {
+            return false;
+        }
+        if (conv.width == -2) {
+            arg_types[n++] = LOG_ARG_INT;
+        }
+        if (conv.precision == -2) {
+            arg_types[n++] = LOG_ARG_INT;
+        }
+        arg_types[n++] = conv.type;
+    }
+
+    *n_args = n;
+    return true;
+}
+
+typedef struct {
+    const char *p;
+    const char *end;
+} LogValues;
+
+static bool
+log_values_read_integer(LogValues values[static 1], uint64_t value[static 1])
+{
+    if (values->end - values->p < (ptrdiff_t)sizeof(*value)) {
+        return false;
+    }
+    memcpy(value, values->p, sizeof(*value));
+    values->p += sizeof(*value);
+    return true;
+}
+
+/*
+ * string is NULL for a NULL pointer.
+ */
+static bool
+log_values_read_string(LogValues values[static 1], const char *string[static 1], size_t length[static 1])
+{
+    uint16_t n;
+    if (values->end - values->p < (ptrdiff_t)sizeof(n)) {
+        return false;
+    }
+    memcpy(&n, values->p, sizeof(n));
+    values->p += sizeof(n);
+
+    if (n == LOG_FORMAT_NULL_STRING) {
+        *string = NULL;
+        *length = 0;
+        return true;
+    }
+    if (values->end - values->p < (ptrdiff_t)n) {
+        return false;
+    }
+    *string = values->p;
+    *length = n;
+    values->p += n;
+    return true;
+}
+
+static void
+log_format_append(char *buffer, size_t size, size_t length[static 1], const char *text, size_t text_length)
+{
+    size_t available = size - 1 - *length;
+    if (text_length > available) {
+        text_length = available;
+    }
+    memcpy(&buffer[*length], text, text_length);
+    *length += text_length;
+    buffer[*length] = '\0';
+}
+
+/*
+ * Append the snprintf() output of spec with a single argument. The macro keeps the argument's type.
+ */
+#define LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, ...) do {                     \
+    int _ret = snprintf(&(buffer)[*(length)], (size) - *(length), (spec), __VA_ARGS__);   \
+    if (_ret > 0) {                                                                       \
+        *(length) += (size_t)_ret < (size) - *(length) ? (size_t)_ret : (size) - 1 - *(length); \
+    }                                                                                     \
+} while (0)
+
+static bool
+log_format_render_conversion(char *buffer, size_t size, size_t length[static 1], LogConversion conv[static 1],
+        LogValues values[static 1])
+{
+    uint64_t value;
+
+    /* '*' fields become literal ones, with the meaning printf() gives to negative values */
+    bool left_justify = false;
+    if (conv->width == -2) {
+        if (!log_values_read_integer(values, &value)) {
+            return false;
+        }
+        int width = (int)(int64_t)value;
+        left_justify = width < 0;
+        conv->width = width < 0 ? -width : width;
+        if (conv->width > LOG_FORMAT_MAX_FIELD_WIDTH) {
+            conv->width = LOG_FORMAT_MAX_FIELD_WIDTH;
+        }
+    }
+    if (conv->precision == -2) {
+        if (!log_values_read_integer(values, &value)) {
+            return false;
+        }
+        int precision = (int)(int64_t)value;
+        conv->precision = precision < 0 ? -1 : precision > LOG_FORMAT_MAX_FIELD_WIDTH ? LOG_FORMAT_MAX_FIELD_WIDTH : precision;
+    }
+
+    char spec[48];
+    int spec_length = snprintf(spec, sizeof(spec), "%%%s%s", conv->flags, left_justify ? "-" : "");
+    if (conv->width >= 0) {
+        spec_length += snprintf(&spec[spec_length], sizeof(spec) - (size_t)spec_length, "%d", conv->width);
+    }
+    if (conv->type == LOG_ARG_STRING) {
+        /* The bytes of the string aren't null terminated, its length is passed as the precision */
+        spec_length += snprintf(&spec[spec_length], sizeof(spec) - (size_t)spec_length, ".*s");
+    } else {
+        if (conv->precision >= 0) {
+            spec_length += snprintf(&spec[spec_length], sizeof(spec) - (size_t)spec_length, ".%d", conv->precision);
+        }
+        spec_length += snprintf(&spec[spec_length], sizeof(spec) - (size_t)spec_length, "%s%c", conv->length, conv->conversion);
+    }
+    if ((size_t)spec_length >= sizeof(spec)) {
+        return false;
+    }
+
+    if (conv->type == LOG_ARG_STRING) {
+        const char *string;
+        size_t string_length;
+        if (!log_values_read_string(values, &string, &string_length)) {
+            return false;
+        }
+        if (!string) {
+            string = "(null)";
+            string_length = strlen(string);
+        }
+        if (conv->precision >= 0 && (size_t)conv->precision < string_length) {
+            string_length = (size_t)conv->precision;
+        }
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (int)string_length, string);
+        return true;
+    }
+
+    if (!log_values_read_integer(values, &value)) {
+        return false;
+    }
+
+    switch (conv->type) {
+    case LOG_ARG_INT:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (int)(int64_t)value);
+        break;
+    case LOG_ARG_UINT:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (unsigned)value);
+        break;
+    case LOG_ARG_LONG:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (long)(int64_t)value);
+        break;
+    case LOG_ARG_ULONG:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (unsigned long)value);
+        break;
+    case LOG_ARG_LLONG:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (long long)(int64_t)value);
+        break;
+    case LOG_ARG_ULLONG:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (unsigned long long)value);
+        break;
+    case LOG_ARG_SSIZE:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (ssize_t)(int64_t)value);
+        break;
+    case LOG_ARG_SIZE:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (size_t)value);
+        break;
+    case LOG_ARG_INTMAX:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (intmax_t)(int64_t)value);
+        break;
+    case LOG_ARG_UINTMAX:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (uintmax_t)value);
+        break;
+    case LOG_ARG_PTRDIFF:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (ptrdiff_t)(int64_t)value);
+        break;
+    case LOG_ARG_DOUBLE: {
+        double d;
+        memcpy(&d, &value, sizeof(d));
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, d);
+        break;
+    }
+    case LOG_ARG_POINTER:
+        LOG_FORMAT_APPEND_VALUE(buffer, size, length, spec, (void *)(uintptr_t)value);
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+size_t
+log_format_render(char *buffer, size_t size, const char *function, const char *format,
+        int n_args, const unsigned char arg_types[n_args], const char *values, size_t values_length)
+{
+    LogValues remaining = { values, values + values_length };
+    size_t length = 0;
+    int arg_index = 0;
+
+    buffer[0] = '\0';
+    log_format_append(buffer, size, &length, function, strlen(function));
+    log_format_append(buffer, size, &length, ": ", 2);
+
+    for (const char *p = format; *p != '\0';) {
+        size_t text_length = strcspn(p, "%");
+        log_format_append(buffer, size, &length, p, text_length);
+        p += text_length;
+        if (*p == '\0') {
+            break;
+        }
+
+        p++;
+        if (*p == '%') {
+            log_format_append(buffer, size, &length, "%", 1);
+            p++;
+            continue;
+        }
+
+        /* The types were recorded with the format, but a corrupted log file must not crash the decoder */
+        LogConversion conv;
+        if (!log_format_parse_conversion(&p, &conv)) {
+            return 0;
+        }
+        int n_needed = 1 + (conv.width == -2) + (conv.precision == -2);
+        if (arg_index + n_needed > n_args) {
+            return 0;
+        }
+        for (int i = 0; i < n_needed - 1; i++) {
+            if (arg_types[arg_index++] != LOG_ARG_INT) {
+                return 0;
+            }
+        }
+        if (arg_types[arg_index++] != conv.type) {
+            return 0;
+        }
+
+        if (!log_format_render_conversion(buffer, size, &length, &conv, &remaining)) {
+            return 0;
+        }
+    }
+
+    return arg_index == n_args ? length : 0;
+}
+
+typedef struct {
+    char *function;
+    char *format;
+    int n_args;
+    unsigned char arg_types[LOG_FORMAT_MAX_ARGS];
+} LogFileFormat;
+
+static void
+log_file_print_timestamp(FILE *out, int64_t timestamp_ns)
+{
+    time_t seconds = (time_t)(timestamp_ns / NSEC_PER_SEC);
+    struct tm tm;
+    char date[32];
+    if (!localtime_r(&seconds, &tm) || strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm) == 0) {
+        strcpy(date, "?");
+    }
+    fprintf(out, "%s.%06ld ", date, (long)(timestamp_ns % NSEC_PER_SEC / 1000));
+}
+
+static bool
+log_file_define_format(LogFileFormat **formats, uint32_t n_formats[static 1], const char *payload, uint32_t length)
+{
+    uint32_t id;
+    uint8_t n_args;
+    if (length < sizeof(id) + sizeof(n_args)) {
+        return false;
+    }
+    memcpy(&id, payload, sizeof(id));
+    memcpy(&n_args, &payload[sizeof(id)], sizeof(n_args));
+    uint32_t offset = sizeof(id) + sizeof(n_args);
+    if (id >= LOG_FILE_MAX_FORMAT_ID || n_args > LOG_FORMAT_MAX_ARGS || length < offset + n_args) {
+        return false;
+    }
+
+    const char *function = &payload[offset + n_args];
+    const char *end = &payload[length];
+    const char *function_end = memchr(function, '\0', (size_t)(end - function));
+    if (!function_end) {
+        return false;
+    }
+    const char *format = function_end + 1;
+    if (!memchr(format, '\0', (size_t)(end - format))) {
+        return false;
+    }
+
+    if (id >= *n_formats) {
+        *formats = erealloc(*formats, (id + 1) * sizeof(**formats));
+        memset(&(*formats)[*n_formats], 0, (id + 1 - *n_formats) * sizeof(**formats));
+        *n_formats = id + 1;
+    }
+
+    LogFileFormat *definition = &(*formats)[id];
+    free(definition->function);
+    free(definition->format);
+    definition->function = emalloc(strlen(function) + 1);
+    strcpy(definition->function, function);
+    definition->format = emalloc(strlen(format) + 1);
+    strcpy(definition->format, format);
+    definition->n_args = n_args;
+    memcpy(definition->arg_types, &payload[offset], n_args);
+
+    return true;
+}
+
+bool
+log_file_decode(FILE *in, FILE *out, bool timestamps)
+{
+    char magic[LOG_FILE_MAGIC_SIZE];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, LOG_FILE_MAGIC, sizeof(magic)) != 0) {
+        return false;
+    }
+
+    LogFileFormat *formats = NULL;
+    uint32_t n_formats = 0;
+    char *payload = NULL;
+    uint32_t payload_capacity = 0;
+    char *line = emalloc(LOG_FILE_MAX_LINE_LENGTH + 1);
+    bool ok = true;
+
+    while (ok) {
+        LogFileRecordHeader header;
+        if (fread(&header, 1, sizeof(header), in) != sizeof(header)) {
+            break;
+        }
+        if (header.length > LOG_FILE_MAX_RECORD_LENGTH) {
+            ok = false;
+            break;
+        }
+        if (header.length > payload_capacity) {
+            payload_capacity = header.length;
+            payload = erealloc(payload, payload_capacity);
+        }
+        if (fread(payload, 1, header.length, in) != header.length) {
+            break;
+        }
+
+        int64_t timestamp_ns;
+
+        switch (header.type) {
+        case LOG_FILE_RECORD_FORMAT:
+            ok = log_file_define_format(&formats, &n_formats, payload, header.length);
+            break;
+        case LOG_FILE_RECORD_MESSAGE: {
+            uint32_t id;
+            if (header.length < sizeof(id) + sizeof(timestamp_ns)) {
+                ok = false;
+                break;
+            }
+            memcpy(&id, payload, sizeof(id));
+            memcpy(&timestamp_ns, &payload[sizeof(id)], sizeof(timestamp_ns));
+            if (id >= n_formats || !formats[id].format) {
+                ok = false;
+                break;
+            }
+            LogFileFormat *definition = &formats[id];
+            size_t values_offset = sizeof(id) + sizeof(timestamp_ns);
+            size_t length = log_format_render(line, LOG_FILE_MAX_LINE_LENGTH + 1, definition->function, definition->format,
+                    definition->n_args, definition->arg_types, &payload[values_offset], header.length - values_offset);
+            if (length == 0) {
+                ok = false;
+                break;
+            }
+            if (timestamps) {
+                log_file_print_timestamp(out, timestamp_ns);
+            }
+            fwrite(line, 1, length, out);
+            fputc('\n', out);
+            break;
+        }
+        case LOG_FILE_RECORD_TEXT:
+            if (header.length < sizeof(timestamp_ns)) {
+                ok = false;
+                break;
+            }
+            memcpy(&timestamp_ns, payload, sizeof(timestamp_ns));
+            if (timestamps) {
+                log_file_print_timestamp(out, timestamp_ns);
+            }
+            fwrite(&payload[sizeof(timestamp_ns)], 1, header.length - sizeof(timestamp_ns), out);
+            fputc('\n', out);
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < n_formats; i++) {
+        free(formats[i].function);
+        free(formats[i].format);
+    }
+    free(formats);
+    free(payload);
+    free(line);
+
+    return ok;
+}
@@ -0,0 +1,85 @@
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Deferred formatting of log messages (see ELOG() in logger.h), shared by the Logger and the log_decode tool.
+ *
+ * A message is recorded as the printf() format of its call site and the raw values of its arguments,
+ * and formatted later, by the Logger thread or offline from a binary log file.
+ * Argument values: integers, doubles and pointers take 8 bytes, strings their 2-byte length followed
+ * by their bytes (LOG_FORMAT_NULL_STRING for a NULL pointer), in native byte order.
+ *
+ * Binary log file: LOG_FILE_MAGIC, then records of a LogFileRecordHeader followed by length bytes:
+ *   LOG_FILE_RECORD_FORMAT:  uint32 id, uint8 n_args, uint8 arg_types[n_args], function\0, format\0
+ *   LOG_FILE_RECORD_MESSAGE: uint32 id, int64 timestamp_ns, argument values
+ *   LOG_FILE_RECORD_TEXT:    int64 timestamp_ns, text of a message formatted by the caller
+ * An id is defined before the first message that uses it in every file. It can be defined again
+ * further on (e.g. by a later run appending to the file), the latest definition applies.
+ * Timestamps are CLOCK_REALTIME.
+ */
+
+#define LOG_FILE_MAGIC "CUTLOG\0\1"
+#define LOG_FILE_MAGIC_SIZE 8
+
+enum {
+    LOG_FILE_RECORD_FORMAT = 1,
+    LOG_FILE_RECORD_MESSAGE,
+    LOG_FILE_RECORD_TEXT,
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t length;
+} LogFileRecordHeader;
+
+/* Upper limit on the conversions of a format, '*' widths and precisions included */
+#define LOG_FORMAT_MAX_ARGS 16
+
+#define LOG_FORMAT_NULL_STRING 0xFFFF
+
+typedef enum {
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_LONG,
+    LOG_ARG_ULONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_ULLONG,
+    LOG_ARG_SSIZE,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_UINTMAX,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER,
+    LOG_ARG_N_TYPES
+} LogArgType;
+
+/*
+ * Find the types of the arguments of a printf() format.
+ * Returns false if the format has more than LOG_FORMAT_MAX_ARGS arguments or a conversion that can't
+ * be deferred (%n, long double, wide characters).
+ */
+bool log_format_parse(const char *format, int n_args[static 1], unsigned char arg_types[LOG_FORMAT_MAX_ARGS]);
+
+/*
+ * Write "function: message" into buffer (null terminated, truncated to size - 1 characters),
+ * formatting the argument values the same way as snprintf().
+ * Returns the length of the written string, or 0 if the values don't match the types.
+ */
+size_t log_format_render(char *buffer, size_t size, const char *function, const char *format,
+        int n_args, const unsigned char arg_types[n_args], const char *values, size_t values_length);
+
+/*
+ * Write the messages of a binary log file as text lines, prefixed with their local time if timestamps is set.
+ * Returns false if in isn't a binary log file or is corrupted, the messages before the error are written.
+ * A file that ends with a partial record (e.g. one that is still being written) is not an error.
+ */
+bool log_file_decode(FILE *in, FILE *out, bool timestamps);
+
+#endif /* LOG_FORMAT_H */
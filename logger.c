@@ -1,149 +1,670 @@
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "logger.h"
 #include "utils.h"
 #include "thread_utils.h"
+#include "stats.h"
 #include "watchdog.h"
 
+/*
+ * The logger queue is a ring of 16-byte cells shared by all producers (MPSC).
+ * Each record starts with a header cell and a LoggerRecordInfo, followed by as many cells as needed
+ * to hold the message, or with ELOG() the values of its arguments (see log_format.h).
+ * A record never wraps around the end of the ring; if it doesn't fit, the remaining cells
+ * are reserved as a padding record.
+ *
+ * Producers reserve space by advancing reserve_index with a CAS and then publish the record
+ * by setting the state of its header. The Logger consumes records in order and zeroes the
+ * cells before handing them back to producers by advancing read_index.
+ */
+#define LOGGER_QUEUE_N_CELLS (16 * 1024) /* Must be a power of two */
+
+enum {
+    LOGGER_RECORD_EMPTY = 0,
+    LOGGER_RECORD_MESSAGE,
+    LOGGER_RECORD_PADDING,
+};
+
+typedef struct {
+    unsigned state;
+    unsigned n_cells;
+    /* Of the message or the argument values */
+    unsigned length;
+    unsigned unused;
+} LoggerQueueCell;
+
+typedef struct {
+    /* CLOCK_REALTIME */
+    long long timestamp_ns;
+    /* NULL for a message formatted by the caller */
+    LoggerFormat *call_site;
+} LoggerRecordInfo;
+
+#define LOGGER_RECORD_INFO_CELLS ((sizeof(LoggerRecordInfo) + sizeof(LoggerQueueCell) - 1) / sizeof(LoggerQueueCell))
+
+/* Call sites with a longer function name and format are formatted by the caller */
+#define LOGGER_MAX_CALL_SITE_LENGTH 1024
+
+/* Upper limit on the scratch buffer space of a record: its formatted message or its binary record headers */
+#define LOGGER_MAX_RECORD_SCRATCH (LOGGER_MAX_MESSAGE_LENGTH + LOGGER_MAX_CALL_SITE_LENGTH + 64)
+
+#define LOGGER_SCRATCH_SIZE (4 * LOGGER_MAX_RECORD_SCRATCH)
+
+/* A message takes up to three: binary record headers or a formatted message, the message, its newline */
+#define LOGGER_MAX_IOVECS 1024
+
 typedef struct {
-    char message[512];
-    char *message_remainder;
-} LoggerQueueEntry;
+    int n_iov;
+    unsigned long n_messages;
+    /* Bytes the batch adds to the log file */
+    size_t length;
+    size_t scratch_length;
+} LoggerBatch;
+
+typedef enum {
+    LOGGER_BATCH_ADDED,
+    LOGGER_BATCH_FULL,
+    /* The message doesn't fit in the log file, it goes to the next one */
+    LOGGER_BATCH_ROTATE,
+} LoggerBatchResult;
 
 typedef struct {
     LoggerArgs *args;
-    FILE *log_file;
+    const char *path;
+    /* -1 if the log file couldn't be recreated after a rotation */
+    int fd;
+    /* Bytes in the log file */
+    long long size;
+    /* The log file couldn't be renamed, it isn't rotated anymore */
+    bool rotation_failed;
+    /* A failed write that couldn't be undone left a partial message or record at the end of the log file */
+    bool partial_write;
+    /* Messages were written since the last fdatasync() */
+    bool dirty;
+    long long last_sync_ns;
+    /*
+     * Changes whenever a log file is opened or a write fails, so that each binary log file defines
+     * the formats it uses, even if a failed write lost their definitions
+     */
+    unsigned long generation;
+    unsigned n_file_formats;
+    struct iovec iov[LOGGER_MAX_IOVECS];
+    /* Formatted messages and binary record headers of a batch, the rest is written straight from the queue */
+    char *scratch;
+    WatchdogHandle *watchdog;
 } LoggerPrivateState;
 
 static struct {
-    bool logger_initialized;
-    LoggerQueueEntry *logger_queue;
-    int n_queue_slots;
-    int n_queued;
-} shared;
+    LoggerQueueCell cells[LOGGER_QUEUE_N_CELLS];
+    char pad0[64];
+    unsigned long reserve_index;
+    char pad1[64];
+    unsigned long read_index;
+    char pad2[64];
+    /* Dropped since the Logger last reported it */
+    unsigned long n_dropped;
+    unsigned long n_dropped_total;
+    /* Log files opened by the Logger since the program started, see LoggerFormat.file_generation */
+    unsigned long n_log_files;
+    bool wakeup_pending;
+    sem_t sem_wakeup;
+} queue;
+
+static pthread_once_t queue_once = PTHREAD_ONCE_INIT;
+
+static void
+logger_queue_init(void)
+{
+    int iret = sem_init(&queue.sem_wakeup, 0, 0);
+    assert(iret == 0);
+}
 
-static pthread_mutex_t logger_lock = PTHREAD_MUTEX_INITIALIZER;
+static void
+logger_queue_wake_consumer(void)
+{
+    if (!__atomic_exchange_n(&queue.wakeup_pending, true, __ATOMIC_ACQ_REL)) {
+        sem_post(&queue.sem_wakeup);
+    }
+}
 
-static pthread_cond_t cond_on_logger_initialized = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t cond_on_queue_emptied = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t cond_on_message_submitted = PTHREAD_COND_INITIALIZER;
+static void
+logger_queue_wait(double seconds)
+{
+    sem_wait_seconds(&queue.sem_wakeup, seconds);
+    (void)__atomic_exchange_n(&queue.wakeup_pending, false, __ATOMIC_ACQ_REL);
+}
+
+static void
+logger_new_generation(LoggerPrivateState *priv)
+{
+    /* Call sites outlive a Logger, a new one (e.g. in the tests) must not reuse the generations of the previous one */
+    priv->generation = ++queue.n_log_files;
+    priv->n_file_formats = 0;
+}
 
 /*
- * Logger lock must be acquired before calling this function.
+ * Remove what a failed write left of its batch, so that the log file doesn't end with a partial message
+ * or record. The batch might have held definitions of formats, the next batches define them again.
  */
 static void
-logger_write_queued_messages_to_log_file(FILE *log_file)
+logger_discard_failed_write(LoggerPrivateState *priv, long long start_size)
 {
-    for (int i = 0; i < shared.n_queued; i++) {
-        LoggerQueueEntry *queue_entry = &shared.logger_queue[i];
-        int iret = fputs(queue_entry->message, log_file);
-        assert(iret != EOF);
-        if (queue_entry->message_remainder) {
-            iret = fputs(queue_entry->message_remainder, log_file);
-            assert(iret != EOF);
-            free(queue_entry->message_remainder);
+    if (priv->fd >= 0 && priv->size > start_size) {
+        if (ftruncate(priv->fd, start_size) == 0) {
+            priv->size = start_size;
+        } else {
+            priv->partial_write = true;
         }
-        iret = fputc('\n', log_file);
-        assert(iret != EOF);
     }
-    shared.n_queued = 0;
+
+    logger_new_generation(priv);
 }
 
+/*
+ * Write a batch of messages with as few writev() calls as possible, resuming after partial writes.
+ * If writing fails the n_messages messages are lost, they are counted as dropped.
+ */
 static void
-logger_handle_queued_messages(FILE *log_file)
+logger_write_batch(LoggerPrivateState *priv, struct iovec *iov, int n_iov, unsigned long n_messages)
 {
-    int iret = pthread_mutex_lock(&logger_lock);
+    long long start_size = priv->size;
+
+    while (n_iov > 0) {
+        ssize_t n = priv->fd >= 0 ? writev(priv->fd, iov, n_iov) : -1;
+        if (n < 0) {
+            if (priv->fd >= 0 && errno == EINTR) {
+                continue;
+            }
+            logger_discard_failed_write(priv, start_size);
+            __atomic_add_fetch(&queue.n_dropped, n_messages, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&queue.n_dropped_total, n_messages, __ATOMIC_RELAXED);
+            stats_counter_add(STATS_COUNTER_LOGGER_MESSAGES_DROPPED, n_messages);
+            return;
+        }
+        stats_counter_add(STATS_COUNTER_LOG_WRITES, 1);
+        stats_counter_add(STATS_COUNTER_LOG_BYTES_WRITTEN, (unsigned long)n);
+        priv->size += n;
+        priv->dirty = true;
+
+        while (n_iov > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+}
+
+static void
+logger_sync(LoggerPrivateState *priv)
+{
+    if (priv->dirty && priv->fd >= 0) {
+        /* An error here is also reported by the next write, if the disk really is failing */
+        (void)fdatasync(priv->fd);
+    }
+    priv->dirty = false;
+    priv->last_sync_ns = clock_now_ns(CLOCK_MONOTONIC);
+}
+
+static bool
+logger_open_log_file(LoggerPrivateState *priv)
+{
+    priv->fd = open(priv->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (priv->fd < 0) {
+        /* Not rotated again until a new file is created */
+        priv->size = 0;
+        return false;
+    }
+
+    struct stat st;
+    priv->size = fstat(priv->fd, &st) == 0 ? (long long)st.st_size : 0;
+
+    priv->partial_write = false;
+    logger_new_generation(priv);
+
+    return true;
+}
+
+static bool
+logger_is_binary_log_file(LoggerPrivateState *priv)
+{
+    /* The log file is open write-only */
+    int fd = open(priv->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    char magic[LOG_FILE_MAGIC_SIZE];
+    bool is_binary = read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic)
+        && memcmp(magic, LOG_FILE_MAGIC, sizeof(magic)) == 0;
+
+    int iret = close(fd);
     assert(iret == 0);
-    pthread_cleanup_push(cleanup_mutex_unlock, &logger_lock);
+    (void)(iret);
+
+    return is_binary;
+}
 
-    if (shared.n_queued == 0) {
-        cond_wait_seconds(&cond_on_message_submitted, &logger_lock, 1);
+/*
+ * Rename the log file to path.1, after renaming path.1 to path.2 and so on, and start a new one.
+ */
+static void
+logger_rotate(LoggerPrivateState *priv)
+{
+    int max_files = priv->args->max_files;
+    size_t path_size = strlen(priv->path) + 8;
+    char older_path[path_size];
+    char newer_path[path_size];
+    for (int i = max_files; i > 1; i--) {
+        snprintf(older_path, path_size, "%s.%d", priv->path, i);
+        snprintf(newer_path, path_size, "%s.%d", priv->path, i - 1);
+        /* Replaces the oldest file, a file that doesn't exist yet is skipped */
+        (void)rename(newer_path, older_path);
+    }
+    int iret;
+    if (max_files > 0) {
+        snprintf(newer_path, path_size, "%s.1", priv->path);
+        iret = rename(priv->path, newer_path);
+    } else {
+        iret = unlink(priv->path);
+    }
+    if (iret != 0 && errno != ENOENT) {
+        /*
+         * E.g. the directory isn't writable. Reopening the same file would rotate it again before every
+         * message, so it's appended to beyond its maximum size instead.
+         */
+        ELOG("Failed to rotate the log file (%s), it won't be rotated anymore: %s", priv->path, strerror(errno));
+        priv->rotation_failed = true;
+        return;
     }
 
-    if (shared.n_queued > 0) {
-        iret = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if (priv->fd >= 0) {
+        /* The rotated file is complete on the disk, whatever happens to the new one */
+        if (priv->args->sync != LOGGER_SYNC_NONE) {
+            logger_sync(priv);
+        }
+        iret = close(priv->fd);
         assert(iret == 0);
+        priv->fd = -1;
+    }
 
-        logger_write_queued_messages_to_log_file(log_file);
+    stats_counter_add(STATS_COUNTER_LOG_ROTATIONS, 1);
 
-        iret = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-        assert(iret == 0);
+    /* If the new file can't be created the messages are dropped, it's tried again with the next batch */
+    (void)logger_open_log_file(priv);
+}
 
-        iret = pthread_cond_broadcast(&cond_on_queue_emptied);
-        assert(iret == 0);
+/*
+ * Called before gathering a batch: start a new log file if the end of this one couldn't be cleaned up
+ * after a failed write, and start an empty binary log file with its magic (again, if writing it failed).
+ */
+static void
+logger_prepare_batch(LoggerPrivateState *priv)
+{
+    if (priv->partial_write) {
+        logger_rotate(priv);
     }
 
-    pthread_cleanup_pop(1);
+    if (priv->args->file_format == LOGGER_FILE_BINARY && priv->fd >= 0 && priv->size == 0) {
+        struct iovec iov = { .iov_base = LOG_FILE_MAGIC, .iov_len = LOG_FILE_MAGIC_SIZE };
+        logger_write_batch(priv, &iov, 1, 0);
+    }
+}
+
+/*
+ * Whether a message of length bytes, written after pending bytes, would make the log file grow beyond
+ * its maximum size. An empty file takes even a message longer than the maximum size.
+ */
+static bool
+logger_must_rotate(LoggerPrivateState *priv, size_t pending, size_t length)
+{
+    long long max_size = priv->args->max_size;
+    long long size = priv->size + (long long)pending;
+    return max_size > 0 && !priv->rotation_failed && size > 0 && size + (long long)length > max_size;
 }
 
 static void
-logger_deinit(void *arg)
+logger_batch_add_iov(LoggerPrivateState *priv, LoggerBatch batch[static 1], const void *base, size_t length)
+{
+    struct iovec *last = batch->n_iov > 0 ? &priv->iov[batch->n_iov - 1] : NULL;
+
+    /* Consecutive parts of the scratch buffer are written as one */
+    if (last && (const char *)last->iov_base + last->iov_len == base) {
+        last->iov_len += length;
+    } else {
+        assert(batch->n_iov < LOGGER_MAX_IOVECS);
+        priv->iov[batch->n_iov++] = (struct iovec){ .iov_base = (void *)base, .iov_len = length };
+    }
+    batch->length += length;
+}
+
+static char *
+logger_batch_append_scratch(LoggerPrivateState *priv, LoggerBatch batch[static 1], const void *data, size_t length)
+{
+    assert(batch->scratch_length + length <= LOGGER_SCRATCH_SIZE);
+
+    char *p = &priv->scratch[batch->scratch_length];
+    memcpy(p, data, length);
+    batch->scratch_length += length;
+    logger_batch_add_iov(priv, batch, p, length);
+    return p;
+}
+
+static void
+logger_batch_append_record_header(LoggerPrivateState *priv, LoggerBatch batch[static 1], uint32_t type, size_t length)
+{
+    LogFileRecordHeader record = { .type = type, .length = (uint32_t)length };
+    logger_batch_append_scratch(priv, batch, &record, sizeof(record));
+}
+
+/*
+ * Add a message to the batch: in text mode the message and its newline, in binary mode a record of
+ * the message (preceded by the definition of its format if it's the first message using it in the file).
+ * If it doesn't fit in the batch, or in the log file (which must then be rotated first), the batch is unchanged.
+ */
+static LoggerBatchResult
+logger_batch_add_message(LoggerPrivateState *priv, LoggerBatch batch[static 1], LoggerQueueCell header[static 1])
+{
+    LoggerRecordInfo info;
+    memcpy(&info, header + 1, sizeof(info));
+    const char *data = (const char *)(header + 1 + LOGGER_RECORD_INFO_CELLS);
+    LoggerFormat *call_site = info.call_site;
+    bool binary = priv->args->file_format == LOGGER_FILE_BINARY;
+
+    /* Enough room for any record, so a batch always takes at least one */
+    if (batch->n_iov + 3 > LOGGER_MAX_IOVECS || LOGGER_SCRATCH_SIZE - batch->scratch_length < LOGGER_MAX_RECORD_SCRATCH) {
+        return LOGGER_BATCH_FULL;
+    }
+
+    if (!binary) {
+        if (!call_site) {
+            if (logger_must_rotate(priv, batch->length, header->length + 1)) {
+                return LOGGER_BATCH_ROTATE;
+            }
+            logger_batch_add_iov(priv, batch, data, header->length);
+            logger_batch_append_scratch(priv, batch, "\n", 1);
+            return LOGGER_BATCH_ADDED;
+        }
+
+        char *line = &priv->scratch[batch->scratch_length];
+        size_t length = log_format_render(line, LOGGER_MAX_MESSAGE_LENGTH + 1, call_site->function, call_site->format,
+                call_site->n_args, call_site->arg_types, data, header->length);
+        assert(length > 0);
+        line[length++] = '\n';
+        if (logger_must_rotate(priv, batch->length, length)) {
+            return LOGGER_BATCH_ROTATE;
+        }
+        batch->scratch_length += length;
+        logger_batch_add_iov(priv, batch, line, length);
+        return LOGGER_BATCH_ADDED;
+    }
+
+    if (!call_site) {
+        if (logger_must_rotate(priv, batch->length, sizeof(LogFileRecordHeader) + sizeof(int64_t) + header->length)) {
+            return LOGGER_BATCH_ROTATE;
+        }
+        int64_t timestamp_ns = info.timestamp_ns;
+        logger_batch_append_record_header(priv, batch, LOG_FILE_RECORD_TEXT, sizeof(timestamp_ns) + header->length);
+        logger_batch_append_scratch(priv, batch, &timestamp_ns, sizeof(timestamp_ns));
+        logger_batch_add_iov(priv, batch, data, header->length);
+        return LOGGER_BATCH_ADDED;
+    }
+
+    bool define = call_site->file_generation != priv->generation;
+    size_t function_size = strlen(call_site->function) + 1;
+    size_t format_size = strlen(call_site->format) + 1;
+    size_t definition_length = sizeof(uint32_t) + sizeof(uint8_t) + (size_t)call_site->n_args + function_size + format_size;
+    size_t message_length = sizeof(uint32_t) + sizeof(int64_t) + header->length;
+    size_t length = sizeof(LogFileRecordHeader) + message_length;
+    if (define) {
+        length += sizeof(LogFileRecordHeader) + definition_length;
+    }
+    if (logger_must_rotate(priv, batch->length, length)) {
+        return LOGGER_BATCH_ROTATE;
+    }
+
+    if (define) {
+        call_site->file_generation = priv->generation;
+        call_site->file_id = priv->n_file_formats++;
+
+        uint32_t id = call_site->file_id;
+        uint8_t n_args = (uint8_t)call_site->n_args;
+        logger_batch_append_record_header(priv, batch, LOG_FILE_RECORD_FORMAT, definition_length);
+        logger_batch_append_scratch(priv, batch, &id, sizeof(id));
+        logger_batch_append_scratch(priv, batch, &n_args, sizeof(n_args));
+        logger_batch_append_scratch(priv, batch, call_site->arg_types, (size_t)call_site->n_args);
+        logger_batch_append_scratch(priv, batch, call_site->function, function_size);
+        logger_batch_append_scratch(priv, batch, call_site->format, format_size);
+    }
+
+    uint32_t id = call_site->file_id;
+    int64_t timestamp_ns = info.timestamp_ns;
+    logger_batch_append_record_header(priv, batch, LOG_FILE_RECORD_MESSAGE, message_length);
+    logger_batch_append_scratch(priv, batch, &id, sizeof(id));
+    logger_batch_append_scratch(priv, batch, &timestamp_ns, sizeof(timestamp_ns));
+    logger_batch_add_iov(priv, batch, data, header->length);
+    return LOGGER_BATCH_ADDED;
+}
+
+/*
+ * Write the number of messages dropped since the last call, if any.
+ */
+static void
+logger_write_dropped_messages(LoggerPrivateState *priv)
 {
-    int iret = pthread_mutex_lock(&logger_lock);
+    unsigned long n_dropped = __atomic_exchange_n(&queue.n_dropped, 0, __ATOMIC_RELAXED);
+    if (n_dropped == 0) {
+        return;
+    }
+
+    char message[128];
+    int message_length = snprintf(message, sizeof(message), "%s: %lu messages dropped", __func__, n_dropped);
+    assert(message_length > 0 && (size_t)message_length < sizeof(message));
+
+    bool binary = priv->args->file_format == LOGGER_FILE_BINARY;
+    size_t length = binary ? sizeof(LogFileRecordHeader) + sizeof(int64_t) + (size_t)message_length : (size_t)message_length + 1;
+    if (logger_must_rotate(priv, 0, length)) {
+        logger_rotate(priv);
+    }
+    logger_prepare_batch(priv);
+
+    LoggerBatch batch = {0};
+    if (binary) {
+        int64_t timestamp_ns = clock_now_ns(CLOCK_REALTIME);
+        logger_batch_append_record_header(priv, &batch, LOG_FILE_RECORD_TEXT, sizeof(timestamp_ns) + (size_t)message_length);
+        logger_batch_append_scratch(priv, &batch, &timestamp_ns, sizeof(timestamp_ns));
+        logger_batch_append_scratch(priv, &batch, message, (size_t)message_length);
+    } else {
+        logger_batch_append_scratch(priv, &batch, message, (size_t)message_length);
+        logger_batch_append_scratch(priv, &batch, "\n", 1);
+    }
+    assert(batch.length == length);
+
+    logger_write_batch(priv, priv->iov, batch.n_iov, 0);
+}
+
+/*
+ * Write all the published messages to the log file, followed by
+ * the number of messages dropped since the last call (if any).
+ * Only the Logger thread may call this function.
+ */
+static void
+logger_write_queued_messages_to_log_file(LoggerPrivateState *priv)
+{
+    if (priv->fd < 0) {
+        (void)logger_open_log_file(priv);
+    }
+
+    unsigned long read_index = queue.read_index;
+    bool drained = false;
+
+    while (!drained) {
+        logger_prepare_batch(priv);
+
+        /* Gather the messages of a batch, the cells can't be reused until they are written */
+        unsigned long batch_end = read_index;
+        LoggerBatch batch = {0};
+        LoggerBatchResult result = LOGGER_BATCH_ADDED;
+
+        /* A full queue wraps around to the first record of the batch, it's still there */
+        while (batch_end - read_index < LOGGER_QUEUE_N_CELLS) {
+            LoggerQueueCell *header = &queue.cells[batch_end % LOGGER_QUEUE_N_CELLS];
+
+            /* Empty means either that the queue is drained or that the record is still being written */
+            unsigned state = __atomic_load_n(&header->state, __ATOMIC_ACQUIRE);
+            if (state == LOGGER_RECORD_EMPTY) {
+                drained = true;
+                break;
+            }
+
+            if (state == LOGGER_RECORD_MESSAGE) {
+                result = logger_batch_add_message(priv, &batch, header);
+                if (result != LOGGER_BATCH_ADDED) {
+                    break;
+                }
+                batch.n_messages++;
+            }
+
+            batch_end += header->n_cells;
+        }
+
+        logger_write_batch(priv, priv->iov, batch.n_iov, batch.n_messages);
+
+        while (read_index != batch_end) {
+            LoggerQueueCell *header = &queue.cells[read_index % LOGGER_QUEUE_N_CELLS];
+            read_index += header->n_cells;
+            memset(header, 0, header->n_cells * sizeof(*header));
+        }
+        __atomic_store_n(&queue.read_index, read_index, __ATOMIC_RELEASE);
+
+        if (result == LOGGER_BATCH_ROTATE) {
+            logger_rotate(priv);
+        }
+    }
+
+    logger_write_dropped_messages(priv);
+
+    if (priv->args->sync == LOGGER_SYNC_BATCH && priv->dirty) {
+        logger_sync(priv);
+    }
+}
+
+/*
+ * Seconds until the next fdatasync() of the interval policy is due, or until the periodic wakeup.
+ */
+static double
+logger_wait_timeout(LoggerPrivateState *priv)
+{
+    double timeout = 1;
+
+    if (priv->args->sync == LOGGER_SYNC_INTERVAL && priv->dirty) {
+        long long due_ns = priv->last_sync_ns + (long long)priv->args->sync_interval_ms * 1000000
+            - clock_now_ns(CLOCK_MONOTONIC);
+        double due = due_ns > 0 ? (double)due_ns / NSEC_PER_SEC : 0;
+        if (due < timeout) {
+            timeout = due;
+        }
+    }
+
+    return timeout;
+}
+
+static void
+logger_handle_queued_messages(LoggerPrivateState *priv)
+{
+    logger_queue_wait(logger_wait_timeout(priv));
+
+    long long batch_start_ns = clock_now_ns(CLOCK_MONOTONIC);
+
+    int iret = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
     assert(iret == 0);
-    pthread_cleanup_push(cleanup_mutex_unlock, &logger_lock);
 
+    logger_write_queued_messages_to_log_file(priv);
+
+    if (priv->args->sync == LOGGER_SYNC_INTERVAL && priv->dirty
+            && batch_start_ns - priv->last_sync_ns >= (long long)priv->args->sync_interval_ms * 1000000) {
+        logger_sync(priv);
+    }
+
+    iret = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    assert(iret == 0);
+
+    /* Let the messages of a burst accumulate into the next batch, they are written if the thread is cancelled meanwhile */
+    struct timespec next_batch = ns_to_timespec(batch_start_ns + LOGGER_BATCH_INTERVAL_MS * 1000000LL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_batch, NULL) == EINTR) {
+    }
+}
+
+static void
+logger_deinit(void *arg)
+{
     LoggerPrivateState *priv = arg;
 
-    logger_write_queued_messages_to_log_file(priv->log_file);
+    if (priv->fd >= 0) {
+        logger_write_queued_messages_to_log_file(priv);
+
+        if (priv->args->sync != LOGGER_SYNC_NONE) {
+            logger_sync(priv);
+        }
 
-    if (priv->log_file) {
-        iret = fclose(priv->log_file);
+        int iret = close(priv->fd);
         assert(iret == 0);
+        (void)(iret);
     }
 
+    watchdog_unregister(priv->watchdog);
+
+    free(priv->scratch);
+    free(priv->args->path);
     free(priv->args);
     free(priv);
-
-    free(shared.logger_queue);
-
-    memset(&shared, 0, sizeof(shared));
-
-    pthread_cleanup_pop(1);
 }
 
 static LoggerPrivateState *
 logger_init(void *arg)
 {
-    int iret = pthread_mutex_lock(&logger_lock);
+    int iret = pthread_once(&queue_once, logger_queue_init);
     assert(iret == 0);
 
     LoggerPrivateState *priv = ecalloc(1, sizeof(*priv));
 
     priv->args = arg;
+    assert(priv->args->max_files >= 0 && priv->args->max_files <= LOGGER_MAX_MAX_FILES);
+    assert(priv->args->sync != LOGGER_SYNC_INTERVAL || priv->args->sync_interval_ms > 0);
 
-    const char *log_file_name = "log.txt";
-
-    priv->log_file = fopen(log_file_name, "a");
-    if (!priv->log_file) {
-        EPRINT("Failed to open log file (%s)", log_file_name);
+    priv->path = priv->args->path ? priv->args->path : LOGGER_DEFAULT_PATH;
+    priv->last_sync_ns = clock_now_ns(CLOCK_MONOTONIC);
+    priv->scratch = emalloc(LOGGER_SCRATCH_SIZE);
 
-        iret = pthread_mutex_unlock(&logger_lock);
-        assert(iret == 0);
+    if (!logger_open_log_file(priv)) {
+        EPRINT("Failed to open log file (%s)", priv->path);
 
         logger_deinit(priv);
         pthread_exit(NULL);
     }
 
-    int n_queue_slots = 5;
-
-    shared.n_queue_slots = n_queue_slots;
-
-    shared.logger_queue = emalloc((size_t)n_queue_slots * sizeof(shared.logger_queue[0]));
-
-    shared.logger_initialized = true;
-
-    iret = pthread_cond_broadcast(&cond_on_logger_initialized);
-    assert(iret == 0);
-
-    iret = pthread_mutex_unlock(&logger_lock);
-    assert(iret == 0);
+    /* A log file of the other format (e.g. from a run with another --log-format) isn't appended to, it's rotated */
+    bool binary = priv->args->file_format == LOGGER_FILE_BINARY;
+    if (priv->size > 0 && logger_is_binary_log_file(priv) != binary) {
+        logger_rotate(priv);
+    }
 
     return priv;
 }
@@ -151,11 +672,15 @@ logger_init(void *arg)
 static void
 logger_loop(LoggerPrivateState *priv)
 {
+    if (priv->args->use_watchdog) {
+        priv->watchdog = watchdog_register("Logger");
+    }
+
     while (1) {
-        logger_handle_queued_messages(priv->log_file);
+        logger_handle_queued_messages(priv);
 
         if (priv->args->use_watchdog) {
-            watchdog_signal_active("Logger");
+            watchdog_signal_active(priv->watchdog);
         }
     }
 }
@@ -165,10 +690,20 @@ logger_run(void *arg)
 {
     assert(arg);
 
+    /*
+     * Producers don't wait for the Logger to be initialized, so a cancellation request might
+     * arrive before the cleanup handler (which writes the remaining messages) is installed.
+     */
+    int iret = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    assert(iret == 0);
+
     LoggerPrivateState *priv = logger_init(arg);
 
     pthread_cleanup_push(logger_deinit, priv);
 
+    iret = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    assert(iret == 0);
+
     logger_loop(priv);
 
     pthread_cleanup_pop(1);
@@ -176,73 +711,274 @@ logger_run(void *arg)
     pthread_exit(NULL);
 }
 
+/*
+ * Reserve a record of length bytes of message or argument values, after its LoggerRecordInfo which is filled in.
+ * Returns the header of the record, to be published with logger_queue_publish() once the bytes are copied,
+ * or NULL if the queue is full (the message is then counted as dropped).
+ */
+static LoggerQueueCell *
+logger_queue_reserve(size_t length, LoggerFormat *call_site)
+{
+    int iret = pthread_once(&queue_once, logger_queue_init);
+    assert(iret == 0);
+
+    unsigned long n_cells = 1 + LOGGER_RECORD_INFO_CELLS + (length + sizeof(LoggerQueueCell) - 1) / sizeof(LoggerQueueCell);
+    unsigned long n_padding;
+
+    unsigned long reserve_index = __atomic_load_n(&queue.reserve_index, __ATOMIC_RELAXED);
+    do {
+        unsigned long read_index = __atomic_load_n(&queue.read_index, __ATOMIC_ACQUIRE);
+
+        unsigned long n_contiguous = LOGGER_QUEUE_N_CELLS - reserve_index % LOGGER_QUEUE_N_CELLS;
+        n_padding = n_contiguous < n_cells ? n_contiguous : 0;
+
+        if (reserve_index + n_padding + n_cells - read_index > LOGGER_QUEUE_N_CELLS) {
+            __atomic_add_fetch(&queue.n_dropped, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&queue.n_dropped_total, 1, __ATOMIC_RELAXED);
+            stats_counter_add(STATS_COUNTER_LOGGER_MESSAGES_DROPPED, 1);
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&queue.reserve_index, &reserve_index, reserve_index + n_padding + n_cells,
+                true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    if (n_padding > 0) {
+        LoggerQueueCell *padding = &queue.cells[reserve_index % LOGGER_QUEUE_N_CELLS];
+        padding->n_cells = (unsigned)n_padding;
+        __atomic_store_n(&padding->state, LOGGER_RECORD_PADDING, __ATOMIC_RELEASE);
+    }
+
+    LoggerQueueCell *header = &queue.cells[(reserve_index + n_padding) % LOGGER_QUEUE_N_CELLS];
+    header->n_cells = (unsigned)n_cells;
+    header->length = (unsigned)length;
+
+    LoggerRecordInfo info = {
+        .timestamp_ns = clock_now_ns(CLOCK_REALTIME),
+        .call_site = call_site,
+    };
+    memcpy(header + 1, &info, sizeof(info));
+
+    return header;
+}
+
+static void
+logger_queue_publish(LoggerQueueCell header[static 1])
+{
+    __atomic_store_n(&header->state, LOGGER_RECORD_MESSAGE, __ATOMIC_RELEASE);
+
+    logger_queue_wake_consumer();
+}
+
 void
-logger_log_message(bool dont_block_on_fail, const char *message)
+logger_log_message(const char *message)
 {
     assert(message);
 
-    int iret = pthread_mutex_lock(&logger_lock);
-    assert(iret == 0);
-    pthread_cleanup_push(cleanup_mutex_unlock, &logger_lock);
-
-    bool can_log = true;
+    size_t message_length = strlen(message);
+    if (message_length > LOGGER_MAX_MESSAGE_LENGTH) {
+        message_length = LOGGER_MAX_MESSAGE_LENGTH;
+    }
 
-    if (!dont_block_on_fail) {
-        ensure_initialized(&shared.logger_initialized, &cond_on_logger_initialized, &logger_lock);
+    LoggerQueueCell *header = logger_queue_reserve(message_length, NULL);
+    if (!header) {
+        return;
     }
+    memcpy(header + 1 + LOGGER_RECORD_INFO_CELLS, message, message_length);
+    logger_queue_publish(header);
+}
 
-    if (!shared.logger_initialized) {
-        can_log = false;
+/*
+ * Parse the format of a call site on its first call.
+ * Returns the state of the call site. While another thread parses it, the caller formats its message itself.
+ */
+static int
+logger_format_init(LoggerFormat call_site[static 1], const char *format)
+{
+    int state = 0;
+    if (!__atomic_compare_exchange_n(&call_site->state, &state, LOGGER_FORMAT_PARSING, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        return state == LOGGER_FORMAT_PARSING ? LOGGER_FORMAT_IMMEDIATE : state;
     }
 
-    while (shared.n_queued >= shared.n_queue_slots) {
-        if (dont_block_on_fail) {
-            can_log = false;
+    call_site->format = format;
+    bool deferred = strlen(call_site->function) + strlen(format) <= LOGGER_MAX_CALL_SITE_LENGTH
+        && log_format_parse(format, &call_site->n_args, call_site->arg_types);
+
+    state = deferred ? LOGGER_FORMAT_DEFERRED : LOGGER_FORMAT_IMMEDIATE;
+    __atomic_store_n(&call_site->state, state, __ATOMIC_RELEASE);
+    return state;
+}
+
+/*
+ * Queue the values of the arguments of a deferred call site (see log_format.h for their encoding).
+ * Strings are truncated so that the values don't take more than LOGGER_MAX_MESSAGE_LENGTH bytes.
+ */
+static void
+logger_log_values(LoggerFormat call_site[static 1], va_list args)
+{
+    int n_args = call_site->n_args;
+    uint64_t values[LOG_FORMAT_MAX_ARGS];
+    const char *strings[LOG_FORMAT_MAX_ARGS];
+    size_t string_lengths[LOG_FORMAT_MAX_ARGS];
+
+    size_t length = 0;
+    for (int i = 0; i < n_args; i++) {
+        switch (call_site->arg_types[i]) {
+        case LOG_ARG_INT:
+            values[i] = (uint64_t)(int64_t)va_arg(args, int);
+            break;
+        case LOG_ARG_UINT:
+            values[i] = va_arg(args, unsigned);
+            break;
+        case LOG_ARG_LONG:
+            values[i] = (uint64_t)(int64_t)va_arg(args, long);
+            break;
+        case LOG_ARG_ULONG:
+            values[i] = va_arg(args, unsigned long);
+            break;
+        case LOG_ARG_LLONG:
+            values[i] = (uint64_t)(int64_t)va_arg(args, long long);
+            break;
+        case LOG_ARG_ULLONG:
+            values[i] = va_arg(args, unsigned long long);
+            break;
+        case LOG_ARG_SSIZE:
+            values[i] = (uint64_t)(int64_t)va_arg(args, ssize_t);
+            break;
+        case LOG_ARG_SIZE:
+            values[i] = va_arg(args, size_t);
+            break;
+        case LOG_ARG_INTMAX:
+            values[i] = (uint64_t)(int64_t)va_arg(args, intmax_t);
+            break;
+        case LOG_ARG_UINTMAX:
+            values[i] = va_arg(args, uintmax_t);
+            break;
+        case LOG_ARG_PTRDIFF:
+            values[i] = (uint64_t)(int64_t)va_arg(args, ptrdiff_t);
+            break;
+        case LOG_ARG_DOUBLE: {
+            double d = va_arg(args, double);
+            memcpy(&values[i], &d, sizeof(d));
+            break;
+        }
+        case LOG_ARG_POINTER:
+            values[i] = (uintptr_t)va_arg(args, void *);
             break;
+        case LOG_ARG_STRING:
+            strings[i] = va_arg(args, const char *);
+            length += sizeof(uint16_t);
+            continue;
+        default:
+            assert(false);
         }
-        iret = pthread_cond_wait(&cond_on_queue_emptied, &logger_lock);
-        assert(iret != EINVAL);
-        assert(iret != EPERM);
+        length += sizeof(values[i]);
     }
 
-    if (can_log) {
-        LoggerQueueEntry *queue_slot = &shared.logger_queue[shared.n_queued];
+    /* The strings get what's left of LOGGER_MAX_MESSAGE_LENGTH, in order */
+    for (int i = 0; i < n_args; i++) {
+        if (call_site->arg_types[i] != LOG_ARG_STRING || !strings[i]) {
+            continue;
+        }
+        size_t max_length = LOGGER_MAX_MESSAGE_LENGTH > length ? LOGGER_MAX_MESSAGE_LENGTH - length : 0;
+        string_lengths[i] = strnlen(strings[i], max_length);
+        length += string_lengths[i];
+    }
 
-        size_t total_length = strlen(message);
-        size_t main_length;
-        size_t remainder_length;
+    LoggerQueueCell *header = logger_queue_reserve(length, call_site);
+    if (!header) {
+        return;
+    }
 
-        const size_t max_main_length = sizeof(queue_slot->message) - 1;
+    char *p = (char *)(header + 1 + LOGGER_RECORD_INFO_CELLS);
+    for (int i = 0; i < n_args; i++) {
+        if (call_site->arg_types[i] != LOG_ARG_STRING) {
+            memcpy(p, &values[i], sizeof(values[i]));
+            p += sizeof(values[i]);
+            continue;
+        }
 
-        if (total_length > max_main_length) {
-            main_length = max_main_length;
-            remainder_length = total_length - max_main_length;
-        } else {
-            main_length = total_length;
-            remainder_length = 0;
+        uint16_t n = strings[i] ? (uint16_t)string_lengths[i] : LOG_FORMAT_NULL_STRING;
+        memcpy(p, &n, sizeof(n));
+        p += sizeof(n);
+        if (strings[i]) {
+            memcpy(p, strings[i], string_lengths[i]);
+            p += string_lengths[i];
         }
+    }
+    assert((size_t)(p - (char *)(header + 1 + LOGGER_RECORD_INFO_CELLS)) == length);
 
-        memcpy(queue_slot->message, message, main_length);
-        queue_slot->message[main_length] = '\0';
+    logger_queue_publish(header);
+}
 
-        if (remainder_length == 0) {
-            queue_slot->message_remainder = NULL;
-        } else {
-            /* Heap-allocated messages are freed in write_queued_messages_to_log_file() */
-            char *rem_str = malloc(remainder_length + 1);
-            if (!rem_str) {
-                EPRINT("malloc() failed. (non-critical)");
-            } else {
-                memcpy(rem_str, &message[main_length], remainder_length + 1);
-            }
-            queue_slot->message_remainder = rem_str;
-        }
+/*
+ * Format a message on the calling thread, for the call sites that can't be deferred.
+ */
+static void
+logger_log_formatted(const char *function, const char *format, va_list args)
+{
+    char message[LOGGER_MAX_MESSAGE_LENGTH + 1];
 
-        shared.n_queued++;
+    int length = snprintf(message, sizeof(message), "%s: ", function);
+    if (length < 0) {
+        return;
+    }
+    if ((size_t)length < sizeof(message)) {
+        (void)vsnprintf(&message[length], sizeof(message) - (size_t)length, format, args);
+    }
 
-        iret = pthread_cond_signal(&cond_on_message_submitted);
-        assert(iret == 0);
+    logger_log_message(message);
+}
+
+void
+logger_log_deferred(LoggerFormat call_site[static 1], const char *format, ...)
+{
+    assert(call_site->function && format);
+
+    int state = __atomic_load_n(&call_site->state, __ATOMIC_ACQUIRE);
+    if (state == 0) {
+        state = logger_format_init(call_site, format);
     }
 
-    pthread_cleanup_pop(1);
+    va_list args;
+    va_start(args, format);
+    if (state == LOGGER_FORMAT_DEFERRED) {
+        logger_log_values(call_site, args);
+    } else {
+        logger_log_formatted(call_site->function, format, args);
+    }
+    va_end(args);
+}
+
+unsigned long
+logger_n_dropped_messages(void)
+{
+    return __atomic_load_n(&queue.n_dropped_total, __ATOMIC_RELAXED);
+}
+
+bool
+logger_parse_file_format(const char *name, LoggerFileFormat format[static 1])
+{
+    if (strcmp(name, "text") == 0) {
+        *format = LOGGER_FILE_TEXT;
+    } else if (strcmp(name, "binary") == 0) {
+        *format = LOGGER_FILE_BINARY;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool
+logger_parse_sync_policy(const char *name, LoggerSyncPolicy policy[static 1])
+{
+    if (strcmp(name, "none") == 0) {
+        *policy = LOGGER_SYNC_NONE;
+    } else if (strcmp(name, "batch") == 0) {
+        *policy = LOGGER_SYNC_BATCH;
+    } else if (strcmp(name, "interval") == 0) {
+        *policy = LOGGER_SYNC_INTERVAL;
+    } else {
+        return false;
+    }
+    return true;
 }
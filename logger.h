@@ -5,39 +5,133 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include "log_format.h"
+
+#define LOGGER_DEFAULT_PATH "log.txt"
+#define LOGGER_DEFAULT_MAX_SIZE (10 * 1024 * 1024)
+#define LOGGER_DEFAULT_MAX_FILES 5
+#define LOGGER_MAX_MAX_FILES 100
+#define LOGGER_DEFAULT_SYNC_INTERVAL_MS 1000
+
+/*
+ * The Logger writes at most one batch of messages per interval, so that a burst of messages
+ * (e.g. an error repeated in a loop) doesn't cost a system call per message.
+ */
+#define LOGGER_BATCH_INTERVAL_MS 10
+
+typedef enum {
+    /* Leave writing the log file back to the disk to the kernel */
+    LOGGER_SYNC_NONE,
+    /* fdatasync() after every batch of messages */
+    LOGGER_SYNC_BATCH,
+    /* fdatasync() every sync_interval_ms if messages were written in the meantime */
+    LOGGER_SYNC_INTERVAL,
+} LoggerSyncPolicy;
+
+typedef enum {
+    /* A line per message */
+    LOGGER_FILE_TEXT,
+    /* Records of the format and arguments of the messages, see log_format.h. They are decoded by log_decode. */
+    LOGGER_FILE_BINARY,
+} LoggerFileFormat;
+
 typedef struct {
+    /* Log file, LOGGER_DEFAULT_PATH (in the current directory) if NULL. Logger takes ownership of the string. */
+    char *path;
+    /* Size in bytes the log file doesn't grow beyond, it's rotated before. 0 to never rotate. */
+    long long max_size;
+    /* Rotated files kept, path.1 (the newest) to path.max_files, up to LOGGER_MAX_MAX_FILES. 0 keeps none. */
+    int max_files;
+    LoggerSyncPolicy sync;
+    int sync_interval_ms;
+    LoggerFileFormat file_format;
     bool use_watchdog;
 } LoggerArgs;
 
+/*
+ * Parse "none", "batch" or "interval". Returns false if the name isn't a known policy.
+ */
+bool logger_parse_sync_policy(const char *name, LoggerSyncPolicy policy[static 1]);
+
+/*
+ * Parse "text" or "binary". Returns false if the name isn't a known format.
+ */
+bool logger_parse_file_format(const char *name, LoggerFileFormat format[static 1]);
+
+/*
+ * Thread that writes the submitted messages to the log file.
+ * Every time it wakes up it writes all the queued messages with a single writev() (or one per few
+ * hundred messages), at most once per LOGGER_BATCH_INTERVAL_MS. When the next message wouldn't fit in
+ * LoggerArgs.max_size the file is renamed to path.1 (path.1 to path.2 and so on, the oldest is removed)
+ * and a new one is started, all by the Logger thread, so rotating never delays the threads logging.
+ * If writing fails (e.g. the disk is full) the messages are counted as dropped.
+ */
 void * logger_run(void *arg);
 
+/*
+ * Longer messages are truncated.
+ */
+#define LOGGER_MAX_MESSAGE_LENGTH (16 * 1024)
+
 /*
  * Submit a message to be written to the log file.
  * message must be a valid pointer to a null-terminated C string.
  * A newline character is appended to the logged message.
- * If dont_block_on_fail is false and the logger queue is full or
- * the logger thread isn't running this function will block until
- * the message can be submitted.
- */
-void logger_log_message(bool dont_block_on_fail, const char *message);
-
-/*
- * Log formatted message and the calling function name.
- * This macro can only handle messages up to 511 characters in total length.
- */
-#define ELOG(dont_block_on_fail, ...) do {                                    \
-    char _msg[512];                                                           \
-    size_t _len = 0;                                                          \
-    int _ret;                                                                 \
-    _ret = snprintf(_msg, sizeof(_msg) - _len, "%s: ", __func__);             \
-    if (_ret < 0) { abort(); }                                                \
-    _len += (size_t)_ret;                                                     \
-    if (_len >= sizeof(_msg)) { abort(); }                                    \
-    _ret = snprintf(&_msg[_len], sizeof(_msg) - _len, __VA_ARGS__);           \
-    if (_ret < 0) { abort(); }                                                \
-    _len += (size_t)_ret;                                                     \
-    if (_len >= sizeof(_msg)) { abort(); }                                    \
-    logger_log_message(dont_block_on_fail, _msg);                             \
+ *
+ * The message is copied into a lock-free queue shared by all threads, so this function
+ * never blocks and never allocates memory. Messages can be submitted before the Logger
+ * thread is started, they will be written once it runs.
+ * If the queue is full the message is dropped. The Logger writes the number of dropped
+ * messages to the log file.
+ */
+void logger_log_message(const char *message);
+
+/*
+ * Total number of messages dropped because the queue was full.
+ */
+unsigned long logger_n_dropped_messages(void);
+
+/*
+ * Call site of ELOG(), a static variable of the calling function.
+ */
+typedef struct {
+    const char *function;
+    /* 0 until the first call parses the format, then LOGGER_FORMAT_DEFERRED or LOGGER_FORMAT_IMMEDIATE */
+    int state;
+    const char *format;
+    int n_args;
+    unsigned char arg_types[LOG_FORMAT_MAX_ARGS];
+    /* Only used by the Logger thread: the binary log file in which the format is defined, and its id there */
+    unsigned long file_generation;
+    unsigned file_id;
+} LoggerFormat;
+
+enum {
+    /* The arguments are recorded and formatted by the Logger */
+    LOGGER_FORMAT_DEFERRED = 1,
+    /* The format has a conversion that can't be deferred (see log_format_parse()), the caller formats the message */
+    LOGGER_FORMAT_IMMEDIATE,
+    /* The first call is parsing the format, concurrent calls format their message */
+    LOGGER_FORMAT_PARSING,
+};
+
+/*
+ * Submit a message made of the printf() format of a call site and its arguments, see ELOG().
+ * format must be the same string literal on every call from a call site.
+ */
+void logger_log_deferred(LoggerFormat call_site[static 1], const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Log formatted message and the calling function name, up to LOGGER_MAX_MESSAGE_LENGTH characters.
+ *
+ * The message isn't formatted by the calling thread: only the timestamp, the call site and the values
+ * of the arguments are copied into the queue (strings included), and the Logger formats the message,
+ * or with a binary log file the log_decode tool does. Like logger_log_message() it never blocks.
+ */
+#define ELOG(...) do {                                                        \
+    static LoggerFormat _logger_call_site = { .function = __func__ };         \
+    logger_log_deferred(&_logger_call_site, __VA_ARGS__);                     \
 } while (0)
 
 #endif /* LOGGER_H */
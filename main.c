@@ -3,36 +3,403 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <sys/sysinfo.h> /* get_nprocs_conf() */
+#include <sys/sysinfo.h> /* get_nprocs_conf(), get_nprocs() */
 
 #include "utils.h"
 #include "proc_stat_utils.h"
 #include "reader.h"
+#include "cpu_freq.h"
+#include "recording.h"
+#include "replayer.h"
 #include "analyzer.h"
+#include "history.h"
+#include "archiver.h"
+#include "exporter.h"
+#include "server.h"
+#include "shm_writer.h"
+#include "output.h"
+#include "process_reader.h"
 #include "printer.h"
+#include "rolling_stats.h"
 #include "logger.h"
 #include "watchdog.h"
 
+typedef struct {
+    int sampling_interval_ms;
+    bool sample_frequencies;
+    CpuFreqBackend cpu_freq_backend;
+    int max_frames_per_second;
+    Layout layout;
+    RollingStatsWindows windows;
+    const char *record_file_name;
+    const char *replay_file_name;
+    double replay_speed;
+    bool replay_as_fast_as_possible;
+    const char *history_file_name;
+    /* Run without the terminal UI, exporting the usage to this file instead */
+    const char *metrics_file_name;
+    /* Write a line per sample to stdout instead of the terminal UI */
+    bool use_output;
+    OutputFormat output_format;
+    /* Add the per-state breakdown to the --output and --serve lines */
+    bool cpu_states;
+    /* Stream the usage of every sample to the clients of this Unix domain socket */
+    const char *socket_path;
+    /* Publish the usage of every sample to this POSIX shared memory segment */
+    const char *shm_name;
+    const char *log_file_name;
+    /* 0 to never rotate the log file */
+    int log_max_size_mb;
+    int log_max_files;
+    LoggerSyncPolicy log_sync;
+    LoggerFileFormat log_format;
+    int n_top_processes;
+    /* 0 until set, the default then depends on the number of online CPUs */
+    int n_scan_workers;
+} Options;
+
+static void
+print_usage(const char *program_name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "\n"
+            "Options:\n"
+            "  --interval MS            Sampling interval in milliseconds (%d-%d, default %d)\n"
+            "  --cpufreq BACKEND        Read CPU frequencies with auto, io_uring or pread, or off (default auto)\n"
+            "  --fps N                  Maximum terminal refresh rate (%d-%d, default %d)\n"
+            "  --layout NAME            Display layout: auto, bars, heatmap, histogram, top, stats, states, procs or threads\n"
+            "                           (default auto)\n"
+            "  --processes N            Number of busiest processes (threads) shown by the procs (threads) layout (%d-%d, default %d)\n"
+            "  --workers N              Threads scanning /proc for the procs and threads layouts (1-%d, default one per CPU up to %d)\n"
+            "  --windows LIST           Rolling statistics windows, e.g. 30s,2m,1h (at most %d, default %s)\n"
+            "  --record FILE            Also write every /proc/stat snapshot to a recording file\n"
+            "  --replay FILE            Feed the snapshots of a recording instead of reading /proc/stat\n"
+            "  --speed X                Replay speed multiplier (default 1)\n"
+            "  --as-fast-as-possible    Replay without pausing between snapshots\n"
+            "  --history FILE           Append every snapshot to a history file\n"
+            "  --daemon FILE            Run without the terminal UI, replacing FILE with the usage of every sample\n"
+            "                           in the Prometheus text format (e.g. for node_exporter's textfile collector)\n"
+            "  --output FORMAT          Write a line per sample to stdout instead of the terminal UI, csv or jsonl\n"
+            "  --serve SOCKET           Stream the usage of every sample as JSON lines to the clients of a Unix socket\n"
+            "  --cpu-states             Add the time spent in each state (user, system, iowait, ...) to the --output and\n"
+            "                           --serve lines\n"
+            "  --shm NAME               Publish the usage of every sample to a POSIX shared memory segment, e.g. /cut\n"
+            "  --log FILE               Log file (default %s in the current directory)\n"
+            "  --log-max-size MB        Rotate the log file before it grows beyond MB megabytes, 0 to never rotate (default %d)\n"
+            "  --log-max-files N        Rotated log files kept, FILE.1 to FILE.N (0-%d, default %d)\n"
+            "  --log-sync POLICY        Flush the log file to the disk: none, batch (after every write) or interval\n"
+            "                           (every %d ms) (default none)\n"
+            "  --log-format FORMAT      Log file format: text or binary (decoded with log_decode) (default text)\n",
+            program_name,
+            READER_MIN_SAMPLING_INTERVAL_MS, READER_MAX_SAMPLING_INTERVAL_MS, READER_DEFAULT_SAMPLING_INTERVAL_MS,
+            PRINTER_MIN_FRAMES_PER_SECOND, PRINTER_MAX_FRAMES_PER_SECOND, PRINTER_DEFAULT_FRAMES_PER_SECOND,
+            PROCESS_READER_MIN_TOP_PROCESSES, PROCESS_READER_MAX_TOP_PROCESSES, PROCESS_READER_DEFAULT_TOP_PROCESSES,
+            PROCESS_SCANNER_MAX_WORKERS, PROCESS_READER_DEFAULT_MAX_WORKERS,
+            ROLLING_STATS_MAX_WINDOWS, ROLLING_STATS_DEFAULT_WINDOWS,
+            LOGGER_DEFAULT_PATH, LOGGER_DEFAULT_MAX_SIZE / (1024 * 1024), LOGGER_MAX_MAX_FILES, LOGGER_DEFAULT_MAX_FILES,
+            LOGGER_DEFAULT_SYNC_INTERVAL_MS);
+}
+
+/*
+ * Parse a decimal integer in [min, max].
+ * Returns false if the string isn't a valid number or is out of range.
+ */
+static bool
+parse_int(const char *str, int min, int max, int result[static 1])
+{
+    char *end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || value < min || value > max) {
+        return false;
+    }
+    *result = (int)value;
+    return true;
+}
+
+/*
+ * Parse a positive decimal floating point number.
+ */
+static bool
+parse_positive_double(const char *str, double result[static 1])
+{
+    char *end;
+    errno = 0;
+    double value = strtod(str, &end);
+    if (errno != 0 || end == str || *end != '\0' || !(value > 0)) {
+        return false;
+    }
+    *result = value;
+    return true;
+}
+
+static void
+parse_options(int argc, char **argv, Options options[static 1])
+{
+    memset(options, 0, sizeof(*options));
+    options->sampling_interval_ms = READER_DEFAULT_SAMPLING_INTERVAL_MS;
+    options->sample_frequencies = true;
+    options->cpu_freq_backend = CPU_FREQ_BACKEND_AUTO;
+    options->max_frames_per_second = PRINTER_DEFAULT_FRAMES_PER_SECOND;
+    options->layout = LAYOUT_AUTO;
+    bool bret = rolling_stats_parse_windows(ROLLING_STATS_DEFAULT_WINDOWS, &options->windows);
+    assert(bret);
+    (void)(bret);
+    options->replay_speed = 1;
+    options->n_top_processes = PROCESS_READER_DEFAULT_TOP_PROCESSES;
+    options->log_max_size_mb = LOGGER_DEFAULT_MAX_SIZE / (1024 * 1024);
+    options->log_max_files = LOGGER_DEFAULT_MAX_FILES;
+    options->log_sync = LOGGER_SYNC_NONE;
+    options->log_format = LOGGER_FILE_TEXT;
+    bool speed_set = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--interval") == 0 && value) {
+            if (!parse_int(value, READER_MIN_SAMPLING_INTERVAL_MS, READER_MAX_SAMPLING_INTERVAL_MS, &options->sampling_interval_ms)) {
+                EPRINT("Invalid sampling interval: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--cpufreq") == 0 && value) {
+            options->sample_frequencies = strcmp(value, "off") != 0;
+            if (options->sample_frequencies && !cpu_freq_backend_from_name(value, &options->cpu_freq_backend)) {
+                EPRINT("Unknown CPU frequency backend: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--fps") == 0 && value) {
+            if (!parse_int(value, PRINTER_MIN_FRAMES_PER_SECOND, PRINTER_MAX_FRAMES_PER_SECOND, &options->max_frames_per_second)) {
+                EPRINT("Invalid frame rate: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--layout") == 0 && value) {
+            if (!layout_from_name(value, &options->layout)) {
+                EPRINT("Unknown layout: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--processes") == 0 && value) {
+            if (!parse_int(value, PROCESS_READER_MIN_TOP_PROCESSES, PROCESS_READER_MAX_TOP_PROCESSES, &options->n_top_processes)) {
+                EPRINT("Invalid number of processes: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--workers") == 0 && value) {
+            if (!parse_int(value, 1, PROCESS_SCANNER_MAX_WORKERS, &options->n_scan_workers)) {
+                EPRINT("Invalid number of workers: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--windows") == 0 && value) {
+            if (!rolling_stats_parse_windows(value, &options->windows)) {
+                EPRINT("Invalid statistics windows: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--record") == 0 && value) {
+            options->record_file_name = value;
+            i++;
+        } else if (strcmp(arg, "--replay") == 0 && value) {
+            options->replay_file_name = value;
+            i++;
+        } else if (strcmp(arg, "--speed") == 0 && value) {
+            if (!parse_positive_double(value, &options->replay_speed)) {
+                EPRINT("Invalid replay speed: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            speed_set = true;
+            i++;
+        } else if (strcmp(arg, "--history") == 0 && value) {
+            options->history_file_name = value;
+            i++;
+        } else if (strcmp(arg, "--daemon") == 0 && value) {
+            options->metrics_file_name = value;
+            i++;
+        } else if (strcmp(arg, "--output") == 0 && value) {
+            if (!output_parse_format(value, &options->output_format)) {
+                EPRINT("Invalid output format: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            options->use_output = true;
+            i++;
+        } else if (strcmp(arg, "--serve") == 0 && value) {
+            options->socket_path = value;
+            i++;
+        } else if (strcmp(arg, "--shm") == 0 && value) {
+            if (value[0] != '/' || value[1] == '\0' || strchr(&value[1], '/')) {
+                EPRINT("Invalid shared memory segment name, must be / followed by a name: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            options->shm_name = value;
+            i++;
+        } else if (strcmp(arg, "--log") == 0 && value) {
+            options->log_file_name = value;
+            i++;
+        } else if (strcmp(arg, "--log-max-size") == 0 && value) {
+            if (!parse_int(value, 0, 1024 * 1024, &options->log_max_size_mb)) {
+                EPRINT("Invalid log file size: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--log-max-files") == 0 && value) {
+            if (!parse_int(value, 0, LOGGER_MAX_MAX_FILES, &options->log_max_files)) {
+                EPRINT("Invalid number of log files: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--log-sync") == 0 && value) {
+            if (!logger_parse_sync_policy(value, &options->log_sync)) {
+                EPRINT("Unknown log sync policy: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--log-format") == 0 && value) {
+            if (!logger_parse_file_format(value, &options->log_format)) {
+                EPRINT("Unknown log format: %s", value);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(arg, "--cpu-states") == 0) {
+            options->cpu_states = true;
+        } else if (strcmp(arg, "--as-fast-as-possible") == 0) {
+            options->replay_as_fast_as_possible = true;
+        } else if (strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        } else {
+            EPRINT("Unrecognized option: %s", arg);
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options->replay_file_name && options->record_file_name) {
+        EPRINT("--record and --replay can't be used together");
+        exit(EXIT_FAILURE);
+    }
+    if (!options->replay_file_name && (speed_set || options->replay_as_fast_as_possible)) {
+        EPRINT("--speed and --as-fast-as-possible require --replay");
+        exit(EXIT_FAILURE);
+    }
+    if (options->replay_file_name && (options->layout == LAYOUT_PROCESSES || options->layout == LAYOUT_THREADS)) {
+        EPRINT("The procs and threads layouts show live processes and can't be used with --replay");
+        exit(EXIT_FAILURE);
+    }
+    if (options->metrics_file_name && (options->layout == LAYOUT_PROCESSES || options->layout == LAYOUT_THREADS)) {
+        EPRINT("The procs and threads layouts are only displayed and can't be used with --daemon");
+        exit(EXIT_FAILURE);
+    }
+    if (options->use_output && (options->layout == LAYOUT_PROCESSES || options->layout == LAYOUT_THREADS)) {
+        EPRINT("The procs and threads layouts are only displayed and can't be used with --output");
+        exit(EXIT_FAILURE);
+    }
+    if (options->use_output && options->metrics_file_name) {
+        EPRINT("--output and --daemon can't be used together");
+        exit(EXIT_FAILURE);
+    }
+    if (speed_set && options->replay_as_fast_as_possible) {
+        EPRINT("--speed and --as-fast-as-possible can't be used together");
+        exit(EXIT_FAILURE);
+    }
+    if (options->cpu_states && !options->use_output && !options->socket_path) {
+        EPRINT("--cpu-states requires --output or --serve, the terminal UI shows the states with --layout states");
+        exit(EXIT_FAILURE);
+    }
+}
+
 int
 main(int argc, char **argv)
 {
-    (void)(argc); (void)(argv);
+    Options options;
+    parse_options(argc, argv, &options);
 
     /*
      * get_nprocs_conf() returns the number of CPUs configured by the operating system.
      * Data structures used for processing the /proc/stat file will be initialized with a number of
      * slots equal to this value + 1 (we need a slot for each of the cores + one more for the average CPU usage).
      * The returned value can be different than the actual number of active processors in the system.
-     * If during the run time of the program the number of CPU per-code entries read out from
-     * the /proc/stat file exceeds this value the program will exit.
+     * If more CPUs come online during the run time of the program the threads grow their buffers,
+     * only recordings and history files are limited to this number of entries per snapshot.
      */
     int nprocs = get_nprocs_conf();
     int max_cpu_entries = nprocs + 1;
 
+    RecordingWriter *recording_writer = NULL;
+    RecordingReader *recording_reader = NULL;
+
+    if (options.record_file_name) {
+        recording_writer = recording_writer_open(options.record_file_name, max_cpu_entries);
+        if (!recording_writer) {
+            EPRINT("Failed to create recording file (%s)", options.record_file_name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options.replay_file_name) {
+        recording_reader = recording_reader_open(options.replay_file_name);
+        if (!recording_reader) {
+            EPRINT("Failed to open recording file (%s)", options.replay_file_name);
+            exit(EXIT_FAILURE);
+        }
+        /* The recording might come from a machine with more CPUs */
+        max_cpu_entries = recording_reader_max_cpu_entries(recording_reader);
+    }
+
+    HistoryWriter *history_writer = NULL;
+
+    if (options.history_file_name) {
+        history_writer = history_writer_open(options.history_file_name, max_cpu_entries);
+        if (!history_writer) {
+            EPRINT("Failed to open history file (%s)", options.history_file_name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ShmWriter *shm_writer = NULL;
+
+    if (options.shm_name) {
+        shm_writer = shm_writer_open(options.shm_name, max_cpu_entries);
+        if (!shm_writer) {
+            EPRINT("Failed to create shared memory segment (%s): %s", options.shm_name,
+                    errno == EEXIST ? "in use by another instance" : strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int server_fd = -1;
+
+    if (options.socket_path) {
+        server_fd = server_listen(options.socket_path);
+        if (server_fd < 0) {
+            EPRINT("Failed to listen on socket (%s): %s", options.socket_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
     int iret;
 
     /*
@@ -41,59 +408,201 @@ main(int argc, char **argv)
     sigset_t masked_signals;
     sigemptyset(&masked_signals);
     sigaddset(&masked_signals, SIGTERM);
+    sigaddset(&masked_signals, SIGUSR1);
     iret = pthread_sigmask(SIG_BLOCK, &masked_signals, NULL);
     assert(iret == 0);
 
     pthread_t watchdog;
-    pthread_t reader;
+    pthread_t reader; /* Or Replayer */
     pthread_t analyzer;
-    pthread_t printer;
+    pthread_t printer; /* Or Exporter, or Output */
     pthread_t logger;
+    pthread_t archiver;
+    pthread_t process_reader;
+    pthread_t server;
 
-    ReaderArgs *reader_args = ecalloc(1, sizeof(*reader_args));
-    reader_args->max_cpu_entries = max_cpu_entries;
-    reader_args->use_watchdog = true;
+    /*
+     * The Reader only reports activity once per sampling interval,
+     * so the Watchdog timeout must be scaled accordingly.
+     */
+    WatchdogArgs *watchdog_args = ecalloc(1, sizeof(*watchdog_args));
+    watchdog_args->timeout_seconds = WATCHDOG_DEFAULT_TIMEOUT_SECONDS;
+    if (watchdog_args->timeout_seconds < 2.0 * options.sampling_interval_ms / 1000) {
+        watchdog_args->timeout_seconds = 2.0 * options.sampling_interval_ms / 1000;
+    }
+
+    ReaderArgs *reader_args = NULL;
+    ReplayerArgs *replayer_args = NULL;
+
+    if (recording_reader) {
+        replayer_args = ecalloc(1, sizeof(*replayer_args));
+        replayer_args->recording = recording_reader;
+        replayer_args->speed = options.replay_speed;
+        replayer_args->as_fast_as_possible = options.replay_as_fast_as_possible;
+        replayer_args->use_watchdog = true;
+    } else {
+        reader_args = ecalloc(1, sizeof(*reader_args));
+        reader_args->sampling_interval_ms = options.sampling_interval_ms;
+        reader_args->recording = recording_writer;
+        reader_args->sample_frequencies = options.sample_frequencies;
+        reader_args->cpu_freq_backend = options.cpu_freq_backend;
+        reader_args->use_watchdog = true;
+    }
 
     AnalyzerArgs *analyzer_args = ecalloc(1, sizeof(*analyzer_args));
     analyzer_args->max_cpu_entries = max_cpu_entries;
+    analyzer_args->windows = options.windows;
+    analyzer_args->use_printer = !options.metrics_file_name && !options.use_output;
+    analyzer_args->use_cpu_states = options.cpu_states || (analyzer_args->use_printer && options.layout == LAYOUT_STATES);
+    analyzer_args->use_archiver = history_writer != NULL;
+    analyzer_args->use_exporter = options.metrics_file_name != NULL;
+    analyzer_args->use_output = options.use_output;
+    analyzer_args->use_server = server_fd >= 0;
+    analyzer_args->shm_writer = shm_writer;
+    /* Replaying as fast as possible waits for the Analyzer instead of dropping snapshots */
+    analyzer_args->backpressure = options.replay_as_fast_as_possible ? STAGE_BACKPRESSURE_BLOCK : STAGE_BACKPRESSURE_DROP;
     analyzer_args->use_watchdog = true;
 
-    PrinterArgs *printer_args = ecalloc(1, sizeof(*printer_args));
-    printer_args->max_cpu_entries = max_cpu_entries;
-    printer_args->use_watchdog = true;
+    ArchiverArgs *archiver_args = NULL;
+    if (history_writer) {
+        archiver_args = ecalloc(1, sizeof(*archiver_args));
+        archiver_args->history = history_writer;
+        archiver_args->max_cpu_entries = max_cpu_entries;
+        archiver_args->use_watchdog = true;
+    }
+
+    ServerArgs *server_args = NULL;
+    if (server_fd >= 0) {
+        server_args = ecalloc(1, sizeof(*server_args));
+        server_args->listen_fd = server_fd;
+        server_args->path = emalloc(strlen(options.socket_path) + 1);
+        strcpy(server_args->path, options.socket_path);
+        server_args->max_cpu_entries = max_cpu_entries;
+        server_args->use_watchdog = true;
+    }
+
+    /* Processes are only scanned when they are displayed */
+    ProcessReaderArgs *process_reader_args = NULL;
+    if (options.layout == LAYOUT_PROCESSES || options.layout == LAYOUT_THREADS) {
+        process_reader_args = ecalloc(1, sizeof(*process_reader_args));
+        process_reader_args->sampling_interval_ms = options.sampling_interval_ms;
+        process_reader_args->n_top_processes = options.n_top_processes;
+        process_reader_args->threads = options.layout == LAYOUT_THREADS;
+        process_reader_args->n_workers = options.n_scan_workers;
+        if (process_reader_args->n_workers == 0) {
+            int n_online = get_nprocs();
+            process_reader_args->n_workers = n_online < 1 ? 1
+                : n_online > PROCESS_READER_DEFAULT_MAX_WORKERS ? PROCESS_READER_DEFAULT_MAX_WORKERS : n_online;
+        }
+        process_reader_args->use_watchdog = true;
+    }
+
+    /* The daemon and the output sinks have no terminal UI */
+    PrinterArgs *printer_args = NULL;
+    ExporterArgs *exporter_args = NULL;
+    OutputArgs *output_args = NULL;
+    if (options.use_output) {
+        output_args = ecalloc(1, sizeof(*output_args));
+        output_args->format = options.output_format;
+        output_args->fd = STDOUT_FILENO;
+        output_args->max_cpu_entries = max_cpu_entries;
+        /* Replaying as fast as possible converts the whole recording */
+        output_args->backpressure = analyzer_args->backpressure;
+        output_args->use_watchdog = true;
+    } else if (options.metrics_file_name) {
+        exporter_args = ecalloc(1, sizeof(*exporter_args));
+        exporter_args->path = emalloc(strlen(options.metrics_file_name) + 1);
+        strcpy(exporter_args->path, options.metrics_file_name);
+        exporter_args->max_cpu_entries = max_cpu_entries;
+        exporter_args->use_watchdog = true;
+    } else {
+        printer_args = ecalloc(1, sizeof(*printer_args));
+        printer_args->max_cpu_entries = max_cpu_entries;
+        printer_args->max_frames_per_second = options.max_frames_per_second;
+        printer_args->layout = options.layout;
+        printer_args->windows = options.windows;
+        printer_args->max_processes = process_reader_args ? options.n_top_processes : 0;
+        printer_args->use_watchdog = true;
+    }
 
     LoggerArgs *logger_args = ecalloc(1, sizeof(*logger_args));
+    if (options.log_file_name) {
+        logger_args->path = emalloc(strlen(options.log_file_name) + 1);
+        strcpy(logger_args->path, options.log_file_name);
+    }
+    logger_args->max_size = (long long)options.log_max_size_mb * 1024 * 1024;
+    logger_args->max_files = options.log_max_files;
+    logger_args->sync = options.log_sync;
+    logger_args->sync_interval_ms = LOGGER_DEFAULT_SYNC_INTERVAL_MS;
+    logger_args->file_format = options.log_format;
     logger_args->use_watchdog = true;
 
-    iret = pthread_create(&watchdog, NULL, watchdog_run, NULL);
+    iret = pthread_create(&watchdog, NULL, watchdog_run, watchdog_args);
     assert(iret == 0);
 
-    iret = pthread_create(&reader, NULL, reader_run, reader_args);
+    if (replayer_args) {
+        iret = pthread_create(&reader, NULL, replayer_run, replayer_args);
+    } else {
+        iret = pthread_create(&reader, NULL, reader_run, reader_args);
+    }
     assert(iret == 0);
 
     iret = pthread_create(&analyzer, NULL, analyzer_run, analyzer_args);
     assert(iret == 0);
 
-    iret = pthread_create(&printer, NULL, printer_run, printer_args);
+    if (printer_args) {
+        iret = pthread_create(&printer, NULL, printer_run, printer_args);
+    } else if (output_args) {
+        iret = pthread_create(&printer, NULL, output_run, output_args);
+    } else {
+        iret = pthread_create(&printer, NULL, exporter_run, exporter_args);
+    }
     assert(iret == 0);
 
     iret = pthread_create(&logger, NULL, logger_run, logger_args);
     assert(iret == 0);
 
-    iret = pthread_join(reader, NULL);
-    assert(iret == 0);
-
-    iret = pthread_join(analyzer, NULL);
-    assert(iret == 0);
+    if (archiver_args) {
+        iret = pthread_create(&archiver, NULL, archiver_run, archiver_args);
+        assert(iret == 0);
+    }
 
-    iret = pthread_join(printer, NULL);
-    assert(iret == 0);
+    if (process_reader_args) {
+        iret = pthread_create(&process_reader, NULL, process_reader_run, process_reader_args);
+        assert(iret == 0);
+    }
 
-    iret = pthread_join(logger, NULL);
-    assert(iret == 0);
+    if (server_args) {
+        iret = pthread_create(&server, NULL, server_run, server_args);
+        assert(iret == 0);
+    }
 
+    /*
+     * Watchdog exits after cancelling the threads it watches. A thread that hasn't reported
+     * activity yet (e.g. when the program is asked to exit right after startup) isn't on
+     * that list, so cancel all of them again before joining.
+     */
     iret = pthread_join(watchdog, NULL);
     assert(iret == 0);
 
+    pthread_t threads[7] = { reader, analyzer, printer, logger };
+    size_t n_threads = 4;
+    if (archiver_args) {
+        threads[n_threads++] = archiver;
+    }
+    if (process_reader_args) {
+        threads[n_threads++] = process_reader;
+    }
+    if (server_args) {
+        threads[n_threads++] = server;
+    }
+    for (size_t i = 0; i < n_threads; i++) {
+        pthread_cancel(threads[i]);
+    }
+    for (size_t i = 0; i < n_threads; i++) {
+        iret = pthread_join(threads[i], NULL);
+        assert(iret == 0);
+    }
+
     pthread_exit(NULL);
 }
@@ -0,0 +1,263 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "sample_format.h"
+#include "utils.h"
+#include "stage.h"
+#include "stats.h"
+#include "thread_utils.h"
+#include "logger.h"
+
+/* Must be a power of two. Deep enough for a second of samples at the shortest sampling interval. */
+#define OUTPUT_QUEUE_DEPTH 128
+
+typedef struct {
+    OutputArgs *args;
+    OutputQueue *queue;
+    /* Formatted lines, those from n_written to length haven't been written yet */
+    char *buffer;
+    size_t buffer_size;
+    size_t length;
+    size_t n_written;
+    /* When the oldest line of the buffer was formatted */
+    long long oldest_line_ns;
+    unsigned long n_samples;
+    /* Columns of the last CSV header, n_header_entries is 0 until one was written */
+    int n_header_entries;
+    int max_header_entries;
+    char (*header_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE];
+    bool header_has_freq_usage;
+    bool header_has_states;
+    bool write_failed;
+} OutputPrivateState;
+
+static Stage output_stage = STAGE_INITIALIZER;
+
+bool
+output_parse_format(const char *name, OutputFormat format[static 1])
+{
+    if (strcmp(name, "csv") == 0) {
+        *format = OUTPUT_FORMAT_CSV;
+    } else if (strcmp(name, "jsonl") == 0) {
+        *format = OUTPUT_FORMAT_JSONL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * The buffer holds OUTPUT_FLUSH_SIZE bytes plus a header and a line of the largest sample so far,
+ * so a line never has to be split.
+ */
+static void
+output_reserve_buffer(OutputPrivateState *priv, int n_cpu_entries, bool has_states)
+{
+    size_t buffer_size = OUTPUT_FLUSH_SIZE + 2 * sample_format_max_line_length(n_cpu_entries, has_states);
+    if (buffer_size > priv->buffer_size) {
+        priv->buffer = erealloc(priv->buffer, buffer_size);
+        priv->buffer_size = buffer_size;
+    }
+}
+
+/*
+ * Progress is kept in n_written, so the cleanup handler resumes a flush that was cancelled midway.
+ */
+static void
+output_flush(OutputPrivateState *priv)
+{
+    while (priv->n_written < priv->length) {
+        ssize_t n = write(priv->args->fd, &priv->buffer[priv->n_written], priv->length - priv->n_written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* The lines are lost, but the pipeline keeps going */
+            if (!priv->write_failed) {
+                ELOG("Failed to write the output: %s", strerror(errno));
+                priv->write_failed = true;
+            }
+            break;
+        }
+        stats_counter_add(STATS_COUNTER_OUTPUT_BYTES_WRITTEN, (unsigned long)n);
+        priv->n_written += (size_t)n;
+    }
+
+    priv->length = 0;
+    priv->n_written = 0;
+}
+
+static bool
+output_csv_header_matches(OutputPrivateState *priv, UsageSample *slot)
+{
+    if (slot->n_cpu_entries != priv->n_header_entries || slot->has_freq_usage != priv->header_has_freq_usage
+            || slot->has_states != priv->header_has_states) {
+        return false;
+    }
+    for (int i = 0; i < slot->n_cpu_entries; i++) {
+        if (strcmp(slot->cpu_names[i], priv->header_names[i]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+output_format_csv_header(OutputPrivateState *priv, UsageSample *slot)
+{
+    if (slot->n_cpu_entries > priv->max_header_entries) {
+        priv->max_header_entries = slot->n_cpu_entries;
+        priv->header_names = erealloc(priv->header_names, (size_t)priv->max_header_entries * sizeof(priv->header_names[0]));
+    }
+    priv->n_header_entries = slot->n_cpu_entries;
+    memcpy(priv->header_names, slot->cpu_names, (size_t)slot->n_cpu_entries * sizeof(slot->cpu_names[0]));
+    priv->header_has_freq_usage = slot->has_freq_usage;
+    priv->header_has_states = slot->has_states;
+
+    priv->length += sample_format_csv_header(&priv->buffer[priv->length], slot->n_cpu_entries, slot->cpu_names,
+            slot->has_freq_usage, slot->has_states);
+}
+
+static void
+output_format_sample(OutputPrivateState *priv, UsageSample *slot)
+{
+    priv->n_samples++;
+
+    output_reserve_buffer(priv, slot->n_cpu_entries, slot->has_states);
+    if (priv->length == 0) {
+        priv->oldest_line_ns = clock_now_ns(CLOCK_MONOTONIC);
+    }
+
+    const double *freq_usage = slot->has_freq_usage ? slot->freq_usage : NULL;
+    const CpuStateBreakdown *states = slot->has_states ? &slot->states : NULL;
+    switch (priv->args->format) {
+        case OUTPUT_FORMAT_CSV:
+            if (!output_csv_header_matches(priv, slot)) {
+                output_format_csv_header(priv, slot);
+            }
+            priv->length += sample_format_csv(&priv->buffer[priv->length], slot->timestamp_ns, slot->n_cpu_entries,
+                    slot->cpu_usage, freq_usage, states);
+            break;
+        case OUTPUT_FORMAT_JSONL:
+            priv->length += sample_format_json(&priv->buffer[priv->length], priv->n_samples, slot->timestamp_ns,
+                    slot->n_cpu_entries, slot->cpu_names, slot->cpu_usage, freq_usage, states);
+            break;
+    }
+
+    if (priv->length >= OUTPUT_FLUSH_SIZE) {
+        output_flush(priv);
+    }
+}
+
+static void
+output_format_submitted_data(OutputPrivateState *priv)
+{
+    for (unsigned n_readable = stage_queue_n_readable(priv->queue); n_readable > 0; n_readable--) {
+        output_format_sample(priv, stage_queue_peek(priv->queue, 0));
+        stage_queue_release(priv->queue);
+    }
+}
+
+static void
+output_deinit(void *arg)
+{
+    OutputPrivateState *priv = arg;
+
+    /* Nothing that was submitted is lost when the program exits, unless a flush was interrupted */
+    if (priv->n_written == 0) {
+        output_format_submitted_data(priv);
+    }
+    output_flush(priv);
+
+    stage_close(&output_stage, priv->queue);
+
+    free(priv->args);
+    free(priv->buffer);
+    free(priv->header_names);
+
+    free(priv);
+}
+
+static OutputPrivateState *
+output_init(void *arg)
+{
+    OutputPrivateState *priv = ecalloc(1, sizeof(*priv));
+
+    priv->args = arg;
+
+    output_reserve_buffer(priv, priv->args->max_cpu_entries, false);
+
+    StageConfig config = {
+        .name = "Output",
+        .depth = OUTPUT_QUEUE_DEPTH,
+        .slot_size = sizeof(UsageSample),
+        .backpressure = priv->args->backpressure,
+        .slot_init = usage_sample_slot_init,
+        .slot_init_arg = &priv->args->max_cpu_entries,
+        .slot_destroy = usage_sample_slot_destroy,
+        .use_watchdog = priv->args->use_watchdog,
+        .dropped_counter = STATS_COUNTER_OUTPUT_SAMPLES_DROPPED,
+        .depth_gauge = STATS_GAUGE_OUTPUT_QUEUE_DEPTH,
+    };
+    priv->queue = stage_open(&output_stage, &config);
+
+    return priv;
+}
+
+static void
+output_loop(OutputPrivateState *priv)
+{
+    const long long flush_interval_ns = OUTPUT_FLUSH_INTERVAL_MS * 1000LL * 1000;
+
+    while (1) {
+        /* Wake up in time to write the buffered lines */
+        double timeout_seconds = 1;
+        if (priv->length > 0) {
+            long long remaining_ns = priv->oldest_line_ns + flush_interval_ns - clock_now_ns(CLOCK_MONOTONIC);
+            timeout_seconds = remaining_ns > 0 ? (double)remaining_ns / NSEC_PER_SEC : 0;
+        }
+
+        bool did_retrieve_data = stage_queue_wait(priv->queue, timeout_seconds);
+        if (did_retrieve_data) {
+            output_format_submitted_data(priv);
+        }
+
+        if (priv->length > 0 && clock_now_ns(CLOCK_MONOTONIC) - priv->oldest_line_ns >= flush_interval_ns) {
+            output_flush(priv);
+        }
+    }
+}
+
+void *
+output_run(void *arg)
+{
+    assert(arg);
+
+    OutputPrivateState *priv = output_init(arg);
+
+    pthread_cleanup_push(output_deinit, priv);
+
+    output_loop(priv);
+
+    pthread_cleanup_pop(1);
+
+    pthread_exit(NULL);
+}
+
+OutputQueue *
+output_queue_attach(void)
+{
+    return stage_attach(&output_stage);
+}
+
+void
+output_queue_detach(OutputQueue *queue)
+{
+    stage_detach(&output_stage, queue);
+}
@@ -0,0 +1,63 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+
+#include "proc_stat_utils.h"
+#include "stage.h"
+
+typedef enum {
+    /* A header line, then one line per sample (see sample_format_csv()) */
+    OUTPUT_FORMAT_CSV,
+    /* One JSON object per sample (see sample_format_json()) */
+    OUTPUT_FORMAT_JSONL,
+} OutputFormat;
+
+typedef struct {
+    OutputFormat format;
+    /* Where the lines are written, e.g. STDOUT_FILENO. It isn't closed. */
+    int fd;
+    /* Initial capacity of the queue slots and the output buffer, they grow when more CPUs come online */
+    int max_cpu_entries;
+    /* What the Analyzer does when the queue is full, e.g. wait when replaying as fast as possible */
+    StageBackpressure backpressure;
+    bool use_watchdog;
+} OutputArgs;
+
+/*
+ * Parse "csv" or "jsonl". Returns false if the name isn't a known format.
+ */
+bool output_parse_format(const char *name, OutputFormat format[static 1]);
+
+/*
+ * Thread that writes a line with the CPU usage of every sample submitted to its queue, for other
+ * programs to consume, e.g. through a pipe.
+ * Lines are formatted into a large reusable buffer, which is written out once it holds
+ * OUTPUT_FLUSH_SIZE bytes or its oldest line is OUTPUT_FLUSH_INTERVAL_MS old, whichever comes first.
+ * The remaining lines are written when the thread exits.
+ * With CSV a new header line is written whenever the CPUs change, or whether the frequencies or the per-state
+ * breakdown are known.
+ */
+void * output_run(void *arg);
+
+#define OUTPUT_FLUSH_SIZE (256 * 1024)
+#define OUTPUT_FLUSH_INTERVAL_MS 100
+
+/*
+ * Input queue of the Output thread, a stage queue (stage.h) of preallocated UsageSample slots (sample_format.h)
+ * filled by usage_sample_submit(), so only one thread at a time may submit data to it.
+ * When the queue is full the Analyzer waits or drops the sample depending on OutputArgs.backpressure.
+ */
+typedef StageQueue OutputQueue;
+
+/*
+ * Attach to the Output thread's input queue as its producer.
+ * Blocks until the Output thread is initialized.
+ * The returned queue stays valid until output_queue_detach() is called, even if
+ * the Output thread exits in the meantime.
+ */
+OutputQueue * output_queue_attach(void);
+
+void output_queue_detach(OutputQueue *queue);
+
+#endif /* OUTPUT_H */
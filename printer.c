@@ -1,17 +1,43 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 
 #include "printer.h"
 #include "utils.h"
 #include "proc_stat_utils.h"
+#include "cpu_states.h"
+#include "screen.h"
+#include "layout.h"
 #include "thread_utils.h"
 #include "logger.h"
 #include "watchdog.h"
+#include "stats.h"
 
 typedef struct {
     PrinterArgs *args;
+    /* Copy of the newest submitted data, so that rendering happens without holding the lock */
+    int n_cpu_entries;
+    int max_cpu_entries;
+    char (*cpu_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE];
+    double *cpu_usage;
+    bool has_freq_usage;
+    double *freq_usage;
+    bool has_summaries;
+    RollingStatsSummary *summaries;
+    bool has_states;
+    CpuStateBreakdown states;
+    bool has_processes;
+    int n_processes;
+    ProcessUsage *processes;
+    Screen screen;
+    long long next_frame_ns;
+    bool write_failed;
+    WatchdogHandle *watchdog;
 } PrinterPrivateState;
 
 static struct {
@@ -21,17 +47,40 @@ static struct {
     int n_cpu_entries;
     char (*cpu_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE];
     double *cpu_usage;
+    bool has_freq_usage;
+    double *freq_usage;
+    int n_windows;
+    bool has_summaries;
+    RollingStatsSummary *summaries;
+    /* The breakdown grows on its own */
+    bool has_states;
+    CpuStateBreakdown states;
+    int max_processes;
+    bool has_processes;
+    int n_processes;
+    ProcessUsage *processes;
     bool new_data_submitted;
 } shared;
 
 static pthread_mutex_t printer_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static pthread_cond_t cond_on_printer_initialized = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t cond_on_data_submitted = PTHREAD_COND_INITIALIZER;
+/* Initialized in printer_init() because it needs to use CLOCK_MONOTONIC */
+static pthread_cond_t cond_on_data_submitted;
 
-static void
-printer_print_usage(void)
+static size_t
+printer_summaries_size(int n_windows, int max_cpu_entries)
+{
+    /* At least one element so that the buffer is never empty */
+    size_t n = (size_t)n_windows * (size_t)max_cpu_entries;
+    return (n > 0 ? n : 1) * sizeof(shared.summaries[0]);
+}
+
+static bool
+printer_retrieve_submitted_data(PrinterPrivateState *priv)
 {
+    bool did_retrieve_data;
+
     int iret = pthread_mutex_lock(&printer_lock);
     assert(iret == 0);
     pthread_cleanup_push(cleanup_mutex_unlock, &printer_lock);
@@ -40,12 +89,98 @@ printer_print_usage(void)
         cond_wait_seconds(&cond_on_data_submitted, &printer_lock, 1);
     }
 
+    did_retrieve_data = shared.new_data_submitted;
+
     if (shared.new_data_submitted) {
         shared.new_data_submitted = false;
-        print_cpu_usage(shared.n_cpu_entries, shared.cpu_names, shared.cpu_usage);
+        if (shared.max_cpu_entries > priv->max_cpu_entries) {
+            priv->max_cpu_entries = shared.max_cpu_entries;
+            priv->cpu_names = erealloc(priv->cpu_names, (size_t)priv->max_cpu_entries * sizeof(priv->cpu_names[0]));
+            priv->cpu_usage = erealloc(priv->cpu_usage, (size_t)priv->max_cpu_entries * sizeof(priv->cpu_usage[0]));
+            priv->freq_usage = erealloc(priv->freq_usage, (size_t)priv->max_cpu_entries * sizeof(priv->freq_usage[0]));
+            priv->summaries = erealloc(priv->summaries, printer_summaries_size(priv->args->windows.n_windows, priv->max_cpu_entries));
+        }
+        priv->n_cpu_entries = shared.n_cpu_entries;
+        memcpy(priv->cpu_names, shared.cpu_names, (size_t)shared.n_cpu_entries * sizeof(shared.cpu_names[0]));
+        memcpy(priv->cpu_usage, shared.cpu_usage, (size_t)shared.n_cpu_entries * sizeof(shared.cpu_usage[0]));
+        priv->has_freq_usage = shared.has_freq_usage;
+        if (shared.has_freq_usage) {
+            memcpy(priv->freq_usage, shared.freq_usage, (size_t)shared.n_cpu_entries * sizeof(shared.freq_usage[0]));
+        }
+        priv->has_summaries = shared.has_summaries;
+        if (shared.has_summaries) {
+            memcpy(priv->summaries, shared.summaries,
+                    (size_t)priv->args->windows.n_windows * (size_t)shared.n_cpu_entries * sizeof(shared.summaries[0]));
+        }
+        priv->has_states = shared.has_states;
+        if (shared.has_states) {
+            cpu_state_breakdown_copy(&priv->states, &shared.states);
+        }
+        priv->has_processes = shared.has_processes;
+        priv->n_processes = shared.n_processes;
+        memcpy(priv->processes, shared.processes, (size_t)shared.n_processes * sizeof(shared.processes[0]));
     }
 
     pthread_cleanup_pop(1);
+
+    return did_retrieve_data;
+}
+
+/*
+ * Sleep until the frame rate limit allows drawing the next frame.
+ */
+static void
+printer_wait_for_next_frame(PrinterPrivateState *priv)
+{
+    if (priv->args->max_frames_per_second <= 0 || priv->next_frame_ns == 0) {
+        return;
+    }
+
+    struct timespec deadline = ns_to_timespec(priv->next_frame_ns);
+    int iret;
+    do {
+        iret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    } while (iret == EINTR);
+    assert(iret == 0);
+}
+
+static void
+printer_print_usage(PrinterPrivateState *priv)
+{
+    /* If stdout isn't a terminal the layout's defaults are used */
+    int terminal_rows = 0;
+    int terminal_cols = 0;
+    struct winsize window_size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window_size) == 0 && window_size.ws_col > 0) {
+        terminal_rows = window_size.ws_row;
+        terminal_cols = window_size.ws_col;
+    }
+
+    LayoutStats stats = {
+        .windows = &priv->args->windows,
+        .summaries = priv->summaries,
+    };
+
+    LayoutProcesses processes = {
+        .n_processes = priv->n_processes,
+        .processes = priv->processes,
+    };
+
+    layout_draw(&priv->screen, priv->args->layout, terminal_rows, terminal_cols,
+            priv->n_cpu_entries, priv->cpu_names, priv->cpu_usage, priv->has_freq_usage ? priv->freq_usage : NULL,
+            priv->has_summaries ? &stats : NULL,
+            priv->has_states ? &priv->states : NULL,
+            priv->has_processes ? &processes : NULL);
+
+    bool bret = screen_flush(&priv->screen, STDOUT_FILENO);
+    if (!bret && !priv->write_failed) {
+        ELOG("Failed to write to the terminal");
+    }
+    priv->write_failed = !bret;
+
+    if (priv->args->max_frames_per_second > 0) {
+        priv->next_frame_ns = clock_now_ns(CLOCK_MONOTONIC) + NSEC_PER_SEC / priv->args->max_frames_per_second;
+    }
 }
 
 static void
@@ -57,11 +192,26 @@ printer_deinit(void *arg)
 
     PrinterPrivateState *priv = arg;
 
+    watchdog_unregister(priv->watchdog);
+    screen_destroy(&priv->screen);
+    free(priv->cpu_names);
+    free(priv->cpu_usage);
+    free(priv->freq_usage);
+    free(priv->summaries);
+    cpu_state_breakdown_free(&priv->states);
+    free(priv->processes);
     free(priv->args);
     free(priv);
 
     free(shared.cpu_names);
     free(shared.cpu_usage);
+    free(shared.freq_usage);
+    free(shared.summaries);
+    cpu_state_breakdown_free(&shared.states);
+    free(shared.processes);
+
+    iret = pthread_cond_destroy(&cond_on_data_submitted);
+    assert(iret == 0);
 
     memset(&shared, 0, sizeof(shared));
 
@@ -86,6 +236,22 @@ printer_init(void *arg)
     shared.max_cpu_entries = max_cpu_entries;
     shared.cpu_names = emalloc((size_t)max_cpu_entries * sizeof(shared.cpu_names[0]));
     shared.cpu_usage = emalloc((size_t)max_cpu_entries * sizeof(shared.cpu_usage[0]));
+    shared.freq_usage = emalloc((size_t)max_cpu_entries * sizeof(shared.freq_usage[0]));
+    shared.n_windows = priv->args->windows.n_windows;
+    shared.summaries = emalloc(printer_summaries_size(shared.n_windows, max_cpu_entries));
+    /* At least one element so that the buffers are never empty */
+    shared.max_processes = priv->args->max_processes;
+    shared.processes = emalloc((size_t)(shared.max_processes > 0 ? shared.max_processes : 1) * sizeof(shared.processes[0]));
+
+    priv->max_cpu_entries = max_cpu_entries;
+    priv->cpu_names = emalloc((size_t)max_cpu_entries * sizeof(priv->cpu_names[0]));
+    priv->cpu_usage = emalloc((size_t)max_cpu_entries * sizeof(priv->cpu_usage[0]));
+    priv->freq_usage = emalloc((size_t)max_cpu_entries * sizeof(priv->freq_usage[0]));
+    priv->summaries = emalloc(printer_summaries_size(priv->args->windows.n_windows, max_cpu_entries));
+    priv->processes = emalloc((size_t)(shared.max_processes > 0 ? shared.max_processes : 1) * sizeof(priv->processes[0]));
+    screen_init(&priv->screen, 0, 0);
+
+    cond_init_monotonic(&cond_on_data_submitted);
 
     shared.printer_initialized = true;
 
@@ -100,11 +266,21 @@ printer_init(void *arg)
 static void
 printer_loop(PrinterPrivateState *priv)
 {
+    if (priv->args->use_watchdog) {
+        priv->watchdog = watchdog_register("Printer");
+    }
+
     while (1) {
-        printer_print_usage();
+        printer_wait_for_next_frame(priv);
+
+        if (printer_retrieve_submitted_data(priv)) {
+            long long render_start_ns = stats_timer_start();
+            printer_print_usage(priv);
+            stats_timer_stop(STATS_TIMER_RENDER, render_start_ns);
+        }
 
         if (priv->args->use_watchdog) {
-            watchdog_signal_active("Printer");
+            watchdog_signal_active(priv->watchdog);
         }
     }
 }
@@ -126,7 +302,8 @@ printer_run(void *arg)
 }
 
 void
-printer_submit_data(int n_cpu_entries, char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries])
+printer_submit_data(int n_cpu_entries, char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage, const RollingStatsSummary *summaries, const CpuStateBreakdown *states)
 {
     int iret = pthread_mutex_lock(&printer_lock);
     assert(iret == 0);
@@ -135,15 +312,51 @@ printer_submit_data(int n_cpu_entries, char cpu_names[n_cpu_entries][PROCSTATCPU
     ensure_initialized(&shared.printer_initialized, &cond_on_printer_initialized, &printer_lock);
 
     if (n_cpu_entries > shared.max_cpu_entries) {
-        ELOG(false, "Exceeded max_cpu_entries");
-    } else {
-        memcpy(shared.cpu_names, cpu_names, (size_t)n_cpu_entries * sizeof(cpu_names[0]));
-        memcpy(shared.cpu_usage, cpu_usage, (size_t)n_cpu_entries * sizeof(cpu_usage[0]));
-        shared.n_cpu_entries = n_cpu_entries;
-        shared.new_data_submitted = true;
-
-        pthread_cond_signal(&cond_on_data_submitted);
+        /* More CPUs came online */
+        shared.max_cpu_entries = n_cpu_entries;
+        shared.cpu_names = erealloc(shared.cpu_names, (size_t)n_cpu_entries * sizeof(shared.cpu_names[0]));
+        shared.cpu_usage = erealloc(shared.cpu_usage, (size_t)n_cpu_entries * sizeof(shared.cpu_usage[0]));
+        shared.freq_usage = erealloc(shared.freq_usage, (size_t)n_cpu_entries * sizeof(shared.freq_usage[0]));
+        shared.summaries = erealloc(shared.summaries, printer_summaries_size(shared.n_windows, n_cpu_entries));
+    }
+
+    memcpy(shared.cpu_names, cpu_names, (size_t)n_cpu_entries * sizeof(cpu_names[0]));
+    memcpy(shared.cpu_usage, cpu_usage, (size_t)n_cpu_entries * sizeof(cpu_usage[0]));
+    shared.has_freq_usage = freq_usage != NULL;
+    if (shared.has_freq_usage) {
+        memcpy(shared.freq_usage, freq_usage, (size_t)n_cpu_entries * sizeof(freq_usage[0]));
     }
+    shared.has_summaries = summaries && shared.n_windows > 0;
+    if (shared.has_summaries) {
+        memcpy(shared.summaries, summaries, (size_t)shared.n_windows * (size_t)n_cpu_entries * sizeof(summaries[0]));
+    }
+    shared.has_states = states != NULL;
+    if (shared.has_states) {
+        cpu_state_breakdown_copy(&shared.states, states);
+    }
+    shared.n_cpu_entries = n_cpu_entries;
+    shared.new_data_submitted = true;
+
+    pthread_cond_signal(&cond_on_data_submitted);
+
+    pthread_cleanup_pop(1);
+}
+
+void
+printer_submit_processes(int n_processes, const ProcessUsage processes[n_processes])
+{
+    int iret = pthread_mutex_lock(&printer_lock);
+    assert(iret == 0);
+    pthread_cleanup_push(cleanup_mutex_unlock, &printer_lock);
+
+    ensure_initialized(&shared.printer_initialized, &cond_on_printer_initialized, &printer_lock);
+
+    shared.n_processes = n_processes < shared.max_processes ? n_processes : shared.max_processes;
+    memcpy(shared.processes, processes, (size_t)shared.n_processes * sizeof(processes[0]));
+    shared.has_processes = true;
+    shared.new_data_submitted = true;
+
+    pthread_cond_signal(&cond_on_data_submitted);
 
     pthread_cleanup_pop(1);
 }
@@ -2,14 +2,48 @@
 #define PRINTER_H
 
 #include "proc_stat_utils.h"
+#include "cpu_states.h"
+#include "layout.h"
+#include "rolling_stats.h"
+#include "process_scanner.h"
+
+#define PRINTER_MIN_FRAMES_PER_SECOND 1
+#define PRINTER_MAX_FRAMES_PER_SECOND 240
+#define PRINTER_DEFAULT_FRAMES_PER_SECOND 30
 
 typedef struct {
+    /* Initial capacity of the buffers, they grow when more CPUs come online */
     int max_cpu_entries;
+    /*
+     * Upper limit on the terminal refresh rate, independent of the sampling rate: data submitted
+     * faster is coalesced and only the newest is shown. 0 means no limit.
+     */
+    int max_frames_per_second;
+    /* Adapted to the terminal size, which is queried for every frame */
+    Layout layout;
+    /* Windows of the rolling statistics submitted along with the usage */
+    RollingStatsWindows windows;
+    /* Maximum number of processes submitted with printer_submit_processes(), 0 if there is no process data */
+    int max_processes;
     bool use_watchdog;
 } PrinterArgs;
 
 void * printer_run(void *arg);
 
-void printer_submit_data(int n_cpu_entries, char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries]);
+/*
+ * Submit the newest usage to be displayed.
+ * freq_usage is the frequency-weighted usage (see cpu_freq_weight_usage()), or NULL if the frequencies are unknown.
+ * summaries holds the rolling statistics of every window in PrinterArgs.windows (window-major,
+ * see rolling_stats_summarize()), or is NULL if there are none.
+ * states is the per-state breakdown of the same entries, or NULL if it isn't calculated.
+ */
+void printer_submit_data(int n_cpu_entries, char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage, const RollingStatsSummary *summaries, const CpuStateBreakdown *states);
+
+/*
+ * Submit the busiest processes, in the order they should be displayed.
+ * At most PrinterArgs.max_processes of them are kept.
+ */
+void printer_submit_processes(int n_processes, const ProcessUsage processes[n_processes]);
 
 #endif /* PRINTER_H */
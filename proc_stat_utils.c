@@ -1,5 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <tgmath.h>
 
 #include "proc_stat_utils.h"
@@ -18,8 +21,7 @@ read_and_parse_proc_stat_file(FILE proc_stat_file[static 1], int max_cpu_entries
         }
 
         if (n_cpu_entries >= max_cpu_entries) {
-            ELOG(true, "Exceeded max_cpu_entries");
-            return -1;
+            return PROC_STAT_TOO_MANY_CPU_ENTRIES;
         }
 
         ProcStatCpuEntry *ce = &cpu_entries[n_cpu_entries];
@@ -29,58 +31,260 @@ read_and_parse_proc_stat_file(FILE proc_stat_file[static 1], int max_cpu_entries
                 ce->cpu_name, &ce->user, &ce->nice, &ce->system, &ce->idle, &ce->iowait,
                 &ce->irq, &ce->softirq, &ce->steal, &ce->guest, &ce->guest_nice);
         if (ret != 11) {
-            ELOG(true, "Parsing CPU entry failed");
+            ELOG("Parsing CPU entry failed");
             return -1;
         }
 
         n_cpu_entries++;
     }
     if (ferror(proc_stat_file)) {
-        ELOG(true, "IO error");
+        ELOG("IO error");
         return -1;
     }
 
     int iret = fseek(proc_stat_file, 0, SEEK_SET);
     if (iret != 0) {
-        ELOG(true, "IO error");
+        ELOG("IO error");
         return -1;
     }
 
     return n_cpu_entries;
 }
 
-bool
-calculate_cpu_usage(int n_cpu_entries, ProcStatCpuEntry previous_stats[n_cpu_entries], ProcStatCpuEntry current_stats[n_cpu_entries], double cpu_usage[n_cpu_entries])
+void
+proc_stat_buffer_free(ProcStatBuffer buffer[static 1])
 {
-    for (int i = 0; i < n_cpu_entries; i++) {
-        ProcStatCpuEntry *prev = &previous_stats[i];
-        ProcStatCpuEntry *curr = &current_stats[i];
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+}
+
+static const char *
+scan_unsigned_long(const char *p, const char *end, unsigned long value[static 1])
+{
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (p == end || (unsigned)(*p - '0') > 9) {
+        return NULL;
+    }
+
+    unsigned long v = 0;
+    do {
+        v = v * 10 + (unsigned long)(*p - '0');
+        p++;
+    } while (p < end && (unsigned)(*p - '0') <= 9);
+
+    *value = v;
+    return p;
+}
+
+/*
+ * Parse a single "cpu..." line (without the trailing newline).
+ */
+static bool
+parse_cpu_line(const char *p, const char *end, ProcStatCpuEntry ce[static 1])
+{
+    const char *name_end = p;
+    while (name_end < end && *name_end != ' ' && *name_end != '\t') {
+        name_end++;
+    }
+    size_t name_length = (size_t)(name_end - p);
+    if (name_length >= sizeof(ce->cpu_name)) {
+        return false;
+    }
+    memcpy(ce->cpu_name, p, name_length);
+    ce->cpu_name[name_length] = '\0';
+
+    unsigned long *fields[PROCSTATCPUENTRY_N_COUNTERS];
+    proc_stat_cpu_entry_counters(ce, fields);
+
+    p = name_end;
+    for (int i = 0; i < PROCSTATCPUENTRY_N_COUNTERS; i++) {
+        p = scan_unsigned_long(p, end, fields[i]);
+        if (!p) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int
+read_and_parse_proc_stat_fd(int proc_stat_fd, ProcStatBuffer buffer[static 1], int max_cpu_entries, ProcStatCpuEntry cpu_entries[max_cpu_entries])
+{
+    if (buffer->size == 0) {
+        buffer->size = 4096;
+        buffer->data = emalloc(buffer->size);
+    }
+
+    while (1) {
+        ssize_t n_read;
+        do {
+            n_read = pread(proc_stat_fd, buffer->data, buffer->size, 0);
+        } while (n_read < 0 && errno == EINTR);
+        if (n_read < 0) {
+            ELOG("IO error");
+            return -1;
+        }
 
         /*
-         * Based on https://stackoverflow.com/a/23376195
+         * If the buffer got filled completely there might be more CPU lines past its end.
+         * In that case the buffer is grown and the file is read again.
          */
-        unsigned long prev_idle = prev->idle + prev->iowait;
-        unsigned long curr_idle = curr->idle + curr->iowait;
+        bool buffer_filled = (size_t)n_read == buffer->size;
+        bool need_more_data = false;
 
-        unsigned long prev_non_idle = prev->user + prev->nice + prev->system + prev->irq + prev->softirq + prev->steal;
-        unsigned long curr_non_idle = curr->user + curr->nice + curr->system + curr->irq + curr->softirq + curr->steal;
+        int n_cpu_entries = 0;
 
-        unsigned long prev_total = prev_idle + prev_non_idle;
-        unsigned long curr_total = curr_idle + curr_non_idle;
+        const char *p = buffer->data;
+        const char *end = p + n_read;
+        while (p < end) {
+            const char *line_end = memchr(p, '\n', (size_t)(end - p));
+            if (!line_end) {
+                /* Once the CPU lines are over, a partial line (i.e. "intr") isn't worth reading whole */
+                size_t partial_length = (size_t)(end - p);
+                bool may_be_cpu_line = memcmp(p, "cpu", partial_length < 3 ? partial_length : 3) == 0;
+                if (buffer_filled && (n_cpu_entries == 0 || may_be_cpu_line)) {
+                    need_more_data = true;
+                    break;
+                }
+                line_end = end;
+            }
 
-        unsigned long total_d = curr_total - prev_total;
-        unsigned long idle_d = curr_idle - prev_idle;
+            if (line_end - p < 3 || memcmp(p, "cpu", 3) != 0) {
+                if (n_cpu_entries > 0) {
+                    /* End of the CPU lines */
+                    break;
+                }
+                p = line_end + 1;
+                continue;
+            }
 
-        if (total_d == 0) {
-            return false;
+            if (n_cpu_entries >= max_cpu_entries) {
+                return PROC_STAT_TOO_MANY_CPU_ENTRIES;
+            }
+
+            if (!parse_cpu_line(p, line_end, &cpu_entries[n_cpu_entries])) {
+                ELOG("Parsing CPU entry failed");
+                return -1;
+            }
+
+            n_cpu_entries++;
+
+            p = line_end + 1;
+        }
+
+        /*
+         * The buffer ended exactly at the end of a line, which was a CPU line (or no CPU line was seen yet):
+         * the next line past the end might be another CPU line.
+         */
+        if (buffer_filled && p == end) {
+            need_more_data = true;
+        }
+
+        if (!need_more_data) {
+            return n_cpu_entries;
         }
 
-        cpu_usage[i] = (double)(total_d - idle_d) / (double)total_d * 100;
+        buffer->size *= 2;
+        buffer->data = erealloc(buffer->data, buffer->size);
+    }
+}
+
+/*
+ * Returns false if no CPU time elapsed between the samples, cpu_usage is then left unchanged.
+ */
+static bool
+calculate_entry_usage(const ProcStatCpuEntry prev[static 1], const ProcStatCpuEntry curr[static 1], double cpu_usage[static 1])
+{
+    /*
+     * Based on https://stackoverflow.com/a/23376195
+     */
+    unsigned long prev_idle = prev->idle + prev->iowait;
+    unsigned long curr_idle = curr->idle + curr->iowait;
+
+    unsigned long prev_non_idle = prev->user + prev->nice + prev->system + prev->irq + prev->softirq + prev->steal;
+    unsigned long curr_non_idle = curr->user + curr->nice + curr->system + curr->irq + curr->softirq + curr->steal;
+
+    unsigned long prev_total = prev_idle + prev_non_idle;
+    unsigned long curr_total = curr_idle + curr_non_idle;
+
+    if (curr_idle < prev_idle || curr_non_idle < prev_non_idle) {
+        /* The counters were reset, there's no meaningful difference */
+        *cpu_usage = 0;
+        return true;
     }
 
+    unsigned long total_d = curr_total - prev_total;
+    unsigned long idle_d = curr_idle - prev_idle;
+
+    if (total_d == 0) {
+        return false;
+    }
+
+    *cpu_usage = (double)(total_d - idle_d) / (double)total_d * 100;
     return true;
 }
 
+bool
+calculate_cpu_usage(int n_cpu_entries, ProcStatCpuEntry previous_stats[n_cpu_entries], ProcStatCpuEntry current_stats[n_cpu_entries], double cpu_usage[n_cpu_entries])
+{
+    bool succ = true;
+
+    for (int i = 0; i < n_cpu_entries; i++) {
+        if (!calculate_entry_usage(&previous_stats[i], &current_stats[i], &cpu_usage[i])) {
+            succ = false;
+        }
+    }
+
+    return succ;
+}
+
+/*
+ * Sort key of an entry: -1 for the CPU average ("cpu"), N for "cpuN".
+ */
+static long
+proc_stat_cpu_id(const char *cpu_name)
+{
+    if (cpu_name[3] == '\0') {
+        return -1;
+    }
+    return strtol(&cpu_name[3], NULL, 10);
+}
+
+bool
+calculate_cpu_usage_by_id(int n_previous_cpu_entries, ProcStatCpuEntry previous_stats[n_previous_cpu_entries],
+        int n_current_cpu_entries, ProcStatCpuEntry current_stats[n_current_cpu_entries], double cpu_usage[n_current_cpu_entries])
+{
+    bool succ = true;
+
+    /* Merge join of the two samples, which usually list the same CPUs so that the names match right away */
+    int j = 0;
+    for (int i = 0; i < n_current_cpu_entries; i++) {
+        ProcStatCpuEntry *curr = &current_stats[i];
+
+        if (j < n_previous_cpu_entries && strcmp(previous_stats[j].cpu_name, curr->cpu_name) != 0) {
+            long id = proc_stat_cpu_id(curr->cpu_name);
+            while (j < n_previous_cpu_entries && proc_stat_cpu_id(previous_stats[j].cpu_name) < id) {
+                j++;
+            }
+        }
+
+        if (j < n_previous_cpu_entries && strcmp(previous_stats[j].cpu_name, curr->cpu_name) == 0) {
+            if (!calculate_entry_usage(&previous_stats[j], curr, &cpu_usage[i])) {
+                succ = false;
+            }
+            j++;
+        } else {
+            /* The CPU just came online */
+            cpu_usage[i] = 0;
+        }
+    }
+
+    return succ;
+}
+
 static void
 print_usage_bar(double percentage)
 {
@@ -20,6 +20,37 @@ typedef struct {
     unsigned long guest_nice;
 } ProcStatCpuEntry;
 
+#define PROCSTATCPUENTRY_N_COUNTERS 10
+
+/*
+ * Upper bound on the number of entries /proc/stat can contain: Linux supports at most 8192 CPUs,
+ * plus one entry for the CPU average.
+ */
+#define PROC_STAT_MAX_CPU_ENTRIES (8192 + 1)
+
+/*
+ * Returned by the parsing functions below if cpu_entries is too small for the file.
+ */
+#define PROC_STAT_TOO_MANY_CPU_ENTRIES (-2)
+
+/*
+ * Get pointers to the counters of an entry, in the order in which they appear in /proc/stat.
+ */
+static inline void
+proc_stat_cpu_entry_counters(ProcStatCpuEntry ce[static 1], unsigned long *counters[static PROCSTATCPUENTRY_N_COUNTERS])
+{
+    counters[0] = &ce->user;
+    counters[1] = &ce->nice;
+    counters[2] = &ce->system;
+    counters[3] = &ce->idle;
+    counters[4] = &ce->iowait;
+    counters[5] = &ce->irq;
+    counters[6] = &ce->softirq;
+    counters[7] = &ce->steal;
+    counters[8] = &ce->guest;
+    counters[9] = &ce->guest_nice;
+}
+
 /*
  * Read and parse the contents of the /proc/stat file, and save CPU time stats to cpu_entries.
  * The first entry is the CPU average, the subsequent entries are for each CPU core/thread.
@@ -34,26 +65,66 @@ typedef struct {
  *      Array of size at least max_cpu_entries for storing the results.
  *
  * Returns
- *  On success: the total number of entries parsed (should be equal to the number of cores/threads + 1).
- *  On failure: -1.
+ *  On success: the total number of entries parsed (equal to the number of online cores/threads + 1).
+ *  If max_cpu_entries is lower than the number of entries that happen to appear in the file:
+ *  PROC_STAT_TOO_MANY_CPU_ENTRIES. The caller can retry with a larger array, CPUs might have been
+ *  brought online.
+ *  On other failures: -1.
  *
- * Will fail if max_cpu_entries is lower than the number of entries that happen to appear in the file.
  * cpu_entries might be modified even if the function fails.
  *
  * A successful call sets the position indicator of proc_stat_file to the beginning.
  */
 int read_and_parse_proc_stat_file(FILE proc_stat_file[static 1], int max_cpu_entries, ProcStatCpuEntry cpu_entries[max_cpu_entries]);
 
+/*
+ * Reusable read buffer for read_and_parse_proc_stat_fd().
+ * Zero-initialize before first use and release with proc_stat_buffer_free().
+ * The buffer grows on demand until it can hold all the CPU lines of the file.
+ */
+typedef struct {
+    char *data;
+    size_t size;
+} ProcStatBuffer;
+
+void proc_stat_buffer_free(ProcStatBuffer buffer[static 1]);
+
+/*
+ * Faster equivalent of read_and_parse_proc_stat_file() operating on a raw file descriptor.
+ *
+ * The file is read from offset 0 with pread() into buffer, so no seeking is necessary and
+ * the descriptor can be reused for subsequent calls.
+ * Only as much of the file as is needed to cover the CPU lines is read: parsing stops at the first
+ * non-CPU line following the CPU lines (the long "intr" line is never copied or scanned).
+ *
+ * Params and return value are the same as for read_and_parse_proc_stat_file().
+ */
+int read_and_parse_proc_stat_fd(int proc_stat_fd, ProcStatBuffer buffer[static 1], int max_cpu_entries, ProcStatCpuEntry cpu_entries[max_cpu_entries]);
+
 /*
  * Calculate CPU usage based on the previous and current CPU time stats.
  * The results are saved to cpu_usage.
  *
  * Returns true on success and false on failure.
  *
- * Might fail if the CPU entries are filled with invalid data, such that the calculations would result in an arithmetic exception.
+ * Fails if no CPU time elapsed between the samples for some entry, which can happen when sampling
+ * faster than the kernel's clock tick. The usage of such entries is left unchanged in cpu_usage,
+ * all other entries are still calculated.
  */
 bool calculate_cpu_usage(int n_cpu_entries, ProcStatCpuEntry previous_stats[n_cpu_entries], ProcStatCpuEntry current_stats[n_cpu_entries], double cpu_usage[n_cpu_entries]);
 
+/*
+ * Same as calculate_cpu_usage(), except that entries are paired by CPU name instead of position,
+ * so the two samples may contain different sets of CPUs (CPUs brought online or offline in between,
+ * sparse CPU ids such as cpu0, cpu2, cpu7). cpu_usage is indexed like current_stats.
+ *
+ * Both samples must list the CPUs in ascending order, as /proc/stat does.
+ * An entry without a counterpart in previous_stats (its CPU just came online) gets a usage of 0,
+ * and so does an entry whose counters went backwards (they were reset while the CPU was offline).
+ */
+bool calculate_cpu_usage_by_id(int n_previous_cpu_entries, ProcStatCpuEntry previous_stats[n_previous_cpu_entries],
+        int n_current_cpu_entries, ProcStatCpuEntry current_stats[n_current_cpu_entries], double cpu_usage[n_current_cpu_entries]);
+
 /*
  * Print CPU usage stored in the cpu_usage array.
  * If n_cpu_entries is less than 2 the function doesn't do anything.
@@ -0,0 +1,132 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include "process_reader.h"
+#include "printer.h"
+#include "utils.h"
+#include "process_scanner.h"
+#include "thread_utils.h"
+#include "logger.h"
+#include "watchdog.h"
+#include "stats.h"
+
+typedef struct {
+    ProcessReaderArgs *args;
+    ProcessScanner *scanner;
+    ProcessUsage *top;
+    long long next_deadline_ns;
+    bool scan_failed;
+    WatchdogHandle *watchdog;
+} ProcessReaderPrivateState;
+
+static void
+process_reader_deinit(void *arg)
+{
+    ProcessReaderPrivateState *priv = arg;
+
+    process_scanner_close(priv->scanner);
+    watchdog_unregister(priv->watchdog);
+    free(priv->top);
+    free(priv->args);
+    free(priv);
+}
+
+static ProcessReaderPrivateState *
+process_reader_init(void *arg)
+{
+    ProcessReaderPrivateState *priv = ecalloc(1, sizeof(*priv));
+
+    priv->args = arg;
+
+    int n_top = priv->args->n_top_processes;
+    assert(n_top >= PROCESS_READER_MIN_TOP_PROCESSES && n_top <= PROCESS_READER_MAX_TOP_PROCESSES);
+    priv->top = emalloc((size_t)n_top * sizeof(priv->top[0]));
+
+    ProcessScannerOptions options = {
+        .threads = priv->args->threads,
+        .n_workers = priv->args->n_workers,
+        .max_open_fds = process_scanner_raise_fd_limit(),
+        .use_watchdog = priv->args->use_watchdog,
+    };
+    priv->scanner = process_scanner_open("/proc", &options);
+    if (!priv->scanner) {
+        ELOG("Failed to open /proc");
+        process_reader_deinit(priv);
+        pthread_exit(NULL);
+    }
+
+    return priv;
+}
+
+/*
+ * Same drift-free schedule as the Reader, missed deadlines are skipped.
+ */
+static void
+process_reader_sleep_until_next_deadline(ProcessReaderPrivateState *priv)
+{
+    long long interval_ns = (long long)priv->args->sampling_interval_ms * 1000 * 1000;
+    long long now_ns = clock_now_ns(CLOCK_MONOTONIC);
+
+    if (priv->next_deadline_ns == 0) {
+        priv->next_deadline_ns = now_ns;
+    }
+    priv->next_deadline_ns += interval_ns;
+    if (now_ns >= priv->next_deadline_ns) {
+        priv->next_deadline_ns += ((now_ns - priv->next_deadline_ns) / interval_ns + 1) * interval_ns;
+    }
+
+    struct timespec deadline = ns_to_timespec(priv->next_deadline_ns);
+    int iret;
+    do {
+        iret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    } while (iret == EINTR);
+    assert(iret == 0);
+}
+
+static void
+process_reader_loop(ProcessReaderPrivateState *priv)
+{
+    if (priv->args->use_watchdog) {
+        priv->watchdog = watchdog_register("ProcessReader");
+    }
+
+    while (1) {
+        long long scan_start_ns = stats_timer_start();
+        int n_top = process_scanner_scan(priv->scanner, scan_start_ns, priv->args->n_top_processes, priv->top);
+        stats_timer_stop(STATS_TIMER_PROCESS_SCAN, scan_start_ns);
+        if (n_top >= 0) {
+            printer_submit_processes(n_top, priv->top);
+        } else if (!priv->scan_failed) {
+            ELOG("Failed to scan /proc, skipping samples until it succeeds");
+        }
+        priv->scan_failed = n_top < 0;
+
+        if (priv->args->use_watchdog) {
+            watchdog_signal_active(priv->watchdog);
+        }
+
+        process_reader_sleep_until_next_deadline(priv);
+    }
+}
+
+void *
+process_reader_run(void *arg)
+{
+    assert(arg);
+
+    ProcessReaderPrivateState *priv = process_reader_init(arg);
+
+    pthread_cleanup_push(process_reader_deinit, priv);
+
+    process_reader_loop(priv);
+
+    pthread_cleanup_pop(1);
+
+    pthread_exit(NULL);
+}
@@ -0,0 +1,30 @@
+#ifndef PROCESS_READER_H
+#define PROCESS_READER_H
+
+#include <stdbool.h>
+
+#define PROCESS_READER_MIN_TOP_PROCESSES 1
+#define PROCESS_READER_MAX_TOP_PROCESSES 1000
+#define PROCESS_READER_DEFAULT_TOP_PROCESSES 20
+/* Without --workers, one worker per online CPU up to this many */
+#define PROCESS_READER_DEFAULT_MAX_WORKERS 8
+
+typedef struct {
+    /* Must be within [READER_MIN_SAMPLING_INTERVAL_MS, READER_MAX_SAMPLING_INTERVAL_MS] */
+    int sampling_interval_ms;
+    /* Number of busiest processes (threads) submitted to the Printer */
+    int n_top_processes;
+    /* Scan the threads of every process instead of the processes */
+    bool threads;
+    /* Within [1, PROCESS_SCANNER_MAX_WORKERS] */
+    int n_workers;
+    bool use_watchdog;
+} ProcessReaderArgs;
+
+/*
+ * Thread that scans /proc/[pid] (or /proc/[pid]/task/[tid]) on the sampling schedule with its
+ * workers and submits the busiest processes (threads) to the Printer (see process_scanner.h).
+ */
+void * process_reader_run(void *arg);
+
+#endif /* PROCESS_READER_H */
@@ -0,0 +1,935 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/resource.h>
+
+#include "process_scanner.h"
+#include "utils.h"
+#include "thread_utils.h"
+#include "watchdog.h"
+
+/* Large enough for any /proc/[pid]/stat line */
+#define PROCESS_SCANNER_BUFFER_SIZE 4096
+/* Descriptors left for the rest of the program by process_scanner_raise_fd_limit() */
+#define PROCESS_SCANNER_RESERVED_FDS 256
+/* Upper limit on the descriptor limit requested from the kernel */
+#define PROCESS_SCANNER_MAX_FDS (1024 * 1024)
+/* log2 of the initial size of the hash tables */
+#define PROCESS_SCANNER_MIN_TABLE_BITS 8
+/* Idle workers report to the Watchdog at least this often */
+#define PROCESS_SCANNER_WORKER_IDLE_SECONDS 1.0
+
+typedef struct {
+    int pid;
+    /* Equal to pid when scanning processes */
+    int tid;
+} ProcessTask;
+
+typedef struct {
+    /* 0 if the slot is empty */
+    int tid;
+    int pid;
+    /* Descriptor of the CPU time file if it is kept open, -1 otherwise */
+    int fd;
+    /* Last scan that saw the task */
+    unsigned generation;
+    bool has_cpu_time;
+    unsigned long long cpu_time_ns;
+    char comm[PROCESS_COMM_SIZE];
+} TaskEntry;
+
+/*
+ * Everything a worker writes during a scan. Shard i lists the tasks of the processes with
+ * pid % n_workers == i, and samples the tasks with tid % n_workers == i out of all the listings.
+ */
+typedef struct {
+    ProcessScanner *scanner;
+    int index;
+    char name[32];
+    pthread_t thread;
+    bool thread_started;
+    WatchdogHandle *watchdog;
+    sem_t sem_start;
+    int max_open_fds;
+    int n_open_fds;
+    /*
+     * Set when scanning processes, whose schedstat only covers their main thread, or once it turns out
+     * that the kernel has no schedstat files
+     */
+    bool use_stat;
+    /* Open addressing with linear probing keyed by tid, 1 << table_bits slots, at most half of them used */
+    TaskEntry *table;
+    int table_bits;
+    int n_entries;
+    unsigned generation;
+    /*
+     * Tasks in the order of the last listing (increasing pids), which is also the order in which
+     * the kernel reads their files fastest
+     */
+    ProcessTask *listed_tasks;
+    int n_listed_tasks;
+    int max_listed_tasks;
+    /* Min-heap of the busiest tasks during the scan, sorted busiest first after it */
+    ProcessUsage *top;
+    int max_top;
+    int n_top;
+    int n_tasks;
+    char buffer[PROCESS_SCANNER_BUFFER_SIZE];
+} ProcessScannerShard;
+
+struct ProcessScanner {
+    ProcessScannerOptions options;
+    DIR *proc_dir;
+    int proc_fd;
+    /* -1 if there is no loadavg file, the directory is then listed on every scan */
+    int loadavg_fd;
+    int last_pid;
+    long long ns_per_tick;
+    /* Pids of the last listing of the directory */
+    int *pids;
+    int n_pids;
+    int max_pids;
+    bool scanned;
+    long long previous_timestamp_ns;
+    /* The scan in progress, read-only for the workers */
+    bool list_tasks;
+    long long elapsed_ns;
+    int k;
+    /* Workers that are done listing, the last one releases the others through sem_listed */
+    unsigned n_listed_shards;
+    sem_t sem_listed;
+    sem_t sem_done;
+    int n_tasks;
+    ProcessScannerShard *shards;
+    char buffer[256];
+};
+
+static size_t
+process_scanner_slot(const ProcessScannerShard *shard, int tid)
+{
+    /* Fibonacci hashing, consecutive tids end up far apart */
+    return (size_t)(((uint32_t)tid * 2654435769u) >> (32 - shard->table_bits));
+}
+
+static void
+process_scanner_grow_table(ProcessScannerShard *shard)
+{
+    TaskEntry *old_table = shard->table;
+    size_t old_size = (size_t)1 << shard->table_bits;
+
+    shard->table_bits++;
+    size_t mask = ((size_t)1 << shard->table_bits) - 1;
+    shard->table = ecalloc(mask + 1, sizeof(shard->table[0]));
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_table[i].tid == 0) {
+            continue;
+        }
+        size_t slot = process_scanner_slot(shard, old_table[i].tid);
+        while (shard->table[slot].tid != 0) {
+            slot = (slot + 1) & mask;
+        }
+        shard->table[slot] = old_table[i];
+    }
+
+    free(old_table);
+}
+
+static void
+process_scanner_close_entry_fd(ProcessScannerShard *shard, TaskEntry *entry)
+{
+    if (entry->fd >= 0) {
+        close(entry->fd);
+        entry->fd = -1;
+        shard->n_open_fds--;
+    }
+}
+
+static TaskEntry *
+process_scanner_find(ProcessScannerShard *shard, int tid)
+{
+    size_t mask = ((size_t)1 << shard->table_bits) - 1;
+    for (size_t slot = process_scanner_slot(shard, tid); shard->table[slot].tid != 0; slot = (slot + 1) & mask) {
+        if (shard->table[slot].tid == tid) {
+            return &shard->table[slot];
+        }
+    }
+    return NULL;
+}
+
+static TaskEntry *
+process_scanner_find_or_insert(ProcessScannerShard *shard, const ProcessTask *task)
+{
+    if ((size_t)(shard->n_entries + 1) * 2 > (size_t)1 << shard->table_bits) {
+        process_scanner_grow_table(shard);
+    }
+
+    size_t mask = ((size_t)1 << shard->table_bits) - 1;
+    size_t slot = process_scanner_slot(shard, task->tid);
+    while (shard->table[slot].tid != 0) {
+        TaskEntry *entry = &shard->table[slot];
+        if (entry->tid == task->tid) {
+            if (entry->pid != task->pid) {
+                /* The tid was reused by a thread of another process */
+                process_scanner_close_entry_fd(shard, entry);
+                entry->pid = task->pid;
+                entry->has_cpu_time = false;
+                entry->comm[0] = '\0';
+            }
+            return entry;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    TaskEntry *entry = &shard->table[slot];
+    memset(entry, 0, sizeof(*entry));
+    entry->tid = task->tid;
+    entry->pid = task->pid;
+    entry->fd = -1;
+    shard->n_entries++;
+    return entry;
+}
+
+/*
+ * Empty a slot, moving the entries that follow it back so that every entry stays reachable
+ * from its home slot without tombstones.
+ */
+static void
+process_scanner_remove_slot(ProcessScannerShard *shard, size_t hole)
+{
+    size_t mask = ((size_t)1 << shard->table_bits) - 1;
+    TaskEntry *table = shard->table;
+
+    for (size_t i = (hole + 1) & mask; table[i].tid != 0; i = (i + 1) & mask) {
+        size_t home = process_scanner_slot(shard, table[i].tid);
+        /* The entry can fill the hole if the hole lies between its home slot and its slot */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table[hole] = table[i];
+            hole = i;
+        }
+    }
+
+    table[hole].tid = 0;
+    shard->n_entries--;
+}
+
+/*
+ * Forget the tasks that the last scan didn't see.
+ */
+static void
+process_scanner_remove_exited(ProcessScannerShard *shard)
+{
+    size_t size = (size_t)1 << shard->table_bits;
+
+    size_t i = 0;
+    while (i < size) {
+        TaskEntry *entry = &shard->table[i];
+        if (entry->tid != 0 && entry->generation != shard->generation) {
+            process_scanner_close_entry_fd(shard, entry);
+            /* Another entry may have moved into the slot, look at it again */
+            process_scanner_remove_slot(shard, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+/*
+ * Returns the pid named by a /proc (or /proc/[pid]/task) directory entry, or -1 if it isn't a
+ * process (or thread) directory.
+ */
+static int
+process_scanner_parse_pid(const char *name)
+{
+    if (*name == '\0') {
+        return -1;
+    }
+
+    int pid = 0;
+    for (const char *p = name; *p; p++) {
+        if (*p < '0' || *p > '9' || pid > (INT_MAX - 9) / 10) {
+            return -1;
+        }
+        pid = pid * 10 + (*p - '0');
+    }
+    return pid;
+}
+
+static int
+process_scanner_open_file(ProcessScannerShard *shard, const TaskEntry *entry, const char *name)
+{
+    char path[64];
+    if (shard->scanner->options.threads) {
+        snprintf(path, sizeof(path), "%d/task/%d/%s", entry->pid, entry->tid, name);
+    } else {
+        snprintf(path, sizeof(path), "%d/%s", entry->pid, name);
+    }
+    return openat(shard->scanner->proc_fd, path, O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * Read a whole (small) file into the buffer and null-terminate it.
+ * Returns the number of bytes read, 0 or -1 if the task exited.
+ */
+static ssize_t
+process_scanner_read_fd(int fd, size_t size, char buffer[size])
+{
+    ssize_t n;
+    do {
+        n = pread(fd, buffer, size - 1, 0);
+    } while (n < 0 && errno == EINTR);
+
+    buffer[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+/*
+ * Read the CPU time file of a task into the buffer, through the descriptor kept open if there is one.
+ * Returns false if the task exited.
+ */
+static bool
+process_scanner_read_cpu_time_file(ProcessScannerShard *shard, TaskEntry *entry)
+{
+    if (entry->fd >= 0) {
+        if (process_scanner_read_fd(entry->fd, sizeof(shard->buffer), shard->buffer) > 0) {
+            return true;
+        }
+        /* The task exited (ESRCH); since its tid is listed again it now belongs to a new task */
+        process_scanner_close_entry_fd(shard, entry);
+        entry->has_cpu_time = false;
+        entry->comm[0] = '\0';
+    }
+
+    int fd;
+    if (!shard->use_stat) {
+        fd = process_scanner_open_file(shard, entry, "schedstat");
+        if (fd < 0 && errno == ENOENT) {
+            /* Either the task just exited, or schedstat isn't supported if its stat file exists */
+            fd = process_scanner_open_file(shard, entry, "stat");
+            shard->use_stat = fd >= 0;
+        }
+    } else {
+        fd = process_scanner_open_file(shard, entry, "stat");
+    }
+    if (fd < 0) {
+        return false;
+    }
+
+    bool bret = process_scanner_read_fd(fd, sizeof(shard->buffer), shard->buffer) > 0;
+    if (bret && shard->n_open_fds < shard->max_open_fds) {
+        entry->fd = fd;
+        shard->n_open_fds++;
+    } else {
+        close(fd);
+    }
+    return bret;
+}
+
+/*
+ * Processes choose their own names, anything but printable ASCII is replaced so that
+ * it can't reach the terminal.
+ */
+static void
+process_scanner_copy_comm(TaskEntry *entry, const char *comm, size_t length)
+{
+    if (length >= PROCESS_COMM_SIZE) {
+        length = PROCESS_COMM_SIZE - 1;
+    }
+    for (size_t i = 0; i < length; i++) {
+        entry->comm[i] = comm[i] >= ' ' && comm[i] <= '~' ? comm[i] : '?';
+    }
+    entry->comm[length] = '\0';
+}
+
+/*
+ * /proc/[pid]/schedstat: time spent on the CPU (ns), time spent waiting on a runqueue (ns), number of timeslices
+ */
+static bool
+process_scanner_parse_schedstat(ProcessScannerShard *shard, unsigned long long cpu_time_ns[static 1])
+{
+    char *end;
+    errno = 0;
+    *cpu_time_ns = strtoull(shard->buffer, &end, 10);
+    return end != shard->buffer && errno == 0;
+}
+
+/*
+ * /proc/[pid]/stat: "pid (comm) state ppid ...", utime and stime in clock ticks are the 12th and 13th
+ * fields after the command name.
+ */
+static bool
+process_scanner_parse_stat(ProcessScannerShard *shard, TaskEntry *entry, unsigned long long cpu_time_ns[static 1])
+{
+    /* The command name can contain anything, including spaces and parentheses */
+    char *comm_start = strchr(shard->buffer, '(');
+    char *comm_end = strrchr(shard->buffer, ')');
+    if (!comm_start || !comm_end || comm_end < comm_start) {
+        return false;
+    }
+
+    process_scanner_copy_comm(entry, comm_start + 1, (size_t)(comm_end - comm_start - 1));
+
+    const char *p = comm_end + 1;
+    for (int field = 1; field < 12; field++) {
+        p = strchr(p + 1, ' ');
+        if (!p) {
+            return false;
+        }
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long long utime = strtoull(p, &end, 10);
+    if (end == p || errno != 0) {
+        return false;
+    }
+    p = end;
+    unsigned long long stime = strtoull(p, &end, 10);
+    if (end == p || errno != 0) {
+        return false;
+    }
+
+    *cpu_time_ns = (utime + stime) * (unsigned long long)shard->scanner->ns_per_tick;
+    return true;
+}
+
+static void
+process_scanner_read_comm(ProcessScannerShard *shard, TaskEntry *entry)
+{
+    entry->comm[0] = '\0';
+
+    int fd = process_scanner_open_file(shard, entry, "comm");
+    if (fd < 0) {
+        return;
+    }
+    ssize_t n = process_scanner_read_fd(fd, sizeof(shard->buffer), shard->buffer);
+    close(fd);
+    if (n <= 0) {
+        return;
+    }
+
+    process_scanner_copy_comm(entry, shard->buffer, strcspn(shard->buffer, "\n"));
+}
+
+/*
+ * Order of the top tasks: by usage, then by tid so that the order is stable.
+ */
+static bool
+process_usage_less(const ProcessUsage *a, const ProcessUsage *b)
+{
+    return a->cpu_usage < b->cpu_usage || (a->cpu_usage == b->cpu_usage && a->tid > b->tid);
+}
+
+static void
+process_usage_swap(ProcessUsage *a, ProcessUsage *b)
+{
+    ProcessUsage tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void
+process_top_sift_up(ProcessUsage *heap, int k)
+{
+    while (k > 0) {
+        int parent = (k - 1) / 2;
+        if (!process_usage_less(&heap[k], &heap[parent])) {
+            break;
+        }
+        process_usage_swap(&heap[k], &heap[parent]);
+        k = parent;
+    }
+}
+
+static void
+process_top_sift_down(ProcessUsage *heap, int n, int k)
+{
+    while (1) {
+        int smallest = k;
+        int left = 2 * k + 1;
+        int right = left + 1;
+        if (left < n && process_usage_less(&heap[left], &heap[smallest])) {
+            smallest = left;
+        }
+        if (right < n && process_usage_less(&heap[right], &heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == k) {
+            return;
+        }
+        process_usage_swap(&heap[k], &heap[smallest]);
+        k = smallest;
+    }
+}
+
+int
+process_scanner_raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return 0;
+    }
+
+    rlim_t wanted = limit.rlim_max == RLIM_INFINITY || limit.rlim_max > PROCESS_SCANNER_MAX_FDS
+        ? PROCESS_SCANNER_MAX_FDS : limit.rlim_max;
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > wanted) {
+        limit.rlim_cur = wanted;
+    } else if (limit.rlim_cur < wanted) {
+        struct rlimit raised = { wanted, limit.rlim_max };
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+            limit.rlim_cur = wanted;
+        }
+    }
+
+    return limit.rlim_cur > PROCESS_SCANNER_RESERVED_FDS ? (int)(limit.rlim_cur - PROCESS_SCANNER_RESERVED_FDS) : 0;
+}
+
+static void
+process_scanner_add_listed_task(ProcessScannerShard *shard, int pid, int tid)
+{
+    if (shard->n_listed_tasks == shard->max_listed_tasks) {
+        shard->max_listed_tasks = shard->max_listed_tasks ? 2 * shard->max_listed_tasks : 1024;
+        shard->listed_tasks = erealloc(shard->listed_tasks, (size_t)shard->max_listed_tasks * sizeof(shard->listed_tasks[0]));
+    }
+    shard->listed_tasks[shard->n_listed_tasks++] = (ProcessTask){ .pid = pid, .tid = tid };
+}
+
+/*
+ * List the tasks of the processes of the shard, from /proc/[pid]/task when scanning threads.
+ * Processes that exited since the directory was listed are skipped.
+ */
+static void
+process_scanner_list_tasks(ProcessScannerShard *shard)
+{
+    ProcessScanner *scanner = shard->scanner;
+    int n_workers = scanner->options.n_workers;
+
+    shard->n_listed_tasks = 0;
+    for (int i = 0; i < scanner->n_pids; i++) {
+        int pid = scanner->pids[i];
+        if (pid % n_workers != shard->index) {
+            continue;
+        }
+        if (!scanner->options.threads) {
+            process_scanner_add_listed_task(shard, pid, pid);
+            continue;
+        }
+
+        char path[32];
+        snprintf(path, sizeof(path), "%d/task", pid);
+        int fd = openat(scanner->proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        DIR *dir = fdopendir(fd);
+        if (!dir) {
+            close(fd);
+            continue;
+        }
+        struct dirent *dirent;
+        while ((dirent = readdir(dir))) {
+            int tid = process_scanner_parse_pid(dirent->d_name);
+            if (tid > 0) {
+                process_scanner_add_listed_task(shard, pid, tid);
+            }
+        }
+        /* Also closes fd */
+        closedir(dir);
+    }
+}
+
+/*
+ * Read the CPU time of a task and add it to the min-heap of the busiest tasks of the shard.
+ * The entry is marked as seen unless the task exited.
+ */
+static void
+process_scanner_sample(ProcessScannerShard *shard, TaskEntry *entry)
+{
+    if (!process_scanner_read_cpu_time_file(shard, entry)) {
+        return;
+    }
+
+    unsigned long long cpu_time_ns;
+    if (shard->use_stat) {
+        if (!process_scanner_parse_stat(shard, entry, &cpu_time_ns)) {
+            return;
+        }
+    } else {
+        if (!process_scanner_parse_schedstat(shard, &cpu_time_ns)) {
+            return;
+        }
+        /* A decreasing CPU time means that the tid was reused by a new task */
+        if (entry->comm[0] == '\0' || (entry->has_cpu_time && cpu_time_ns < entry->cpu_time_ns)) {
+            process_scanner_read_comm(shard, entry);
+        }
+    }
+
+    entry->generation = shard->generation;
+    shard->n_tasks++;
+
+    long long elapsed_ns = shard->scanner->elapsed_ns;
+    int k = shard->scanner->k;
+    if (entry->has_cpu_time && cpu_time_ns >= entry->cpu_time_ns && elapsed_ns > 0 && k > 0) {
+        ProcessUsage usage = {
+            .pid = entry->pid,
+            .tid = entry->tid,
+            .cpu_usage = 100.0 * (double)(cpu_time_ns - entry->cpu_time_ns) / (double)elapsed_ns,
+        };
+        memcpy(usage.comm, entry->comm, sizeof(usage.comm));
+
+        if (shard->n_top < k) {
+            shard->top[shard->n_top++] = usage;
+            process_top_sift_up(shard->top, shard->n_top - 1);
+        } else if (process_usage_less(&shard->top[0], &usage)) {
+            shard->top[0] = usage;
+            process_top_sift_down(shard->top, shard->n_top, 0);
+        }
+    }
+
+    entry->has_cpu_time = true;
+    entry->cpu_time_ns = cpu_time_ns;
+}
+
+static void
+process_scanner_sample_tasks(ProcessScannerShard *shard)
+{
+    ProcessScanner *scanner = shard->scanner;
+    int n_workers = scanner->options.n_workers;
+
+    shard->generation++;
+    shard->n_tasks = 0;
+    shard->n_top = 0;
+
+    /*
+     * The tasks of a process are spread over all the shards, so that a process with thousands
+     * of threads is sampled by all the workers
+     */
+    for (int s = 0; s < n_workers; s++) {
+        const ProcessScannerShard *listing = &scanner->shards[s];
+        for (int i = 0; i < listing->n_listed_tasks; i++) {
+            const ProcessTask *task = &listing->listed_tasks[i];
+            if (task->tid % n_workers != shard->index) {
+                continue;
+            }
+            /* Tasks that exited since the listing are no longer in the table */
+            TaskEntry *entry = scanner->list_tasks ? process_scanner_find_or_insert(shard, task) : process_scanner_find(shard, task->tid);
+            if (entry) {
+                process_scanner_sample(shard, entry);
+            }
+        }
+    }
+
+    /* The entries that weren't marked as seen belong to tasks that exited */
+    process_scanner_remove_exited(shard);
+
+    /* Heapsort, busiest first */
+    for (int n = shard->n_top - 1; n > 0; n--) {
+        process_usage_swap(&shard->top[0], &shard->top[n]);
+        process_top_sift_down(shard->top, n, 0);
+    }
+}
+
+static void
+process_scanner_sem_wait(sem_t *sem)
+{
+    while (sem_wait(sem) != 0) {
+        assert(errno == EINTR);
+    }
+}
+
+static void
+process_scanner_scan_shard(ProcessScannerShard *shard)
+{
+    ProcessScanner *scanner = shard->scanner;
+    int n_workers = scanner->options.n_workers;
+
+    if (scanner->list_tasks) {
+        process_scanner_list_tasks(shard);
+
+        /* Every shard samples tasks out of every listing, wait until all of them are complete */
+        if (n_workers > 1) {
+            if (__atomic_add_fetch(&scanner->n_listed_shards, 1, __ATOMIC_ACQ_REL) == (unsigned)n_workers) {
+                for (int i = 0; i < n_workers - 1; i++) {
+                    sem_post(&scanner->sem_listed);
+                }
+            } else {
+                process_scanner_sem_wait(&scanner->sem_listed);
+            }
+        }
+    }
+
+    process_scanner_sample_tasks(shard);
+}
+
+static void
+process_scanner_worker_deinit(void *arg)
+{
+    ProcessScannerShard *shard = arg;
+
+    watchdog_unregister(shard->watchdog);
+    shard->watchdog = NULL;
+}
+
+static void *
+process_scanner_worker_run(void *arg)
+{
+    ProcessScannerShard *shard = arg;
+
+    pthread_cleanup_push(process_scanner_worker_deinit, shard);
+
+    if (shard->scanner->options.use_watchdog) {
+        shard->watchdog = watchdog_register(shard->name);
+    }
+
+    while (1) {
+        bool started = sem_wait_seconds(&shard->sem_start, PROCESS_SCANNER_WORKER_IDLE_SECONDS);
+        if (started) {
+            process_scanner_scan_shard(shard);
+        }
+
+        if (shard->scanner->options.use_watchdog) {
+            watchdog_signal_active(shard->watchdog);
+        }
+
+        if (started) {
+            sem_post(&shard->scanner->sem_done);
+        }
+    }
+
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+ProcessScanner *
+process_scanner_open(const char *proc_path, const ProcessScannerOptions options[static 1])
+{
+    assert(options->n_workers >= 1 && options->n_workers <= PROCESS_SCANNER_MAX_WORKERS);
+
+    int fd = open(proc_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return NULL;
+    }
+
+    ProcessScanner *scanner = ecalloc(1, sizeof(*scanner));
+    scanner->options = *options;
+    scanner->proc_dir = dir;
+    scanner->proc_fd = fd;
+    scanner->loadavg_fd = openat(fd, "loadavg", O_RDONLY | O_CLOEXEC);
+
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+    scanner->ns_per_tick = 1000LL * 1000 * 1000 / (ticks_per_second > 0 ? ticks_per_second : 100);
+
+    int iret = sem_init(&scanner->sem_listed, 0, 0);
+    assert(iret == 0);
+    iret = sem_init(&scanner->sem_done, 0, 0);
+    assert(iret == 0);
+
+    int n_workers = options->n_workers;
+    int max_open_fds = options->max_open_fds > 0 ? options->max_open_fds : 0;
+    scanner->shards = ecalloc((size_t)n_workers, sizeof(scanner->shards[0]));
+    for (int i = 0; i < n_workers; i++) {
+        ProcessScannerShard *shard = &scanner->shards[i];
+        shard->scanner = scanner;
+        shard->index = i;
+        snprintf(shard->name, sizeof(shard->name), "ScanWorker%d", i);
+        shard->max_open_fds = max_open_fds / n_workers;
+        shard->use_stat = !options->threads;
+        shard->table_bits = PROCESS_SCANNER_MIN_TABLE_BITS;
+        shard->table = ecalloc((size_t)1 << shard->table_bits, sizeof(shard->table[0]));
+        iret = sem_init(&shard->sem_start, 0, 0);
+        assert(iret == 0);
+    }
+
+    /* A single shard is scanned by the calling thread */
+    for (int i = 0; i < n_workers && n_workers > 1; i++) {
+        ProcessScannerShard *shard = &scanner->shards[i];
+        if (pthread_create(&shard->thread, NULL, process_scanner_worker_run, shard) != 0) {
+            process_scanner_close(scanner);
+            return NULL;
+        }
+        shard->thread_started = true;
+    }
+
+    return scanner;
+}
+
+void
+process_scanner_close(ProcessScanner *scanner)
+{
+    if (!scanner) {
+        return;
+    }
+
+    for (int i = 0; i < scanner->options.n_workers; i++) {
+        ProcessScannerShard *shard = &scanner->shards[i];
+        if (shard->thread_started) {
+            pthread_cancel(shard->thread);
+            pthread_join(shard->thread, NULL);
+        }
+    }
+
+    for (int i = 0; i < scanner->options.n_workers; i++) {
+        ProcessScannerShard *shard = &scanner->shards[i];
+        size_t size = (size_t)1 << shard->table_bits;
+        for (size_t j = 0; j < size; j++) {
+            if (shard->table[j].tid != 0) {
+                process_scanner_close_entry_fd(shard, &shard->table[j]);
+            }
+        }
+        assert(shard->n_open_fds == 0);
+
+        free(shard->table);
+        free(shard->listed_tasks);
+        free(shard->top);
+        sem_destroy(&shard->sem_start);
+    }
+
+    sem_destroy(&scanner->sem_listed);
+    sem_destroy(&scanner->sem_done);
+    if (scanner->loadavg_fd >= 0) {
+        close(scanner->loadavg_fd);
+    }
+    free(scanner->shards);
+    free(scanner->pids);
+    /* Also closes proc_fd */
+    closedir(scanner->proc_dir);
+    free(scanner);
+}
+
+/*
+ * The last field of /proc/loadavg is the last pid allocated (to a process or a thread) in the pid namespace.
+ * Returns -1 if it can't be read.
+ */
+static int
+process_scanner_read_last_pid(ProcessScanner *scanner)
+{
+    if (scanner->loadavg_fd < 0 || process_scanner_read_fd(scanner->loadavg_fd, sizeof(scanner->buffer), scanner->buffer) <= 0) {
+        return -1;
+    }
+
+    const char *last_field = strrchr(scanner->buffer, ' ');
+    if (!last_field) {
+        return -1;
+    }
+    char *end;
+    long last_pid = strtol(last_field + 1, &end, 10);
+    return end != last_field + 1 && last_pid >= 0 && last_pid <= INT_MAX ? (int)last_pid : -1;
+}
+
+static bool
+process_scanner_list_pids(ProcessScanner *scanner)
+{
+    scanner->n_pids = 0;
+    rewinddir(scanner->proc_dir);
+    while (1) {
+        errno = 0;
+        struct dirent *dirent = readdir(scanner->proc_dir);
+        if (!dirent) {
+            return errno == 0;
+        }
+
+        int pid = process_scanner_parse_pid(dirent->d_name);
+        if (pid <= 0) {
+            continue;
+        }
+
+        if (scanner->n_pids == scanner->max_pids) {
+            scanner->max_pids = scanner->max_pids ? 2 * scanner->max_pids : 1024;
+            scanner->pids = erealloc(scanner->pids, (size_t)scanner->max_pids * sizeof(scanner->pids[0]));
+        }
+        scanner->pids[scanner->n_pids++] = pid;
+    }
+}
+
+int
+process_scanner_scan(ProcessScanner *scanner, long long timestamp_ns, int k, ProcessUsage top[k])
+{
+    int n_workers = scanner->options.n_workers;
+
+    /*
+     * A new task can only appear if a pid was allocated since the previous scan. If none was,
+     * listing the directories (the most expensive part of a scan with many tasks) is skipped and
+     * only the tasks of the last listing are read.
+     */
+    int last_pid = process_scanner_read_last_pid(scanner);
+    bool list_tasks = last_pid < 0 || last_pid != scanner->last_pid || !scanner->scanned;
+    scanner->last_pid = last_pid;
+
+    if (list_tasks && !process_scanner_list_pids(scanner)) {
+        /* Make sure that the next scan lists the directory again */
+        scanner->last_pid = -1;
+        return -1;
+    }
+
+    scanner->list_tasks = list_tasks;
+    scanner->elapsed_ns = timestamp_ns - scanner->previous_timestamp_ns;
+    scanner->k = k;
+    scanner->n_listed_shards = 0;
+    for (int i = 0; i < n_workers; i++) {
+        ProcessScannerShard *shard = &scanner->shards[i];
+        if (shard->max_top < k) {
+            shard->top = erealloc(shard->top, (size_t)k * sizeof(shard->top[0]));
+            shard->max_top = k;
+        }
+    }
+
+    if (n_workers == 1) {
+        process_scanner_scan_shard(&scanner->shards[0]);
+    } else {
+        for (int i = 0; i < n_workers; i++) {
+            sem_post(&scanner->shards[i].sem_start);
+        }
+        for (int i = 0; i < n_workers; i++) {
+            process_scanner_sem_wait(&scanner->sem_done);
+        }
+    }
+
+    /* Merge the sorted tops of the shards, which the workers no longer touch */
+    int heads[PROCESS_SCANNER_MAX_WORKERS] = { 0 };
+    int n_top = 0;
+    while (n_top < k) {
+        const ProcessScannerShard *best = NULL;
+        for (int i = 0; i < n_workers; i++) {
+            const ProcessScannerShard *shard = &scanner->shards[i];
+            if (heads[i] < shard->n_top
+                    && (!best || process_usage_less(&best->top[heads[best->index]], &shard->top[heads[i]]))) {
+                best = shard;
+            }
+        }
+        if (!best) {
+            break;
+        }
+        top[n_top++] = best->top[heads[best->index]++];
+    }
+
+    scanner->n_tasks = 0;
+    for (int i = 0; i < n_workers; i++) {
+        scanner->n_tasks += scanner->shards[i].n_tasks;
+    }
+    scanner->previous_timestamp_ns = timestamp_ns;
+    scanner->scanned = true;
+
+    return n_top;
+}
+
+int
+process_scanner_n_tasks(const ProcessScanner *scanner)
+{
+    return scanner->n_tasks;
+}
@@ -0,0 +1,90 @@
+#ifndef PROCESS_SCANNER_H
+#define PROCESS_SCANNER_H
+
+#include <stdbool.h>
+
+/*
+ * CPU usage of every process, or of every thread, from the /proc/[pid] (/proc/[pid]/task/[tid]) directories.
+ *
+ * The scanner keeps a hash table keyed by tid with the CPU time of each task (process or thread) at the
+ * previous scan, and the descriptor of its stat file kept open so that a scan costs a single pread() per
+ * task instead of an openat(), read() and close(). Paths are resolved relative to a cached descriptor of
+ * the /proc directory.
+ *
+ * The directories are only listed again when /proc/loadavg shows that a pid was allocated since the
+ * previous scan, otherwise the tasks already known are read in the order of the last listing.
+ *
+ * The CPU time of a process is utime + stime from /proc/[pid]/stat, which add up all its threads.
+ * The CPU time of a thread is read from schedstat (nanoseconds on CPU), which the kernel formats several
+ * times faster than stat but which only covers a single thread. If the kernel has no schedstat files,
+ * utime + stime from the thread's stat are used instead.
+ *
+ * With several workers the tasks are sharded: worker i lists /proc/[pid]/task for the processes with
+ * pid % n_workers == i, then, once every worker is done listing, samples the tasks with
+ * tid % n_workers == i out of all the listings, so that the threads of a single huge process are
+ * spread over all the workers. Each worker has its own hash table, descriptors and top tasks; the
+ * calling thread merges the sorted tops once all the workers are done, without any lock.
+ */
+
+#define PROCESS_COMM_SIZE 16
+
+#define PROCESS_SCANNER_MAX_WORKERS 32
+
+typedef struct {
+    int pid;
+    /* Thread id when scanning threads, otherwise the same as pid */
+    int tid;
+    char comm[PROCESS_COMM_SIZE];
+    /* Percentage of one CPU, more than 100 for processes with several busy threads */
+    double cpu_usage;
+} ProcessUsage;
+
+typedef struct {
+    /* Scan every thread instead of every process */
+    bool threads;
+    /* Within [1, PROCESS_SCANNER_MAX_WORKERS], a single worker scans in the calling thread */
+    int n_workers;
+    /*
+     * At most this many descriptors, shared evenly by the workers, are kept open between scans;
+     * the files of the remaining tasks are opened and closed on every scan
+     */
+    int max_open_fds;
+    /* Workers report their activity to the Watchdog */
+    bool use_watchdog;
+} ProcessScannerOptions;
+
+typedef struct ProcessScanner ProcessScanner;
+
+/*
+ * Keeping a descriptor open per task saves an openat() and a close() per task on every scan,
+ * so raise the soft limit on open descriptors as far as the hard limit allows (this affects the
+ * whole program). Returns how many descriptors a scanner may then keep open.
+ */
+int process_scanner_raise_fd_limit(void);
+
+/*
+ * Open a scanner of the processes in proc_path (normally "/proc") and start its workers.
+ * Returns NULL on failure.
+ */
+ProcessScanner * process_scanner_open(const char *proc_path, const ProcessScannerOptions options[static 1]);
+
+/*
+ * Stop the workers and close the scanner.
+ */
+void process_scanner_close(ProcessScanner *scanner);
+
+/*
+ * Read the CPU time of every task and find the k busiest ones since the previous scan,
+ * timestamp_ns being the CLOCK_MONOTONIC time of the scan.
+ * top receives them in descending order of usage (ties ordered by tid). Tasks that weren't
+ * seen by the previous scan have no usage yet and are left out.
+ * Returns the number of tasks written to top, or -1 on failure.
+ */
+int process_scanner_scan(ProcessScanner *scanner, long long timestamp_ns, int k, ProcessUsage top[k]);
+
+/*
+ * Number of processes (or threads) seen by the last scan.
+ */
+int process_scanner_n_tasks(const ProcessScanner *scanner);
+
+#endif /* PROCESS_SCANNER_H */
@@ -5,21 +5,32 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
 #include <assert.h>
 
 #include "reader.h"
 #include "analyzer.h"
 #include "utils.h"
 #include "proc_stat_utils.h"
+#include "cpu_freq.h"
 #include "thread_utils.h"
 #include "logger.h"
 #include "watchdog.h"
+#include "stats.h"
 
 typedef struct {
     ReaderArgs *args;
-    FILE *proc_stat_file;
+    int proc_stat_fd;
+    ProcStatBuffer proc_stat_buffer;
+    /* NULL if the frequencies aren't sampled */
+    CpuFreqReader *cpu_freq_reader;
     bool first_sleep_done;
-    ProcStatCpuEntry *cpu_entries;
+    long long next_deadline_ns;
+    unsigned long n_missed_deadlines;
+    bool parse_failed;
+    bool too_many_cpus_reported;
+    AnalyzerQueue *analyzer_queue;
+    WatchdogHandle *watchdog;
 } ReaderPrivateState;
 
 static void
@@ -27,14 +38,23 @@ reader_deinit(void *arg)
 {
     ReaderPrivateState *priv = arg;
 
+    recording_writer_close(priv->args->recording);
     free(priv->args);
 
-    if (priv->proc_stat_file) {
-        int iret = fclose(priv->proc_stat_file);
+    if (priv->proc_stat_fd >= 0) {
+        int iret = close(priv->proc_stat_fd);
         assert(iret == 0);
     }
 
-    free(priv->cpu_entries);
+    proc_stat_buffer_free(&priv->proc_stat_buffer);
+
+    cpu_freq_reader_close(priv->cpu_freq_reader);
+
+    if (priv->analyzer_queue) {
+        analyzer_queue_detach(priv->analyzer_queue);
+    }
+
+    watchdog_unregister(priv->watchdog);
 
     free(priv);
 }
@@ -46,47 +66,152 @@ reader_init(void *arg)
 
     priv->args = arg;
 
-    priv->proc_stat_file = fopen("/proc/stat", "r");
-    if (!priv->proc_stat_file) {
-        ELOG(false, "Failed to open /proc/stat");
+    int interval_ms = priv->args->sampling_interval_ms;
+    assert(interval_ms >= READER_MIN_SAMPLING_INTERVAL_MS && interval_ms <= READER_MAX_SAMPLING_INTERVAL_MS);
+    (void)(interval_ms);
+
+    priv->proc_stat_fd = open("/proc/stat", O_RDONLY);
+    if (priv->proc_stat_fd < 0) {
+        ELOG("Failed to open /proc/stat");
         reader_deinit(priv);
         pthread_exit(NULL);
     }
 
-    priv->cpu_entries = emalloc((size_t)priv->args->max_cpu_entries * sizeof(priv->cpu_entries[0]));
+    if (priv->args->sample_frequencies) {
+        priv->cpu_freq_reader = cpu_freq_reader_open("/sys/devices/system/cpu", priv->args->cpu_freq_backend);
+        if (!priv->cpu_freq_reader) {
+            ELOG("Failed to open /sys/devices/system/cpu, CPU frequencies won't be sampled");
+        }
+    }
 
     return priv;
 }
 
+/*
+ * Samples are taken on an absolute CLOCK_MONOTONIC schedule so that the time spent
+ * parsing and submitting doesn't make the sampling period drift.
+ * If a deadline has already passed it is counted as missed and skipped.
+ */
+static void
+reader_sleep_until_next_deadline(ReaderPrivateState *priv)
+{
+    long long interval_ns = (long long)priv->args->sampling_interval_ms * 1000 * 1000;
+    long long now_ns = clock_now_ns(CLOCK_MONOTONIC);
+
+    if (!priv->first_sleep_done) {
+        priv->first_sleep_done = true;
+
+        /* Reduce the duration of the first sleep to reduce program startup time */
+        long long first_interval_ns = 100 * 1000 * 1000;
+        if (first_interval_ns > interval_ns) {
+            first_interval_ns = interval_ns;
+        }
+        priv->next_deadline_ns = now_ns + first_interval_ns;
+    } else {
+        priv->next_deadline_ns += interval_ns;
+    }
+
+    if (now_ns >= priv->next_deadline_ns) {
+        long long n_missed = (now_ns - priv->next_deadline_ns) / interval_ns + 1;
+        priv->n_missed_deadlines += (unsigned long)n_missed;
+        priv->next_deadline_ns += n_missed * interval_ns;
+
+        ELOG("Missed %lld sampling deadline(s), %lu in total", n_missed, priv->n_missed_deadlines);
+    }
+
+    struct timespec deadline = ns_to_timespec(priv->next_deadline_ns);
+    int iret;
+    do {
+        iret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    } while (iret == EINTR);
+    assert(iret == 0);
+}
+
+static void
+reader_record_snapshot(ReaderPrivateState *priv, long long timestamp_ns, int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries])
+{
+    if (n_cpu_entries > recording_writer_max_cpu_entries(priv->args->recording)) {
+        /* The recording was created for fewer CPUs than are online now */
+        stats_counter_add(STATS_COUNTER_RECORDING_SNAPSHOTS_SKIPPED, 1);
+        if (!priv->too_many_cpus_reported) {
+            ELOG("Snapshot has more CPUs than the recording supports, skipping such snapshots");
+            priv->too_many_cpus_reported = true;
+        }
+        return;
+    }
+
+    bool bret = recording_writer_write(priv->args->recording, timestamp_ns, n_cpu_entries, cpu_entries);
+    if (!bret) {
+        ELOG("Failed to write to the recording, recording stopped");
+        recording_writer_close(priv->args->recording);
+        priv->args->recording = NULL;
+    }
+}
+
+/*
+ * Parse /proc/stat into the acquired queue slot, growing the slot if more CPUs came online than it can hold.
+ * Returns the number of entries or a negative value on failure.
+ */
+static int
+reader_parse_proc_stat(ReaderPrivateState *priv, ProcStatCpuEntry *cpu_entries[static 1], int max_cpu_entries)
+{
+    while (1) {
+        int n_cpu_entries = read_and_parse_proc_stat_fd(priv->proc_stat_fd, &priv->proc_stat_buffer,
+                max_cpu_entries, *cpu_entries);
+        if (n_cpu_entries != PROC_STAT_TOO_MANY_CPU_ENTRIES || max_cpu_entries >= PROC_STAT_MAX_CPU_ENTRIES) {
+            return n_cpu_entries;
+        }
+
+        int min_cpu_entries = max_cpu_entries * 2 < PROC_STAT_MAX_CPU_ENTRIES ? max_cpu_entries * 2 : PROC_STAT_MAX_CPU_ENTRIES;
+        *cpu_entries = analyzer_queue_grow_slot(priv->analyzer_queue, min_cpu_entries, &max_cpu_entries);
+    }
+}
+
 static void
 reader_loop(ReaderPrivateState *priv)
 {
+    if (priv->args->use_watchdog) {
+        priv->watchdog = watchdog_register("Reader");
+    }
+
     while (1) {
-        int n_cpu_entries = read_and_parse_proc_stat_file(priv->proc_stat_file,
-                priv->args->max_cpu_entries, priv->cpu_entries);
-        assert(n_cpu_entries > 1);
+        if (!priv->analyzer_queue) {
+            priv->analyzer_queue = analyzer_queue_attach();
+        }
 
-        bool bret = analyzer_submit_data(n_cpu_entries, priv->cpu_entries);
-        assert(bret);
+        /* The snapshot is parsed directly into the Analyzer's queue slot, if the queue is full the sample is dropped */
+        int max_cpu_entries;
+        ProcStatCpuEntry *cpu_entries = analyzer_queue_acquire_slot(priv->analyzer_queue, &max_cpu_entries);
+        if (cpu_entries) {
+            long long parse_start_ns = stats_timer_start();
+            int n_cpu_entries = reader_parse_proc_stat(priv, &cpu_entries, max_cpu_entries);
+            stats_timer_stop(STATS_TIMER_PARSE, parse_start_ns);
+            if (n_cpu_entries > 1) {
+                long long timestamp_ns = clock_now_ns(CLOCK_REALTIME);
+                long long monotonic_ns = clock_now_ns(CLOCK_MONOTONIC);
+
+                if (priv->cpu_freq_reader) {
+                    cpu_freq_reader_read(priv->cpu_freq_reader, n_cpu_entries, cpu_entries,
+                            analyzer_queue_slot_frequencies(priv->analyzer_queue));
+                }
+
+                if (priv->args->recording) {
+                    reader_record_snapshot(priv, timestamp_ns, n_cpu_entries, cpu_entries);
+                }
+
+                analyzer_queue_commit_slot(priv->analyzer_queue, n_cpu_entries, timestamp_ns, monotonic_ns);
+            } else if (!priv->parse_failed) {
+                /* The slot stays acquired and gets reused for the next sample */
+                ELOG("Failed to parse /proc/stat, skipping samples until it succeeds");
+            }
+            priv->parse_failed = n_cpu_entries <= 1;
+        }
 
         if (priv->args->use_watchdog) {
-            watchdog_signal_active("Reader");
+            watchdog_signal_active(priv->watchdog);
         }
 
-        /* Reduce the duration of the first sleep to reduce program startup time */
-        if (!priv->first_sleep_done) {
-            priv->first_sleep_done = true;
-
-            struct timespec ts = {0};
-            /* 100 miliseconds */
-            ts.tv_nsec = 100 * 1000 * 1000;
-            nanosleep(&ts, NULL);
-        } else {
-            struct timespec ts = {0};
-            /* 1 second */
-            ts.tv_sec = 1;
-            nanosleep(&ts, NULL);
-        }
+        reader_sleep_until_next_deadline(priv);
     }
 }
 
@@ -1,8 +1,21 @@
 #ifndef READER_H
 #define READER_H
 
+#include "recording.h"
+#include "cpu_freq.h"
+
+#define READER_MIN_SAMPLING_INTERVAL_MS 10
+#define READER_MAX_SAMPLING_INTERVAL_MS (60 * 1000)
+#define READER_DEFAULT_SAMPLING_INTERVAL_MS 1000
+
 typedef struct {
-    int max_cpu_entries;
+    /* Must be within [READER_MIN_SAMPLING_INTERVAL_MS, READER_MAX_SAMPLING_INTERVAL_MS] */
+    int sampling_interval_ms;
+    /* If not NULL every snapshot is also appended to this recording, Reader takes ownership of it */
+    RecordingWriter *recording;
+    /* Sample the frequency of every CPU along with /proc/stat, see cpu_freq.h */
+    bool sample_frequencies;
+    CpuFreqBackend cpu_freq_backend;
     bool use_watchdog;
 } ReaderArgs;
 
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "recording.h"
+#include "proc_stat_utils.h"
+#include "varint.h"
+#include "utils.h"
+#include "stats.h"
+
+static const unsigned char recording_magic[8] = { 'C', 'U', 'T', 'R', 'E', 'C', 0, 1 };
+
+struct RecordingWriter {
+    FILE *file;
+    int max_cpu_entries;
+    long long previous_timestamp_ns;
+    int n_previous_cpu_entries;
+    ProcStatCpuEntry *previous_cpu_entries;
+    unsigned char *buffer;
+    size_t buffer_size;
+};
+
+struct RecordingReader {
+    FILE *file;
+    int max_cpu_entries;
+    long long previous_timestamp_ns;
+    int n_previous_cpu_entries;
+    ProcStatCpuEntry *previous_cpu_entries;
+    unsigned char *buffer;
+    size_t buffer_size;
+};
+
+/*
+ * Upper bound of the payload size of a record with max_cpu_entries entries.
+ */
+static size_t
+recording_max_payload_size(int max_cpu_entries)
+{
+    size_t max_entry_size = 1 + PROCSTATCPUENTRY_CPU_NAME_SIZE + PROCSTATCPUENTRY_N_COUNTERS * VARINT_MAX_LENGTH;
+    return 2 * VARINT_MAX_LENGTH + (size_t)max_cpu_entries * max_entry_size;
+}
+
+/*
+ * The entry at the same position in the previous snapshot, if it's for the same CPU.
+ */
+static ProcStatCpuEntry *
+recording_delta_base(int n_previous_cpu_entries, ProcStatCpuEntry *previous_cpu_entries, int i, const char *cpu_name)
+{
+    if (i >= n_previous_cpu_entries || strcmp(previous_cpu_entries[i].cpu_name, cpu_name) != 0) {
+        return NULL;
+    }
+    return &previous_cpu_entries[i];
+}
+
+RecordingWriter *
+recording_writer_open(const char *file_name, int max_cpu_entries)
+{
+    assert(file_name);
+    assert(max_cpu_entries > 0);
+
+    FILE *file = fopen(file_name, "wb");
+    if (!file) {
+        return NULL;
+    }
+
+    unsigned char header[sizeof(recording_magic) + VARINT_MAX_LENGTH];
+    memcpy(header, recording_magic, sizeof(recording_magic));
+    size_t header_length = sizeof(recording_magic) + varint_encode((uint64_t)max_cpu_entries, &header[sizeof(recording_magic)]);
+
+    if (fwrite(header, 1, header_length, file) != header_length || fflush(file) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    RecordingWriter *writer = ecalloc(1, sizeof(*writer));
+    writer->file = file;
+    writer->max_cpu_entries = max_cpu_entries;
+    writer->previous_cpu_entries = emalloc((size_t)max_cpu_entries * sizeof(writer->previous_cpu_entries[0]));
+    writer->buffer_size = recording_max_payload_size(max_cpu_entries);
+    writer->buffer = emalloc(writer->buffer_size);
+
+    return writer;
+}
+
+bool
+recording_writer_write(RecordingWriter *writer, long long timestamp_ns, int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries])
+{
+    assert(writer);
+
+    if (n_cpu_entries > writer->max_cpu_entries) {
+        return false;
+    }
+
+    unsigned char *p = writer->buffer;
+
+    p += varint_encode(zigzag_encode(timestamp_ns - writer->previous_timestamp_ns), p);
+    p += varint_encode((uint64_t)n_cpu_entries, p);
+
+    for (int i = 0; i < n_cpu_entries; i++) {
+        ProcStatCpuEntry *ce = &cpu_entries[i];
+
+        size_t name_length = strlen(ce->cpu_name);
+        *p++ = (unsigned char)name_length;
+        memcpy(p, ce->cpu_name, name_length);
+        p += name_length;
+
+        unsigned long *counters[PROCSTATCPUENTRY_N_COUNTERS];
+        proc_stat_cpu_entry_counters(ce, counters);
+
+        unsigned long *base_counters[PROCSTATCPUENTRY_N_COUNTERS];
+        ProcStatCpuEntry *base = recording_delta_base(writer->n_previous_cpu_entries, writer->previous_cpu_entries, i, ce->cpu_name);
+        if (base) {
+            proc_stat_cpu_entry_counters(base, base_counters);
+        }
+
+        for (int j = 0; j < PROCSTATCPUENTRY_N_COUNTERS; j++) {
+            uint64_t base_value = base ? *base_counters[j] : 0;
+            p += varint_encode(zigzag_encode((int64_t)(*counters[j] - base_value)), p);
+        }
+    }
+
+    unsigned char length_prefix[VARINT_MAX_LENGTH];
+    size_t payload_length = (size_t)(p - writer->buffer);
+    size_t prefix_length = varint_encode(payload_length, length_prefix);
+
+    if (fwrite(length_prefix, 1, prefix_length, writer->file) != prefix_length
+            || fwrite(writer->buffer, 1, payload_length, writer->file) != payload_length
+            || fflush(writer->file) != 0) {
+        return false;
+    }
+    stats_counter_add(STATS_COUNTER_RECORDING_BYTES_WRITTEN, prefix_length + payload_length);
+
+    writer->previous_timestamp_ns = timestamp_ns;
+    writer->n_previous_cpu_entries = n_cpu_entries;
+    memcpy(writer->previous_cpu_entries, cpu_entries, (size_t)n_cpu_entries * sizeof(cpu_entries[0]));
+
+    return true;
+}
+
+int
+recording_writer_max_cpu_entries(RecordingWriter *writer)
+{
+    assert(writer);
+
+    return writer->max_cpu_entries;
+}
+
+void
+recording_writer_close(RecordingWriter *writer)
+{
+    if (!writer) {
+        return;
+    }
+
+    fclose(writer->file);
+    free(writer->previous_cpu_entries);
+    free(writer->buffer);
+    free(writer);
+}
+
+/*
+ * Read a varint directly from the file.
+ * Returns false at end of file or if the varint is malformed.
+ */
+static bool
+recording_read_varint(FILE *file, uint64_t value[static 1])
+{
+    unsigned char bytes[VARINT_MAX_LENGTH];
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        int c = getc(file);
+        if (c == EOF) {
+            return false;
+        }
+        bytes[i] = (unsigned char)c;
+        if (!(c & 0x80)) {
+            return varint_decode(bytes, &bytes[i + 1], value) != NULL;
+        }
+    }
+    return false;
+}
+
+RecordingReader *
+recording_reader_open(const char *file_name)
+{
+    assert(file_name);
+
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    unsigned char magic[sizeof(recording_magic)];
+    uint64_t max_cpu_entries;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+            || memcmp(magic, recording_magic, sizeof(magic)) != 0
+            || !recording_read_varint(file, &max_cpu_entries)
+            || max_cpu_entries == 0 || max_cpu_entries > 1024 * 1024) {
+        fclose(file);
+        return NULL;
+    }
+
+    RecordingReader *reader = ecalloc(1, sizeof(*reader));
+    reader->file = file;
+    reader->max_cpu_entries = (int)max_cpu_entries;
+    reader->previous_cpu_entries = emalloc((size_t)max_cpu_entries * sizeof(reader->previous_cpu_entries[0]));
+    reader->buffer_size = recording_max_payload_size(reader->max_cpu_entries);
+    reader->buffer = emalloc(reader->buffer_size);
+
+    return reader;
+}
+
+int
+recording_reader_max_cpu_entries(RecordingReader *reader)
+{
+    assert(reader);
+    return reader->max_cpu_entries;
+}
+
+int
+recording_reader_read(RecordingReader *reader, long long timestamp_ns[static 1], ProcStatCpuEntry *cpu_entries)
+{
+    assert(reader);
+    assert(cpu_entries);
+
+    uint64_t payload_length;
+    if (!recording_read_varint(reader->file, &payload_length)) {
+        return feof(reader->file) ? 0 : -1;
+    }
+    if (payload_length > reader->buffer_size) {
+        return -1;
+    }
+    if (fread(reader->buffer, 1, payload_length, reader->file) != payload_length) {
+        return -1;
+    }
+
+    const unsigned char *p = reader->buffer;
+    const unsigned char *end = p + payload_length;
+
+    uint64_t timestamp_delta;
+    uint64_t n_cpu_entries;
+    p = varint_decode(p, end, &timestamp_delta);
+    if (!p || !(p = varint_decode(p, end, &n_cpu_entries)) || n_cpu_entries > (uint64_t)reader->max_cpu_entries) {
+        return -1;
+    }
+
+    for (int i = 0; i < (int)n_cpu_entries; i++) {
+        ProcStatCpuEntry *ce = &cpu_entries[i];
+
+        if (p == end || *p >= PROCSTATCPUENTRY_CPU_NAME_SIZE || (size_t)(end - p) < 1u + *p) {
+            return -1;
+        }
+        size_t name_length = *p++;
+        memcpy(ce->cpu_name, p, name_length);
+        ce->cpu_name[name_length] = '\0';
+        p += name_length;
+
+        unsigned long *counters[PROCSTATCPUENTRY_N_COUNTERS];
+        proc_stat_cpu_entry_counters(ce, counters);
+
+        unsigned long *base_counters[PROCSTATCPUENTRY_N_COUNTERS];
+        ProcStatCpuEntry *base = recording_delta_base(reader->n_previous_cpu_entries, reader->previous_cpu_entries, i, ce->cpu_name);
+        if (base) {
+            proc_stat_cpu_entry_counters(base, base_counters);
+        }
+
+        for (int j = 0; j < PROCSTATCPUENTRY_N_COUNTERS; j++) {
+            uint64_t delta;
+            p = varint_decode(p, end, &delta);
+            if (!p) {
+                return -1;
+            }
+            uint64_t base_value = base ? *base_counters[j] : 0;
+            *counters[j] = (unsigned long)(base_value + (uint64_t)zigzag_decode(delta));
+        }
+    }
+
+    reader->previous_timestamp_ns += zigzag_decode(timestamp_delta);
+    reader->n_previous_cpu_entries = (int)n_cpu_entries;
+    memcpy(reader->previous_cpu_entries, cpu_entries, (size_t)n_cpu_entries * sizeof(cpu_entries[0]));
+
+    *timestamp_ns = reader->previous_timestamp_ns;
+    return (int)n_cpu_entries;
+}
+
+void
+recording_reader_close(RecordingReader *reader)
+{
+    if (!reader) {
+        return;
+    }
+
+    fclose(reader->file);
+    free(reader->previous_cpu_entries);
+    free(reader->buffer);
+    free(reader);
+}
@@ -0,0 +1,65 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <stdbool.h>
+
+#include "proc_stat_utils.h"
+
+/*
+ * Recordings of raw /proc/stat CPU snapshots.
+ *
+ * File format (all integers are varints, see varint.h):
+ *  header: the 8 magic bytes "CUTREC\0\1" followed by max_cpu_entries
+ *  record: payload_length, then the payload:
+ *      timestamp: nanoseconds (CLOCK_REALTIME) since the previous record, absolute for the first one
+ *      n_cpu_entries
+ *      for each entry:
+ *          name_length, name bytes
+ *          10 counters (user ... guest_nice), each one zigzag encoded as the difference from the
+ *          same counter of the entry at the same position in the previous record, or from 0 if
+ *          there is no such entry or its name differs
+ */
+
+typedef struct RecordingWriter RecordingWriter;
+typedef struct RecordingReader RecordingReader;
+
+/*
+ * Create (or truncate) a recording file.
+ * max_cpu_entries is the maximum number of entries a snapshot written to it can contain.
+ * Returns NULL on failure.
+ */
+RecordingWriter * recording_writer_open(const char *file_name, int max_cpu_entries);
+
+/*
+ * Append a snapshot and flush it to the file.
+ * Returns false on failure, or if the snapshot has more than recording_writer_max_cpu_entries() entries.
+ */
+bool recording_writer_write(RecordingWriter *writer, long long timestamp_ns, int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries]);
+
+/*
+ * Maximum number of entries a snapshot written to the file can contain.
+ */
+int recording_writer_max_cpu_entries(RecordingWriter *writer);
+
+void recording_writer_close(RecordingWriter *writer);
+
+/*
+ * Open a recording file for reading.
+ * Returns NULL if the file can't be opened or isn't a recording.
+ */
+RecordingReader * recording_reader_open(const char *file_name);
+
+/*
+ * The maximum number of entries of a snapshot in the recording.
+ */
+int recording_reader_max_cpu_entries(RecordingReader *reader);
+
+/*
+ * Read the next snapshot into cpu_entries (which must hold recording_reader_max_cpu_entries() entries).
+ * Returns the number of entries read, 0 at the end of the recording and -1 if the file is corrupted.
+ */
+int recording_reader_read(RecordingReader *reader, long long timestamp_ns[static 1], ProcStatCpuEntry *cpu_entries);
+
+void recording_reader_close(RecordingReader *reader);
+
+#endif /* RECORDING_H */
@@ -0,0 +1,211 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "replayer.h"
+#include "analyzer.h"
+#include "utils.h"
+#include "proc_stat_utils.h"
+#include "recording.h"
+#include "thread_utils.h"
+#include "logger.h"
+#include "watchdog.h"
+
+/* Longest sleep between watchdog reports while waiting for the next snapshot's time */
+#define REPLAYER_MAX_SLEEP_NS (500LL * 1000 * 1000)
+
+typedef struct {
+    ReplayerArgs *args;
+    AnalyzerQueue *analyzer_queue;
+    ProcStatCpuEntry *cpu_entries;
+    bool first_snapshot_done;
+    long long first_timestamp_ns;
+    long long start_ns;
+    unsigned long n_snapshots;
+    unsigned long n_dropped;
+    WatchdogHandle *watchdog;
+} ReplayerPrivateState;
+
+static void
+replayer_deinit(void *arg)
+{
+    ReplayerPrivateState *priv = arg;
+
+    recording_reader_close(priv->args->recording);
+    free(priv->args);
+
+    if (priv->analyzer_queue) {
+        analyzer_queue_detach(priv->analyzer_queue);
+    }
+
+    free(priv->cpu_entries);
+
+    watchdog_unregister(priv->watchdog);
+
+    free(priv);
+}
+
+static ReplayerPrivateState *
+replayer_init(void *arg)
+{
+    ReplayerPrivateState *priv = ecalloc(1, sizeof(*priv));
+
+    priv->args = arg;
+
+    assert(priv->args->recording);
+    assert(priv->args->as_fast_as_possible || priv->args->speed > 0);
+
+    int max_cpu_entries = recording_reader_max_cpu_entries(priv->args->recording);
+    priv->cpu_entries = emalloc((size_t)max_cpu_entries * sizeof(priv->cpu_entries[0]));
+
+    return priv;
+}
+
+static void
+replayer_signal_active(ReplayerPrivateState *priv)
+{
+    if (priv->args->use_watchdog) {
+        watchdog_signal_active(priv->watchdog);
+    }
+}
+
+/*
+ * Sleep until the moment the snapshot with the given timestamp should be replayed,
+ * relative to the first snapshot and scaled by the playback speed.
+ */
+static void
+replayer_wait_for_snapshot_time(ReplayerPrivateState *priv, long long timestamp_ns)
+{
+    long long offset_ns = (long long)((double)(timestamp_ns - priv->first_timestamp_ns) / priv->args->speed);
+    long long deadline_ns = priv->start_ns + offset_ns;
+
+    while (1) {
+        long long now_ns = clock_now_ns(CLOCK_MONOTONIC);
+        if (now_ns >= deadline_ns) {
+            break;
+        }
+
+        long long sleep_until_ns = deadline_ns;
+        if (sleep_until_ns - now_ns > REPLAYER_MAX_SLEEP_NS) {
+            sleep_until_ns = now_ns + REPLAYER_MAX_SLEEP_NS;
+        }
+        struct timespec ts = ns_to_timespec(sleep_until_ns);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+        replayer_signal_active(priv);
+    }
+}
+
+static void
+replayer_finish(ReplayerPrivateState *priv, bool corrupted)
+{
+    double elapsed = (double)(clock_now_ns(CLOCK_MONOTONIC) - priv->start_ns) / NSEC_PER_SEC;
+    double throughput = elapsed > 0 ? (double)priv->n_snapshots / elapsed : 0;
+
+    if (corrupted) {
+        EPRINT("Recording is corrupted or truncated, stopping the replay");
+        ELOG("Recording is corrupted or truncated, stopping the replay");
+    }
+
+    EPRINT("Replayed %lu snapshots (%lu dropped) in %.3f s (%.1f snapshots/s)", priv->n_snapshots, priv->n_dropped, elapsed, throughput);
+    ELOG("Replayed %lu snapshots (%lu dropped) in %.3f s (%.1f snapshots/s)", priv->n_snapshots, priv->n_dropped, elapsed, throughput);
+
+    /*
+     * Give the Analyzer a moment to process the snapshots still in its queue, so that e.g. converting
+     * a recording with --output doesn't lose its end. The last snapshot is only kept as the previous one.
+     */
+    for (int i = 0; i < 1000; i++) {
+        StageMetrics metrics = analyzer_queue_metrics(priv->analyzer_queue);
+        if (metrics.n_released + 1 >= metrics.n_committed) {
+            break;
+        }
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000 * 1000 };
+        nanosleep(&ts, NULL);
+    }
+
+    /* Watchdog handles SIGTERM by shutting down the other threads */
+    kill(getpid(), SIGTERM);
+}
+
+/*
+ * Same as analyzer_submit_data() but using the queue the Replayer stays attached to.
+ * When replaying as fast as possible the Analyzer's queue waits for a free slot instead of dropping the snapshot.
+ */
+static void
+replayer_submit_snapshot(ReplayerPrivateState *priv, long long timestamp_ns, int n_cpu_entries)
+{
+    int max_cpu_entries;
+    ProcStatCpuEntry *slot = analyzer_queue_acquire_slot(priv->analyzer_queue, &max_cpu_entries);
+    if (!slot) {
+        priv->n_dropped++;
+        return;
+    }
+
+    if (n_cpu_entries > max_cpu_entries) {
+        slot = analyzer_queue_grow_slot(priv->analyzer_queue, n_cpu_entries, &max_cpu_entries);
+    }
+
+    memcpy(slot, priv->cpu_entries, (size_t)n_cpu_entries * sizeof(priv->cpu_entries[0]));
+    /*
+     * Recordings only store the wall clock time, the windows follow it so that they cover
+     * the recorded time and not the replay time, which is shorter when replaying as fast as possible.
+     */
+    analyzer_queue_commit_slot(priv->analyzer_queue, n_cpu_entries, timestamp_ns, timestamp_ns);
+}
+
+static void
+replayer_loop(ReplayerPrivateState *priv)
+{
+    priv->analyzer_queue = analyzer_queue_attach();
+
+    if (priv->args->use_watchdog) {
+        priv->watchdog = watchdog_register("Replayer");
+    }
+
+    while (1) {
+        long long timestamp_ns;
+        int n_cpu_entries = recording_reader_read(priv->args->recording, &timestamp_ns, priv->cpu_entries);
+        if (n_cpu_entries <= 0) {
+            replayer_finish(priv, n_cpu_entries < 0);
+            return;
+        }
+
+        if (!priv->first_snapshot_done) {
+            priv->first_snapshot_done = true;
+            priv->first_timestamp_ns = timestamp_ns;
+            priv->start_ns = clock_now_ns(CLOCK_MONOTONIC);
+        }
+
+        if (!priv->args->as_fast_as_possible) {
+            replayer_wait_for_snapshot_time(priv, timestamp_ns);
+        }
+
+        replayer_submit_snapshot(priv, timestamp_ns, n_cpu_entries);
+
+        priv->n_snapshots++;
+
+        replayer_signal_active(priv);
+    }
+}
+
+void *
+replayer_run(void *arg)
+{
+    assert(arg);
+
+    ReplayerPrivateState *priv = replayer_init(arg);
+
+    pthread_cleanup_push(replayer_deinit, priv);
+
+    replayer_loop(priv);
+
+    pthread_cleanup_pop(1);
+
+    pthread_exit(NULL);
+}
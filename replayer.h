@@ -0,0 +1,23 @@
+#ifndef REPLAYER_H
+#define REPLAYER_H
+
+#include "recording.h"
+
+typedef struct {
+    /* Replayer takes ownership of the recording */
+    RecordingReader *recording;
+    /* Playback speed relative to the recorded timestamps, ignored if as_fast_as_possible is set */
+    double speed;
+    /* Submit snapshots as soon as the Analyzer accepts them (waiting instead of dropping when its queue is full) */
+    bool as_fast_as_possible;
+    bool use_watchdog;
+} ReplayerArgs;
+
+/*
+ * Replacement for the Reader thread that feeds snapshots from a recording to the Analyzer.
+ * When the recording ends the number of replayed snapshots and the throughput are logged
+ * and printed, and SIGTERM is raised to shut the program down.
+ */
+void * replayer_run(void *arg);
+
+#endif /* REPLAYER_H */
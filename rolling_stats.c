@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "rolling_stats.h"
+#include "utils.h"
+
+typedef struct {
+    uint16_t histogram[ROLLING_STATS_N_BUCKETS];
+    uint16_t n_samples;
+    float min;
+    float max;
+    double sum;
+} RollingStatsSubwindow;
+
+struct RollingStatsWindowData {
+    /* Sum of the histograms of the sub-windows */
+    uint32_t histogram[ROLLING_STATS_N_BUCKETS];
+    uint32_t n_samples;
+    RollingStatsSubwindow subwindows[ROLLING_STATS_N_SUBWINDOWS];
+};
+
+static const struct {
+    char suffix;
+    long long ns;
+} rolling_stats_units[] = {
+    { 'h', 3600LL * 1000 * 1000 * 1000 },
+    { 'm', 60LL * 1000 * 1000 * 1000 },
+    { 's', 1000LL * 1000 * 1000 },
+};
+
+bool
+rolling_stats_parse_windows(const char *str, RollingStatsWindows windows[static 1])
+{
+    memset(windows, 0, sizeof(*windows));
+
+    const char *p = str;
+    while (1) {
+        if (windows->n_windows == ROLLING_STATS_MAX_WINDOWS || *p < '0' || *p > '9') {
+            return false;
+        }
+
+        char *end;
+        errno = 0;
+        long long value = strtoll(p, &end, 10);
+        if (errno != 0 || value <= 0) {
+            return false;
+        }
+
+        long long unit_ns = 0;
+        for (size_t i = 0; i < sizeof(rolling_stats_units) / sizeof(rolling_stats_units[0]); i++) {
+            if (*end == rolling_stats_units[i].suffix) {
+                unit_ns = rolling_stats_units[i].ns;
+            }
+        }
+        if (unit_ns == 0 || value > ROLLING_STATS_MAX_WINDOW_NS / unit_ns) {
+            return false;
+        }
+
+        windows->window_ns[windows->n_windows++] = value * unit_ns;
+
+        p = end + 1;
+        if (*p == '\0') {
+            return true;
+        }
+        if (*p != ',') {
+            return false;
+        }
+        p++;
+    }
+}
+
+void
+rolling_stats_format_window(long long window_ns, char out[static 16])
+{
+    for (size_t i = 0; i < sizeof(rolling_stats_units) / sizeof(rolling_stats_units[0]); i++) {
+        if (window_ns % rolling_stats_units[i].ns == 0) {
+            snprintf(out, 16, "%lld%c", window_ns / rolling_stats_units[i].ns, rolling_stats_units[i].suffix);
+            return;
+        }
+    }
+    snprintf(out, 16, "%.1fs", (double)window_ns / 1e9);
+}
+
+void
+rolling_stats_init(RollingStats stats[static 1], const RollingStatsWindows windows[static 1])
+{
+    assert(windows->n_windows >= 0 && windows->n_windows <= ROLLING_STATS_MAX_WINDOWS);
+    for (int w = 0; w < windows->n_windows; w++) {
+        assert(windows->window_ns[w] >= ROLLING_STATS_N_SUBWINDOWS);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->windows = *windows;
+}
+
+void
+rolling_stats_destroy(RollingStats stats[static 1])
+{
+    free(stats->data);
+    memset(stats, 0, sizeof(*stats));
+}
+
+static RollingStatsWindowData *
+rolling_stats_data(RollingStats stats[static 1], int i, int w)
+{
+    return &stats->data[i * stats->windows.n_windows + w];
+}
+
+static void
+rolling_stats_clear_subwindow(RollingStatsWindowData *data, int s)
+{
+    RollingStatsSubwindow *subwindow = &data->subwindows[s];
+    if (subwindow->n_samples == 0) {
+        return;
+    }
+
+    for (int b = 0; b < ROLLING_STATS_N_BUCKETS; b++) {
+        data->histogram[b] -= subwindow->histogram[b];
+    }
+    data->n_samples -= subwindow->n_samples;
+
+    memset(subwindow, 0, sizeof(*subwindow));
+}
+
+/*
+ * Move the newest sub-window of window w forward so that it contains timestamp_ns,
+ * emptying the sub-windows that fall out of the window.
+ */
+static void
+rolling_stats_advance(RollingStats stats[static 1], int w, long long timestamp_ns)
+{
+    long long subwindow_ns = stats->windows.window_ns[w] / ROLLING_STATS_N_SUBWINDOWS;
+    long long elapsed_ns = timestamp_ns - stats->subwindow_start_ns[w];
+    if (elapsed_ns < subwindow_ns) {
+        return;
+    }
+
+    long long n_steps = elapsed_ns / subwindow_ns;
+    int n_cleared = n_steps < ROLLING_STATS_N_SUBWINDOWS ? (int)n_steps : ROLLING_STATS_N_SUBWINDOWS;
+
+    for (int step = 0; step < n_cleared; step++) {
+        int s = (stats->current_subwindow[w] + 1 + step) % ROLLING_STATS_N_SUBWINDOWS;
+        for (int i = 0; i < stats->n_cpu_entries; i++) {
+            rolling_stats_clear_subwindow(rolling_stats_data(stats, i, w), s);
+        }
+    }
+
+    stats->current_subwindow[w] = (int)((stats->current_subwindow[w] + n_steps) % ROLLING_STATS_N_SUBWINDOWS);
+    stats->subwindow_start_ns[w] += n_steps * subwindow_ns;
+}
+
+static void
+rolling_stats_reserve(RollingStats stats[static 1], int n_cpu_entries)
+{
+    if (n_cpu_entries > stats->max_cpu_entries) {
+        int max_cpu_entries = stats->max_cpu_entries ? stats->max_cpu_entries : 1;
+        while (max_cpu_entries < n_cpu_entries) {
+            max_cpu_entries *= 2;
+        }
+        size_t n_windows = (size_t)stats->windows.n_windows;
+        stats->data = erealloc(stats->data, (size_t)max_cpu_entries * n_windows * sizeof(stats->data[0]));
+        stats->max_cpu_entries = max_cpu_entries;
+    }
+
+    if (n_cpu_entries > stats->n_cpu_entries) {
+        size_t n_windows = (size_t)stats->windows.n_windows;
+        memset(&stats->data[(size_t)stats->n_cpu_entries * n_windows], 0,
+                (size_t)(n_cpu_entries - stats->n_cpu_entries) * n_windows * sizeof(stats->data[0]));
+        stats->n_cpu_entries = n_cpu_entries;
+    }
+}
+
+static void
+rolling_stats_add_value(RollingStatsWindowData *data, int s, double value)
+{
+    RollingStatsSubwindow *subwindow = &data->subwindows[s];
+    if (subwindow->n_samples == UINT16_MAX) {
+        /* Can't happen with windows up to ROLLING_STATS_MAX_WINDOW_NS and the shortest sampling interval */
+        return;
+    }
+
+    if (!(value >= 0)) {
+        value = 0;
+    }
+    if (value > ROLLING_STATS_N_BUCKETS - 1) {
+        value = ROLLING_STATS_N_BUCKETS - 1;
+    }
+    int b = (int)(value + 0.5);
+
+    subwindow->histogram[b]++;
+    data->histogram[b]++;
+    if (subwindow->n_samples == 0 || value < subwindow->min) {
+        subwindow->min = (float)value;
+    }
+    if (subwindow->n_samples == 0 || value > subwindow->max) {
+        subwindow->max = (float)value;
+    }
+    subwindow->n_samples++;
+    subwindow->sum += value;
+    data->n_samples++;
+}
+
+void
+rolling_stats_add(RollingStats stats[static 1], long long timestamp_ns, int n_cpu_entries, const double cpu_usage[n_cpu_entries])
+{
+    int n_windows = stats->windows.n_windows;
+    if (n_windows == 0) {
+        return;
+    }
+
+    rolling_stats_reserve(stats, n_cpu_entries);
+
+    if (!stats->started) {
+        stats->started = true;
+        for (int w = 0; w < n_windows; w++) {
+            stats->subwindow_start_ns[w] = timestamp_ns;
+        }
+    }
+
+    for (int w = 0; w < n_windows; w++) {
+        rolling_stats_advance(stats, w, timestamp_ns);
+    }
+
+    for (int i = 0; i < n_cpu_entries; i++) {
+        for (int w = 0; w < n_windows; w++) {
+            rolling_stats_add_value(rolling_stats_data(stats, i, w), stats->current_subwindow[w], cpu_usage[i]);
+        }
+    }
+}
+
+void
+rolling_stats_reset_entry(RollingStats stats[static 1], int i)
+{
+    if (i >= stats->n_cpu_entries || stats->windows.n_windows == 0) {
+        return;
+    }
+    memset(rolling_stats_data(stats, i, 0), 0, (size_t)stats->windows.n_windows * sizeof(stats->data[0]));
+}
+
+static void
+rolling_stats_summarize_window(RollingStatsWindowData *data, RollingStatsSummary summary[static 1])
+{
+    memset(summary, 0, sizeof(*summary));
+
+    if (data->n_samples == 0) {
+        return;
+    }
+
+    double sum = 0;
+    bool first = true;
+    for (int s = 0; s < ROLLING_STATS_N_SUBWINDOWS; s++) {
+        RollingStatsSubwindow *subwindow = &data->subwindows[s];
+        if (subwindow->n_samples == 0) {
+            continue;
+        }
+        sum += subwindow->sum;
+        if (first || subwindow->min < summary->min) {
+            summary->min = subwindow->min;
+        }
+        if (first || subwindow->max > summary->max) {
+            summary->max = subwindow->max;
+        }
+        first = false;
+    }
+
+    summary->n_samples = data->n_samples;
+    summary->mean = (float)(sum / data->n_samples);
+
+    /* Nearest-rank percentiles, all three in a single pass over the histogram */
+    uint32_t rank_p50 = (data->n_samples * 50 + 99) / 100;
+    uint32_t rank_p95 = (data->n_samples * 95 + 99) / 100;
+    uint32_t rank_p99 = (data->n_samples * 99 + 99) / 100;
+    float *percentiles[] = { &summary->p50, &summary->p95, &summary->p99 };
+    uint32_t ranks[] = { rank_p50, rank_p95, rank_p99 };
+    int next = 0;
+
+    uint32_t cumulative = 0;
+    for (int b = 0; b < ROLLING_STATS_N_BUCKETS && next < 3; b++) {
+        cumulative += data->histogram[b];
+        while (next < 3 && cumulative >= ranks[next]) {
+            /* The extreme values are known exactly */
+            float value = (float)b;
+            if (value < summary->min) {
+                value = summary->min;
+            }
+            if (value > summary->max) {
+                value = summary->max;
+            }
+            *percentiles[next++] = value;
+        }
+    }
+}
+
+void
+rolling_stats_summarize(RollingStats stats[static 1], int n_cpu_entries, RollingStatsSummary *summaries)
+{
+    int n_windows = stats->windows.n_windows;
+
+    for (int w = 0; w < n_windows; w++) {
+        for (int i = 0; i < n_cpu_entries; i++) {
+            RollingStatsSummary *summary = &summaries[w * n_cpu_entries + i];
+            if (i < stats->n_cpu_entries) {
+                rolling_stats_summarize_window(rolling_stats_data(stats, i, w), summary);
+            } else {
+                memset(summary, 0, sizeof(*summary));
+            }
+        }
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef ROLLING_STATS_H
+#define ROLLING_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Rolling statistics of CPU usage (mean, min, max and percentiles) over several time windows,
+ * for every entry of the samples.
+ *
+ * Each window is divided into ROLLING_STATS_N_SUBWINDOWS sub-windows. Every sub-window keeps a histogram
+ * of the usage values with 1% buckets together with their sum, minimum and maximum, and every window keeps
+ * the sum of the histograms of its sub-windows. Adding a sample is O(1). When the newest sub-window is
+ * full the oldest one is subtracted from the window and reused, so the statistics cover between
+ * (ROLLING_STATS_N_SUBWINDOWS - 1) / ROLLING_STATS_N_SUBWINDOWS of the window and the whole window.
+ * Memory depends only on the number of entries and windows, never on the uptime.
+ * Percentiles are accurate to the bucket width (1%).
+ */
+
+#define ROLLING_STATS_MAX_WINDOWS 4
+#define ROLLING_STATS_N_SUBWINDOWS 6
+/* Usage percentages 0 to 100, rounded to the nearest integer */
+#define ROLLING_STATS_N_BUCKETS 101
+/*
+ * Upper limit on the length of a window. With the shortest sampling interval a sub-window then
+ * holds fewer samples than its 16-bit counters can count.
+ */
+#define ROLLING_STATS_MAX_WINDOW_NS (3600LL * 1000 * 1000 * 1000)
+
+typedef struct {
+    int n_windows;
+    long long window_ns[ROLLING_STATS_MAX_WINDOWS];
+} RollingStatsWindows;
+
+/* 10 s, 1 min and 5 min */
+#define ROLLING_STATS_DEFAULT_WINDOWS "10s,1m,5m"
+
+/*
+ * Parse a comma separated list of window lengths, each a positive integer followed by
+ * "s", "m" or "h" (e.g. "10s,1m,5m"). At most ROLLING_STATS_MAX_WINDOWS windows of at most
+ * ROLLING_STATS_MAX_WINDOW_NS each.
+ * Returns false if the list is invalid.
+ */
+bool rolling_stats_parse_windows(const char *str, RollingStatsWindows windows[static 1]);
+
+/*
+ * Format a window length the way rolling_stats_parse_windows() accepts it, using the largest unit
+ * that divides it ("90s", "5m", "1h").
+ */
+void rolling_stats_format_window(long long window_ns, char out[static 16]);
+
+typedef struct {
+    /* 0 if there were no samples in the window, the other fields are then 0 as well */
+    unsigned n_samples;
+    float mean;
+    float min;
+    float max;
+    float p50;
+    float p95;
+    float p99;
+} RollingStatsSummary;
+
+typedef struct RollingStatsWindowData RollingStatsWindowData;
+
+typedef struct {
+    RollingStatsWindows windows;
+    /* Start of the newest sub-window and its index, for each window */
+    long long subwindow_start_ns[ROLLING_STATS_MAX_WINDOWS];
+    int current_subwindow[ROLLING_STATS_MAX_WINDOWS];
+    bool started;
+    /* Number of entries that have been seen so far, and for how many there is room */
+    int n_cpu_entries;
+    int max_cpu_entries;
+    /* Entry-major: data[i * windows.n_windows + w] is window w of entry i */
+    RollingStatsWindowData *data;
+} RollingStats;
+
+void rolling_stats_init(RollingStats stats[static 1], const RollingStatsWindows windows[static 1]);
+
+void rolling_stats_destroy(RollingStats stats[static 1]);
+
+/*
+ * Add the usage of every entry of a sample taken at timestamp_ns.
+ * Timestamps should increase; a sample older than the newest sub-window is counted in it.
+ * Storage grows if the sample has more entries than any before.
+ */
+void rolling_stats_add(RollingStats stats[static 1], long long timestamp_ns, int n_cpu_entries, const double cpu_usage[n_cpu_entries]);
+
+/*
+ * Forget everything about entry i, e.g. because it now holds a different CPU.
+ */
+void rolling_stats_reset_entry(RollingStats stats[static 1], int i);
+
+/*
+ * Summarize every window for the first n_cpu_entries entries.
+ * summaries is window-major: summaries[w * n_cpu_entries + i] is window w of entry i.
+ */
+void rolling_stats_summarize(RollingStats stats[static 1], int n_cpu_entries, RollingStatsSummary *summaries);
+
+#endif /* ROLLING_STATS_H */
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "sample_format.h"
+#include "cpu_states.h"
+#include "utils.h"
+#include "stage.h"
+#include "thread_utils.h"
+
+/* Upper limit on the length of the parts of a line that don't depend on the number of CPUs */
+#define SAMPLE_FORMAT_MAX_FIXED_LENGTH 128
+/* Upper limit on the length of a value of one CPU, e.g. ,"cpu123":100.00 or ,freq_cpu123 */
+#define SAMPLE_FORMAT_MAX_ENTRY_LENGTH (PROCSTATCPUENTRY_CPU_NAME_SIZE + SAMPLE_FORMAT_MAX_NUMBER_LENGTH + 8)
+
+/* Upper limit on the length of the key and braces of a state in JSON, e.g. ,"guest_nice":{} */
+#define SAMPLE_FORMAT_MAX_STATE_LENGTH 32
+
+/* Beyond this the value is written by printf() in scientific notation */
+#define SAMPLE_FORMAT_MAX_FAST_VALUE 1e15
+
+static const char sample_format_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+size_t
+sample_format_max_line_length(int n_cpu_entries, bool has_states)
+{
+    /* Usage and frequency-weighted usage of every CPU */
+    size_t length = SAMPLE_FORMAT_MAX_FIXED_LENGTH + 2 * (size_t)n_cpu_entries * SAMPLE_FORMAT_MAX_ENTRY_LENGTH;
+    if (has_states) {
+        length += CPU_N_STATES * (SAMPLE_FORMAT_MAX_STATE_LENGTH + (size_t)n_cpu_entries * SAMPLE_FORMAT_MAX_ENTRY_LENGTH);
+    }
+    return length;
+}
+
+static char *
+sample_format_unsigned(char *p, unsigned long long value)
+{
+    /* Written backwards, two digits at a time */
+    char digits[20];
+    char *end = &digits[sizeof(digits)];
+    char *q = end;
+    while (value >= 100) {
+        const char *pair = &sample_format_digit_pairs[2 * (value % 100)];
+        value /= 100;
+        *--q = pair[1];
+        *--q = pair[0];
+    }
+    if (value >= 10) {
+        *--q = sample_format_digit_pairs[2 * value + 1];
+        *--q = sample_format_digit_pairs[2 * value];
+    } else {
+        *--q = (char)('0' + value);
+    }
+
+    size_t length = (size_t)(end - q);
+    memcpy(p, q, length);
+    return p + length;
+}
+
+char *
+sample_format_number(char *p, double value)
+{
+    /* Also NaN */
+    if (!(value > -SAMPLE_FORMAT_MAX_FAST_VALUE && value < SAMPLE_FORMAT_MAX_FAST_VALUE)) {
+        int iret = snprintf(p, SAMPLE_FORMAT_MAX_NUMBER_LENGTH, "%.6e", value);
+        assert(iret > 0 && iret < SAMPLE_FORMAT_MAX_NUMBER_LENGTH);
+        return p + iret;
+    }
+
+    if (value < 0) {
+        *p++ = '-';
+        value = -value;
+    }
+    unsigned long long hundredths = (unsigned long long)(value * 100 + 0.5);
+
+    p = sample_format_unsigned(p, hundredths / 100);
+    *p++ = '.';
+    const char *pair = &sample_format_digit_pairs[2 * (hundredths % 100)];
+    *p++ = pair[0];
+    *p++ = pair[1];
+
+    return p;
+}
+
+/*
+ * Seconds with milliseconds, e.g. 1700000000.123
+ */
+static char *
+sample_format_timestamp(char *p, long long timestamp_ns)
+{
+    assert(timestamp_ns >= 0);
+
+    p = sample_format_unsigned(p, (unsigned long long)(timestamp_ns / NSEC_PER_SEC));
+    unsigned milliseconds = (unsigned)(timestamp_ns % NSEC_PER_SEC / (1000 * 1000));
+    *p++ = '.';
+    *p++ = (char)('0' + milliseconds / 100);
+    const char *pair = &sample_format_digit_pairs[2 * (milliseconds % 100)];
+    *p++ = pair[0];
+    *p++ = pair[1];
+
+    return p;
+}
+
+static char *
+sample_format_string(char *p, const char *s)
+{
+    size_t length = strlen(s);
+    memcpy(p, s, length);
+    return p + length;
+}
+
+/*
+ * "name":
+ */
+static char *
+sample_format_json_key(char *p, const char *cpu_name)
+{
+    *p++ = '"';
+    p = sample_format_string(p, cpu_name);
+    *p++ = '"';
+    *p++ = ':';
+    return p;
+}
+
+size_t
+sample_format_json(char *buffer, unsigned long seq, long long timestamp_ns, int n_cpu_entries,
+        char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage, const CpuStateBreakdown *states)
+{
+    char *p = buffer;
+
+    p = sample_format_string(p, "{\"seq\":");
+    p = sample_format_unsigned(p, seq);
+    p = sample_format_string(p, ",\"timestamp\":");
+    p = sample_format_timestamp(p, timestamp_ns);
+    p = sample_format_string(p, ",\"usage\":{");
+    for (int i = 0; i < n_cpu_entries; i++) {
+        if (i > 0) {
+            *p++ = ',';
+        }
+        p = sample_format_json_key(p, cpu_names[i]);
+        p = sample_format_number(p, cpu_usage[i]);
+    }
+    *p++ = '}';
+
+    if (freq_usage) {
+        p = sample_format_string(p, ",\"freq_usage\":{");
+        for (int i = 0; i < n_cpu_entries; i++) {
+            if (i > 0) {
+                *p++ = ',';
+            }
+            p = sample_format_json_key(p, cpu_names[i]);
+            p = freq_usage[i] >= 0 ? sample_format_number(p, freq_usage[i]) : sample_format_string(p, "null");
+        }
+        *p++ = '}';
+    }
+
+    if (states) {
+        assert(states->n_cpu_entries == n_cpu_entries);
+        p = sample_format_string(p, ",\"states\":{");
+        for (int s = 0; s < CPU_N_STATES; s++) {
+            if (s > 0) {
+                *p++ = ',';
+            }
+            p = sample_format_json_key(p, cpu_state_name((CpuState)s));
+            *p++ = '{';
+            for (int i = 0; i < n_cpu_entries; i++) {
+                if (i > 0) {
+                    *p++ = ',';
+                }
+                p = sample_format_json_key(p, cpu_names[i]);
+                p = sample_format_number(p, states->percentage[s][i]);
+            }
+            *p++ = '}';
+        }
+        *p++ = '}';
+    }
+
+    p = sample_format_string(p, "}\n");
+    *p = '\0';
+
+    assert((size_t)(p - buffer) < sample_format_max_line_length(n_cpu_entries, states != NULL));
+
+    return (size_t)(p - buffer);
+}
+
+size_t
+sample_format_csv_header(char *buffer, int n_cpu_entries, char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE],
+        bool has_freq_usage, bool has_states)
+{
+    char *p = buffer;
+
+    p = sample_format_string(p, "timestamp");
+    for (int i = 0; i < n_cpu_entries; i++) {
+        *p++ = ',';
+        p = sample_format_string(p, cpu_names[i]);
+    }
+    if (has_freq_usage) {
+        for (int i = 0; i < n_cpu_entries; i++) {
+            p = sample_format_string(p, ",freq_");
+            p = sample_format_string(p, cpu_names[i]);
+        }
+    }
+    if (has_states) {
+        for (int s = 0; s < CPU_N_STATES; s++) {
+            for (int i = 0; i < n_cpu_entries; i++) {
+                *p++ = ',';
+                p = sample_format_string(p, cpu_state_name((CpuState)s));
+                *p++ = '_';
+                p = sample_format_string(p, cpu_names[i]);
+            }
+        }
+    }
+    *p++ = '\n';
+    *p = '\0';
+
+    assert((size_t)(p - buffer) < sample_format_max_line_length(n_cpu_entries, has_states));
+
+    return (size_t)(p - buffer);
+}
+
+size_t
+sample_format_csv(char *buffer, long long timestamp_ns, int n_cpu_entries, double cpu_usage[n_cpu_entries],
+        const double *freq_usage, const CpuStateBreakdown *states)
+{
+    char *p = buffer;
+
+    p = sample_format_timestamp(p, timestamp_ns);
+    for (int i = 0; i < n_cpu_entries; i++) {
+        *p++ = ',';
+        p = sample_format_number(p, cpu_usage[i]);
+    }
+    if (freq_usage) {
+        for (int i = 0; i < n_cpu_entries; i++) {
+            *p++ = ',';
+            if (freq_usage[i] >= 0) {
+                p = sample_format_number(p, freq_usage[i]);
+            }
+        }
+    }
+    if (states) {
+        assert(states->n_cpu_entries == n_cpu_entries);
+        for (int s = 0; s < CPU_N_STATES; s++) {
+            for (int i = 0; i < n_cpu_entries; i++) {
+                *p++ = ',';
+                p = sample_format_number(p, states->percentage[s][i]);
+            }
+        }
+    }
+    *p++ = '\n';
+    *p = '\0';
+
+    assert((size_t)(p - buffer) < sample_format_max_line_length(n_cpu_entries, states != NULL));
+
+    return (size_t)(p - buffer);
+}
+
+static void
+usage_sample_alloc(UsageSample *sample, int max_cpu_entries)
+{
+    sample->max_cpu_entries = max_cpu_entries;
+    sample->cpu_names = erealloc(sample->cpu_names, (size_t)max_cpu_entries * sizeof(sample->cpu_names[0]));
+    sample->cpu_usage = erealloc(sample->cpu_usage, (size_t)max_cpu_entries * sizeof(sample->cpu_usage[0]));
+    sample->freq_usage = erealloc(sample->freq_usage, (size_t)max_cpu_entries * sizeof(sample->freq_usage[0]));
+}
+
+void
+usage_sample_slot_init(void *slot, const void *max_cpu_entries)
+{
+    usage_sample_alloc(slot, *(const int *)max_cpu_entries);
+}
+
+void
+usage_sample_slot_destroy(void *slot)
+{
+    UsageSample *sample = slot;
+
+    free(sample->cpu_names);
+    free(sample->cpu_usage);
+    free(sample->freq_usage);
+    cpu_state_breakdown_free(&sample->states);
+}
+
+bool
+usage_sample_submit(StageQueue *queue, long long timestamp_ns, int n_cpu_entries,
+        char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage, const CpuStateBreakdown *states)
+{
+    UsageSample *sample = stage_queue_acquire(queue);
+    if (!sample) {
+        return false;
+    }
+
+    if (n_cpu_entries > sample->max_cpu_entries) {
+        /* The consumer can't see the slot until it's committed, so it's safe to reallocate it */
+        usage_sample_alloc(sample, n_cpu_entries);
+    }
+    sample->timestamp_ns = timestamp_ns;
+    sample->n_cpu_entries = n_cpu_entries;
+    memcpy(sample->cpu_names, cpu_names, (size_t)n_cpu_entries * sizeof(cpu_names[0]));
+    memcpy(sample->cpu_usage, cpu_usage, (size_t)n_cpu_entries * sizeof(cpu_usage[0]));
+    sample->has_freq_usage = freq_usage != NULL;
+    if (freq_usage) {
+        memcpy(sample->freq_usage, freq_usage, (size_t)n_cpu_entries * sizeof(freq_usage[0]));
+    }
+    sample->has_states = states != NULL;
+    if (states) {
+        /* The breakdown grows on its own, it doesn't depend on max_cpu_entries */
+        cpu_state_breakdown_copy(&sample->states, states);
+    }
+
+    stage_queue_commit(queue);
+
+    return true;
+}
@@ -0,0 +1,103 @@
+#ifndef SAMPLE_FORMAT_H
+#define SAMPLE_FORMAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "proc_stat_utils.h"
+#include "cpu_states.h"
+#include "stage.h"
+
+/*
+ * Text encodings of the CPU usage of a sample, one line per sample, for the Server and the Output sinks.
+ *
+ * Numbers are written digit pair by digit pair from a lookup table rather than with printf(), which
+ * parses its format and converts every double at full precision: encoding a sample of 512 CPUs takes
+ * a few microseconds. Usage is in percent with two decimals like "%.2f", except that halfway cases
+ * are rounded away from zero.
+ */
+
+/* Upper limit on the length of a number written by sample_format_number() */
+#define SAMPLE_FORMAT_MAX_NUMBER_LENGTH 32
+
+/*
+ * Upper limit on the length of a line of any of the formats for a sample with n_cpu_entries entries,
+ * with or without the per-state breakdown.
+ */
+size_t sample_format_max_line_length(int n_cpu_entries, bool has_states);
+
+/*
+ * Write value with two decimals at p (not null terminated). Returns the end of the number.
+ */
+char * sample_format_number(char *p, double value);
+
+/*
+ * Encode a sample as a single line of JSON into buffer, which must hold at least
+ * sample_format_max_line_length(n_cpu_entries, states != NULL) bytes, e.g.
+ *   {"seq":7,"timestamp":1700000000.123,"usage":{"cpu":12.50,"cpu0":25.00},"freq_usage":{"cpu":6.25,"cpu0":null}}
+ * seq numbers the samples, so readers can tell how many they missed.
+ * freq_usage is only present if freq_usage isn't NULL (negative, i.e. unknown, values are null).
+ * If states isn't NULL its entries match cpu_names and a "states" object follows with the usage of every CPU
+ * in each state, e.g. "states":{"user":{"cpu":10.00,"cpu0":20.00},"nice":{...},...}
+ * Returns the length of the line, including the newline but not the terminating null byte.
+ */
+size_t sample_format_json(char *buffer, unsigned long seq, long long timestamp_ns, int n_cpu_entries,
+        char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage, const CpuStateBreakdown *states);
+
+/*
+ * Encode the CSV header of the samples with these entries, e.g.
+ *   timestamp,cpu,cpu0,freq_cpu,freq_cpu0,user_cpu,user_cpu0,nice_cpu,...
+ * The freq_ columns are only present if has_freq_usage, the columns of every state (see cpu_state_name())
+ * only if has_states.
+ * Same requirements on buffer and return value as sample_format_json().
+ */
+size_t sample_format_csv_header(char *buffer, int n_cpu_entries, char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE],
+        bool has_freq_usage, bool has_states);
+
+/*
+ * Encode a sample as a CSV line matching sample_format_csv_header(), e.g.
+ *   1700000000.123,12.50,25.00,6.25,
+ * Unknown frequency-weighted usage is an empty field.
+ * Same requirements on buffer and return value as sample_format_json().
+ */
+size_t sample_format_csv(char *buffer, long long timestamp_ns, int n_cpu_entries, double cpu_usage[n_cpu_entries],
+        const double *freq_usage, const CpuStateBreakdown *states);
+
+/*
+ * Usage of a sample, as queued by the Analyzer for the stages that export it (Exporter, Server and Output).
+ * Those stages use it as the slot type of their queue: StageConfig.slot_init is usage_sample_slot_init()
+ * with a pointer to the initial max_cpu_entries as slot_init_arg, slot_destroy is usage_sample_slot_destroy().
+ */
+typedef struct {
+    /* CLOCK_REALTIME time at which the sample was taken */
+    long long timestamp_ns;
+    int n_cpu_entries;
+    /* Only the producer changes the capacity, while it owns the slot */
+    int max_cpu_entries;
+    char (*cpu_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE];
+    double *cpu_usage;
+    bool has_freq_usage;
+    double *freq_usage;
+    /* Only filled if has_states */
+    bool has_states;
+    CpuStateBreakdown states;
+} UsageSample;
+
+void usage_sample_slot_init(void *slot, const void *max_cpu_entries);
+
+void usage_sample_slot_destroy(void *slot);
+
+/*
+ * Copy the usage of a sample into a queue of UsageSample slots, growing the slot if needed.
+ * freq_usage can be NULL if the frequencies aren't known, negative values are unknown as well.
+ * states can be NULL if the per-state breakdown wasn't calculated.
+ * timestamp_ns is the CLOCK_REALTIME time at which the sample was taken.
+ * If the queue is full either waits for a free slot or returns false and counts the sample as dropped,
+ * depending on the backpressure policy of the queue.
+ */
+bool usage_sample_submit(StageQueue *queue, long long timestamp_ns, int n_cpu_entries,
+        char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage, const CpuStateBreakdown *states);
+
+#endif /* SAMPLE_FORMAT_H */
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "screen.h"
+#include "utils.h"
+#include "stats.h"
+
+/*
+ * Unchanged cells between two changed ones are re-sent instead of moving the cursor
+ * if there are at most this many of them (a cursor movement takes up to 10 bytes).
+ */
+#define SCREEN_MAX_RESENT_GAP 8
+
+void
+screen_init(Screen screen[static 1], int n_rows, int n_cols)
+{
+    memset(screen, 0, sizeof(*screen));
+    screen_resize(screen, n_rows, n_cols);
+}
+
+void
+screen_destroy(Screen screen[static 1])
+{
+    free(screen->cells);
+    free(screen->previous_cells);
+    free(screen->output);
+    memset(screen, 0, sizeof(*screen));
+}
+
+void
+screen_resize(Screen screen[static 1], int n_rows, int n_cols)
+{
+    assert(n_rows >= 0 && n_cols >= 0);
+
+    if (screen->cells && screen->n_rows == n_rows && screen->n_cols == n_cols) {
+        return;
+    }
+
+    size_t n_cells = (size_t)n_rows * (size_t)n_cols;
+
+    screen->n_rows = n_rows;
+    screen->n_cols = n_cols;
+    /* One extra cell so that an empty frame still has a valid buffer */
+    screen->cells = erealloc(screen->cells, (n_cells + 1) * sizeof(screen->cells[0]));
+    screen->previous_cells = erealloc(screen->previous_cells, (n_cells + 1) * sizeof(screen->previous_cells[0]));
+    screen->full_redraw = true;
+
+    screen_clear(screen);
+}
+
+void
+screen_clear(Screen screen[static 1])
+{
+    for (int i = 0; i < screen->n_rows * screen->n_cols; i++) {
+        screen->cells[i] = ' ';
+    }
+}
+
+void
+screen_fill(Screen screen[static 1], int row, int col, int n, uint32_t code_point)
+{
+    if (row < 0 || row >= screen->n_rows) {
+        return;
+    }
+
+    int first = col < 0 ? 0 : col;
+    int last = col + n < screen->n_cols ? col + n : screen->n_cols;
+
+    for (int i = first; i < last; i++) {
+        screen->cells[row * screen->n_cols + i] = code_point;
+    }
+}
+
+int
+screen_put_text(Screen screen[static 1], int row, int col, const char *text)
+{
+    for (; *text; text++, col++) {
+        if (row >= 0 && row < screen->n_rows && col >= 0 && col < screen->n_cols) {
+            screen->cells[row * screen->n_cols + col] = (unsigned char)*text;
+        }
+    }
+    return col;
+}
+
+int
+screen_printf(Screen screen[static 1], int row, int col, const char *format, ...)
+{
+    char text[256];
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    return screen_put_text(screen, row, col, text);
+}
+
+/*
+ * Make room for at least n more bytes of output.
+ */
+static void
+screen_reserve_output(Screen screen[static 1], size_t used, size_t n)
+{
+    if (used + n <= screen->output_capacity) {
+        return;
+    }
+
+    size_t capacity = screen->output_capacity ? screen->output_capacity : 4096;
+    while (capacity < used + n) {
+        capacity *= 2;
+    }
+    screen->output = erealloc(screen->output, capacity);
+    screen->output_capacity = capacity;
+}
+
+static size_t
+screen_encode_utf8(uint32_t code_point, char out[static 4])
+{
+    if (code_point < 0x80) {
+        out[0] = (char)code_point;
+        return 1;
+    }
+    if (code_point < 0x800) {
+        out[0] = (char)(0xc0 | (code_point >> 6));
+        out[1] = (char)(0x80 | (code_point & 0x3f));
+        return 2;
+    }
+    if (code_point < 0x10000) {
+        out[0] = (char)(0xe0 | (code_point >> 12));
+        out[1] = (char)(0x80 | ((code_point >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (code_point & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (code_point >> 18));
+    out[1] = (char)(0x80 | ((code_point >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((code_point >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (code_point & 0x3f));
+    return 4;
+}
+
+const char *
+screen_compose(Screen screen[static 1], size_t length[static 1])
+{
+    size_t used = 0;
+
+    if (screen->full_redraw) {
+        /* The terminal gets cleared, so only the cells that aren't spaces have to be sent */
+        static const char clear[] = "\033[H\033[J";
+        screen_reserve_output(screen, used, sizeof(clear));
+        memcpy(screen->output, clear, sizeof(clear) - 1);
+        used += sizeof(clear) - 1;
+        for (int i = 0; i < screen->n_rows * screen->n_cols; i++) {
+            screen->previous_cells[i] = ' ';
+        }
+    }
+
+    bool changed = false;
+
+    for (int row = 0; row < screen->n_rows; row++) {
+        uint32_t *cells = &screen->cells[row * screen->n_cols];
+        uint32_t *previous_cells = &screen->previous_cells[row * screen->n_cols];
+
+        int col = 0;
+        while (col < screen->n_cols) {
+            if (cells[col] == previous_cells[col]) {
+                col++;
+                continue;
+            }
+
+            /* Find the end of the run of changed cells, bridging short gaps of unchanged ones */
+            int run_end = col + 1;
+            int last_changed = col;
+            while (run_end < screen->n_cols && run_end - last_changed <= SCREEN_MAX_RESENT_GAP) {
+                if (cells[run_end] != previous_cells[run_end]) {
+                    last_changed = run_end;
+                }
+                run_end++;
+            }
+            run_end = last_changed + 1;
+
+            screen_reserve_output(screen, used, 32 + (size_t)(run_end - col) * 4);
+            used += (size_t)sprintf(&screen->output[used], "\033[%d;%dH", row + 1, col + 1);
+            for (; col < run_end; col++) {
+                used += screen_encode_utf8(cells[col], &screen->output[used]);
+            }
+
+            changed = true;
+        }
+    }
+
+    if (changed || screen->full_redraw) {
+        /* Leave the cursor below the frame */
+        screen_reserve_output(screen, used, 32);
+        used += (size_t)sprintf(&screen->output[used], "\033[%d;1H", screen->n_rows + 1);
+    }
+
+    memcpy(screen->previous_cells, screen->cells, (size_t)screen->n_rows * (size_t)screen->n_cols * sizeof(screen->cells[0]));
+    screen->full_redraw = false;
+
+    *length = used;
+    return screen->output;
+}
+
+bool
+screen_flush(Screen screen[static 1], int fd)
+{
+    size_t length;
+    const char *output = screen_compose(screen, &length);
+
+    while (length > 0) {
+        ssize_t n = write(fd, output, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        stats_counter_add(STATS_COUNTER_SCREEN_BYTES_WRITTEN, (unsigned long)n);
+        output += n;
+        length -= (size_t)n;
+    }
+
+    return true;
+}
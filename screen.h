@@ -0,0 +1,78 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frame buffer for differential terminal output.
+ *
+ * A frame is drawn into a grid of cells (one Unicode code point each, all assumed to be one column wide)
+ * and then sent to the terminal with screen_flush(). Only the cells that differ from the previously
+ * sent frame are emitted, using cursor addressing, and the whole frame goes out in a single write().
+ * The first frame and the first frame after screen_resize() clear the terminal and redraw everything.
+ */
+typedef struct {
+    int n_rows;
+    int n_cols;
+    /* The frame being drawn */
+    uint32_t *cells;
+    /* The frame the terminal currently shows */
+    uint32_t *previous_cells;
+    bool full_redraw;
+    char *output;
+    size_t output_capacity;
+} Screen;
+
+void screen_init(Screen screen[static 1], int n_rows, int n_cols);
+
+void screen_destroy(Screen screen[static 1]);
+
+/*
+ * Change the size of the frame. Does nothing if the size doesn't change,
+ * otherwise the frame is cleared and the next flush redraws the whole terminal.
+ */
+void screen_resize(Screen screen[static 1], int n_rows, int n_cols);
+
+/*
+ * Fill the whole frame with spaces.
+ */
+void screen_clear(Screen screen[static 1]);
+
+/*
+ * Set n cells of a row starting at col to code_point. Cells outside of the frame are ignored.
+ */
+void screen_fill(Screen screen[static 1], int row, int col, int n, uint32_t code_point);
+
+/*
+ * Draw ASCII text starting at the given cell, clipped to the frame.
+ * Returns the column following the text.
+ */
+int screen_put_text(Screen screen[static 1], int row, int col, const char *text);
+
+/*
+ * printf() counterpart of screen_put_text(). Output longer than 255 characters is truncated.
+ */
+int screen_printf(Screen screen[static 1], int row, int col, const char *format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 4, 5)))
+#endif
+    ;
+
+/*
+ * Build the terminal output that turns the previously sent frame into the current one,
+ * and consider the current frame sent.
+ * Returns a pointer to the output (valid until the next call) and sets length, which is 0 if
+ * nothing changed.
+ */
+const char * screen_compose(Screen screen[static 1], size_t length[static 1]);
+
+/*
+ * screen_compose() and write the result to fd with a single write() (repeated only if
+ * the kernel accepts it partially). Nothing is written if nothing changed.
+ * Returns false if writing failed.
+ */
+bool screen_flush(Screen screen[static 1], int fd);
+
+#endif /* SCREEN_H */
@@ -0,0 +1,533 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "sample_format.h"
+#include "utils.h"
+#include "stage.h"
+#include "stats.h"
+#include "thread_utils.h"
+#include "logger.h"
+
+/* Must be a power of two */
+#define SERVER_QUEUE_DEPTH 16
+/* Samples queued for a client at most, must be a power of two */
+#define SERVER_CLIENT_BACKLOG 64
+#define SERVER_LISTEN_BACKLOG 16
+/* How often new connections and hang-ups are checked for when no sample arrives */
+#define SERVER_POLL_INTERVAL_SECONDS 0.1
+
+/*
+ * Encoding of a sample, shared by all the clients it's queued for.
+ * Only the Server thread uses messages, so the reference count isn't atomic.
+ */
+typedef struct ServerMessage {
+    /* Clients the message is queued for, it goes back to the pool when the last one has written it */
+    int n_references;
+    size_t length;
+    size_t capacity;
+    char *data;
+    /* Next message of the pool */
+    struct ServerMessage *next;
+} ServerMessage;
+
+typedef struct {
+    int fd;
+    unsigned long id;
+    /* Ring of the messages queued for the client, the oldest one at head */
+    ServerMessage *backlog[SERVER_CLIENT_BACKLOG];
+    unsigned head;
+    /* Bytes of the oldest message already written */
+    size_t head_offset;
+    /* Time of the last write, or of the queueing of a message when none was pending */
+    long long last_progress_ns;
+    /* Only written by the Server thread, read by server_clients_metrics() */
+    unsigned n_pending;
+    size_t n_bytes_pending;
+    unsigned long n_samples_sent;
+    unsigned long n_samples_skipped;
+} ServerClient;
+
+typedef struct {
+    ServerArgs *args;
+    ServerQueue *queue;
+    /* Messages that aren't queued for any client, reused for the following samples */
+    ServerMessage *free_messages;
+    unsigned long n_samples;
+    unsigned long n_connections;
+    bool did_log_too_many_clients;
+    struct pollfd poll_fds[1 + SERVER_MAX_CLIENTS];
+} ServerPrivateState;
+
+static Stage server_stage = STAGE_INITIALIZER;
+
+/*
+ * Only the Server thread adds and removes clients, with the lock acquired,
+ * so it doesn't need the lock to access them otherwise.
+ */
+static struct {
+    ServerClient clients[SERVER_MAX_CLIENTS];
+    int n_clients;
+} shared;
+
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+server_listen(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        /* Only a socket nobody listens on anymore is replaced */
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+            close(fd);
+            errno = EADDRINUSE;
+            return -1;
+        }
+        unlink(path);
+    }
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0
+            || listen(fd, SERVER_LISTEN_BACKLOG) != 0
+            || fcntl(fd, F_SETFL, O_NONBLOCK) != 0
+            || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return fd;
+}
+
+static ServerMessage *
+server_message_get(ServerPrivateState *priv, size_t min_capacity)
+{
+    ServerMessage *message = priv->free_messages;
+    if (message) {
+        priv->free_messages = message->next;
+    } else {
+        message = ecalloc(1, sizeof(*message));
+    }
+
+    if (message->capacity < min_capacity) {
+        message->data = erealloc(message->data, min_capacity);
+        message->capacity = min_capacity;
+    }
+    message->n_references = 0;
+
+    return message;
+}
+
+static void
+server_message_put(ServerPrivateState *priv, ServerMessage *message)
+{
+    message->next = priv->free_messages;
+    priv->free_messages = message;
+}
+
+static void
+server_message_release(ServerPrivateState *priv, ServerMessage *message)
+{
+    assert(message->n_references > 0);
+
+    message->n_references--;
+    if (message->n_references == 0) {
+        server_message_put(priv, message);
+    }
+}
+
+static void
+server_client_enqueue(ServerClient *client, ServerMessage *message, long long now_ns)
+{
+    if (client->n_pending == SERVER_CLIENT_BACKLOG) {
+        __atomic_store_n(&client->n_samples_skipped, client->n_samples_skipped + 1, __ATOMIC_RELAXED);
+        stats_counter_add(STATS_COUNTER_SERVER_SAMPLES_SKIPPED, 1);
+        return;
+    }
+
+    if (client->n_pending == 0) {
+        client->last_progress_ns = now_ns;
+    }
+
+    client->backlog[(client->head + client->n_pending) & (SERVER_CLIENT_BACKLOG - 1)] = message;
+    message->n_references++;
+    __atomic_store_n(&client->n_pending, client->n_pending + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&client->n_bytes_pending, client->n_bytes_pending + message->length, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write as much of the backlog of the client as its socket accepts without blocking.
+ * Returns false if the client is gone.
+ */
+static bool
+server_client_flush(ServerPrivateState *priv, ServerClient *client, long long now_ns)
+{
+    while (client->n_pending > 0) {
+        struct iovec iov[SERVER_CLIENT_BACKLOG];
+        for (unsigned i = 0; i < client->n_pending; i++) {
+            ServerMessage *message = client->backlog[(client->head + i) & (SERVER_CLIENT_BACKLOG - 1)];
+            size_t offset = i == 0 ? client->head_offset : 0;
+            iov[i].iov_base = &message->data[offset];
+            iov[i].iov_len = message->length - offset;
+        }
+
+        /* sendmsg() is writev() with flags: a client that hung up must not raise SIGPIPE */
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = client->n_pending };
+        ssize_t n = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        stats_counter_add(STATS_COUNTER_SERVER_BYTES_WRITTEN, (unsigned long)n);
+        client->last_progress_ns = now_ns;
+        __atomic_store_n(&client->n_bytes_pending, client->n_bytes_pending - (size_t)n, __ATOMIC_RELAXED);
+
+        size_t n_written = (size_t)n;
+        while (n_written > 0) {
+            ServerMessage *message = client->backlog[client->head];
+            size_t remaining = message->length - client->head_offset;
+            if (n_written < remaining) {
+                client->head_offset += n_written;
+                break;
+            }
+            n_written -= remaining;
+            client->head_offset = 0;
+            client->head = (client->head + 1) & (SERVER_CLIENT_BACKLOG - 1);
+            __atomic_store_n(&client->n_pending, client->n_pending - 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&client->n_samples_sent, client->n_samples_sent + 1, __ATOMIC_RELAXED);
+            server_message_release(priv, message);
+        }
+    }
+
+    return true;
+}
+
+static void
+server_add_client(ServerPrivateState *priv, int fd)
+{
+    int iret = pthread_mutex_lock(&server_lock);
+    assert(iret == 0);
+    pthread_cleanup_push(cleanup_mutex_unlock, &server_lock);
+
+    ServerClient *client = &shared.clients[shared.n_clients];
+    memset(client, 0, sizeof(*client));
+    client->fd = fd;
+    client->id = ++priv->n_connections;
+    shared.n_clients++;
+
+    pthread_cleanup_pop(1);
+}
+
+/*
+ * Disconnect the i-th client. The last client takes its place.
+ */
+static void
+server_remove_client(ServerPrivateState *priv, int i, const char *reason)
+{
+    ServerClient client;
+
+    int iret = pthread_mutex_lock(&server_lock);
+    assert(iret == 0);
+    pthread_cleanup_push(cleanup_mutex_unlock, &server_lock);
+
+    client = shared.clients[i];
+    shared.n_clients--;
+    if (i != shared.n_clients) {
+        shared.clients[i] = shared.clients[shared.n_clients];
+    }
+
+    pthread_cleanup_pop(1);
+
+    stats_gauge_set(STATS_GAUGE_SERVER_CLIENTS, shared.n_clients);
+
+    ELOG("Client %lu disconnected (%s): %lu samples sent, %lu skipped, %u pending", client.id, reason,
+            client.n_samples_sent, client.n_samples_skipped, client.n_pending);
+
+    for (unsigned k = 0; k < client.n_pending; k++) {
+        server_message_release(priv, client.backlog[(client.head + k) & (SERVER_CLIENT_BACKLOG - 1)]);
+    }
+    close(client.fd);
+}
+
+static void
+server_accept_clients(ServerPrivateState *priv)
+{
+    while (1) {
+        int fd = accept(priv->args->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                ELOG("accept() failed: %s", strerror(errno));
+            }
+            if (errno != EINTR && errno != ECONNABORTED) {
+                return;
+            }
+            continue;
+        }
+
+        if (shared.n_clients == SERVER_MAX_CLIENTS) {
+            if (!priv->did_log_too_many_clients) {
+                ELOG("Too many clients, connections are refused (at most %d)", SERVER_MAX_CLIENTS);
+                priv->did_log_too_many_clients = true;
+            }
+            close(fd);
+            continue;
+        }
+        priv->did_log_too_many_clients = false;
+
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+            ELOG("fcntl() failed: %s", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        server_add_client(priv, fd);
+        stats_gauge_set(STATS_GAUGE_SERVER_CLIENTS, shared.n_clients);
+        ELOG("Client %lu connected", shared.clients[shared.n_clients - 1].id);
+    }
+}
+
+/*
+ * Accept new connections and drop the clients that hung up, without blocking.
+ */
+static void
+server_poll_sockets(ServerPrivateState *priv)
+{
+    int n_clients = shared.n_clients;
+
+    priv->poll_fds[0].fd = priv->args->listen_fd;
+    priv->poll_fds[0].events = POLLIN;
+    for (int i = 0; i < n_clients; i++) {
+        priv->poll_fds[1 + i].fd = shared.clients[i].fd;
+        priv->poll_fds[1 + i].events = POLLIN;
+    }
+
+    int n_ready = poll(priv->poll_fds, (nfds_t)(1 + n_clients), 0);
+    if (n_ready <= 0) {
+        return;
+    }
+
+    /* Backwards, so that the client taking the place of a removed one has already been checked */
+    for (int i = n_clients - 1; i >= 0; i--) {
+        short revents = priv->poll_fds[1 + i].revents;
+        if (revents & (POLLIN | POLLHUP | POLLERR)) {
+            /* Anything the client sends is discarded, end of file or an error means it hung up */
+            char discarded[256];
+            ssize_t n = recv(shared.clients[i].fd, discarded, sizeof(discarded), MSG_DONTWAIT);
+            if (n == 0) {
+                server_remove_client(priv, i, "hung up");
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                server_remove_client(priv, i, strerror(errno));
+            } else if (n < 0 && (revents & POLLERR)) {
+                server_remove_client(priv, i, "socket error");
+            }
+        }
+    }
+
+    if (priv->poll_fds[0].revents & POLLIN) {
+        server_accept_clients(priv);
+    }
+}
+
+static void
+server_flush_clients(ServerPrivateState *priv)
+{
+    long long now_ns = clock_now_ns(CLOCK_MONOTONIC);
+
+    for (int i = shared.n_clients - 1; i >= 0; i--) {
+        ServerClient *client = &shared.clients[i];
+        if (!server_client_flush(priv, client, now_ns)) {
+            server_remove_client(priv, i, strerror(errno));
+        } else if (client->n_pending > 0 && now_ns - client->last_progress_ns > SERVER_CLIENT_TIMEOUT_SECONDS * NSEC_PER_SEC) {
+            server_remove_client(priv, i, "not reading");
+        }
+    }
+}
+
+/*
+ * Encode every submitted sample once and queue it for all the clients.
+ */
+static void
+server_broadcast_submitted_data(ServerPrivateState *priv)
+{
+    long long now_ns = clock_now_ns(CLOCK_MONOTONIC);
+
+    for (unsigned n_readable = stage_queue_n_readable(priv->queue); n_readable > 0; n_readable--) {
+        UsageSample *slot = stage_queue_peek(priv->queue, 0);
+        priv->n_samples++;
+
+        if (shared.n_clients > 0) {
+            ServerMessage *message = server_message_get(priv, sample_format_max_line_length(slot->n_cpu_entries, slot->has_states));
+            message->length = sample_format_json(message->data, priv->n_samples, slot->timestamp_ns, slot->n_cpu_entries,
+                    slot->cpu_names, slot->cpu_usage, slot->has_freq_usage ? slot->freq_usage : NULL,
+                    slot->has_states ? &slot->states : NULL);
+
+            for (int i = 0; i < shared.n_clients; i++) {
+                server_client_enqueue(&shared.clients[i], message, now_ns);
+            }
+            if (message->n_references == 0) {
+                server_message_put(priv, message);
+            }
+        }
+
+        stage_queue_release(priv->queue);
+    }
+}
+
+int
+server_clients_metrics(int max_clients, ServerClientMetrics metrics[max_clients])
+{
+    int n_clients;
+
+    int iret = pthread_mutex_lock(&server_lock);
+    assert(iret == 0);
+    pthread_cleanup_push(cleanup_mutex_unlock, &server_lock);
+
+    n_clients = shared.n_clients;
+    for (int i = 0; i < n_clients && i < max_clients; i++) {
+        ServerClient *client = &shared.clients[i];
+        metrics[i] = (ServerClientMetrics){
+            .id = client->id,
+            .n_samples_sent = __atomic_load_n(&client->n_samples_sent, __ATOMIC_RELAXED),
+            .n_samples_skipped = __atomic_load_n(&client->n_samples_skipped, __ATOMIC_RELAXED),
+            .n_samples_pending = __atomic_load_n(&client->n_pending, __ATOMIC_RELAXED),
+            .n_bytes_pending = __atomic_load_n(&client->n_bytes_pending, __ATOMIC_RELAXED),
+        };
+    }
+
+    pthread_cleanup_pop(1);
+
+    return n_clients;
+}
+
+void
+server_log_clients(void)
+{
+    ServerClientMetrics metrics[SERVER_MAX_CLIENTS];
+    int n_clients = server_clients_metrics(SERVER_MAX_CLIENTS, metrics);
+
+    for (int i = 0; i < n_clients; i++) {
+        ELOG("Client %lu: %lu samples sent, %lu skipped, lag %u samples (%zu bytes)", metrics[i].id,
+                metrics[i].n_samples_sent, metrics[i].n_samples_skipped, metrics[i].n_samples_pending,
+                metrics[i].n_bytes_pending);
+    }
+}
+
+static void
+server_deinit(void *arg)
+{
+    ServerPrivateState *priv = arg;
+
+    stage_close(&server_stage, priv->queue);
+
+    for (int i = shared.n_clients - 1; i >= 0; i--) {
+        server_remove_client(priv, i, "exiting");
+    }
+
+    while (priv->free_messages) {
+        ServerMessage *message = priv->free_messages;
+        priv->free_messages = message->next;
+        free(message->data);
+        free(message);
+    }
+
+    close(priv->args->listen_fd);
+    unlink(priv->args->path);
+
+    free(priv->args->path);
+    free(priv->args);
+
+    free(priv);
+}
+
+static ServerPrivateState *
+server_init(void *arg)
+{
+    ServerPrivateState *priv = ecalloc(1, sizeof(*priv));
+
+    priv->args = arg;
+
+    assert(priv->args->listen_fd >= 0 && priv->args->path);
+
+    StageConfig config = {
+        .name = "Server",
+        .depth = SERVER_QUEUE_DEPTH,
+        .slot_size = sizeof(UsageSample),
+        .backpressure = STAGE_BACKPRESSURE_DROP,
+        .slot_init = usage_sample_slot_init,
+        .slot_init_arg = &priv->args->max_cpu_entries,
+        .slot_destroy = usage_sample_slot_destroy,
+        .use_watchdog = priv->args->use_watchdog,
+        .dropped_counter = STATS_COUNTER_SERVER_SAMPLES_DROPPED,
+        .depth_gauge = STATS_GAUGE_SERVER_QUEUE_DEPTH,
+    };
+    priv->queue = stage_open(&server_stage, &config);
+
+    return priv;
+}
+
+static void
+server_loop(ServerPrivateState *priv)
+{
+    while (1) {
+        bool did_retrieve_data = stage_queue_wait(priv->queue, SERVER_POLL_INTERVAL_SECONDS);
+        if (did_retrieve_data) {
+            server_broadcast_submitted_data(priv);
+        }
+        server_poll_sockets(priv);
+        server_flush_clients(priv);
+    }
+}
+
+void *
+server_run(void *arg)
+{
+    assert(arg);
+
+    ServerPrivateState *priv = server_init(arg);
+
+    pthread_cleanup_push(server_deinit, priv);
+
+    server_loop(priv);
+
+    pthread_cleanup_pop(1);
+
+    pthread_exit(NULL);
+}
+
+ServerQueue *
+server_queue_attach(void)
+{
+    return stage_attach(&server_stage);
+}
+
+void
+server_queue_detach(ServerQueue *queue)
+{
+    stage_detach(&server_stage, queue);
+}
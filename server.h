@@ -0,0 +1,87 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+
+#include "proc_stat_utils.h"
+#include "stage.h"
+
+/* Upper limit on the number of connected clients, more are turned away */
+#define SERVER_MAX_CLIENTS 64
+/* A client with queued samples that doesn't accept any data for this long is disconnected */
+#define SERVER_CLIENT_TIMEOUT_SECONDS 10
+
+typedef struct {
+    /* Listening socket returned by server_listen(), Server takes ownership of it */
+    int listen_fd;
+    /* Path the socket is bound to, removed when the Server exits. Server takes ownership of the string. */
+    char *path;
+    /* Initial capacity of the queue slots and the messages, they grow when more CPUs come online */
+    int max_cpu_entries;
+    bool use_watchdog;
+} ServerArgs;
+
+/*
+ * Create a Unix domain stream socket listening on path.
+ * A socket left over at path by a crashed instance is replaced, but not one that is still being listened
+ * on (errno is then EADDRINUSE) or any other file.
+ * Returns the socket or -1 on error (errno is set).
+ */
+int server_listen(const char *path);
+
+/*
+ * Thread that streams the CPU usage of every sample submitted to its queue to all the clients
+ * connected to its socket, one JSON object per line (see sample_format_json()).
+ *
+ * Each sample is encoded once into a reference counted message that is queued for every client
+ * and written with non-blocking vectored writes, so one client never delays another or the pipeline.
+ * A client that doesn't keep up with the samples skips them while its backlog is full, and is
+ * disconnected if it doesn't accept any data for SERVER_CLIENT_TIMEOUT_SECONDS.
+ * Data sent by the clients is ignored.
+ */
+void * server_run(void *arg);
+
+/*
+ * Input queue of the Server, a stage queue (stage.h) of preallocated UsageSample slots (sample_format.h)
+ * filled by usage_sample_submit(), so only one thread at a time may submit data to the Server.
+ * Submitting never blocks, samples are dropped when the queue is full.
+ */
+typedef StageQueue ServerQueue;
+
+/*
+ * Attach to the Server's input queue as its producer.
+ * Blocks until the Server thread is initialized.
+ * The returned queue stays valid until server_queue_detach() is called, even if
+ * the Server thread exits in the meantime.
+ */
+ServerQueue * server_queue_attach(void);
+
+void server_queue_detach(ServerQueue *queue);
+
+/*
+ * Counters of a connected client.
+ */
+typedef struct {
+    /* Number of the client, in the order of the connections since the Server started */
+    unsigned long id;
+    /* Samples written to the client entirely */
+    unsigned long n_samples_sent;
+    /* Samples the client missed because its backlog was full */
+    unsigned long n_samples_skipped;
+    /* Lag: samples queued for the client and not yet written entirely, and their remaining bytes */
+    unsigned n_samples_pending;
+    size_t n_bytes_pending;
+} ServerClientMetrics;
+
+/*
+ * Copy the counters of up to max_clients connected clients into metrics.
+ * Returns the number of connected clients. Can be called by any thread.
+ */
+int server_clients_metrics(int max_clients, ServerClientMetrics metrics[max_clients]);
+
+/*
+ * Log the counters of every connected client. Can be called by any thread.
+ */
+void server_log_clients(void);
+
+#endif /* SERVER_H */
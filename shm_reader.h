@@ -0,0 +1,202 @@
+#ifndef SHM_READER_H
+#define SHM_READER_H
+
+/*
+ * Header-only reader of the CPU usage published by cut --shm NAME (see shm_writer.h).
+ * Self-contained, so other programs can copy this file. Requires GCC or Clang (__atomic builtins),
+ * link with -lrt on older glibc.
+ *
+ * The POSIX shared memory segment holds the latest sample, protected by a seqlock: the writer makes
+ * the sequence odd while it updates the sample and even again when it's done, and a reader copies
+ * the sample and retries if the sequence changed in the meantime. Reading takes no system call and
+ * no lock, any number of processes can read at the same time and readers never delay the writer.
+ *
+ * Segment layout (native byte order, the segment is only shared between processes of one host):
+ *  header, SHM_HEADER_SIZE bytes: see ShmHeader, the seqlock has its own cache line
+ *  char cpu_names[max_cpu_entries][SHM_CPU_NAME_SIZE]: "cpu", "cpu0", "cpu1", ... (null terminated)
+ *  double cpu_usage[max_cpu_entries]: usage in percent, entry 0 is the aggregate of all CPUs
+ *  double freq_usage[max_cpu_entries]: frequency-weighted usage in percent, negative if unknown
+ *
+ * Usage:
+ *   ShmReader reader;
+ *   if (shm_reader_open(&reader, "/cut")) {
+ *       int max = shm_reader_max_cpu_entries(&reader);
+ *       ... allocate max names and usage values ...
+ *       ShmSample sample;
+ *       if (shm_reader_read(&reader, &sample, names, usage, NULL) && sample.n_samples > 0) ...
+ *       shm_reader_close(&reader);
+ *   }
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_MAGIC "CUTSHM\0\1"
+#define SHM_VERSION 1
+#define SHM_CPU_NAME_SIZE 16
+#define SHM_HEADER_SIZE 128
+
+/* Attempts of shm_reader_read() to get a consistent copy, e.g. if the writer died while updating */
+#define SHM_READER_MAX_RETRIES 100000
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_cpu_entries;
+    /* Process ID of the writer */
+    int32_t pid;
+    char padding0[44];
+    /* Seqlock, odd while the writer updates the fields below and the arrays */
+    uint64_t sequence;
+    /* Samples published since the writer started, 0 if there is no sample yet */
+    uint64_t n_samples;
+    /* Time at which the sample was taken (CLOCK_REALTIME) */
+    int64_t timestamp_ns;
+    uint32_t n_cpu_entries;
+    uint32_t has_freq_usage;
+    char padding1[32];
+} ShmHeader;
+
+typedef struct {
+    uint64_t n_samples;
+    int64_t timestamp_ns;
+    int n_cpu_entries;
+    bool has_freq_usage;
+} ShmSample;
+
+typedef struct {
+    ShmHeader *header;
+    size_t size;
+} ShmReader;
+
+static inline size_t
+shm_segment_size(uint32_t max_cpu_entries)
+{
+    return SHM_HEADER_SIZE + (size_t)max_cpu_entries * (SHM_CPU_NAME_SIZE + 2 * sizeof(double));
+}
+
+static inline char (*shm_cpu_names(ShmHeader *header))[SHM_CPU_NAME_SIZE]
+{
+    return (char (*)[SHM_CPU_NAME_SIZE])((char *)header + SHM_HEADER_SIZE);
+}
+
+static inline double *
+shm_cpu_usage(ShmHeader *header)
+{
+    return (double *)((char *)header + SHM_HEADER_SIZE + (size_t)header->max_cpu_entries * SHM_CPU_NAME_SIZE);
+}
+
+static inline double *
+shm_freq_usage(ShmHeader *header)
+{
+    return &shm_cpu_usage(header)[header->max_cpu_entries];
+}
+
+/*
+ * Map the segment published under name (e.g. "/cut") read-only.
+ * Returns false if it doesn't exist or isn't a segment of a supported version.
+ */
+static inline bool
+shm_reader_open(ShmReader reader[static 1], const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < SHM_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    ShmHeader *header = map;
+    if (memcmp(header->magic, SHM_MAGIC, sizeof(header->magic)) != 0 || header->version != SHM_VERSION
+            || shm_segment_size(header->max_cpu_entries) > (size_t)st.st_size) {
+        munmap(map, (size_t)st.st_size);
+        return false;
+    }
+
+    reader->header = header;
+    reader->size = (size_t)st.st_size;
+
+    return true;
+}
+
+static inline void
+shm_reader_close(ShmReader reader[static 1])
+{
+    munmap(reader->header, reader->size);
+    reader->header = NULL;
+}
+
+/*
+ * Number of entries the arrays passed to shm_reader_read() must hold.
+ */
+static inline int
+shm_reader_max_cpu_entries(const ShmReader reader[static 1])
+{
+    return (int)reader->header->max_cpu_entries;
+}
+
+/*
+ * Copy a consistent snapshot of the latest sample: sample->n_cpu_entries entries of each array.
+ * The arrays must hold shm_reader_max_cpu_entries() entries, cpu_names and freq_usage can be NULL
+ * if they aren't needed (names only change when CPUs go online or offline).
+ * sample->n_samples is 0 if nothing was published yet, and grows by one with every sample, so a reader
+ * polling it can tell whether the sample is new and how many it missed.
+ * Returns false if no consistent snapshot could be read within SHM_READER_MAX_RETRIES attempts.
+ */
+static inline bool
+shm_reader_read(const ShmReader reader[static 1], ShmSample sample[static 1],
+        char (*cpu_names)[SHM_CPU_NAME_SIZE], double *cpu_usage, double *freq_usage)
+{
+    ShmHeader *header = reader->header;
+
+    for (int i = 0; i < SHM_READER_MAX_RETRIES; i++) {
+        uint64_t sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            continue;
+        }
+
+        sample->n_samples = header->n_samples;
+        sample->timestamp_ns = header->timestamp_ns;
+        uint32_t n_cpu_entries = header->n_cpu_entries;
+        if (n_cpu_entries > header->max_cpu_entries) {
+            /* Torn read, the sequence has changed */
+            continue;
+        }
+        sample->n_cpu_entries = (int)n_cpu_entries;
+        sample->has_freq_usage = header->has_freq_usage != 0;
+
+        if (cpu_names) {
+            memcpy(cpu_names, shm_cpu_names(header), n_cpu_entries * sizeof(cpu_names[0]));
+        }
+        memcpy(cpu_usage, shm_cpu_usage(header), n_cpu_entries * sizeof(cpu_usage[0]));
+        if (freq_usage) {
+            memcpy(freq_usage, shm_freq_usage(header), n_cpu_entries * sizeof(freq_usage[0]));
+        }
+
+        /* The copies must complete before the sequence is checked again */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->sequence, __ATOMIC_RELAXED) == sequence) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#endif /* SHM_READER_H */
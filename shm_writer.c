@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "shm_writer.h"
+#include "shm_reader.h"
+#include "utils.h"
+
+struct ShmWriter {
+    char *name;
+    ShmHeader *header;
+    size_t size;
+    char (*cpu_names)[SHM_CPU_NAME_SIZE];
+    double *cpu_usage;
+    double *freq_usage;
+};
+
+/*
+ * Whether the segment name was created by a process that is still running.
+ */
+static bool
+shm_writer_is_in_use(const char *name)
+{
+    ShmReader reader;
+    if (!shm_reader_open(&reader, name)) {
+        return false;
+    }
+
+    pid_t pid = reader.header->pid;
+    shm_reader_close(&reader);
+
+    /* EPERM: the process exists but belongs to another user */
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+ShmWriter *
+shm_writer_open(const char *name, int max_cpu_entries)
+{
+    assert(max_cpu_entries > 0);
+    /* The readers depend on it */
+    assert(SHM_CPU_NAME_SIZE == PROCSTATCPUENTRY_CPU_NAME_SIZE && sizeof(ShmHeader) == SHM_HEADER_SIZE);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        if (shm_writer_is_in_use(name)) {
+            errno = EEXIST;
+            return NULL;
+        }
+        /* Readers that still map the old segment keep it, new readers find the new one */
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+
+    size_t size = shm_segment_size((uint32_t)max_cpu_entries);
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int saved_errno = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    ShmWriter *writer = ecalloc(1, sizeof(*writer));
+    writer->name = emalloc(strlen(name) + 1);
+    strcpy(writer->name, name);
+    writer->header = map;
+    writer->size = size;
+
+    /* ftruncate() zeroed the segment */
+    ShmHeader *header = writer->header;
+    header->version = SHM_VERSION;
+    header->max_cpu_entries = (uint32_t)max_cpu_entries;
+    header->pid = (int32_t)getpid();
+    writer->cpu_names = shm_cpu_names(header);
+    writer->cpu_usage = shm_cpu_usage(header);
+    writer->freq_usage = shm_freq_usage(header);
+    /* Readers check the magic last */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, SHM_MAGIC, sizeof(header->magic));
+
+    return writer;
+}
+
+bool
+shm_writer_publish(ShmWriter *writer, long long timestamp_ns, int n_cpu_entries,
+        char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage)
+{
+    ShmHeader *header = writer->header;
+
+    if (n_cpu_entries > (int)header->max_cpu_entries) {
+        return false;
+    }
+
+    /* Only this thread writes the sequence, the readers retry while it's odd or if it changed */
+    uint64_t sequence = header->sequence;
+    __atomic_store_n(&header->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    header->n_samples++;
+    header->timestamp_ns = timestamp_ns;
+    header->n_cpu_entries = (uint32_t)n_cpu_entries;
+    header->has_freq_usage = freq_usage != NULL;
+    memcpy(writer->cpu_names, cpu_names, (size_t)n_cpu_entries * sizeof(cpu_names[0]));
+    memcpy(writer->cpu_usage, cpu_usage, (size_t)n_cpu_entries * sizeof(cpu_usage[0]));
+    if (freq_usage) {
+        memcpy(writer->freq_usage, freq_usage, (size_t)n_cpu_entries * sizeof(freq_usage[0]));
+    }
+
+    __atomic_store_n(&header->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void
+shm_writer_close(ShmWriter *writer)
+{
+    if (!writer) {
+        return;
+    }
+
+    shm_unlink(writer->name);
+    munmap(writer->header, writer->size);
+    free(writer->name);
+    free(writer);
+}
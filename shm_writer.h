@@ -0,0 +1,39 @@
+#ifndef SHM_WRITER_H
+#define SHM_WRITER_H
+
+#include <stdbool.h>
+
+#include "proc_stat_utils.h"
+
+/*
+ * Publication of the latest CPU usage in a POSIX shared memory segment, for consumers on the same
+ * host that can't afford a system call per sample. The layout and the reader are in shm_reader.h.
+ * There must be a single writer per segment, and a single thread using the writer.
+ */
+
+typedef struct ShmWriter ShmWriter;
+
+/*
+ * Create the shared memory segment name (a single "/"-prefixed component, e.g. "/cut") for samples
+ * of up to max_cpu_entries entries. A segment left over by a writer that no longer runs is replaced.
+ * Returns NULL on failure (errno is set, EEXIST if another writer is running).
+ */
+ShmWriter * shm_writer_open(const char *name, int max_cpu_entries);
+
+/*
+ * Publish a sample, replacing the previous one. Makes no system call.
+ * freq_usage can be NULL if the frequencies aren't known, negative values are unknown as well.
+ * timestamp_ns is the CLOCK_REALTIME time at which the sample was taken.
+ * Returns false if the sample has more entries than the segment was created for (it isn't published).
+ */
+bool shm_writer_publish(ShmWriter *writer, long long timestamp_ns, int n_cpu_entries,
+        char cpu_names[n_cpu_entries][PROCSTATCPUENTRY_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries],
+        const double *freq_usage);
+
+/*
+ * Remove the segment. Readers that have mapped it keep their mapping but see no new samples.
+ * writer can be NULL.
+ */
+void shm_writer_close(ShmWriter *writer);
+
+#endif /* SHM_WRITER_H */
@@ -0,0 +1,32 @@
+#include <semaphore.h>
+#include <string.h>
+#include <assert.h>
+
+#include "spsc_ring.h"
+#include "thread_utils.h"
+
+void
+spsc_ring_init(SpscRing ring[static 1], unsigned n_slots)
+{
+    /* Power of two so that the free-running indices stay consistent when they wrap around */
+    assert(n_slots > 0 && (n_slots & (n_slots - 1)) == 0);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->n_slots = n_slots;
+
+    int iret = sem_init(&ring->sem_committed, 0, 0);
+    assert(iret == 0);
+}
+
+void
+spsc_ring_destroy(SpscRing ring[static 1])
+{
+    int iret = sem_destroy(&ring->sem_committed);
+    assert(iret == 0);
+}
+
+bool
+spsc_ring_wait(SpscRing ring[static 1], double seconds)
+{
+    return sem_wait_seconds(&ring->sem_committed, seconds);
+}
@@ -0,0 +1,115 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdbool.h>
+#include <semaphore.h>
+
+/*
+ * Bounded lock-free single-producer/single-consumer ring.
+ *
+ * The ring only manages slot indices, the slots themselves are owned by the user and are
+ * filled and consumed in place (an index returned by the functions below is in [0, n_slots)).
+ *
+ * Producer: spsc_ring_acquire() -> fill the slot -> spsc_ring_commit().
+ * Consumer: spsc_ring_wait() -> spsc_ring_peek() -> read the slot(s) -> spsc_ring_release().
+ *
+ * The consumer may keep any number of committed slots unreleased (e.g. to keep the previous
+ * sample around), the producer can't reuse a slot until it has been released.
+ */
+typedef struct {
+    unsigned n_slots;
+    sem_t sem_committed;
+    char pad0[64];
+    /* Only written by the producer */
+    unsigned write_index;
+    char pad1[64];
+    /* Only written by the consumer */
+    unsigned read_index;
+    char pad2[64];
+    unsigned long n_dropped;
+} SpscRing;
+
+/*
+ * n_slots must be a power of two.
+ */
+void spsc_ring_init(SpscRing ring[static 1], unsigned n_slots);
+
+void spsc_ring_destroy(SpscRing ring[static 1]);
+
+/*
+ * Consumer: wait up to the specified (possibly fractional) number of seconds for a slot to be committed.
+ * Every successful call corresponds to exactly one spsc_ring_commit().
+ * Returns true if a slot was committed and false on timeout.
+ */
+bool spsc_ring_wait(SpscRing ring[static 1], double seconds);
+
+/*
+ * Producer: get the index of the next free slot.
+ * Returns -1 if the ring is full.
+ * Calling this function again before spsc_ring_commit() returns the same slot.
+ */
+static inline int
+spsc_ring_acquire(SpscRing ring[static 1])
+{
+    unsigned write_index = ring->write_index;
+    unsigned read_index = __atomic_load_n(&ring->read_index, __ATOMIC_ACQUIRE);
+    if (write_index - read_index >= ring->n_slots) {
+        return -1;
+    }
+    return (int)(write_index % ring->n_slots);
+}
+
+/*
+ * Producer: publish the slot returned by spsc_ring_acquire() to the consumer.
+ */
+static inline void
+spsc_ring_commit(SpscRing ring[static 1])
+{
+    __atomic_store_n(&ring->write_index, ring->write_index + 1, __ATOMIC_RELEASE);
+    sem_post(&ring->sem_committed);
+}
+
+/*
+ * Producer: count a sample that was dropped because the ring was full.
+ */
+static inline void
+spsc_ring_record_drop(SpscRing ring[static 1])
+{
+    __atomic_add_fetch(&ring->n_dropped, 1, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long
+spsc_ring_n_dropped(SpscRing ring[static 1])
+{
+    return __atomic_load_n(&ring->n_dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Consumer: number of committed slots that haven't been released yet.
+ */
+static inline unsigned
+spsc_ring_n_readable(SpscRing ring[static 1])
+{
+    return __atomic_load_n(&ring->write_index, __ATOMIC_ACQUIRE) - ring->read_index;
+}
+
+/*
+ * Consumer: get the index of the offset-th unreleased committed slot (0 is the oldest).
+ * offset must be lower than spsc_ring_n_readable().
+ */
+static inline int
+spsc_ring_peek(SpscRing ring[static 1], unsigned offset)
+{
+    return (int)((ring->read_index + offset) % ring->n_slots);
+}
+
+/*
+ * Consumer: release the oldest committed slot back to the producer.
+ */
+static inline void
+spsc_ring_release(SpscRing ring[static 1])
+{
+    __atomic_store_n(&ring->read_index, ring->read_index + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* SPSC_RING_H */
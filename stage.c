@@ -0,0 +1,279 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "stage.h"
+#include "utils.h"
+#include "spsc_ring.h"
+#include "thread_utils.h"
+#include "logger.h"
+#include "watchdog.h"
+
+/* Slots start on their own cache line, so that the producer filling one doesn't slow down the consumer reading the previous one */
+#define STAGE_SLOT_ALIGNMENT 64
+
+struct StageQueue {
+    StageConfig config;
+    SpscRing ring;
+    size_t slot_stride;
+    char *slots;
+    /* Only written by the producer */
+    unsigned long n_committed;
+    unsigned long n_blocked;
+    /* Set by a producer about to wait for a slot to be released (STAGE_BACKPRESSURE_BLOCK) */
+    bool producer_waiting;
+    sem_t sem_released;
+    /* Only written by the consumer */
+    unsigned long n_released;
+    unsigned long n_dropped_reported;
+    /* Registered on the first wait, so that the stage thread doesn't block in its init */
+    WatchdogHandle *watchdog;
+    /* Protected by the lock of the stage */
+    int n_references;
+};
+
+static StageQueue *
+stage_queue_create(const StageConfig config[static 1])
+{
+    assert(config->name && config->slot_size > 0);
+
+    StageQueue *queue = ecalloc(1, sizeof(*queue));
+    queue->config = *config;
+
+    spsc_ring_init(&queue->ring, config->depth);
+
+    int iret = sem_init(&queue->sem_released, 0, 0);
+    assert(iret == 0);
+    (void)(iret);
+
+    queue->slot_stride = (config->slot_size + STAGE_SLOT_ALIGNMENT - 1) / STAGE_SLOT_ALIGNMENT * STAGE_SLOT_ALIGNMENT;
+    size_t slots_size = config->depth * queue->slot_stride;
+    void *slots;
+    if (posix_memalign(&slots, STAGE_SLOT_ALIGNMENT, slots_size) != 0) {
+        EPRINT("posix_memalign() failed");
+        exit(EXIT_FAILURE);
+    }
+    queue->slots = memset(slots, 0, slots_size);
+    if (config->slot_init) {
+        for (unsigned i = 0; i < config->depth; i++) {
+            config->slot_init(&queue->slots[i * queue->slot_stride], config->slot_init_arg);
+        }
+    }
+
+    queue->n_references = 1;
+
+    return queue;
+}
+
+/*
+ * The lock of the stage must be acquired before calling this function.
+ */
+static void
+stage_queue_release_reference(StageQueue *queue)
+{
+    assert(queue->n_references > 0);
+
+    queue->n_references--;
+    if (queue->n_references == 0) {
+        if (queue->config.slot_destroy) {
+            for (unsigned i = 0; i < queue->config.depth; i++) {
+                queue->config.slot_destroy(&queue->slots[i * queue->slot_stride]);
+            }
+        }
+        free(queue->slots);
+        int iret = sem_destroy(&queue->sem_released);
+        assert(iret == 0);
+        (void)(iret);
+        spsc_ring_destroy(&queue->ring);
+        free(queue);
+    }
+}
+
+StageQueue *
+stage_open(Stage stage[static 1], const StageConfig config[static 1])
+{
+    StageQueue *queue = stage_queue_create(config);
+
+    int iret = pthread_mutex_lock(&stage->lock);
+    assert(iret == 0);
+    pthread_cleanup_push(cleanup_mutex_unlock, &stage->lock);
+
+    stage->queue = queue;
+    stage->initialized = true;
+
+    iret = pthread_cond_broadcast(&stage->cond_on_initialized);
+    assert(iret == 0);
+
+    pthread_cleanup_pop(1);
+
+    return queue;
+}
+
+void
+stage_close(Stage stage[static 1], StageQueue *queue)
+{
+    int iret = pthread_mutex_lock(&stage->lock);
+    assert(iret == 0);
+    pthread_cleanup_push(cleanup_mutex_unlock, &stage->lock);
+
+    stage->initialized = false;
+    stage->queue = NULL;
+
+    watchdog_unregister(queue->watchdog);
+    queue->watchdog = NULL;
+
+    stage_queue_release_reference(queue);
+
+    pthread_cleanup_pop(1);
+}
+
+StageQueue *
+stage_attach(Stage stage[static 1])
+{
+    StageQueue *queue;
+
+    int iret = pthread_mutex_lock(&stage->lock);
+    assert(iret == 0);
+    pthread_cleanup_push(cleanup_mutex_unlock, &stage->lock);
+
+    ensure_initialized(&stage->initialized, &stage->cond_on_initialized, &stage->lock);
+
+    queue = stage->queue;
+    queue->n_references++;
+
+    pthread_cleanup_pop(1);
+
+    return queue;
+}
+
+void
+stage_detach(Stage stage[static 1], StageQueue *queue)
+{
+    int iret = pthread_mutex_lock(&stage->lock);
+    assert(iret == 0);
+    pthread_cleanup_push(cleanup_mutex_unlock, &stage->lock);
+
+    stage_queue_release_reference(queue);
+
+    pthread_cleanup_pop(1);
+}
+
+void *
+stage_queue_acquire(StageQueue *queue)
+{
+    int slot_index = spsc_ring_acquire(&queue->ring);
+
+    if (slot_index < 0 && queue->config.backpressure == STAGE_BACKPRESSURE_BLOCK) {
+        __atomic_store_n(&queue->n_blocked, queue->n_blocked + 1, __ATOMIC_RELAXED);
+        while (slot_index < 0) {
+            /*
+             * Sequentially consistent with the consumer's release and load of the flag: either the consumer
+             * sees the flag and posts, or the check below sees the released slot.
+             */
+            __atomic_store_n(&queue->producer_waiting, true, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            slot_index = spsc_ring_acquire(&queue->ring);
+            if (slot_index < 0) {
+                /* A cancellation point, so a producer waiting for a stage thread that hangs can still be shut down */
+                sem_wait_seconds(&queue->sem_released, 1);
+                slot_index = spsc_ring_acquire(&queue->ring);
+            }
+        }
+        __atomic_store_n(&queue->producer_waiting, false, __ATOMIC_RELAXED);
+    }
+
+    if (slot_index < 0) {
+        spsc_ring_record_drop(&queue->ring);
+        if (queue->config.dropped_counter != STATS_COUNTER_NONE) {
+            stats_counter_add(queue->config.dropped_counter, 1);
+        }
+        return NULL;
+    }
+
+    return &queue->slots[(size_t)slot_index * queue->slot_stride];
+}
+
+void
+stage_queue_commit(StageQueue *queue)
+{
+    assert(spsc_ring_acquire(&queue->ring) >= 0);
+
+    __atomic_store_n(&queue->n_committed, queue->n_committed + 1, __ATOMIC_RELAXED);
+    spsc_ring_commit(&queue->ring);
+}
+
+static void
+stage_queue_report_dropped(StageQueue *queue)
+{
+    unsigned long n_dropped = spsc_ring_n_dropped(&queue->ring);
+    if (n_dropped != queue->n_dropped_reported) {
+        ELOG("%lu samples dropped (%s queue full)", n_dropped - queue->n_dropped_reported, queue->config.name);
+        queue->n_dropped_reported = n_dropped;
+    }
+}
+
+bool
+stage_queue_wait(StageQueue *queue, double seconds)
+{
+    bool did_retrieve_data = spsc_ring_wait(&queue->ring, seconds);
+
+    if (queue->config.depth_gauge != STATS_GAUGE_NONE) {
+        stats_gauge_set(queue->config.depth_gauge, spsc_ring_n_readable(&queue->ring));
+    }
+
+    stage_queue_report_dropped(queue);
+
+    if (queue->config.use_watchdog) {
+        if (!queue->watchdog) {
+            queue->watchdog = watchdog_register(queue->config.name);
+        }
+        watchdog_signal_active(queue->watchdog);
+    }
+
+    return did_retrieve_data;
+}
+
+unsigned
+stage_queue_n_readable(StageQueue *queue)
+{
+    return spsc_ring_n_readable(&queue->ring);
+}
+
+void *
+stage_queue_peek(StageQueue *queue, unsigned offset)
+{
+    assert(offset < spsc_ring_n_readable(&queue->ring));
+
+    return &queue->slots[(size_t)spsc_ring_peek(&queue->ring, offset) * queue->slot_stride];
+}
+
+void
+stage_queue_release(StageQueue *queue)
+{
+    assert(spsc_ring_n_readable(&queue->ring) > 0);
+
+    __atomic_store_n(&queue->n_released, queue->n_released + 1, __ATOMIC_RELAXED);
+    spsc_ring_release(&queue->ring);
+
+    if (queue->config.backpressure == STAGE_BACKPRESSURE_BLOCK) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&queue->producer_waiting, false, __ATOMIC_SEQ_CST)) {
+            sem_post(&queue->sem_released);
+        }
+    }
+}
+
+StageMetrics
+stage_queue_metrics(StageQueue *queue)
+{
+    StageMetrics metrics = {
+        .n_committed = __atomic_load_n(&queue->n_committed, __ATOMIC_RELAXED),
+        .n_dropped = spsc_ring_n_dropped(&queue->ring),
+        .n_released = __atomic_load_n(&queue->n_released, __ATOMIC_RELAXED),
+        .n_blocked = __atomic_load_n(&queue->n_blocked, __ATOMIC_RELAXED),
+    };
+    return metrics;
+}
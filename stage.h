@@ -0,0 +1,143 @@
+#ifndef STAGE_H
+#define STAGE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "stats.h"
+
+/*
+ * Pipeline stage: a thread consuming the messages that another thread submits to its input queue.
+ *
+ * The queue is a lock-free single-producer/single-consumer ring (spsc_ring.h) of preallocated,
+ * fixed-size message slots of a type chosen by the stage, filled and consumed in place.
+ * It's reference counted, so a producer stays attached to it even if the stage thread exits.
+ *
+ * Stage thread:
+ *   init:   stage_open()
+ *   loop:   stage_queue_wait() -> stage_queue_peek() -> process the slot(s) -> stage_queue_release()
+ *   deinit: stage_close()
+ *
+ * Producer:
+ *   stage_attach() -> [stage_queue_acquire() -> fill the slot -> stage_queue_commit()]... -> stage_detach()
+ *
+ * stage_queue_wait() also logs the messages dropped since its previous call and reports the stage's
+ * activity to the Watchdog, so a stage thread doesn't need to do either itself.
+ */
+
+typedef enum {
+    /* stage_queue_acquire() returns NULL when the queue is full, the message is counted as dropped */
+    STAGE_BACKPRESSURE_DROP,
+    /* stage_queue_acquire() waits for the stage thread to release a slot */
+    STAGE_BACKPRESSURE_BLOCK,
+} StageBackpressure;
+
+typedef struct {
+    /* Name of the stage thread, reported to the Watchdog and in logs */
+    const char *name;
+    /* Number of slots, must be a power of two */
+    unsigned depth;
+    size_t slot_size;
+    StageBackpressure backpressure;
+    /* Called for every (zeroed) slot when the queue is created, e.g. to allocate its buffers, can be NULL */
+    void (*slot_init)(void *slot, const void *slot_init_arg);
+    const void *slot_init_arg;
+    /* Called for every slot when the queue is destroyed, can be NULL */
+    void (*slot_destroy)(void *slot);
+    bool use_watchdog;
+    /* Incremented for every dropped message, can be STATS_COUNTER_NONE */
+    StatsCounter dropped_counter;
+    /* Set to the number of readable slots whenever the stage thread wakes up, can be STATS_GAUGE_NONE */
+    StatsGauge depth_gauge;
+} StageConfig;
+
+/*
+ * Counters of a queue since it was created.
+ */
+typedef struct {
+    unsigned long n_committed;
+    unsigned long n_dropped;
+    unsigned long n_released;
+    /* Acquisitions that found the queue full and waited (STAGE_BACKPRESSURE_BLOCK) */
+    unsigned long n_blocked;
+} StageMetrics;
+
+typedef struct StageQueue StageQueue;
+
+/*
+ * Where producers find the queue of a stage thread, usually a static variable of the stage's module.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond_on_initialized;
+    bool initialized;
+    StageQueue *queue;
+} Stage;
+
+#define STAGE_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, NULL }
+
+/*
+ * Stage thread: create the input queue and hand it out to the producers waiting in stage_attach().
+ * The config is copied. The stage thread holds a reference to the queue until stage_close().
+ */
+StageQueue * stage_open(Stage stage[static 1], const StageConfig config[static 1]);
+
+/*
+ * Stage thread: stop handing out the queue and release the stage thread's reference to it.
+ */
+void stage_close(Stage stage[static 1], StageQueue *queue);
+
+/*
+ * Producer: attach to the input queue of a stage as its producer.
+ * Blocks until the stage thread is initialized.
+ * The returned queue stays valid until stage_detach() is called, even if
+ * the stage thread exits in the meantime.
+ */
+StageQueue * stage_attach(Stage stage[static 1]);
+
+void stage_detach(Stage stage[static 1], StageQueue *queue);
+
+/*
+ * Producer: get the next free slot of the queue so that it can be filled in place.
+ * When the queue is full the configured backpressure policy applies: NULL is returned and the message
+ * counted as dropped, or the function waits for a slot to be released (it's a cancellation point then).
+ * Calling this function again before stage_queue_commit() returns the same slot.
+ */
+void * stage_queue_acquire(StageQueue *queue);
+
+/*
+ * Producer: hand the slot returned by stage_queue_acquire() over to the stage thread.
+ */
+void stage_queue_commit(StageQueue *queue);
+
+/*
+ * Stage thread: wait up to the specified (possibly fractional) number of seconds for a slot to be committed.
+ * Every successful call corresponds to exactly one stage_queue_commit(), though several slots might
+ * be readable by then. Returns true if a slot was committed and false on timeout.
+ */
+bool stage_queue_wait(StageQueue *queue, double seconds);
+
+/*
+ * Stage thread: number of committed slots that haven't been released yet.
+ */
+unsigned stage_queue_n_readable(StageQueue *queue);
+
+/*
+ * Stage thread: the offset-th unreleased committed slot (0 is the oldest).
+ * offset must be lower than stage_queue_n_readable().
+ */
+void * stage_queue_peek(StageQueue *queue, unsigned offset);
+
+/*
+ * Stage thread: release the oldest committed slot back to the producer.
+ * Slots may be kept unreleased for as long as needed, e.g. to keep the previous message around.
+ */
+void stage_queue_release(StageQueue *queue);
+
+/*
+ * Can be called by any thread.
+ */
+StageMetrics stage_queue_metrics(StageQueue *queue);
+
+#endif /* STAGE_H */
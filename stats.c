@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stats.h"
+#include "utils.h"
+#include "logger.h"
+
+__thread StatsThreadBlock *stats_thread_block;
+
+static const char *stats_counter_names[STATS_N_COUNTERS] = {
+    [STATS_COUNTER_NONE] = NULL,
+    [STATS_COUNTER_ANALYZER_SAMPLES_DROPPED] = "analyzer_samples_dropped",
+    [STATS_COUNTER_ARCHIVER_SAMPLES_DROPPED] = "archiver_samples_dropped",
+    [STATS_COUNTER_EXPORTER_SAMPLES_DROPPED] = "exporter_samples_dropped",
+    [STATS_COUNTER_SERVER_SAMPLES_DROPPED] = "server_samples_dropped",
+    [STATS_COUNTER_OUTPUT_SAMPLES_DROPPED] = "output_samples_dropped",
+    [STATS_COUNTER_SERVER_SAMPLES_SKIPPED] = "server_samples_skipped",
+    [STATS_COUNTER_RECORDING_SNAPSHOTS_SKIPPED] = "recording_snapshots_skipped",
+    [STATS_COUNTER_LOGGER_MESSAGES_DROPPED] = "logger_messages_dropped",
+    [STATS_COUNTER_LOG_WRITES] = "log_writes",
+    [STATS_COUNTER_LOG_ROTATIONS] = "log_rotations",
+    [STATS_COUNTER_SCREEN_BYTES_WRITTEN] = "screen_bytes_written",
+    [STATS_COUNTER_LOG_BYTES_WRITTEN] = "log_bytes_written",
+    [STATS_COUNTER_RECORDING_BYTES_WRITTEN] = "recording_bytes_written",
+    [STATS_COUNTER_HISTORY_BYTES_WRITTEN] = "history_bytes_written",
+    [STATS_COUNTER_EXPORTER_BYTES_WRITTEN] = "exporter_bytes_written",
+    [STATS_COUNTER_SERVER_BYTES_WRITTEN] = "server_bytes_written",
+    [STATS_COUNTER_OUTPUT_BYTES_WRITTEN] = "output_bytes_written",
+};
+
+static const char *stats_timer_names[STATS_N_TIMERS] = {
+    [STATS_TIMER_PARSE] = "parse",
+    [STATS_TIMER_ANALYZE] = "analyze",
+    [STATS_TIMER_RENDER] = "render",
+    [STATS_TIMER_PROCESS_SCAN] = "process_scan",
+};
+
+static const char *stats_gauge_names[STATS_N_GAUGES] = {
+    [STATS_GAUGE_NONE] = NULL,
+    [STATS_GAUGE_ANALYZER_QUEUE_DEPTH] = "analyzer_queue_depth",
+    [STATS_GAUGE_ARCHIVER_QUEUE_DEPTH] = "archiver_queue_depth",
+    [STATS_GAUGE_EXPORTER_QUEUE_DEPTH] = "exporter_queue_depth",
+    [STATS_GAUGE_OUTPUT_QUEUE_DEPTH] = "output_queue_depth",
+    [STATS_GAUGE_SERVER_QUEUE_DEPTH] = "server_queue_depth",
+    [STATS_GAUGE_SERVER_CLIENTS] = "server_clients",
+};
+
+static struct {
+    /* Blocks of the running threads */
+    StatsThreadBlock *blocks;
+    /* Sum of the blocks of the threads that exited */
+    StatsThreadBlock exited;
+    long long gauges[STATS_N_GAUGES];
+    long long gauges_max[STATS_N_GAUGES];
+} shared;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static pthread_key_t stats_key;
+
+static void
+stats_add_block(StatsThreadBlock sum[static 1], const StatsThreadBlock block[static 1])
+{
+    for (int i = 0; i < STATS_N_COUNTERS; i++) {
+        sum->counters[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < STATS_N_TIMERS; i++) {
+        const StatsTimerValue *value = &block->timers[i];
+        sum->timers[i].n_calls += __atomic_load_n(&value->n_calls, __ATOMIC_RELAXED);
+        sum->timers[i].total_ns += __atomic_load_n(&value->total_ns, __ATOMIC_RELAXED);
+        long long max_ns = __atomic_load_n(&value->max_ns, __ATOMIC_RELAXED);
+        if (max_ns > sum->timers[i].max_ns) {
+            sum->timers[i].max_ns = max_ns;
+        }
+    }
+}
+
+/*
+ * Called when a thread that has a block exits, including when it's cancelled.
+ */
+static void
+stats_thread_block_destroy(void *arg)
+{
+    StatsThreadBlock *block = arg;
+
+    /* Destructors of other keys might still update the stats, they get a new block */
+    stats_thread_block = NULL;
+
+    int iret = pthread_mutex_lock(&stats_lock);
+    assert(iret == 0);
+
+    stats_add_block(&shared.exited, block);
+
+    StatsThreadBlock **link = &shared.blocks;
+    while (*link != block) {
+        link = &(*link)->next;
+    }
+    *link = block->next;
+
+    iret = pthread_mutex_unlock(&stats_lock);
+    assert(iret == 0);
+
+    free(block);
+}
+
+static void
+stats_init(void)
+{
+    int iret = pthread_key_create(&stats_key, stats_thread_block_destroy);
+    assert(iret == 0);
+    (void)(iret);
+}
+
+StatsThreadBlock *
+stats_thread_block_create(void)
+{
+    int iret = pthread_once(&stats_once, stats_init);
+    assert(iret == 0);
+
+    StatsThreadBlock *block = ecalloc(1, sizeof(*block));
+
+    iret = pthread_mutex_lock(&stats_lock);
+    assert(iret == 0);
+    pthread_cleanup_push(cleanup_mutex_unlock, &stats_lock);
+
+    block->next = shared.blocks;
+    shared.blocks = block;
+
+    pthread_cleanup_pop(1);
+
+    iret = pthread_setspecific(stats_key, block);
+    assert(iret == 0);
+
+    stats_thread_block = block;
+
+    return block;
+}
+
+void
+stats_gauge_set(StatsGauge gauge, long long value)
+{
+    assert(gauge > STATS_GAUGE_NONE && gauge < STATS_N_GAUGES);
+
+    __atomic_store_n(&shared.gauges[gauge], value, __ATOMIC_RELAXED);
+    if (value > __atomic_load_n(&shared.gauges_max[gauge], __ATOMIC_RELAXED)) {
+        __atomic_store_n(&shared.gauges_max[gauge], value, __ATOMIC_RELAXED);
+    }
+}
+
+void
+stats_snapshot(StatsSnapshot snapshot[static 1])
+{
+    StatsThreadBlock sum;
+
+    int iret = pthread_mutex_lock(&stats_lock);
+    assert(iret == 0);
+    pthread_cleanup_push(cleanup_mutex_unlock, &stats_lock);
+
+    sum = shared.exited;
+    for (StatsThreadBlock *block = shared.blocks; block; block = block->next) {
+        stats_add_block(&sum, block);
+    }
+
+    pthread_cleanup_pop(1);
+
+    memcpy(snapshot->counters, sum.counters, sizeof(snapshot->counters));
+    memcpy(snapshot->timers, sum.timers, sizeof(snapshot->timers));
+    for (int i = 0; i < STATS_N_GAUGES; i++) {
+        snapshot->gauges[i] = __atomic_load_n(&shared.gauges[i], __ATOMIC_RELAXED);
+        snapshot->gauges_max[i] = __atomic_load_n(&shared.gauges_max[i], __ATOMIC_RELAXED);
+    }
+}
+
+void
+stats_log(void)
+{
+    StatsSnapshot snapshot;
+    stats_snapshot(&snapshot);
+
+    for (int i = 0; i < STATS_N_TIMERS; i++) {
+        const StatsTimerValue *value = &snapshot.timers[i];
+        double mean_us = value->n_calls > 0 ? (double)value->total_ns / (double)value->n_calls / 1000 : 0;
+        ELOG("%s: %lu calls, mean %.1f us, max %.1f us, total %.3f s", stats_timer_names[i], value->n_calls,
+                mean_us, (double)value->max_ns / 1000, (double)value->total_ns / NSEC_PER_SEC);
+    }
+    for (int i = STATS_COUNTER_NONE + 1; i < STATS_N_COUNTERS; i++) {
+        ELOG("%s: %lu", stats_counter_names[i], snapshot.counters[i]);
+    }
+    for (int i = STATS_GAUGE_NONE + 1; i < STATS_N_GAUGES; i++) {
+        ELOG("%s: %lld (max %lld)", stats_gauge_names[i], snapshot.gauges[i], snapshot.gauges_max[i]);
+    }
+}
@@ -0,0 +1,151 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <time.h>
+
+#include "thread_utils.h"
+
+/*
+ * Built-in instrumentation: counters, timers and gauges of the hot paths.
+ *
+ * Counters and timers are kept per thread. Updating them is a few plain (relaxed atomic) stores into
+ * the calling thread's own block, found through a thread-local pointer, so the sampling path never
+ * takes a lock or contends a cache line. A thread's block is allocated and added to a list the first
+ * time the thread uses it, and folded into the totals when the thread exits.
+ * stats_log() sums the blocks of all threads.
+ *
+ * Gauges hold the current and the highest value of something that is set by a single thread.
+ */
+
+typedef enum {
+    STATS_COUNTER_NONE,
+    STATS_COUNTER_ANALYZER_SAMPLES_DROPPED,
+    STATS_COUNTER_ARCHIVER_SAMPLES_DROPPED,
+    STATS_COUNTER_EXPORTER_SAMPLES_DROPPED,
+    STATS_COUNTER_SERVER_SAMPLES_DROPPED,
+    STATS_COUNTER_OUTPUT_SAMPLES_DROPPED,
+    /* Samples not sent to a client because its backlog was full */
+    STATS_COUNTER_SERVER_SAMPLES_SKIPPED,
+    /* Snapshots with more CPUs than the recording was created for */
+    STATS_COUNTER_RECORDING_SNAPSHOTS_SKIPPED,
+    STATS_COUNTER_LOGGER_MESSAGES_DROPPED,
+    /* System calls writing the log file, each one writes a batch of messages */
+    STATS_COUNTER_LOG_WRITES,
+    STATS_COUNTER_LOG_ROTATIONS,
+    STATS_COUNTER_SCREEN_BYTES_WRITTEN,
+    STATS_COUNTER_LOG_BYTES_WRITTEN,
+    STATS_COUNTER_RECORDING_BYTES_WRITTEN,
+    STATS_COUNTER_HISTORY_BYTES_WRITTEN,
+    STATS_COUNTER_EXPORTER_BYTES_WRITTEN,
+    STATS_COUNTER_SERVER_BYTES_WRITTEN,
+    STATS_COUNTER_OUTPUT_BYTES_WRITTEN,
+    STATS_N_COUNTERS
+} StatsCounter;
+
+typedef enum {
+    /* Reading and parsing /proc/stat */
+    STATS_TIMER_PARSE,
+    /* Calculating the usage and statistics of a sample */
+    STATS_TIMER_ANALYZE,
+    /* Drawing and writing a frame */
+    STATS_TIMER_RENDER,
+    /* Scanning the processes in /proc */
+    STATS_TIMER_PROCESS_SCAN,
+    STATS_N_TIMERS
+} StatsTimer;
+
+typedef enum {
+    STATS_GAUGE_NONE,
+    /* Number of committed slots found by the stage thread when it wakes up */
+    STATS_GAUGE_ANALYZER_QUEUE_DEPTH,
+    STATS_GAUGE_ARCHIVER_QUEUE_DEPTH,
+    STATS_GAUGE_EXPORTER_QUEUE_DEPTH,
+    STATS_GAUGE_OUTPUT_QUEUE_DEPTH,
+    STATS_GAUGE_SERVER_QUEUE_DEPTH,
+    /* Number of clients connected to the Server */
+    STATS_GAUGE_SERVER_CLIENTS,
+    STATS_N_GAUGES
+} StatsGauge;
+
+typedef struct {
+    unsigned long n_calls;
+    long long total_ns;
+    long long max_ns;
+} StatsTimerValue;
+
+typedef struct StatsThreadBlock {
+    unsigned long counters[STATS_N_COUNTERS];
+    StatsTimerValue timers[STATS_N_TIMERS];
+    /* Protected by the lock of the list of blocks */
+    struct StatsThreadBlock *next;
+} StatsThreadBlock;
+
+/* Block of the calling thread, NULL until it's first used */
+extern __thread StatsThreadBlock *stats_thread_block;
+
+StatsThreadBlock * stats_thread_block_create(void);
+
+static inline StatsThreadBlock *
+stats_get_thread_block(void)
+{
+    StatsThreadBlock *block = stats_thread_block;
+    if (!block) {
+        block = stats_thread_block_create();
+    }
+    return block;
+}
+
+static inline void
+stats_counter_add(StatsCounter counter, unsigned long n)
+{
+    StatsThreadBlock *block = stats_get_thread_block();
+
+    /* Only this thread writes the block */
+    __atomic_store_n(&block->counters[counter], block->counters[counter] + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Start of a timed operation, pass the result to stats_timer_stop().
+ */
+static inline long long
+stats_timer_start(void)
+{
+    return clock_now_ns(CLOCK_MONOTONIC);
+}
+
+static inline void
+stats_timer_stop(StatsTimer timer, long long start_ns)
+{
+    long long elapsed_ns = clock_now_ns(CLOCK_MONOTONIC) - start_ns;
+
+    StatsTimerValue *value = &stats_get_thread_block()->timers[timer];
+    __atomic_store_n(&value->n_calls, value->n_calls + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&value->total_ns, value->total_ns + elapsed_ns, __ATOMIC_RELAXED);
+    if (elapsed_ns > value->max_ns) {
+        __atomic_store_n(&value->max_ns, elapsed_ns, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Must only be called by a single thread for each gauge.
+ */
+void stats_gauge_set(StatsGauge gauge, long long value);
+
+typedef struct {
+    unsigned long counters[STATS_N_COUNTERS];
+    StatsTimerValue timers[STATS_N_TIMERS];
+    long long gauges[STATS_N_GAUGES];
+    long long gauges_max[STATS_N_GAUGES];
+} StatsSnapshot;
+
+/*
+ * Totals of all threads, those that exited included, since the program started.
+ */
+void stats_snapshot(StatsSnapshot snapshot[static 1]);
+
+/*
+ * Log the totals of all counters, timers and gauges.
+ */
+void stats_log(void);
+
+#endif /* STATS_H */
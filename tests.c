@@ -3,15 +3,49 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
 #include <assert.h>
+#include <math.h>
 #include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/sysinfo.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <signal.h>
 
 #include "utils.h"
+#include "thread_utils.h"
 #include "proc_stat_utils.h"
+#include "cpu_states.h"
+#include "cpu_freq.h"
+#include "rolling_stats.h"
+#include "latency_histogram.h"
+#include "stats.h"
+#include "process_scanner.h"
 #include "reader.h"
+#include "recording.h"
+#include "history.h"
+#include "exporter.h"
+#include "server.h"
+#include "sample_format.h"
+#include "output.h"
+#include "shm_writer.h"
+#include "shm_reader.h"
 #include "analyzer.h"
+#include "spsc_ring.h"
+#include "stage.h"
+#include "screen.h"
+#include "layout.h"
 #include "printer.h"
+#include "log_format.h"
 #include "logger.h"
 #include "watchdog.h"
 
@@ -58,7 +92,7 @@ test_proc_stat_parse(void)
         int ret = read_and_parse_proc_stat_file(proc_stat_file, 4, cpu_entries);
 
         /* Parsing fails if the cpu_entries array is too small */
-        assert(ret < 0);
+        assert(ret == PROC_STAT_TOO_MANY_CPU_ENTRIES);
 
         assert(fclose(proc_stat_file) == 0);
     }
@@ -66,7 +100,2288 @@ test_proc_stat_parse(void)
     printf("%s OK\n", __func__);
 }
 
+/*
+ * Write contents to a new temporary file and return its file name.
+ * The name is stored in file_name which must hold at least 32 characters.
+ */
+static void
+write_temporary_file(char file_name[static 32], const char *contents, size_t size)
+{
+    strcpy(file_name, "/tmp/cut_test_XXXXXX");
+    int fd = mkstemp(file_name);
+    assert(fd >= 0);
+    assert(write(fd, contents, size) == (ssize_t)size);
+    assert(close(fd) == 0);
+}
+
+/*
+ * Parse the file file_name with both read_and_parse_proc_stat_file() and
+ * read_and_parse_proc_stat_fd() and check that the results are identical.
+ * Returns the number of parsed entries.
+ */
+static int
+compare_proc_stat_parsers(const char *file_name, int max_cpu_entries)
+{
+    ProcStatCpuEntry reference_entries[max_cpu_entries];
+    ProcStatCpuEntry fast_entries[max_cpu_entries];
+
+    FILE *file = fopen(file_name, "r");
+    assert(file);
+    int n_reference = read_and_parse_proc_stat_file(file, max_cpu_entries, reference_entries);
+    assert(fclose(file) == 0);
+
+    int fd = open(file_name, O_RDONLY);
+    assert(fd >= 0);
+    ProcStatBuffer buffer = {0};
+    int n_fast = read_and_parse_proc_stat_fd(fd, &buffer, max_cpu_entries, fast_entries);
+
+    /* Parsing again with the same (already grown) buffer gives the same result */
+    assert(read_and_parse_proc_stat_fd(fd, &buffer, max_cpu_entries, fast_entries) == n_fast);
+
+    proc_stat_buffer_free(&buffer);
+    assert(close(fd) == 0);
+
+    assert(n_reference == n_fast);
+
+    for (int i = 0; i < n_fast; i++) {
+        ProcStatCpuEntry *r = &reference_entries[i];
+        ProcStatCpuEntry *f = &fast_entries[i];
+        assert(strcmp(r->cpu_name, f->cpu_name) == 0);
+        assert(r->user == f->user);
+        assert(r->nice == f->nice);
+        assert(r->system == f->system);
+        assert(r->idle == f->idle);
+        assert(r->iowait == f->iowait);
+        assert(r->irq == f->irq);
+        assert(r->softirq == f->softirq);
+        assert(r->steal == f->steal);
+        assert(r->guest == f->guest);
+        assert(r->guest_nice == f->guest_nice);
+    }
+
+    return n_fast;
+}
+
+static void
+test_proc_stat_parse_fd(void)
+{
+    int max_cpu_entries = get_nprocs_conf() + 1;
+
+    /*
+     * Test that both parsers give identical results for a snapshot of /proc/stat.
+     */
+    {
+        FILE *proc_stat_file = fopen("/proc/stat", "r");
+        assert(proc_stat_file);
+
+        size_t size = 0;
+        size_t capacity = 4096;
+        char *contents = emalloc(capacity);
+        size_t n;
+        while ((n = fread(&contents[size], 1, capacity - size, proc_stat_file)) > 0) {
+            size += n;
+            if (size == capacity) {
+                capacity *= 2;
+                contents = erealloc(contents, capacity);
+            }
+        }
+        assert(fclose(proc_stat_file) == 0);
+
+        char file_name[32];
+        write_temporary_file(file_name, contents, size);
+
+        int n_cpu_entries = compare_proc_stat_parsers(file_name, max_cpu_entries);
+        assert(n_cpu_entries > 1);
+
+        assert(unlink(file_name) == 0);
+        free(contents);
+    }
+
+    /*
+     * Test a file with more CPU lines than fit in the initial buffer,
+     * followed by a long non-CPU line.
+     */
+    {
+        int n_cpus = 300;
+        size_t capacity = (size_t)(n_cpus + 1) * 128 + 64 * 1024;
+        char *contents = emalloc(capacity);
+        size_t size = 0;
+
+        for (int i = 0; i <= n_cpus; i++) {
+            char name[16] = "cpu";
+            if (i > 0) {
+                snprintf(name, sizeof(name), "cpu%d", i - 1);
+            }
+            size += (size_t)sprintf(&contents[size], "%s %d %d %d %d %d %d %d %d %d %d\n", name,
+                    i * 11 + 1, i * 7, i * 5 + 3, 123456789 + i, i % 3, 0, i * 2, 1, 0, i);
+        }
+        size += (size_t)sprintf(&contents[size], "intr 12345");
+        for (int i = 0; i < 8 * 1024; i++) {
+            size += (size_t)sprintf(&contents[size], " 0");
+        }
+        size += (size_t)sprintf(&contents[size], "\nctxt 1\n");
+
+        char file_name[32];
+        write_temporary_file(file_name, contents, size);
+
+        assert(compare_proc_stat_parsers(file_name, n_cpus + 1) == n_cpus + 1);
+
+        /* Parsing fails if the cpu_entries array is too small */
+        assert(compare_proc_stat_parsers(file_name, 4) == PROC_STAT_TOO_MANY_CPU_ENTRIES);
+
+        assert(unlink(file_name) == 0);
+        free(contents);
+    }
+
+    /*
+     * Test CPU lines of which one ends exactly at the end of the initial buffer (4096 bytes, 64 lines of 64 bytes),
+     * with more CPU lines after it.
+     */
+    {
+        enum { LINE_LENGTH = 64 };
+        int n_cpus = 79;
+        char *contents = emalloc((size_t)(n_cpus + 1) * LINE_LENGTH + 64);
+        size_t size = 0;
+
+        for (int i = 0; i <= n_cpus; i++) {
+            char name[16] = "cpu";
+            if (i > 0) {
+                snprintf(name, sizeof(name), "cpu%d", i - 1);
+            }
+            int length = sprintf(&contents[size], "%s %d %d %d %d %d %d %d %d %d ", name,
+                    i * 11 + 1, i * 7, i * 5 + 3, 123456789 + i, i % 3, 0, i * 2, 1, 0);
+            /* The last counter is padded with zeros so that every line has the same length */
+            int n_zeros = LINE_LENGTH - length - 1 - snprintf(NULL, 0, "%d", i);
+            memset(&contents[size + (size_t)length], '0', (size_t)n_zeros);
+            sprintf(&contents[size + (size_t)(length + n_zeros)], "%d\n", i);
+            size += LINE_LENGTH;
+        }
+        size += (size_t)sprintf(&contents[size], "intr 12345 0 0\nctxt 1\n");
+
+        char file_name[32];
+        write_temporary_file(file_name, contents, size);
+
+        assert(compare_proc_stat_parsers(file_name, n_cpus + 1) == n_cpus + 1);
+
+        assert(unlink(file_name) == 0);
+        free(contents);
+    }
+
+    /*
+     * Test that a very long "intr" line following the CPU lines doesn't make the buffer grow.
+     */
+    {
+        int n_cpus = 71;
+        size_t capacity = (size_t)(n_cpus + 1) * 128 + 256 * 1024;
+        char *contents = emalloc(capacity);
+        size_t size = 0;
+
+        for (int i = 0; i <= n_cpus; i++) {
+            char name[16] = "cpu";
+            if (i > 0) {
+                snprintf(name, sizeof(name), "cpu%d", i - 1);
+            }
+            size += (size_t)sprintf(&contents[size], "%s %d %d %d %d %d %d %d %d %d %d\n", name,
+                    i * 11 + 1, i * 7, i * 5 + 3, 123456789 + i, i % 3, 0, i * 2, 1, 0, i);
+        }
+        size_t cpu_lines_size = size;
+        size += (size_t)sprintf(&contents[size], "intr 12345");
+        for (int i = 0; i < 100 * 1024; i++) {
+            size += (size_t)sprintf(&contents[size], " 0");
+        }
+        size += (size_t)sprintf(&contents[size], "\nctxt 1\n");
+
+        char file_name[32];
+        write_temporary_file(file_name, contents, size);
+
+        assert(compare_proc_stat_parsers(file_name, n_cpus + 1) == n_cpus + 1);
+
+        ProcStatCpuEntry cpu_entries[n_cpus + 1];
+        ProcStatBuffer buffer = {0};
+        int fd = open(file_name, O_RDONLY);
+        assert(fd >= 0);
+        assert(read_and_parse_proc_stat_fd(fd, &buffer, n_cpus + 1, cpu_entries) == n_cpus + 1);
+        assert(buffer.size < 2 * cpu_lines_size + 4096);
+        proc_stat_buffer_free(&buffer);
+        assert(close(fd) == 0);
+
+        assert(unlink(file_name) == 0);
+        free(contents);
+    }
+
+    printf("%s OK\n", __func__);
+}
+
+/*
+ * Entry whose counters add up to total jiffies, busy of which weren't idle.
+ */
+static ProcStatCpuEntry
+hotplug_test_entry(const char *cpu_name, unsigned long total, unsigned long busy)
+{
+    ProcStatCpuEntry ce = {0};
+    strcpy(ce.cpu_name, cpu_name);
+    ce.user = busy;
+    ce.idle = total - busy;
+    return ce;
+}
+
+static void
+test_cpu_usage_hotplug(void)
+{
+    /* Sparse ids: cpu1 and cpu3..cpu6 are offline */
+    ProcStatCpuEntry previous[] = {
+        hotplug_test_entry("cpu", 3000, 600),
+        hotplug_test_entry("cpu0", 1000, 100),
+        hotplug_test_entry("cpu2", 1000, 200),
+        hotplug_test_entry("cpu7", 1000, 300),
+    };
+
+    /* cpu2 went offline, cpu5 came online, and cpu7's counters were reset */
+    ProcStatCpuEntry current[] = {
+        hotplug_test_entry("cpu", 3200, 700),
+        hotplug_test_entry("cpu0", 1100, 150),
+        hotplug_test_entry("cpu5", 500, 400),
+        hotplug_test_entry("cpu7", 10, 5),
+    };
+
+    double cpu_usage[4] = {-1, -1, -1, -1};
+    assert(calculate_cpu_usage_by_id(4, previous, 4, current, cpu_usage));
+
+    assert(cpu_usage[0] == 50.0);
+    assert(cpu_usage[1] == 50.0);
+    /* Nothing to compare against yet */
+    assert(cpu_usage[2] == 0.0);
+    assert(cpu_usage[3] == 0.0);
+
+    /* cpu2 comes back: it's paired with nothing, the others keep being paired by name */
+    ProcStatCpuEntry next[] = {
+        hotplug_test_entry("cpu", 3400, 800),
+        hotplug_test_entry("cpu0", 1200, 175),
+        hotplug_test_entry("cpu2", 1100, 250),
+        hotplug_test_entry("cpu5", 600, 410),
+        hotplug_test_entry("cpu7", 110, 55),
+    };
+
+    double next_usage[5];
+    assert(calculate_cpu_usage_by_id(4, current, 5, next, next_usage));
+
+    assert(next_usage[0] == 50.0);
+    assert(next_usage[1] == 25.0);
+    assert(next_usage[2] == 0.0);
+    assert(next_usage[3] == 10.0);
+    assert(next_usage[4] == 50.0);
+
+    /* An entry that didn't advance keeps its usage and is reported */
+    double same_usage[5] = {1, 2, 3, 4, 5};
+    assert(!calculate_cpu_usage_by_id(5, next, 5, next, same_usage));
+    assert(same_usage[0] == 1 && same_usage[4] == 5);
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+test_cpu_state_breakdown(void)
+{
+    /* Not a multiple of the block size, so that the padding is exercised */
+    enum { N_CPU_ENTRIES = 11 };
+
+    ProcStatCpuEntry previous[N_CPU_ENTRIES] = {0};
+    ProcStatCpuEntry current[N_CPU_ENTRIES] = {0};
+
+    for (int i = 0; i < N_CPU_ENTRIES; i++) {
+        ProcStatCpuEntry *prev = &previous[i];
+        ProcStatCpuEntry *curr = &current[i];
+        prev->user = 1000 * (unsigned long)i;
+        prev->system = 500;
+        prev->idle = 100000;
+        prev->guest = 7;
+        /* 200 ticks elapsed: 40 user (10 of them guest), 20 system, 10 iowait, 130 idle */
+        *curr = *prev;
+        curr->user += 40;
+        curr->guest += 10;
+        curr->system += 20;
+        curr->iowait += 10;
+        curr->idle += 130;
+    }
+
+    /* Counters close to wrapping around 32 bits still give exact differences */
+    previous[1].idle = 0xffffffffUL - 50;
+    current[1].idle = previous[1].idle + 130;
+
+    /* Reset counter: counts as no time in that state */
+    current[2].idle = 0;
+
+    /* No time elapsed */
+    current[3] = previous[3];
+
+    CpuStateCounters previous_counters = {0};
+    CpuStateCounters current_counters = {0};
+    CpuStateBreakdown breakdown = {0};
+
+    cpu_state_counters_load(&previous_counters, N_CPU_ENTRIES, previous);
+    cpu_state_counters_load(&current_counters, N_CPU_ENTRIES, current);
+    assert(current_counters.capacity % CPU_STATES_BLOCK_SIZE == 0);
+
+    cpu_state_breakdown_calculate(&breakdown, &previous_counters, &current_counters);
+    assert(breakdown.n_cpu_entries == N_CPU_ENTRIES);
+
+    for (int i = 0; i < N_CPU_ENTRIES; i++) {
+        float *p[CPU_N_STATES];
+        for (int s = 0; s < CPU_N_STATES; s++) {
+            p[s] = &breakdown.percentage[s][i];
+        }
+
+        if (i == 2) {
+            /* 70 ticks elapsed outside of idle */
+            assert(fabsf(*p[CPU_STATE_USER] - 40 * 100.0f / 70) < 1e-3f);
+            assert(*p[CPU_STATE_IDLE] == 0.0f);
+        } else if (i == 3) {
+            for (int s = 0; s < CPU_N_STATES; s++) {
+                assert(*p[s] == 0.0f);
+            }
+        } else {
+            assert(fabsf(*p[CPU_STATE_USER] - 20.0f) < 1e-4f);
+            assert(fabsf(*p[CPU_STATE_SYSTEM] - 10.0f) < 1e-4f);
+            assert(fabsf(*p[CPU_STATE_IOWAIT] - 5.0f) < 1e-4f);
+            assert(fabsf(*p[CPU_STATE_IDLE] - 65.0f) < 1e-4f);
+            assert(fabsf(*p[CPU_STATE_GUEST] - 5.0f) < 1e-4f);
+            assert(*p[CPU_STATE_NICE] == 0.0f);
+            assert(*p[CPU_STATE_STEAL] == 0.0f);
+        }
+    }
+
+    assert(strcmp(cpu_state_name(CPU_STATE_GUEST_NICE), "guest_nice") == 0);
+
+    cpu_state_counters_free(&previous_counters);
+    cpu_state_counters_free(&current_counters);
+    cpu_state_breakdown_free(&breakdown);
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+test_rolling_stats(void)
+{
+    RollingStatsWindows windows;
+    assert(rolling_stats_parse_windows("6s,1m,2h", &windows) == false);
+    assert(rolling_stats_parse_windows("6s,,1m", &windows) == false);
+    assert(rolling_stats_parse_windows("6x", &windows) == false);
+    assert(rolling_stats_parse_windows("1s,2s,3s,4s,5s", &windows) == false);
+    assert(rolling_stats_parse_windows("6s,1m", &windows));
+    assert(windows.n_windows == 2);
+    assert(windows.window_ns[0] == 6LL * NSEC_PER_SEC && windows.window_ns[1] == 60LL * NSEC_PER_SEC);
+
+    char text[16];
+    rolling_stats_format_window(90LL * NSEC_PER_SEC, text);
+    assert(strcmp(text, "90s") == 0);
+    rolling_stats_format_window(3600LL * NSEC_PER_SEC, text);
+    assert(strcmp(text, "1h") == 0);
+
+    RollingStats stats;
+    rolling_stats_init(&stats, &windows);
+
+    /* One sample per 10 ms for 1 s: entry 0 goes 0..99, entry 1 is constant */
+    for (int k = 0; k < 100; k++) {
+        double cpu_usage[2] = { k, 42.4 };
+        rolling_stats_add(&stats, k * NSEC_PER_SEC / 100, 2, cpu_usage);
+    }
+
+    RollingStatsSummary summaries[2 * 3];
+    rolling_stats_summarize(&stats, 3, summaries);
+
+    RollingStatsSummary *s = &summaries[0];
+    assert(s->n_samples == 100);
+    assert(fabsf(s->mean - 49.5f) < 1e-4f);
+    assert(s->min == 0 && s->max == 99);
+    assert(s->p50 == 49 && s->p95 == 94 && s->p99 == 98);
+
+    s = &summaries[1];
+    assert(s->n_samples == 100);
+    assert(fabsf(s->mean - 42.4f) < 1e-4f);
+    /* Percentiles are bucketed, but clamped to the exact extremes */
+    assert(fabsf(s->p50 - 42.4f) < 1e-4f && fabsf(s->p99 - 42.4f) < 1e-4f);
+
+    /* An entry that was never seen */
+    assert(summaries[2].n_samples == 0 && summaries[2].max == 0);
+
+    /* The 1 min window summaries follow the 6 s ones */
+    assert(summaries[3].n_samples == 100);
+
+    /* 6.5 s later the first second has left the 6 s window, but not the 1 min window */
+    double cpu_usage[2] = { 100, 0 };
+    rolling_stats_add(&stats, 7500 * NSEC_PER_SEC / 1000, 2, cpu_usage);
+    rolling_stats_summarize(&stats, 2, summaries);
+    assert(summaries[0].n_samples == 1 && summaries[0].mean == 100);
+    assert(summaries[2].n_samples == 101 && summaries[2].max == 100);
+
+    /* Resetting an entry forgets it in every window */
+    rolling_stats_reset_entry(&stats, 1);
+    rolling_stats_summarize(&stats, 2, summaries);
+    assert(summaries[1].n_samples == 0 && summaries[3].n_samples == 0);
+    assert(summaries[2].n_samples == 101);
+
+    /* Entries grow on demand, and a long gap empties every window */
+    double more_usage[5] = { 1, 2, 3, 4, 5 };
+    rolling_stats_add(&stats, 3600LL * NSEC_PER_SEC, 5, more_usage);
+    RollingStatsSummary more_summaries[2 * 5];
+    rolling_stats_summarize(&stats, 5, more_summaries);
+    for (int i = 0; i < 2 * 5; i++) {
+        assert(more_summaries[i].n_samples == 1);
+        assert(more_summaries[i].mean == (float)more_usage[i % 5]);
+    }
+
+    rolling_stats_destroy(&stats);
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+write_fake_process_file(const char *proc_path, int pid, const char *name, const char *content)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%d", proc_path, pid);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/%d/%s", proc_path, pid, name);
+    FILE *file = fopen(path, "w");
+    assert(file);
+    fputs(content, file);
+    assert(fclose(file) == 0);
+}
+
+static void
+write_fake_process_stat(const char *proc_path, int pid, const char *comm, unsigned long long utime, unsigned long long stime)
+{
+    char content[256];
+    snprintf(content, sizeof(content), "%d (%s) S 1 %d %d 0 -1 4194560 100 0 0 0 %llu %llu 0 0 20 0 1 0 100 1000000 100\n",
+            pid, comm, pid, pid, utime, stime);
+    write_fake_process_file(proc_path, pid, "stat", content);
+}
+
+/*
+ * Files of a process that spent cpu_time_ns on the CPU (rounded down to clock ticks), only a
+ * thousandth of which in its main thread, the only one its schedstat covers.
+ */
+static void
+write_fake_process_cpu_time(const char *proc_path, int pid, const char *comm, unsigned long long cpu_time_ns)
+{
+    unsigned long long ns_per_tick = (unsigned long long)(NSEC_PER_SEC / sysconf(_SC_CLK_TCK));
+    write_fake_process_stat(proc_path, pid, comm, cpu_time_ns / ns_per_tick, 0);
+
+    char content[64];
+    snprintf(content, sizeof(content), "%llu 12345 67\n", cpu_time_ns / 1000);
+    write_fake_process_file(proc_path, pid, "schedstat", content);
+    snprintf(content, sizeof(content), "%s\n", comm);
+    write_fake_process_file(proc_path, pid, "comm", content);
+}
+
+static void
+write_fake_loadavg(const char *proc_path, int last_pid)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/loadavg", proc_path);
+    FILE *file = fopen(path, "w");
+    assert(file);
+    fprintf(file, "0.10 0.20 0.30 1/123 %d\n", last_pid);
+    assert(fclose(file) == 0);
+}
+
+static void
+remove_fake_process(const char *proc_path, int pid)
+{
+    const char *names[] = { "stat", "schedstat", "comm" };
+    char path[256];
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%d/%s", proc_path, pid, names[i]);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/%d", proc_path, pid);
+    assert(rmdir(path) == 0);
+}
+
+static void
+write_fake_thread_schedstat(const char *proc_path, int pid, int tid, const char *comm, unsigned long long cpu_time_ns)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%d", proc_path, pid);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/%d/task", proc_path, pid);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/%d/task/%d", proc_path, pid, tid);
+    mkdir(path, 0700);
+
+    char content[64];
+    snprintf(path, sizeof(path), "%s/%d/task/%d/schedstat", proc_path, pid, tid);
+    FILE *file = fopen(path, "w");
+    assert(file);
+    fprintf(file, "%llu 12345 67\n", cpu_time_ns);
+    assert(fclose(file) == 0);
+
+    snprintf(path, sizeof(path), "%s/%d/task/%d/comm", proc_path, pid, tid);
+    file = fopen(path, "w");
+    assert(file);
+    snprintf(content, sizeof(content), "%s\n", comm);
+    fputs(content, file);
+    assert(fclose(file) == 0);
+}
+
+static void
+remove_fake_thread(const char *proc_path, int pid, int tid)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%d/task/%d/schedstat", proc_path, pid, tid);
+    assert(unlink(path) == 0);
+    snprintf(path, sizeof(path), "%s/%d/task/%d/comm", proc_path, pid, tid);
+    assert(unlink(path) == 0);
+    snprintf(path, sizeof(path), "%s/%d/task/%d", proc_path, pid, tid);
+    assert(rmdir(path) == 0);
+}
+
+static void
+remove_fake_threaded_process(const char *proc_path, int pid)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%d/task", proc_path, pid);
+    assert(rmdir(path) == 0);
+    snprintf(path, sizeof(path), "%s/%d", proc_path, pid);
+    assert(rmdir(path) == 0);
+}
+
+static void
+test_latency_histogram(void)
+{
+    /* Buckets are contiguous and never wider than 1/16 of their lower bound above the linear ones */
+    assert(latency_histogram_bucket_lower_ns(0) == 0);
+    for (int i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS - 1; i++) {
+        long long lower_ns = latency_histogram_bucket_lower_ns(i);
+        long long upper_ns = latency_histogram_bucket_upper_ns(i);
+        assert(upper_ns == latency_histogram_bucket_lower_ns(i + 1));
+        assert(i < LATENCY_HISTOGRAM_SUB_BUCKETS || (upper_ns - lower_ns) * LATENCY_HISTOGRAM_SUB_BUCKETS <= lower_ns);
+    }
+
+    LatencyHistogram *histogram = ecalloc(1, sizeof(*histogram));
+    assert(latency_histogram_percentile_ns(histogram, 0.99) == 0);
+    assert(latency_histogram_max_ns(histogram) == 0);
+
+    /* Every duration lands in the bucket that contains it */
+    long long durations_ns[] = { -5, 0, 999, 1000, 15999, 16000, 31999, 32000, 1234567, 999999999, 1000000000 };
+    for (size_t k = 0; k < sizeof(durations_ns) / sizeof(durations_ns[0]); k++) {
+        LatencyHistogram *single = ecalloc(1, sizeof(*single));
+        latency_histogram_record(single, durations_ns[k]);
+        long long us_ns = durations_ns[k] > 0 ? durations_ns[k] / 1000 * 1000 : 0;
+        long long upper_ns = latency_histogram_max_ns(single);
+        assert(upper_ns > us_ns);
+        assert(upper_ns - us_ns <= (us_ns < 16000 ? 1000 : us_ns / LATENCY_HISTOGRAM_SUB_BUCKETS));
+        free(single);
+    }
+
+    /* Longer than the histogram's range */
+    latency_histogram_record(histogram, 100LL * 24 * 3600 * NSEC_PER_SEC);
+    assert(histogram->counts[LATENCY_HISTOGRAM_N_BUCKETS - 1] == 1);
+    memset(histogram, 0, sizeof(*histogram));
+
+    /* 1 ms to 100 ms */
+    for (int k = 1; k <= 100; k++) {
+        latency_histogram_record(histogram, k * 1000LL * 1000);
+    }
+    assert(latency_histogram_n_recorded(histogram) == 100);
+    long long p50_ns = latency_histogram_percentile_ns(histogram, 0.5);
+    long long p99_ns = latency_histogram_percentile_ns(histogram, 0.99);
+    assert(p50_ns > 50LL * 1000 * 1000 && p50_ns <= 50LL * 1000 * 1000 * 17 / 16);
+    assert(p99_ns > 99LL * 1000 * 1000 && p99_ns <= 99LL * 1000 * 1000 * 17 / 16);
+    assert(latency_histogram_percentile_ns(histogram, 1) == latency_histogram_max_ns(histogram));
+
+    /* Only what was recorded after the copy is left */
+    LatencyHistogram *older = ecalloc(1, sizeof(*older));
+    latency_histogram_load(histogram, older);
+    for (int k = 0; k < 10; k++) {
+        latency_histogram_record(histogram, 2LL * NSEC_PER_SEC);
+    }
+    latency_histogram_subtract(histogram, older);
+    assert(latency_histogram_n_recorded(histogram) == 10);
+    assert(latency_histogram_percentile_ns(histogram, 0.01) > 2LL * NSEC_PER_SEC);
+
+    free(older);
+    free(histogram);
+
+    printf("%s OK\n", __func__);
+}
+
+static void *
+stats_test_thread_run(void *arg)
+{
+    (void)(arg);
+
+    for (int i = 0; i < 1000; i++) {
+        stats_counter_add(STATS_COUNTER_LOG_BYTES_WRITTEN, 3);
+    }
+
+    long long start_ns = stats_timer_start();
+    stats_timer_stop(STATS_TIMER_PARSE, start_ns - 5000);
+
+    return NULL;
+}
+
+static void
+test_stats(void)
+{
+    StatsSnapshot before;
+    stats_snapshot(&before);
+
+    /* Threads that exited are still counted */
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        int iret = pthread_create(&threads[i], NULL, stats_test_thread_run, NULL);
+        assert(iret == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        int iret = pthread_join(threads[i], NULL);
+        assert(iret == 0);
+    }
+    stats_test_thread_run(NULL);
+
+    stats_gauge_set(STATS_GAUGE_ANALYZER_QUEUE_DEPTH, 7);
+    stats_gauge_set(STATS_GAUGE_ANALYZER_QUEUE_DEPTH, 2);
+
+    StatsSnapshot after;
+    stats_snapshot(&after);
+
+    assert(after.counters[STATS_COUNTER_LOG_BYTES_WRITTEN] - before.counters[STATS_COUNTER_LOG_BYTES_WRITTEN] == 5 * 3000);
+    const StatsTimerValue *timer = &after.timers[STATS_TIMER_PARSE];
+    assert(timer->n_calls - before.timers[STATS_TIMER_PARSE].n_calls == 5);
+    assert(timer->total_ns - before.timers[STATS_TIMER_PARSE].total_ns >= 5 * 5000);
+    assert(timer->max_ns >= 5000);
+    assert(after.gauges[STATS_GAUGE_ANALYZER_QUEUE_DEPTH] == 2);
+    assert(after.gauges_max[STATS_GAUGE_ANALYZER_QUEUE_DEPTH] >= 7);
+
+    printf("%s OK\n", __func__);
+}
+
+static void *
+process_scanner_test_spin(void *arg)
+{
+    bool *spin = arg;
+    while (__atomic_load_n(spin, __ATOMIC_RELAXED)) {
+    }
+    return NULL;
+}
+
+static void
+test_process_scanner(void)
+{
+    long long ticks_per_second = sysconf(_SC_CLK_TCK);
+    ProcessUsage top[1000];
+
+    /* Without schedstat files, with only one descriptor kept open */
+    char proc_path[] = "test_proc_XXXXXX";
+    assert(mkdtemp(proc_path));
+    char path[256];
+    snprintf(path, sizeof(path), "%s/self", proc_path);
+    assert(mkdir(path, 0700) == 0);
+
+    write_fake_process_stat(proc_path, 100, "init", 1000, 500);
+    write_fake_process_stat(proc_path, 200, "a (b) c", 0, 0);
+    write_fake_process_stat(proc_path, 300, "x\ty", 7, 7);
+
+    ProcessScannerOptions options = { .n_workers = 1, .max_open_fds = 1 };
+    ProcessScanner *scanner = process_scanner_open(proc_path, &options);
+    assert(scanner);
+
+    /* Nothing to compare with yet */
+    assert(process_scanner_scan(scanner, 1 * NSEC_PER_SEC, 10, top) == 0);
+    assert(process_scanner_n_tasks(scanner) == 3);
+
+    write_fake_process_stat(proc_path, 100, "init", 1000 + ticks_per_second / 4, 500 + ticks_per_second / 4);
+    write_fake_process_stat(proc_path, 200, "a (b) c", ticks_per_second, ticks_per_second);
+
+    /* Only the k busiest, busiest first */
+    assert(process_scanner_scan(scanner, 2 * NSEC_PER_SEC, 2, top) == 2);
+    assert(top[0].pid == 200 && strcmp(top[0].comm, "a (b) c") == 0 && fabs(top[0].cpu_usage - 200) < 1e-9);
+    assert(top[1].pid == 100 && strcmp(top[1].comm, "init") == 0 && fabs(top[1].cpu_usage - 50) < 1e-9);
+
+    /* Exited and new processes */
+    remove_fake_process(proc_path, 100);
+    write_fake_process_stat(proc_path, 300, "x\ty", 7 + ticks_per_second / 10, 7);
+    write_fake_process_stat(proc_path, 400, "new", 1, 1);
+
+    assert(process_scanner_scan(scanner, 3 * NSEC_PER_SEC, 10, top) == 2);
+    assert(process_scanner_n_tasks(scanner) == 3);
+    assert(top[0].pid == 300 && strcmp(top[0].comm, "x?y") == 0 && fabs(top[0].cpu_usage - 10) < 1e-9);
+    assert(top[1].pid == 200 && top[1].cpu_usage == 0);
+
+    process_scanner_close(scanner);
+    remove_fake_process(proc_path, 200);
+    remove_fake_process(proc_path, 300);
+    remove_fake_process(proc_path, 400);
+    assert(rmdir(path) == 0);
+
+    /* With schedstat files too, enough processes to grow the hash table and remove from it */
+    write_fake_process_cpu_time(proc_path, 1, "worker", 1000 * 1000);
+    options.max_open_fds = 1000;
+    scanner = process_scanner_open(proc_path, &options);
+    assert(scanner);
+    assert(process_scanner_scan(scanner, 0, 10, top) == 0);
+
+    write_fake_process_cpu_time(proc_path, 1, "worker", 251 * 1000 * 1000);
+    assert(process_scanner_scan(scanner, 1 * NSEC_PER_SEC, 10, top) == 1);
+    assert(top[0].pid == 1 && strcmp(top[0].comm, "worker") == 0 && fabs(top[0].cpu_usage - 25) < 1e-9);
+
+    /* The CPU time went backwards: the pid was reused */
+    write_fake_process_cpu_time(proc_path, 1, "other", 1000);
+    assert(process_scanner_scan(scanner, 2 * NSEC_PER_SEC, 10, top) == 0);
+    write_fake_process_cpu_time(proc_path, 1, "other", 1000 + NSEC_PER_SEC / 2);
+    assert(process_scanner_scan(scanner, 3 * NSEC_PER_SEC, 10, top) == 1);
+    assert(strcmp(top[0].comm, "other") == 0 && fabs(top[0].cpu_usage - 50) < 1e-9);
+
+    /*
+     * The directory is only listed again if a pid was allocated since the previous scan.
+     * From here on the processes are sharded over several workers.
+     */
+    write_fake_loadavg(proc_path, 1);
+    process_scanner_close(scanner);
+    options.n_workers = 3;
+    scanner = process_scanner_open(proc_path, &options);
+    assert(scanner);
+    assert(process_scanner_scan(scanner, 3 * NSEC_PER_SEC, 10, top) == 0);
+    write_fake_process_cpu_time(proc_path, 2, "late", 0);
+    assert(process_scanner_scan(scanner, 4 * NSEC_PER_SEC, 10, top) == 1);
+    assert(process_scanner_n_tasks(scanner) == 1);
+    write_fake_loadavg(proc_path, 2);
+    assert(process_scanner_scan(scanner, 5 * NSEC_PER_SEC, 10, top) == 1);
+    assert(process_scanner_n_tasks(scanner) == 2);
+
+    for (int pid = 2; pid <= 600; pid++) {
+        write_fake_process_cpu_time(proc_path, pid, "many", 0);
+    }
+    write_fake_loadavg(proc_path, 600);
+    assert(process_scanner_scan(scanner, 6 * NSEC_PER_SEC, 1000, top) == 2);
+    assert(process_scanner_n_tasks(scanner) == 600);
+
+    /* Every process still there must be found again after the others are removed */
+    for (int round = 1; round <= 2; round++) {
+        for (int pid = 2; pid <= 600; pid++) {
+            if (round == 1 && pid % 3 != 0) {
+                remove_fake_process(proc_path, pid);
+            } else if (pid % 3 == 0) {
+                write_fake_process_cpu_time(proc_path, pid, "many", (unsigned long long)round * 10 * 1000 * 1000);
+            }
+        }
+        write_fake_loadavg(proc_path, 600 + round);
+        int n_top = process_scanner_scan(scanner, (6 + round) * NSEC_PER_SEC, 1000, top);
+        assert(n_top == 1 + 200);
+        assert(process_scanner_n_tasks(scanner) == n_top);
+        /* Ties ordered by pid */
+        assert(top[0].pid == 3 && fabs(top[0].cpu_usage - 1) < 1e-9);
+        assert(top[n_top - 1].pid == 1 && top[n_top - 1].cpu_usage == 0);
+    }
+
+    process_scanner_close(scanner);
+    for (int pid = 1; pid <= 600; pid++) {
+        if (pid == 1 || pid % 3 == 0) {
+            remove_fake_process(proc_path, pid);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/loadavg", proc_path);
+    assert(unlink(path) == 0);
+    assert(rmdir(proc_path) == 0);
+
+    /* The real thing */
+    options.max_open_fds = 0;
+    scanner = process_scanner_open("/proc", &options);
+    assert(scanner);
+    assert(process_scanner_scan(scanner, 1, 10, top) == 0);
+    assert(process_scanner_n_tasks(scanner) > 0);
+    assert(process_scanner_scan(scanner, 2, 10, top) > 0);
+
+    /* A process is as busy as all its threads, not only its main thread */
+    bool spin = true;
+    pthread_t spinning_thread;
+    assert(pthread_create(&spinning_thread, NULL, process_scanner_test_spin, &spin) == 0);
+    long long start_ns = clock_now_ns(CLOCK_MONOTONIC);
+    assert(process_scanner_scan(scanner, start_ns, 1000, top) >= 0);
+    struct timespec half_a_second = { .tv_nsec = 500 * 1000 * 1000 };
+    nanosleep(&half_a_second, NULL);
+    int n_top = process_scanner_scan(scanner, clock_now_ns(CLOCK_MONOTONIC), 1000, top);
+    __atomic_store_n(&spin, false, __ATOMIC_RELAXED);
+    assert(pthread_join(spinning_thread, NULL) == 0);
+    double self_usage = -1;
+    for (int i = 0; i < n_top; i++) {
+        if (top[i].pid == getpid()) {
+            self_usage = top[i].cpu_usage;
+        }
+    }
+    /* The main thread sleeps, and the spinning thread may share a single CPU with the workers */
+    assert(self_usage > 20);
+
+    process_scanner_close(scanner);
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+test_process_scanner_threads(void)
+{
+    ProcessUsage top[100];
+
+    /* A process with many threads, whose threads end up in every shard, and a small one */
+    char proc_path[] = "test_proc_XXXXXX";
+    assert(mkdtemp(proc_path));
+    for (int tid = 10; tid < 40; tid++) {
+        write_fake_thread_schedstat(proc_path, 10, tid, tid == 10 ? "java" : "worker", 0);
+    }
+    write_fake_thread_schedstat(proc_path, 50, 50, "small", 0);
+    write_fake_thread_schedstat(proc_path, 50, 51, "helper", 0);
+
+    ProcessScannerOptions options = { .threads = true, .n_workers = 4, .max_open_fds = 16 };
+    ProcessScanner *scanner = process_scanner_open(proc_path, &options);
+    assert(scanner);
+    assert(process_scanner_scan(scanner, 1 * NSEC_PER_SEC, 100, top) == 0);
+    assert(process_scanner_n_tasks(scanner) == 32);
+
+    /* Thread t of the big process used t% of a CPU */
+    for (int tid = 10; tid < 40; tid++) {
+        write_fake_thread_schedstat(proc_path, 10, tid, tid == 10 ? "java" : "worker", (unsigned long long)tid * NSEC_PER_SEC / 100);
+    }
+    write_fake_thread_schedstat(proc_path, 50, 51, "helper", NSEC_PER_SEC / 2);
+
+    /* The tops of the shards are merged, busiest first */
+    assert(process_scanner_scan(scanner, 2 * NSEC_PER_SEC, 5, top) == 5);
+    assert(top[0].pid == 50 && top[0].tid == 51 && strcmp(top[0].comm, "helper") == 0 && fabs(top[0].cpu_usage - 50) < 1e-9);
+    for (int i = 1; i < 5; i++) {
+        assert(top[i].pid == 10 && top[i].tid == 40 - i && strcmp(top[i].comm, "worker") == 0);
+        assert(fabs(top[i].cpu_usage - (40 - i)) < 1e-9);
+    }
+    /* Idle, ties ordered by tid across the shards */
+    assert(process_scanner_scan(scanner, 3 * NSEC_PER_SEC, 100, top) == 32);
+    assert(top[0].pid == 10 && top[0].tid == 10 && strcmp(top[0].comm, "java") == 0 && top[0].cpu_usage == 0);
+    for (int i = 1; i < 32; i++) {
+        assert(top[i].tid == top[i - 1].tid + (i == 30 ? 11 : 1));
+    }
+
+    /* A thread that exited, and its tid reused by a thread of another process */
+    remove_fake_thread(proc_path, 50, 51);
+    write_fake_thread_schedstat(proc_path, 60, 51, "reused", 0);
+    assert(process_scanner_scan(scanner, 4 * NSEC_PER_SEC, 100, top) == 30 + 1);
+    assert(process_scanner_n_tasks(scanner) == 32);
+    write_fake_thread_schedstat(proc_path, 60, 51, "reused", NSEC_PER_SEC / 4);
+    assert(process_scanner_scan(scanner, 5 * NSEC_PER_SEC, 1, top) == 1);
+    assert(top[0].pid == 60 && top[0].tid == 51 && strcmp(top[0].comm, "reused") == 0 && fabs(top[0].cpu_usage - 25) < 1e-9);
+
+    process_scanner_close(scanner);
+    for (int tid = 10; tid < 40; tid++) {
+        remove_fake_thread(proc_path, 10, tid);
+    }
+    remove_fake_thread(proc_path, 50, 50);
+    remove_fake_thread(proc_path, 60, 51);
+    remove_fake_threaded_process(proc_path, 10);
+    remove_fake_threaded_process(proc_path, 50);
+    remove_fake_threaded_process(proc_path, 60);
+    assert(rmdir(proc_path) == 0);
+
+    /* The threads of this program, sharded over as many workers as allowed */
+    options.n_workers = PROCESS_SCANNER_MAX_WORKERS;
+    options.max_open_fds = 0;
+    scanner = process_scanner_open("/proc", &options);
+    assert(scanner);
+    assert(process_scanner_scan(scanner, 1, 10, top) == 0);
+    assert(process_scanner_n_tasks(scanner) > PROCESS_SCANNER_MAX_WORKERS);
+    assert(process_scanner_scan(scanner, 2, 10, top) > 0);
+    process_scanner_close(scanner);
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+write_fake_cpufreq_file(const char *sysfs_path, int cpu, const char *name, const char *content)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/cpu%d", sysfs_path, cpu);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/cpu%d/cpufreq", sysfs_path, cpu);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/%s", sysfs_path, cpu, name);
+    FILE *file = fopen(path, "w");
+    assert(file);
+    fputs(content, file);
+    assert(fclose(file) == 0);
+}
+
+static void
+remove_fake_cpufreq(const char *sysfs_path, int cpu)
+{
+    const char *names[] = { "scaling_cur_freq", "cpuinfo_max_freq" };
+    char path[256];
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/%s", sysfs_path, cpu, names[i]);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/cpu%d/cpufreq", sysfs_path, cpu);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/cpu%d", sysfs_path, cpu);
+    assert(rmdir(path) == 0);
+}
+
+static void
+test_cpu_freq(void)
+{
+    CpuFreqBackend backend;
+    assert(cpu_freq_backend_from_name("io_uring", &backend) && backend == CPU_FREQ_BACKEND_IO_URING);
+    assert(strcmp(cpu_freq_backend_name(CPU_FREQ_BACKEND_PREAD), "pread") == 0);
+    assert(!cpu_freq_backend_from_name("aio", &backend));
+
+    /* Sparse CPU ids, cpu1 has no cpufreq directory */
+    char sysfs_path[] = "test_cpufreq_XXXXXX";
+    assert(mkdtemp(sysfs_path));
+
+    ProcStatCpuEntry cpu_entries[4];
+    memset(cpu_entries, 0, sizeof(cpu_entries));
+    const char *cpu_names[] = { "cpu", "cpu0", "cpu1", "cpu3" };
+    for (int i = 0; i < 4; i++) {
+        snprintf(cpu_entries[i].cpu_name, sizeof(cpu_entries[i].cpu_name), "%s", cpu_names[i]);
+    }
+
+    CpuFreqBackend backends[] = { CPU_FREQ_BACKEND_PREAD, CPU_FREQ_BACKEND_IO_URING };
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        write_fake_cpufreq_file(sysfs_path, 0, "scaling_cur_freq", "1000000\n");
+        write_fake_cpufreq_file(sysfs_path, 0, "cpuinfo_max_freq", "2000000\n");
+        write_fake_cpufreq_file(sysfs_path, 3, "scaling_cur_freq", "3000000\n");
+        write_fake_cpufreq_file(sysfs_path, 3, "cpuinfo_max_freq", "3000000\n");
+
+        CpuFreqReader *reader = cpu_freq_reader_open(sysfs_path, backends[b]);
+        assert(reader);
+        /* io_uring might not be available, the reads are then made with pread() */
+        bool io_uring = cpu_freq_reader_backend(reader) == CPU_FREQ_BACKEND_IO_URING;
+        assert(io_uring || cpu_freq_reader_backend(reader) == CPU_FREQ_BACKEND_PREAD);
+
+        CpuFrequency frequencies[4];
+        assert(cpu_freq_reader_read(reader, 4, cpu_entries, frequencies));
+        assert(frequencies[1].cur_khz == 1000000 && frequencies[1].max_khz == 2000000);
+        assert(frequencies[2].cur_khz == 0 && frequencies[2].max_khz == 0);
+        assert(frequencies[3].cur_khz == 3000000 && frequencies[3].max_khz == 3000000);
+        assert(frequencies[0].cur_khz == 2000000 && frequencies[0].max_khz == 2500000);
+
+        /* The descriptors stay open: a single io_uring_enter(), or a pread() per CPU */
+        write_fake_cpufreq_file(sysfs_path, 0, "scaling_cur_freq", "1500000\n");
+        assert(cpu_freq_reader_read(reader, 4, cpu_entries, frequencies));
+        assert(frequencies[1].cur_khz == 1500000);
+        assert(cpu_freq_reader_n_syscalls(reader) == (io_uring ? 1 : 2));
+
+        /* A CPU whose frequency can't be read any more is unknown until it's opened again */
+        write_fake_cpufreq_file(sysfs_path, 3, "scaling_cur_freq", "");
+        write_fake_cpufreq_file(sysfs_path, 1, "scaling_cur_freq", "800000\n");
+        write_fake_cpufreq_file(sysfs_path, 1, "cpuinfo_max_freq", "1600000\n");
+        assert(cpu_freq_reader_read(reader, 4, cpu_entries, frequencies));
+        assert(frequencies[3].cur_khz == 0);
+        assert(frequencies[2].cur_khz == 0);
+        write_fake_cpufreq_file(sysfs_path, 3, "scaling_cur_freq", "2000000\n");
+        for (int i = 0; i < CPU_FREQ_REOPEN_INTERVAL; i++) {
+            assert(cpu_freq_reader_read(reader, 4, cpu_entries, frequencies));
+        }
+        assert(frequencies[2].cur_khz == 800000 && frequencies[2].max_khz == 1600000);
+        assert(frequencies[3].cur_khz == 2000000);
+        assert(frequencies[0].cur_khz == (1500000 + 800000 + 2000000) / 3);
+
+        cpu_freq_reader_close(reader);
+        remove_fake_cpufreq(sysfs_path, 0);
+        remove_fake_cpufreq(sysfs_path, 1);
+        remove_fake_cpufreq(sysfs_path, 3);
+    }
+
+    /* Without any cpufreq directory nothing is known */
+    CpuFreqReader *reader = cpu_freq_reader_open(sysfs_path, CPU_FREQ_BACKEND_AUTO);
+    assert(reader);
+    CpuFrequency frequencies[4];
+    assert(!cpu_freq_reader_read(reader, 4, cpu_entries, frequencies));
+    assert(frequencies[0].cur_khz == 0);
+    cpu_freq_reader_close(reader);
+    assert(rmdir(sysfs_path) == 0);
+    assert(!cpu_freq_reader_open(sysfs_path, CPU_FREQ_BACKEND_AUTO));
+
+    /* Usage scaled by the share of the maximum frequency, the average over the known CPUs */
+    CpuFrequency weights[4] = { { 1000000, 2000000 }, { 1000000, 2000000 }, { 0, 0 }, { 3000000, 3000000 } };
+    double usage[4] = { 50, 40, 80, 100 };
+    double weighted[4];
+    cpu_freq_weight_usage(4, weights, usage, weighted);
+    assert(weighted[1] == 20 && weighted[2] < 0 && weighted[3] == 100 && weighted[0] == 60);
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+test_recording_round_trip(void)
+{
+#define RECORDING_TEST_MAX_CPU_ENTRIES 5
+#define RECORDING_TEST_N_SNAPSHOTS 6
+    char file_name[] = "test_recording_XXXXXX";
+    int fd = mkstemp(file_name);
+    assert(fd >= 0);
+    assert(close(fd) == 0);
+
+    ProcStatCpuEntry snapshots[RECORDING_TEST_N_SNAPSHOTS][RECORDING_TEST_MAX_CPU_ENTRIES];
+    int n_cpu_entries[RECORDING_TEST_N_SNAPSHOTS];
+    long long timestamps[RECORDING_TEST_N_SNAPSHOTS];
+    memset(snapshots, 0, sizeof(snapshots));
+
+    /*
+     * Counters grow (mostly) monotonically, but the number of entries changes (CPU hotplug),
+     * an entry is renamed and one counter goes backwards, to exercise all delta cases.
+     */
+    for (int s = 0; s < RECORDING_TEST_N_SNAPSHOTS; s++) {
+        n_cpu_entries[s] = (s == 2) ? 3 : RECORDING_TEST_MAX_CPU_ENTRIES;
+        timestamps[s] = 1700000000000000000LL + s * 10000000LL - (s == 4 ? 20000000LL : 0);
+        for (int i = 0; i < n_cpu_entries[s]; i++) {
+            ProcStatCpuEntry *ce = &snapshots[s][i];
+            if (i == 0) {
+                strcpy(ce->cpu_name, "cpu");
+            } else {
+                snprintf(ce->cpu_name, sizeof(ce->cpu_name), "cpu%d", (s == 3 && i == 4) ? 7 : i - 1);
+            }
+            unsigned long *counters[PROCSTATCPUENTRY_N_COUNTERS];
+            proc_stat_cpu_entry_counters(ce, counters);
+            for (int c = 0; c < PROCSTATCPUENTRY_N_COUNTERS; c++) {
+                *counters[c] = (unsigned long)(s * 1000 + i * 100 + c) * 12345UL;
+            }
+            if (s == 5) {
+                ce->idle = 1;
+            }
+        }
+    }
+
+    RecordingWriter *writer = recording_writer_open(file_name, RECORDING_TEST_MAX_CPU_ENTRIES);
+    assert(writer);
+    assert(recording_writer_max_cpu_entries(writer) == RECORDING_TEST_MAX_CPU_ENTRIES);
+    for (int s = 0; s < RECORDING_TEST_N_SNAPSHOTS; s++) {
+        assert(recording_writer_write(writer, timestamps[s], n_cpu_entries[s], snapshots[s]));
+        /* A snapshot with too many entries isn't written, the recording goes on */
+        assert(!recording_writer_write(writer, timestamps[s], RECORDING_TEST_MAX_CPU_ENTRIES + 1, snapshots[s]));
+    }
+    recording_writer_close(writer);
+
+    RecordingReader *reader = recording_reader_open(file_name);
+    assert(reader);
+    assert(recording_reader_max_cpu_entries(reader) == RECORDING_TEST_MAX_CPU_ENTRIES);
+    for (int s = 0; s < RECORDING_TEST_N_SNAPSHOTS; s++) {
+        ProcStatCpuEntry cpu_entries[RECORDING_TEST_MAX_CPU_ENTRIES];
+        memset(cpu_entries, 0, sizeof(cpu_entries));
+        long long timestamp_ns;
+        assert(recording_reader_read(reader, &timestamp_ns, cpu_entries) == n_cpu_entries[s]);
+        assert(timestamp_ns == timestamps[s]);
+        assert(memcmp(cpu_entries, snapshots[s], (size_t)n_cpu_entries[s] * sizeof(cpu_entries[0])) == 0);
+    }
+    long long timestamp_ns;
+    ProcStatCpuEntry cpu_entries[RECORDING_TEST_MAX_CPU_ENTRIES];
+    assert(recording_reader_read(reader, &timestamp_ns, cpu_entries) == 0);
+    recording_reader_close(reader);
+
+    /* Files that aren't recordings are rejected */
+    FILE *file = fopen(file_name, "w");
+    assert(file);
+    assert(fputs("cpu 1 2 3 4 5 6 7 8 9 10\n", file) >= 0);
+    assert(fclose(file) == 0);
+    assert(recording_reader_open(file_name) == NULL);
+
+    assert(unlink(file_name) == 0);
+
+    printf("%s OK\n", __func__);
+}
+
+/*
+ * Deterministic snapshot number s of a machine with n_cpu_entries - 1 CPUs.
+ */
+static void
+history_test_snapshot(int s, int n_cpu_entries, ProcStatCpuEntry cpu_entries[n_cpu_entries])
+{
+    memset(cpu_entries, 0, (size_t)n_cpu_entries * sizeof(cpu_entries[0]));
+    for (int i = 0; i < n_cpu_entries; i++) {
+        ProcStatCpuEntry *ce = &cpu_entries[i];
+        if (i == 0) {
+            strcpy(ce->cpu_name, "cpu");
+        } else {
+            snprintf(ce->cpu_name, sizeof(ce->cpu_name), "cpu%d", i - 1);
+        }
+        unsigned long *counters[PROCSTATCPUENTRY_N_COUNTERS];
+        proc_stat_cpu_entry_counters(ce, counters);
+        for (int c = 0; c < PROCSTATCPUENTRY_N_COUNTERS; c++) {
+            *counters[c] = (unsigned long)s * (unsigned long)(i + c + 1) * 37UL + (unsigned long)((s * 7 + c) % 5);
+        }
+    }
+}
+
+static long long
+history_test_timestamp(int s)
+{
+    return 1700000000000000000LL + s * 10000000LL;
+}
+
+static void
+test_exporter(void)
+{
+    char cpu_names[3][PROCSTATCPUENTRY_CPU_NAME_SIZE] = { "cpu", "cpu0", "cpu12" };
+    double cpu_usage[3] = { 50, 25, 75 };
+    /* The frequency of cpu12 is unknown */
+    double freq_usage[3] = { 20, 12.5, -1 };
+
+    char *buffer = emalloc(exporter_max_metrics_length(3));
+    size_t length = exporter_format_metrics(buffer, 1700000000123456789LL, 42, 3, cpu_names, cpu_usage, freq_usage);
+    assert(length == strlen(buffer));
+    assert(length < exporter_max_metrics_length(3));
+    assert(strstr(buffer, "\ncut_cpu_aggregate_usage_ratio 0.5000\n"));
+    assert(strstr(buffer, "\ncut_cpu_usage_ratio{cpu=\"0\"} 0.2500\n"));
+    assert(strstr(buffer, "\ncut_cpu_usage_ratio{cpu=\"12\"} 0.7500\n"));
+    assert(strstr(buffer, "\ncut_cpu_frequency_weighted_usage_ratio{cpu=\"0\"} 0.1250\n"));
+    assert(!strstr(buffer, "cut_cpu_frequency_weighted_usage_ratio{cpu=\"12\"}"));
+    assert(strstr(buffer, "\ncut_last_sample_timestamp_seconds 1700000000.123\n"));
+    assert(strstr(buffer, "\n# TYPE cut_samples_total counter\ncut_samples_total 42\n"));
+
+    length = exporter_format_metrics(buffer, 0, 1, 3, cpu_names, cpu_usage, NULL);
+    assert(length == strlen(buffer));
+    assert(!strstr(buffer, "frequency"));
+
+    /* The Exporter thread replaces the file with every sample */
+    char directory[] = "test_exporter_XXXXXX";
+    assert(mkdtemp(directory));
+    char path[64];
+    snprintf(path, sizeof(path), "%s/cut.prom", directory);
+
+    ExporterArgs *exporter_args = ecalloc(1, sizeof(*exporter_args));
+    exporter_args->path = emalloc(strlen(path) + 1);
+    strcpy(exporter_args->path, path);
+    exporter_args->max_cpu_entries = 2;
+
+    pthread_t exporter;
+    int iret = pthread_create(&exporter, NULL, exporter_run, exporter_args);
+    assert(iret == 0);
+
+    /* More CPUs than the slots were allocated for */
+    ExporterQueue *queue = exporter_queue_attach();
+    assert(usage_sample_submit(queue, 1000LL * NSEC_PER_SEC, 3, cpu_names, cpu_usage, NULL, NULL));
+
+    FILE *file = NULL;
+    for (int i = 0; i < 200 && !file; i++) {
+        file = fopen(path, "r");
+        if (!file) {
+            struct timespec ts = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    assert(file);
+    length = fread(buffer, 1, exporter_max_metrics_length(3) - 1, file);
+    buffer[length] = '\0';
+    assert(fclose(file) == 0);
+    assert(strstr(buffer, "\ncut_cpu_usage_ratio{cpu=\"12\"} 0.7500\n"));
+    assert(strstr(buffer, "\ncut_last_sample_timestamp_seconds 1000.000\n"));
+
+    exporter_queue_detach(queue);
+    iret = pthread_cancel(exporter);
+    assert(iret == 0);
+    iret = pthread_join(exporter, NULL);
+    assert(iret == 0);
+
+    assert(unlink(path) == 0);
+    assert(rmdir(directory) == 0);
+    free(buffer);
+
+    printf("%s OK\n", __func__);
+}
+
+static int
+test_server_connect(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    int iret = connect(fd, (struct sockaddr *)&address, sizeof(address));
+    assert(iret == 0);
+
+    return fd;
+}
+
+/*
+ * Wait up to 5 seconds for the Server to have n_clients clients.
+ */
+static void
+test_server_wait_clients(int n_clients, ServerClientMetrics metrics[SERVER_MAX_CLIENTS])
+{
+    for (int i = 0; i < 500 && server_clients_metrics(SERVER_MAX_CLIENTS, metrics) != n_clients; i++) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+        nanosleep(&ts, NULL);
+    }
+    assert(server_clients_metrics(SERVER_MAX_CLIENTS, metrics) == n_clients);
+}
+
+/*
+ * Read what the client received without blocking, returns the number of lines.
+ */
+static long
+test_server_receive(int fd, char *buffer, size_t buffer_size, size_t length[static 1])
+{
+    long n_lines = 0;
+    while (1) {
+        ssize_t n = recv(fd, buffer, buffer_size, MSG_DONTWAIT);
+        if (n <= 0) {
+            return n_lines;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            n_lines += buffer[i] == '\n';
+        }
+        *length += (size_t)n;
+    }
+}
+
+static void
+test_sample_format(void)
+{
+    char number[SAMPLE_FORMAT_MAX_NUMBER_LENGTH + 1];
+    const struct {
+        double value;
+        const char *expected;
+    } numbers[] = {
+        { 0, "0.00" }, { 100, "100.00" }, { 12.5, "12.50" }, { 9.999, "10.00" }, { 0.004, "0.00" },
+        { 0.005001, "0.01" }, { 33.333333, "33.33" }, { 66.666666, "66.67" }, { -1.5, "-1.50" },
+        { 123456789.01, "123456789.01" }, { 1e20, "1.000000e+20" },
+    };
+    for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+        *sample_format_number(number, numbers[i].value) = '\0';
+        assert(strcmp(number, numbers[i].expected) == 0);
+    }
+    /* Same as printf() */
+    for (int i = 0; i <= 100000; i++) {
+        double value = (double)i / 1000 + 0.0001;
+        char expected[SAMPLE_FORMAT_MAX_NUMBER_LENGTH];
+        snprintf(expected, sizeof(expected), "%.2f", value);
+        *sample_format_number(number, value) = '\0';
+        assert(strcmp(number, expected) == 0);
+    }
+
+    char cpu_names[3][PROCSTATCPUENTRY_CPU_NAME_SIZE] = { "cpu", "cpu0", "cpu12" };
+    double cpu_usage[3] = { 50, 25, 75 };
+    double freq_usage[3] = { 20, 12.5, -1 };
+
+    char *line = emalloc(sample_format_max_line_length(3, false));
+    size_t length = sample_format_json(line, 7, 1700000000123456789LL, 3, cpu_names, cpu_usage, freq_usage, NULL);
+    assert(length == strlen(line));
+    assert(length < sample_format_max_line_length(3, false));
+    assert(strcmp(line, "{\"seq\":7,\"timestamp\":1700000000.123,\"usage\":{\"cpu\":50.00,\"cpu0\":25.00,\"cpu12\":75.00},"
+            "\"freq_usage\":{\"cpu\":20.00,\"cpu0\":12.50,\"cpu12\":null}}\n") == 0);
+    length = sample_format_json(line, 1, 0, 1, cpu_names, cpu_usage, NULL, NULL);
+    assert(strcmp(line, "{\"seq\":1,\"timestamp\":0.000,\"usage\":{\"cpu\":50.00}}\n") == 0);
+    assert(length == strlen(line));
+
+    length = sample_format_csv_header(line, 3, cpu_names, true, false);
+    assert(length == strlen(line));
+    assert(strcmp(line, "timestamp,cpu,cpu0,cpu12,freq_cpu,freq_cpu0,freq_cpu12\n") == 0);
+    length = sample_format_csv(line, 1700000000012000000LL, 3, cpu_usage, freq_usage, NULL);
+    assert(length == strlen(line));
+    assert(strcmp(line, "1700000000.012,50.00,25.00,75.00,20.00,12.50,\n") == 0);
+    sample_format_csv_header(line, 2, cpu_names, false, false);
+    assert(strcmp(line, "timestamp,cpu,cpu0\n") == 0);
+    sample_format_csv(line, 999000000LL, 2, cpu_usage, NULL, NULL);
+    assert(strcmp(line, "0.999,50.00,25.00\n") == 0);
+
+    /* Per-state breakdown: an object per state in JSON, a column per state and CPU in CSV */
+    float percentages[CPU_N_STATES][2] = {
+        [CPU_STATE_USER] = { 10, 20 },
+        [CPU_STATE_IDLE] = { 90, 80 },
+    };
+    CpuStateBreakdown states = { .n_cpu_entries = 2 };
+    for (int s = 0; s < CPU_N_STATES; s++) {
+        states.percentage[s] = percentages[s];
+    }
+    free(line);
+    line = emalloc(sample_format_max_line_length(2, true));
+    length = sample_format_json(line, 1, 0, 2, cpu_names, cpu_usage, NULL, &states);
+    assert(length == strlen(line));
+    const char *start = "{\"seq\":1,\"timestamp\":0.000,\"usage\":{\"cpu\":50.00,\"cpu0\":25.00},\"states\":{"
+        "\"user\":{\"cpu\":10.00,\"cpu0\":20.00},\"nice\":{\"cpu\":0.00,\"cpu0\":0.00},";
+    const char *end = ",\"guest_nice\":{\"cpu\":0.00,\"cpu0\":0.00}}}\n";
+    assert(strncmp(line, start, strlen(start)) == 0);
+    assert(strstr(line, ",\"idle\":{\"cpu\":90.00,\"cpu0\":80.00},"));
+    assert(strcmp(&line[length - strlen(end)], end) == 0);
+    length = sample_format_csv_header(line, 2, cpu_names, false, true);
+    assert(length == strlen(line));
+    start = "timestamp,cpu,cpu0,user_cpu,user_cpu0,nice_cpu,nice_cpu0,system_cpu,";
+    end = ",guest_nice_cpu,guest_nice_cpu0\n";
+    assert(strncmp(line, start, strlen(start)) == 0);
+    assert(strcmp(&line[length - strlen(end)], end) == 0);
+    length = sample_format_csv(line, 999000000LL, 2, cpu_usage, NULL, &states);
+    assert(length == strlen(line));
+    start = "0.999,50.00,25.00,10.00,20.00,0.00,0.00,0.00,0.00,90.00,80.00,0.00,";
+    assert(strncmp(line, start, strlen(start)) == 0);
+    /* A value per state and CPU after the timestamp and the usage */
+    int n_fields = 1;
+    for (const char *c = line; *c; c++) {
+        n_fields += *c == ',';
+    }
+    assert(n_fields == 1 + 2 + CPU_N_STATES * 2);
+
+    free(line);
+
+    printf("%s OK\n", __func__);
+}
+
+/*
+ * Read from fd until it has been quiet for 300 ms (or reached end of file), into a null terminated buffer.
+ */
+static size_t
+test_output_read(int fd, char *buffer, size_t buffer_size)
+{
+    size_t length = 0;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (length < buffer_size - 1 && poll(&pfd, 1, 300) > 0) {
+        ssize_t n = read(fd, &buffer[length], buffer_size - 1 - length);
+        if (n <= 0) {
+            break;
+        }
+        length += (size_t)n;
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+static void
+test_output(void)
+{
+    OutputFormat format;
+    assert(output_parse_format("csv", &format) && format == OUTPUT_FORMAT_CSV);
+    assert(output_parse_format("jsonl", &format) && format == OUTPUT_FORMAT_JSONL);
+    assert(!output_parse_format("xml", &format));
+
+    int pipe_fds[2];
+    assert(pipe(pipe_fds) == 0);
+
+    OutputArgs *output_args = ecalloc(1, sizeof(*output_args));
+    output_args->format = OUTPUT_FORMAT_CSV;
+    output_args->fd = pipe_fds[1];
+    output_args->max_cpu_entries = 2;
+    output_args->backpressure = STAGE_BACKPRESSURE_BLOCK;
+
+    pthread_t output;
+    int iret = pthread_create(&output, NULL, output_run, output_args);
+    assert(iret == 0);
+
+    char cpu_names[3][PROCSTATCPUENTRY_CPU_NAME_SIZE] = { "cpu", "cpu0", "cpu1" };
+    double cpu_usage[3] = { 50, 25, 75 };
+    double freq_usage[3] = { 20, -1, 40 };
+
+    OutputQueue *queue = output_queue_attach();
+    assert(usage_sample_submit(queue, 1 * NSEC_PER_SEC, 2, cpu_names, cpu_usage, NULL, NULL));
+    assert(usage_sample_submit(queue, 2 * NSEC_PER_SEC, 2, cpu_names, cpu_usage, NULL, NULL));
+    /* A CPU came online and frequencies became available, the header is repeated */
+    assert(usage_sample_submit(queue, 3 * NSEC_PER_SEC, 3, cpu_names, cpu_usage, freq_usage, NULL));
+
+    /* Written after the flush interval, though the buffer is far from full */
+    char buffer[1024];
+    test_output_read(pipe_fds[0], buffer, sizeof(buffer));
+    assert(strcmp(buffer,
+            "timestamp,cpu,cpu0\n"
+            "1.000,50.00,25.00\n"
+            "2.000,50.00,25.00\n"
+            "timestamp,cpu,cpu0,cpu1,freq_cpu,freq_cpu0,freq_cpu1\n"
+            "3.000,50.00,25.00,75.00,20.00,,40.00\n") == 0);
+
+    /* The Output thread reports the depth of its queue */
+    StatsSnapshot snapshot;
+    stats_snapshot(&snapshot);
+    assert(snapshot.gauges_max[STATS_GAUGE_OUTPUT_QUEUE_DEPTH] >= 1);
+
+    /* The per-state breakdown is copied along with the usage and has columns of its own */
+    CpuStateBreakdown states = {0};
+    ProcStatCpuEntry previous_entries[2] = { { .user = 100, .idle = 100 }, { .idle = 100 } };
+    ProcStatCpuEntry current_entries[2] = { { .user = 150, .idle = 150 }, { .system = 10, .idle = 190 } };
+    CpuStateCounters previous_counters = {0};
+    CpuStateCounters current_counters = {0};
+    cpu_state_counters_load(&previous_counters, 2, previous_entries);
+    cpu_state_counters_load(&current_counters, 2, current_entries);
+    cpu_state_breakdown_calculate(&states, &previous_counters, &current_counters);
+    assert(usage_sample_submit(queue, 4 * NSEC_PER_SEC, 2, cpu_names, cpu_usage, NULL, &states));
+    cpu_state_counters_free(&previous_counters);
+    cpu_state_counters_free(&current_counters);
+    cpu_state_breakdown_free(&states);
+
+    test_output_read(pipe_fds[0], buffer, sizeof(buffer));
+    const char *header = "timestamp,cpu,cpu0,user_cpu,user_cpu0,nice_cpu,nice_cpu0,system_cpu,system_cpu0,idle_cpu,idle_cpu0,";
+    const char *line = "\n4.000,50.00,25.00,50.00,0.00,0.00,0.00,0.00,10.00,50.00,90.00,0.00,";
+    assert(strncmp(buffer, header, strlen(header)) == 0);
+    assert(strstr(buffer, line));
+
+    /* What's buffered or queued when the thread is cancelled is written */
+    assert(usage_sample_submit(queue, 5 * NSEC_PER_SEC, 3, cpu_names, cpu_usage, freq_usage, NULL));
+    iret = pthread_cancel(output);
+    assert(iret == 0);
+    iret = pthread_join(output, NULL);
+    assert(iret == 0);
+    output_queue_detach(queue);
+
+    test_output_read(pipe_fds[0], buffer, sizeof(buffer));
+    assert(strcmp(buffer,
+            "timestamp,cpu,cpu0,cpu1,freq_cpu,freq_cpu0,freq_cpu1\n"
+            "5.000,50.00,25.00,75.00,20.00,,40.00\n") == 0);
+
+    assert(close(pipe_fds[0]) == 0 && close(pipe_fds[1]) == 0);
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+test_server(void)
+{
+    char directory[] = "test_server_XXXXXX";
+    assert(mkdtemp(directory));
+    char path[64];
+    snprintf(path, sizeof(path), "%s/cut.sock", directory);
+
+    int listen_fd = server_listen(path);
+    assert(listen_fd >= 0);
+
+    ServerArgs *server_args = ecalloc(1, sizeof(*server_args));
+    server_args->listen_fd = listen_fd;
+    server_args->path = emalloc(strlen(path) + 1);
+    strcpy(server_args->path, path);
+    server_args->max_cpu_entries = 3;
+
+    pthread_t server;
+    int iret = pthread_create(&server, NULL, server_run, server_args);
+    assert(iret == 0);
+
+    ServerClientMetrics metrics[SERVER_MAX_CLIENTS];
+    int reading_fd = test_server_connect(path);
+    test_server_wait_clients(1, metrics);
+    /* Never reads, so its socket buffer and backlog fill up */
+    int stalled_fd = test_server_connect(path);
+    test_server_wait_clients(2, metrics);
+
+    /* Large samples, so that the stalled client falls behind quickly */
+    enum { N_CPU_ENTRIES = 513, N_SAMPLES = 300 };
+    char (*many_cpu_names)[PROCSTATCPUENTRY_CPU_NAME_SIZE] = ecalloc(N_CPU_ENTRIES, sizeof(many_cpu_names[0]));
+    double *many_cpu_usage = ecalloc(N_CPU_ENTRIES, sizeof(many_cpu_usage[0]));
+    for (int i = 0; i < N_CPU_ENTRIES; i++) {
+        snprintf(many_cpu_names[i], sizeof(many_cpu_names[i]), i == 0 ? "cpu" : "cpu%d", i - 1);
+        many_cpu_usage[i] = i % 101;
+    }
+
+    size_t buffer_size = 1 << 16;
+    char *buffer = emalloc(buffer_size);
+    size_t n_received = 0;
+    long n_lines = 0;
+
+    ServerQueue *queue = server_queue_attach();
+    for (int i = 0; i < N_SAMPLES; i++) {
+        while (!usage_sample_submit(queue, i * NSEC_PER_SEC, N_CPU_ENTRIES, many_cpu_names, many_cpu_usage, NULL, NULL)) {
+            struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000 * 1000 };
+            nanosleep(&ts, NULL);
+        }
+        if (i == 0) {
+            /* The first sample is the first line received */
+            struct timespec ts = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+            nanosleep(&ts, NULL);
+            ssize_t n = recv(reading_fd, buffer, 64, MSG_DONTWAIT);
+            assert(n == 64);
+            const char *prefix = "{\"seq\":1,\"timestamp\":0.000,\"usage\":{";
+            assert(strncmp(buffer, prefix, strlen(prefix)) == 0);
+            n_received += (size_t)n;
+        }
+        n_lines += test_server_receive(reading_fd, buffer, buffer_size, &n_received);
+    }
+    for (int i = 0; i < 500 && n_lines < N_SAMPLES; i++) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+        nanosleep(&ts, NULL);
+        n_lines += test_server_receive(reading_fd, buffer, buffer_size, &n_received);
+    }
+    /* The reading client got every sample, whatever the other one does */
+    assert(n_lines == N_SAMPLES);
+
+    assert(server_clients_metrics(SERVER_MAX_CLIENTS, metrics) == 2);
+    ServerClientMetrics *reading = metrics[0].id < metrics[1].id ? &metrics[0] : &metrics[1];
+    ServerClientMetrics *stalled = metrics[0].id < metrics[1].id ? &metrics[1] : &metrics[0];
+    assert(reading->n_samples_sent == N_SAMPLES && reading->n_samples_skipped == 0);
+    assert(reading->n_samples_pending == 0 && reading->n_bytes_pending == 0);
+    assert(stalled->n_samples_skipped > 0);
+    assert(stalled->n_samples_sent + stalled->n_samples_skipped + stalled->n_samples_pending == N_SAMPLES);
+    assert(stalled->n_samples_pending > 0 && stalled->n_bytes_pending > 0);
+
+    assert(close(stalled_fd) == 0);
+    test_server_wait_clients(1, metrics);
+    assert(metrics[0].n_samples_sent == N_SAMPLES);
+
+    /* Only one instance can listen on a path (the check connects to it) */
+    assert(server_listen(path) < 0 && errno == EADDRINUSE);
+
+    server_queue_detach(queue);
+    iret = pthread_cancel(server);
+    assert(iret == 0);
+    iret = pthread_join(server, NULL);
+    assert(iret == 0);
+
+    /* The socket is removed and the clients disconnected */
+    assert(access(path, F_OK) != 0);
+    assert(recv(reading_fd, buffer, buffer_size, 0) == 0);
+    assert(close(reading_fd) == 0);
+    assert(rmdir(directory) == 0);
+
+    free(buffer);
+    free(many_cpu_usage);
+    free(many_cpu_names);
+
+    printf("%s OK\n", __func__);
+}
+
+/*
+ * Entry i of sample k: usage k + i, frequency-weighted usage k / 2 + i, so torn copies are detected.
+ */
+static bool
+test_shm_is_consistent(ShmSample sample[static 1], int n_cpu_entries, char cpu_names[n_cpu_entries][SHM_CPU_NAME_SIZE],
+        char expected_cpu_names[n_cpu_entries][SHM_CPU_NAME_SIZE], double cpu_usage[n_cpu_entries], double freq_usage[n_cpu_entries])
+{
+    if (sample->n_cpu_entries != n_cpu_entries || !sample->has_freq_usage) {
+        return false;
+    }
+    double k = (double)sample->n_samples;
+    for (int i = 0; i < n_cpu_entries; i++) {
+        if (cpu_usage[i] != k + i || freq_usage[i] != k / 2 + i || strcmp(cpu_names[i], expected_cpu_names[i]) != 0) {
+            return false;
+        }
+    }
+    return sample->timestamp_ns == (long long)sample->n_samples * NSEC_PER_SEC;
+}
+
+static void
+test_shm(void)
+{
+    enum { N_CPU_ENTRIES = 257, N_SAMPLES = 20000 };
+
+    char name[64];
+    snprintf(name, sizeof(name), "/cut_test_shm_%d", (int)getpid());
+
+    ShmWriter *writer = shm_writer_open(name, N_CPU_ENTRIES);
+    assert(writer);
+    /* A single writer per segment */
+    assert(!shm_writer_open(name, N_CPU_ENTRIES) && errno == EEXIST);
+
+    char (*cpu_names)[SHM_CPU_NAME_SIZE] = ecalloc(N_CPU_ENTRIES, sizeof(cpu_names[0]));
+    char (*expected_cpu_names)[SHM_CPU_NAME_SIZE] = ecalloc(N_CPU_ENTRIES, sizeof(expected_cpu_names[0]));
+    double *cpu_usage = ecalloc(N_CPU_ENTRIES, sizeof(cpu_usage[0]));
+    double *freq_usage = ecalloc(N_CPU_ENTRIES, sizeof(freq_usage[0]));
+    for (int i = 0; i < N_CPU_ENTRIES; i++) {
+        snprintf(expected_cpu_names[i], sizeof(expected_cpu_names[i]), i == 0 ? "cpu" : "cpu%d", i - 1);
+    }
+
+    ShmReader reader;
+    assert(shm_reader_open(&reader, name));
+    assert(shm_reader_max_cpu_entries(&reader) == N_CPU_ENTRIES);
+    ShmSample sample;
+    assert(shm_reader_read(&reader, &sample, cpu_names, cpu_usage, freq_usage));
+    assert(sample.n_samples == 0 && sample.n_cpu_entries == 0);
+
+    int ready_pipe[2];
+    assert(pipe(ready_pipe) == 0);
+
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        /* Another process, which only maps the segment and reads it while the parent keeps publishing */
+        ShmReader child_reader;
+        if (!shm_reader_open(&child_reader, name)) {
+            _exit(2);
+        }
+        if (write(ready_pipe[1], "", 1) != 1) {
+            _exit(3);
+        }
+        long long deadline_ns = clock_now_ns(CLOCK_MONOTONIC) + 20 * NSEC_PER_SEC;
+        while (clock_now_ns(CLOCK_MONOTONIC) < deadline_ns) {
+            if (!shm_reader_read(&child_reader, &sample, cpu_names, cpu_usage, freq_usage) || sample.n_samples == 0) {
+                continue;
+            }
+            if (!test_shm_is_consistent(&sample, N_CPU_ENTRIES, cpu_names, expected_cpu_names, cpu_usage, freq_usage)) {
+                _exit(4);
+            }
+            if (sample.n_samples == N_SAMPLES) {
+                _exit(0);
+            }
+        }
+        _exit(5);
+    }
+
+    char ready;
+    assert(read(ready_pipe[0], &ready, 1) == 1);
+    assert(close(ready_pipe[0]) == 0 && close(ready_pipe[1]) == 0);
+
+    for (int k = 1; k <= N_SAMPLES; k++) {
+        for (int i = 0; i < N_CPU_ENTRIES; i++) {
+            cpu_usage[i] = (double)k + i;
+            freq_usage[i] = (double)k / 2 + i;
+        }
+        bool bret = shm_writer_publish(writer, k * NSEC_PER_SEC, N_CPU_ENTRIES, expected_cpu_names, cpu_usage, freq_usage);
+        assert(bret);
+    }
+
+    int status;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    memset(cpu_usage, 0, N_CPU_ENTRIES * sizeof(cpu_usage[0]));
+    assert(shm_reader_read(&reader, &sample, cpu_names, cpu_usage, freq_usage));
+    assert(sample.n_samples == N_SAMPLES);
+    assert(test_shm_is_consistent(&sample, N_CPU_ENTRIES, cpu_names, expected_cpu_names, cpu_usage, freq_usage));
+
+    /* Samples that don't fit aren't published */
+    char (*more_cpu_names)[SHM_CPU_NAME_SIZE] = ecalloc(N_CPU_ENTRIES + 1, sizeof(more_cpu_names[0]));
+    double *more_cpu_usage = ecalloc(N_CPU_ENTRIES + 1, sizeof(more_cpu_usage[0]));
+    assert(!shm_writer_publish(writer, 0, N_CPU_ENTRIES + 1, more_cpu_names, more_cpu_usage, NULL));
+    assert(shm_reader_read(&reader, &sample, NULL, cpu_usage, NULL) && sample.n_samples == N_SAMPLES);
+
+    /* The segment is removed, existing mappings stay valid */
+    shm_writer_close(writer);
+    ShmReader other_reader;
+    assert(!shm_reader_open(&other_reader, name));
+    assert(shm_reader_read(&reader, &sample, NULL, cpu_usage, NULL) && sample.n_samples == N_SAMPLES);
+    shm_reader_close(&reader);
+
+    free(more_cpu_usage);
+    free(more_cpu_names);
+    free(freq_usage);
+    free(cpu_usage);
+    free(expected_cpu_names);
+    free(cpu_names);
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+test_history(void)
+{
+#define HISTORY_TEST_N_CPU_ENTRIES 65
+    /* Enough snapshots to fill several blocks */
+    int n_snapshots = 3000;
+
+    char file_name[] = "test_history_XXXXXX";
+    int fd = mkstemp(file_name);
+    assert(fd >= 0);
+    assert(close(fd) == 0);
+
+    ProcStatCpuEntry expected[HISTORY_TEST_N_CPU_ENTRIES];
+    ProcStatCpuEntry cpu_entries[HISTORY_TEST_N_CPU_ENTRIES];
+    long long timestamp_ns;
+
+    /* The first half is appended by one writer, the second half by another one reopening the file */
+    for (int half = 0; half < 2; half++) {
+        HistoryWriter *writer = history_writer_open(file_name, HISTORY_TEST_N_CPU_ENTRIES);
+        assert(writer);
+        for (int s = half * n_snapshots / 2; s < (half + 1) * n_snapshots / 2; s++) {
+            history_test_snapshot(s, HISTORY_TEST_N_CPU_ENTRIES, expected);
+            assert(history_writer_append(writer, history_test_timestamp(s), HISTORY_TEST_N_CPU_ENTRIES, expected));
+        }
+        history_writer_close(writer);
+    }
+
+    /* A file created for fewer entries can't be appended to */
+    assert(history_writer_open(file_name, HISTORY_TEST_N_CPU_ENTRIES + 1) == NULL);
+
+    HistoryReader *reader = history_reader_open(file_name);
+    assert(reader);
+    assert(history_reader_max_cpu_entries(reader) == HISTORY_TEST_N_CPU_ENTRIES);
+
+    long long first_timestamp_ns;
+    long long last_timestamp_ns;
+    assert(history_reader_time_range(reader, &first_timestamp_ns, &last_timestamp_ns));
+    assert(first_timestamp_ns == history_test_timestamp(0));
+    assert(last_timestamp_ns == history_test_timestamp(n_snapshots - 1));
+
+    /* Sequential read of everything */
+    for (int s = 0; s < n_snapshots; s++) {
+        assert(history_reader_next(reader, &timestamp_ns, cpu_entries) == HISTORY_TEST_N_CPU_ENTRIES);
+        assert(timestamp_ns == history_test_timestamp(s));
+        history_test_snapshot(s, HISTORY_TEST_N_CPU_ENTRIES, expected);
+        assert(memcmp(cpu_entries, expected, sizeof(expected)) == 0);
+    }
+    assert(history_reader_next(reader, &timestamp_ns, cpu_entries) == 0);
+
+    /* Seeking to exact timestamps, to timestamps between snapshots and out of range */
+    int seek_targets[] = { 0, 1, 517, 1499, 1500, 1501, 2222, n_snapshots - 1 };
+    for (size_t i = 0; i < sizeof(seek_targets) / sizeof(seek_targets[0]); i++) {
+        int s = seek_targets[i];
+        for (long long offset = -1; offset <= 0; offset++) {
+            assert(history_reader_seek(reader, history_test_timestamp(s) + offset));
+            assert(history_reader_next(reader, &timestamp_ns, cpu_entries) == HISTORY_TEST_N_CPU_ENTRIES);
+            assert(timestamp_ns == history_test_timestamp(s));
+            history_test_snapshot(s, HISTORY_TEST_N_CPU_ENTRIES, expected);
+            assert(memcmp(cpu_entries, expected, sizeof(expected)) == 0);
+
+            /* Reading continues from there */
+            if (s + 1 < n_snapshots) {
+                assert(history_reader_next(reader, &timestamp_ns, cpu_entries) == HISTORY_TEST_N_CPU_ENTRIES);
+                assert(timestamp_ns == history_test_timestamp(s + 1));
+            }
+        }
+    }
+    assert(history_reader_seek(reader, 0));
+    assert(history_reader_next(reader, &timestamp_ns, cpu_entries) == HISTORY_TEST_N_CPU_ENTRIES);
+    assert(timestamp_ns == history_test_timestamp(0));
+    assert(!history_reader_seek(reader, history_test_timestamp(n_snapshots - 1) + 1));
+    assert(history_reader_next(reader, &timestamp_ns, cpu_entries) == 0);
+
+    history_reader_close(reader);
+
+    /* Names other than "cpu" and "cpuN" can't be stored */
+    assert(unlink(file_name) == 0);
+    HistoryWriter *writer = history_writer_open(file_name, HISTORY_TEST_N_CPU_ENTRIES);
+    assert(writer);
+    history_test_snapshot(0, 2, expected);
+    strcpy(expected[1].cpu_name, "gpu0");
+    assert(!history_writer_append(writer, history_test_timestamp(0), 2, expected));
+    history_writer_close(writer);
+
+    assert(unlink(file_name) == 0);
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+test_screen(void)
+{
+    Screen screen;
+    screen_init(&screen, 3, 10);
+
+    size_t length;
+    const char *output;
+
+    /* The first frame clears the terminal and sends only what isn't blank */
+    screen_put_text(&screen, 0, 0, "abc");
+    screen_fill(&screen, 2, 8, 5, 0x2588);
+    output = screen_compose(&screen, &length);
+    const char first_frame[] = "\033[H\033[J\033[1;1Habc\033[3;9H\xe2\x96\x88\xe2\x96\x88\033[4;1H";
+    assert(length == sizeof(first_frame) - 1);
+    assert(memcmp(output, first_frame, length) == 0);
+
+    /* Nothing changed, nothing to send */
+    output = screen_compose(&screen, &length);
+    assert(length == 0);
+
+    /* Only the changed cells are sent, short gaps of unchanged cells are bridged */
+    screen_put_text(&screen, 0, 0, "aXc");
+    screen_printf(&screen, 1, 2, "%d", 42);
+    screen_put_text(&screen, 1, 8, "Z");
+    output = screen_compose(&screen, &length);
+    const char second_frame[] = "\033[1;2HX\033[2;3H42    Z\033[4;1H";
+    assert(length == sizeof(second_frame) - 1);
+    assert(memcmp(output, second_frame, length) == 0);
+
+    /* Text is clipped to the frame */
+    assert(screen_put_text(&screen, 2, 7, "12345") == 12);
+    output = screen_compose(&screen, &length);
+    const char third_frame[] = "\033[3;8H123\033[4;1H";
+    assert(length == sizeof(third_frame) - 1);
+    assert(memcmp(output, third_frame, length) == 0);
+
+    /* Resizing redraws everything */
+    screen_resize(&screen, 1, 4);
+    screen_put_text(&screen, 0, 1, "ok");
+    output = screen_compose(&screen, &length);
+    const char resized_frame[] = "\033[H\033[J\033[1;2Hok\033[2;1H";
+    assert(length == sizeof(resized_frame) - 1);
+    assert(memcmp(output, resized_frame, length) == 0);
+
+    screen_destroy(&screen);
+
+    printf("%s OK\n", __func__);
+}
+
+/*
+ * Contents of a screen row as a string, with non-ASCII cells replaced by '?'.
+ */
+static const char *
+screen_row_text(Screen *screen, int row)
+{
+    static char text[512];
+    int n = 0;
+    for (; n < screen->n_cols && n < (int)sizeof(text) - 1; n++) {
+        uint32_t cell = screen->cells[row * screen->n_cols + n];
+        text[n] = cell < 0x80 ? (char)cell : '?';
+    }
+    /* Trailing spaces don't matter */
+    while (n > 0 && text[n - 1] == ' ') {
+        n--;
+    }
+    text[n] = '\0';
+    return text;
+}
+
+static void
+test_layouts(void)
+{
+#define LAYOUT_TEST_N_CPU_ENTRIES 10
+    char cpu_names[LAYOUT_TEST_N_CPU_ENTRIES][PROCSTATCPUENTRY_CPU_NAME_SIZE];
+    double cpu_usage[LAYOUT_TEST_N_CPU_ENTRIES] = { 51.2, 5, 95, 15, 100, 0, 55, 55, 99, 42 };
+    for (int i = 0; i < LAYOUT_TEST_N_CPU_ENTRIES; i++) {
+        snprintf(cpu_names[i], sizeof(cpu_names[i]), i == 0 ? "cpu" : "cpu%d", i - 1);
+    }
+
+    Layout layout;
+    assert(layout_from_name("heatmap", &layout) && layout == LAYOUT_HEATMAP);
+    assert(!layout_from_name("pie", &layout));
+
+    Screen screen;
+    screen_init(&screen, 0, 0);
+
+    /* Unlimited height: bars in as many columns as fit */
+    layout_draw(&screen, LAYOUT_AUTO, 0, 90, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(screen.n_rows == 6);
+    assert(strcmp(screen_row_text(&screen, 0), "Avg.    [||||||||||          ]  51.2%") == 0);
+    assert(strcmp(screen_row_text(&screen, 1),
+            "cpu0    [|                   ]   5.0%           cpu1    [||||||||||||||||||| ]  95.0%") == 0);
+    assert(strcmp(screen_row_text(&screen, 2),
+            "cpu2    [|||                 ]  15.0%           cpu3    [||||||||||||||||||||] 100.0%") == 0);
+    layout_draw(&screen, LAYOUT_BARS, 0, 40, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(screen.n_rows == 10);
+
+    /* Frequency-weighted usage next to the bars, blank for the cores whose frequency is unknown */
+    double freq_usage[LAYOUT_TEST_N_CPU_ENTRIES] = { 30.5, 2.5, -1, 15, 50, 0, 55, 27.5, 99, 21 };
+    layout_draw(&screen, LAYOUT_AUTO, 0, 94, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, freq_usage, NULL, NULL, NULL);
+    assert(screen.n_rows == 6);
+    assert(strcmp(screen_row_text(&screen, 0), "Avg.    [||||||||||          ]  51.2% @  30.5%") == 0);
+    assert(strcmp(screen_row_text(&screen, 1),
+            "cpu0    [|                   ]   5.0% @   2.5%  cpu1    [||||||||||||||||||| ]  95.0%") == 0);
+    layout_draw(&screen, LAYOUT_AUTO, 0, 93, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, freq_usage, NULL, NULL, NULL);
+    assert(screen.n_rows == 10);
+    layout_draw(&screen, LAYOUT_HISTOGRAM, 0, 60, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, freq_usage, NULL, NULL, NULL);
+    assert(strcmp(screen_row_text(&screen, 0), "Avg.    [||||||||||          ]  51.2% @  30.5%   9 cores") == 0);
+
+    /* Top: the busiest cores in descending order, as many as fit */
+    layout_draw(&screen, LAYOUT_TOP, 6, 40, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(screen.n_rows == 5);
+    assert(strcmp(screen_row_text(&screen, 1), "Busiest cores") == 0);
+    assert(strncmp(screen_row_text(&screen, 2), "cpu3 ", 5) == 0);
+    assert(strncmp(screen_row_text(&screen, 3), "cpu7 ", 5) == 0);
+    assert(strncmp(screen_row_text(&screen, 4), "cpu1 ", 5) == 0);
+
+    /* Histogram: the number of cores in each bucket, busiest bucket first */
+    layout_draw(&screen, LAYOUT_HISTOGRAM, 0, 30, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(screen.n_rows == 12);
+    assert(strcmp(screen_row_text(&screen, 2), " 90-100% ############## 3") == 0);
+    assert(strcmp(screen_row_text(&screen, 6), " 50-60%  ########## 2") == 0);
+    assert(strcmp(screen_row_text(&screen, 7), " 40-50%  ##### 1") == 0);
+    assert(strcmp(screen_row_text(&screen, 8), " 30-40%   0") == 0);
+    assert(strcmp(screen_row_text(&screen, 11), "  0-10%  ########## 2") == 0);
+
+    /* Heatmap: one shaded cell per core, rows labeled with their first core */
+    layout_draw(&screen, LAYOUT_HEATMAP, 0, 10, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(screen.n_rows == 5);
+    assert(strcmp(screen_row_text(&screen, 2), "    0 ????") == 0);
+    assert(strcmp(screen_row_text(&screen, 4), "    8 ?") == 0);
+    uint32_t expected_shades[] = { 0x2591, 0x2588, 0x2591, 0x2588, 0x00b7, 0x2593, 0x2593, 0x2588, 0x2592 };
+    for (int i = 0; i < 9; i++) {
+        assert(screen.cells[(2 + i / 4) * screen.n_cols + 6 + i % 4] == expected_shades[i]);
+    }
+
+    /* Auto: bars if they fit, otherwise heatmap, histogram and top stacked in the terminal height */
+    layout_draw(&screen, LAYOUT_AUTO, 25, 40, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(screen.n_rows == 10);
+    assert(strncmp(screen_row_text(&screen, 9), "cpu8 ", 5) == 0);
+    layout_draw(&screen, LAYOUT_AUTO, 9, 40, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(screen.n_rows == 8);
+    assert(strcmp(screen_row_text(&screen, 3), "    0 ?????????") == 0);
+    assert(strcmp(screen_row_text(&screen, 5), "Cores by usage") == 0);
+
+    /* Stats: a header, then the average and a row per core until the terminal is full */
+    RollingStatsWindows windows;
+    assert(rolling_stats_parse_windows("10s,1m", &windows));
+    RollingStatsSummary summaries[2 * LAYOUT_TEST_N_CPU_ENTRIES] = {{0}};
+    for (int i = 0; i < LAYOUT_TEST_N_CPU_ENTRIES; i++) {
+        summaries[i] = (RollingStatsSummary){ 3, 10, 5, 20, 10, 20, 20 };
+    }
+    LayoutStats stats = { &windows, summaries };
+    layout_draw(&screen, LAYOUT_STATS, 7, 60, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, &stats, NULL, NULL);
+    assert(screen.n_rows == 6);
+    assert(strcmp(screen_row_text(&screen, 0), "Avg.    [||||||||||          ]  51.2%   9 cores") == 0);
+    assert(strcmp(screen_row_text(&screen, 1), "                 last 10s             last 1m") == 0);
+    assert(strcmp(screen_row_text(&screen, 2), "           now     mean   p95   max     mean   p95   max") == 0);
+    assert(strcmp(screen_row_text(&screen, 3), "Avg.      51.2     10.0  20.0  20.0        -     -     -") == 0);
+    assert(strncmp(screen_row_text(&screen, 5), "cpu1      95.0 ", 15) == 0);
+    layout_draw(&screen, LAYOUT_STATS, 0, 200, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, &stats, NULL, NULL);
+    assert(screen.n_rows == 1 + 2 + LAYOUT_TEST_N_CPU_ENTRIES);
+    assert(strncmp(screen_row_text(&screen, 2), "           now     mean   p50   p95   p99   min   max     mean", 61) == 0);
+    layout_draw(&screen, LAYOUT_STATS, 0, 60, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(strcmp(screen_row_text(&screen, 1), "No rolling statistics") == 0);
+
+    /* States: a header with the state names, then the average and a row per core */
+    float percentages[CPU_N_STATES][LAYOUT_TEST_N_CPU_ENTRIES] = {
+        [CPU_STATE_USER] = { 40, 5, 90 },
+        [CPU_STATE_SYSTEM] = { 11.2, 0, 5 },
+        [CPU_STATE_IDLE] = { 48.8, 95, 5 },
+    };
+    CpuStateBreakdown states = { .n_cpu_entries = LAYOUT_TEST_N_CPU_ENTRIES };
+    for (int s = 0; s < CPU_N_STATES; s++) {
+        states.percentage[s] = percentages[s];
+    }
+    layout_draw(&screen, LAYOUT_STATES, 5, 100, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, &states, NULL);
+    assert(screen.n_rows == 4);
+    assert(strcmp(screen_row_text(&screen, 1),
+            "           user   nice system   idle iowait    irq softirq  steal  guest guest_nice") == 0);
+    assert(strcmp(screen_row_text(&screen, 2),
+            "Avg.       40.0    0.0   11.2   48.8    0.0    0.0     0.0    0.0    0.0        0.0") == 0);
+    assert(strcmp(screen_row_text(&screen, 3),
+            "cpu0        5.0    0.0    0.0   95.0    0.0    0.0     0.0    0.0    0.0        0.0") == 0);
+    layout_draw(&screen, LAYOUT_STATES, 0, 100, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, &states, NULL);
+    assert(screen.n_rows == 2 + LAYOUT_TEST_N_CPU_ENTRIES);
+    layout_draw(&screen, LAYOUT_STATES, 0, 60, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(strcmp(screen_row_text(&screen, 1), "No per-state breakdown") == 0);
+
+    /* Processes: a header, then the busiest processes */
+    ProcessUsage top_processes[2] = { { 42, 43, "busy", 250 }, { 7, 7, "idle", 0.5 } };
+    LayoutProcesses processes = { 2, top_processes };
+    layout_draw(&screen, LAYOUT_PROCESSES, 0, 60, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, &processes);
+    assert(screen.n_rows == 4);
+    assert(strcmp(screen_row_text(&screen, 1), "    PID     CPU%  COMMAND") == 0);
+    assert(strcmp(screen_row_text(&screen, 2), "     42   250.0%  busy") == 0);
+    assert(strcmp(screen_row_text(&screen, 3), "      7     0.5%  idle") == 0);
+    layout_draw(&screen, LAYOUT_PROCESSES, 3, 60, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, &processes);
+    assert(screen.n_rows == 2);
+    layout_draw(&screen, LAYOUT_PROCESSES, 0, 60, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(strcmp(screen_row_text(&screen, 1), "No process data") == 0);
+
+    /* Threads: the tid in front of the pid of the process */
+    layout_draw(&screen, LAYOUT_THREADS, 0, 60, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, &processes);
+    assert(screen.n_rows == 4);
+    assert(strcmp(screen_row_text(&screen, 1), "    TID    PID     CPU%  COMMAND") == 0);
+    assert(strcmp(screen_row_text(&screen, 2), "     43     42   250.0%  busy") == 0);
+    layout_draw(&screen, LAYOUT_THREADS, 0, 60, LAYOUT_TEST_N_CPU_ENTRIES, cpu_names, cpu_usage, NULL, NULL, NULL, NULL);
+    assert(strcmp(screen_row_text(&screen, 1), "No thread data") == 0);
+
+    screen_destroy(&screen);
+
+    printf("%s OK\n", __func__);
+}
+
+#define SPSC_TEST_N_SLOTS 4
+#define SPSC_TEST_N_ITEMS 100000
+
+static SpscRing spsc_test_ring;
+static unsigned spsc_test_slots[SPSC_TEST_N_SLOTS];
+
+static void *
+spsc_producer_thread_run(void *arg)
+{
+    (void)(arg);
+
+    for (unsigned i = 0; i < SPSC_TEST_N_ITEMS; i++) {
+        int slot;
+        while ((slot = spsc_ring_acquire(&spsc_test_ring)) < 0) {
+            spsc_ring_record_drop(&spsc_test_ring);
+            sched_yield();
+        }
+        spsc_test_slots[slot] = i;
+        spsc_ring_commit(&spsc_test_ring);
+    }
+
+    pthread_exit(NULL);
+}
+
+static void
+test_spsc_ring(void)
+{
+    /*
+     * Push a sequence of numbers through the ring from one thread and verify
+     * on the consumer side that none got lost, duplicated or reordered.
+     * The consumer keeps the previous item unreleased the same way Analyzer does.
+     */
+
+    spsc_ring_init(&spsc_test_ring, SPSC_TEST_N_SLOTS);
+
+    pthread_t producer;
+    int iret = pthread_create(&producer, NULL, spsc_producer_thread_run, NULL);
+    assert(iret == 0);
+
+    unsigned n_received = 0;
+    while (n_received < SPSC_TEST_N_ITEMS) {
+        bool bret = spsc_ring_wait(&spsc_test_ring, 5);
+        assert(bret);
+
+        unsigned n_readable = spsc_ring_n_readable(&spsc_test_ring);
+        assert(n_readable >= 1 && n_readable <= SPSC_TEST_N_SLOTS);
+
+        if (n_received == 0) {
+            assert(spsc_test_slots[spsc_ring_peek(&spsc_test_ring, 0)] == 0);
+        } else {
+            assert(n_readable >= 2);
+            unsigned previous = spsc_test_slots[spsc_ring_peek(&spsc_test_ring, 0)];
+            unsigned current = spsc_test_slots[spsc_ring_peek(&spsc_test_ring, 1)];
+            assert(previous + 1 == current);
+            assert(current == n_received);
+            spsc_ring_release(&spsc_test_ring);
+        }
+        n_received++;
+    }
+
+    iret = pthread_join(producer, NULL);
+    assert(iret == 0);
+
+    assert(spsc_ring_n_readable(&spsc_test_ring) == 1);
+    assert(!spsc_ring_wait(&spsc_test_ring, 0));
+
+    spsc_ring_destroy(&spsc_test_ring);
+
+    printf("%s OK\n", __func__);
+}
+
+#define STAGE_TEST_DEPTH 4
+#define STAGE_TEST_N_ITEMS 10000
+
+typedef struct {
+    unsigned value;
+    unsigned *buffer;
+} StageTestSlot;
+
+static Stage stage_test_stage = STAGE_INITIALIZER;
+static int stage_test_n_slots_alive;
+
+static void
+stage_test_slot_init(void *slot_arg, const void *arg)
+{
+    StageTestSlot *slot = slot_arg;
+    assert(slot->value == 0 && !slot->buffer);
+    slot->buffer = emalloc(*(const int *)arg * sizeof(slot->buffer[0]));
+    __atomic_add_fetch(&stage_test_n_slots_alive, 1, __ATOMIC_RELAXED);
+}
+
+static void
+stage_test_slot_destroy(void *slot_arg)
+{
+    StageTestSlot *slot = slot_arg;
+    free(slot->buffer);
+    __atomic_sub_fetch(&stage_test_n_slots_alive, 1, __ATOMIC_RELAXED);
+}
+
+static void *
+stage_producer_thread_run(void *arg)
+{
+    (void)(arg);
+
+    /* Attached before the stage is opened, so this waits for it */
+    StageQueue *queue = stage_attach(&stage_test_stage);
+
+    for (unsigned i = 0; i < STAGE_TEST_N_ITEMS; i++) {
+        StageTestSlot *slot = stage_queue_acquire(queue);
+        assert(slot);
+        slot->value = i;
+        slot->buffer[0] = i * 2;
+        stage_queue_commit(queue);
+    }
+
+    stage_detach(&stage_test_stage, queue);
+
+    pthread_exit(NULL);
+}
+
+static void
+test_stage(void)
+{
+    int buffer_size = 8;
+    StageConfig config = {
+        .name = "Test stage",
+        .depth = STAGE_TEST_DEPTH,
+        .slot_size = sizeof(StageTestSlot),
+        .backpressure = STAGE_BACKPRESSURE_DROP,
+        .slot_init = stage_test_slot_init,
+        .slot_init_arg = &buffer_size,
+        .slot_destroy = stage_test_slot_destroy,
+    };
+
+    /* Dropping: acquiring again returns the same slot, a full queue drops the message */
+    StageQueue *queue = stage_open(&stage_test_stage, &config);
+    assert(stage_test_n_slots_alive == STAGE_TEST_DEPTH);
+    StageQueue *producer_queue = stage_attach(&stage_test_stage);
+    assert(producer_queue == queue);
+    for (unsigned i = 0; i < STAGE_TEST_DEPTH; i++) {
+        StageTestSlot *slot = stage_queue_acquire(queue);
+        assert(slot && slot == stage_queue_acquire(queue));
+        /* Every slot is aligned on a cache line */
+        assert((uintptr_t)slot % 64 == 0);
+        slot->value = i;
+        stage_queue_commit(queue);
+    }
+    assert(!stage_queue_acquire(queue));
+    assert(stage_queue_wait(queue, 0));
+    assert(stage_queue_n_readable(queue) == STAGE_TEST_DEPTH);
+    assert(((StageTestSlot *)stage_queue_peek(queue, 0))->value == 0);
+    assert(((StageTestSlot *)stage_queue_peek(queue, 3))->value == 3);
+    stage_queue_release(queue);
+    assert(stage_queue_acquire(queue));
+    StageMetrics metrics = stage_queue_metrics(queue);
+    assert(metrics.n_committed == STAGE_TEST_DEPTH && metrics.n_dropped == 1 && metrics.n_released == 1 && metrics.n_blocked == 0);
+
+    /* The queue outlives the stage until its producer detaches */
+    stage_close(&stage_test_stage, queue);
+    assert(stage_test_n_slots_alive == STAGE_TEST_DEPTH);
+    stage_detach(&stage_test_stage, producer_queue);
+    assert(stage_test_n_slots_alive == 0);
+
+    /*
+     * Blocking: a producer faster than the consumer waits instead of dropping, nothing gets lost,
+     * duplicated or reordered. The consumer keeps the previous item unreleased the same way Analyzer does.
+     */
+    pthread_t producer;
+    int iret = pthread_create(&producer, NULL, stage_producer_thread_run, NULL);
+    assert(iret == 0);
+
+    config.backpressure = STAGE_BACKPRESSURE_BLOCK;
+    queue = stage_open(&stage_test_stage, &config);
+
+    unsigned n_received = 0;
+    while (n_received < STAGE_TEST_N_ITEMS) {
+        bool bret = stage_queue_wait(queue, 5);
+        assert(bret);
+
+        if (n_received == 0) {
+            assert(((StageTestSlot *)stage_queue_peek(queue, 0))->value == 0);
+        } else {
+            StageTestSlot *previous = stage_queue_peek(queue, 0);
+            StageTestSlot *next = stage_queue_peek(queue, 1);
+            assert(previous->value + 1 == next->value);
+            assert(next->value == n_received && next->buffer[0] == n_received * 2);
+            stage_queue_release(queue);
+        }
+        n_received++;
+        if (n_received % 1000 == 0) {
+            /* Let the producer fill the queue */
+            struct timespec ts = { .tv_nsec = 1000 * 1000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    iret = pthread_join(producer, NULL);
+    assert(iret == 0);
+
+    metrics = stage_queue_metrics(queue);
+    assert(metrics.n_committed == STAGE_TEST_N_ITEMS && metrics.n_dropped == 0 && metrics.n_blocked > 0);
+    assert(metrics.n_released == STAGE_TEST_N_ITEMS - 1);
+
+    stage_close(&stage_test_stage, queue);
+    assert(stage_test_n_slots_alive == 0);
+
+    printf("%s OK\n", __func__);
+}
+
 static char short_message[] = "short message";
+typedef struct {
+    char data[512];
+    size_t length;
+} TestLogValues;
+
+static void
+test_log_values_integer(TestLogValues values[static 1], uint64_t value)
+{
+    memcpy(&values->data[values->length], &value, sizeof(value));
+    values->length += sizeof(value);
+}
+
+static void
+test_log_values_double(TestLogValues values[static 1], double value)
+{
+    memcpy(&values->data[values->length], &value, sizeof(value));
+    values->length += sizeof(value);
+}
+
+static void
+test_log_values_string(TestLogValues values[static 1], const char *string)
+{
+    uint16_t length = string ? (uint16_t)strlen(string) : LOG_FORMAT_NULL_STRING;
+    memcpy(&values->data[values->length], &length, sizeof(length));
+    values->length += sizeof(length);
+    if (string) {
+        memcpy(&values->data[values->length], string, length);
+        values->length += length;
+    }
+}
+
+static void
+test_log_format_render(const char *format, TestLogValues values[static 1], const char *expected)
+{
+    int n_args;
+    unsigned char arg_types[LOG_FORMAT_MAX_ARGS];
+    assert(log_format_parse(format, &n_args, arg_types));
+
+    char buffer[256];
+    size_t length = log_format_render(buffer, sizeof(buffer), "f", format, n_args, arg_types, values->data, values->length);
+    assert(length == strlen(expected));
+    assert(strcmp(buffer, expected) == 0);
+
+    /* Missing values */
+    if (values->length > 0) {
+        assert(log_format_render(buffer, sizeof(buffer), "f", format, n_args, arg_types, values->data, values->length - 1) == 0);
+    }
+}
+
+static void
+test_log_format(void)
+{
+    /*
+     * Render formats with the values encoded the way the Logger records them,
+     * and verify that the messages are the same as snprintf() writes.
+     */
+
+    char expected[256];
+
+    TestLogValues values = {0};
+    test_log_values_integer(&values, (uint64_t)-42);
+    test_log_values_integer(&values, 4000000000u);
+    test_log_values_integer(&values, (uint64_t)LLONG_MIN);
+    test_log_values_integer(&values, SIZE_MAX);
+    test_log_values_integer(&values, (uint64_t)-1);
+    test_log_values_integer(&values, 255);
+    test_log_values_integer(&values, 'c');
+    snprintf(expected, sizeof(expected), "f: %d %5u %lld %zu %zd %#x %c 100%%", -42, 4000000000u, LLONG_MIN, SIZE_MAX,
+            (ssize_t)-1, 255, 'c');
+    test_log_format_render("%d %5u %lld %zu %zd %#x %c 100%%", &values, expected);
+
+    values = (TestLogValues){0};
+    test_log_values_double(&values, 3.14159);
+    test_log_values_double(&values, -1e-300);
+    test_log_values_double(&values, 0.5);
+    snprintf(expected, sizeof(expected), "f: %.2f|%10.3e|%-8g|", 3.14159, -1e-300, 0.5);
+    test_log_format_render("%.2f|%10.3e|%-8g|", &values, expected);
+
+    /* '*' fields, a negative width justifies to the left, a negative precision is ignored */
+    values = (TestLogValues){0};
+    test_log_values_integer(&values, 8);
+    test_log_values_string(&values, "right");
+    test_log_values_integer(&values, (uint64_t)-8);
+    test_log_values_integer(&values, 3);
+    test_log_values_string(&values, "left");
+    test_log_values_integer(&values, (uint64_t)-1);
+    test_log_values_double(&values, 2.5);
+    snprintf(expected, sizeof(expected), "f: %*s|%-*.*s|%.*f", 8, "right", -8, 3, "left", -1, 2.5);
+    test_log_format_render("%*s|%-*.*s|%.*f", &values, expected);
+
+    values = (TestLogValues){0};
+    test_log_values_string(&values, NULL);
+    test_log_values_string(&values, "");
+    test_log_values_integer(&values, (uintptr_t)&values);
+    snprintf(expected, sizeof(expected), "f: (null) [] %p", (void *)&values);
+    test_log_format_render("%s [%s] %p", &values, expected);
+
+    values = (TestLogValues){0};
+    test_log_format_render("no conversions", &values, "f: no conversions");
+
+    /* Conversions that can't be deferred */
+    int n_args;
+    unsigned char arg_types[LOG_FORMAT_MAX_ARGS];
+    assert(!log_format_parse("%n", &n_args, arg_types));
+    assert(!log_format_parse("%Lf", &n_args, arg_types));
+    assert(!log_format_parse("%ls", &n_args, arg_types));
+    assert(!log_format_parse("%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %*d", &n_args, arg_types));
+    assert(log_format_parse("%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d", &n_args, arg_types) && n_args == 16);
+
+    /* Truncated to the size of the buffer */
+    values = (TestLogValues){0};
+    test_log_values_string(&values, "abcdefghij");
+    assert(log_format_parse("%s", &n_args, arg_types));
+    char buffer[8];
+    assert(log_format_render(buffer, sizeof(buffer), "f", "%s", n_args, arg_types, values.data, values.length) == 7);
+    assert(strcmp(buffer, "f: abcd") == 0);
+
+    printf("%s OK\n", __func__);
+}
+
 static char long_message[] = "very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string very long string";
 
 static void *
@@ -74,7 +2389,7 @@ logger_message_thread_run(void *arg)
 {
     char *msg = arg;
 
-    logger_log_message(false, arg);
+    logger_log_message(arg);
 
     pthread_exit(NULL);
 }
@@ -125,10 +2440,11 @@ test_logger_long_message(void)
     iret = fseek(log_file, 0, SEEK_SET);
     assert(iret == 0);
 
-    char *contents = emalloc((size_t)size);
+    char *contents = emalloc((size_t)size + 1);
 
     iret = fread(contents, 1, size, log_file);
     assert(iret == size);
+    contents[size] = '\0';
 
     iret = fclose(log_file);
     assert(iret == 0);
@@ -144,14 +2460,47 @@ test_logger_long_message(void)
     printf("%s OK\n", __func__);
 }
 
+/*
+ * Count the test messages written to log.txt, and the number of messages
+ * the logger reported as dropped.
+ */
+static void
+count_logged_test_messages(unsigned long n_written[static 1], unsigned long n_dropped[static 1])
+{
+    FILE *log_file = fopen("log.txt", "r");
+    assert(log_file);
+
+    *n_written = 0;
+    *n_dropped = 0;
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, log_file) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (strcmp(line, short_message) == 0 || strcmp(line, long_message) == 0) {
+            (*n_written)++;
+        } else if (strstr(line, " messages dropped")) {
+            unsigned long n;
+            int iret = sscanf(strchr(line, ':') + 1, "%lu", &n);
+            assert(iret == 1);
+            *n_dropped += n;
+        }
+    }
+    free(line);
+
+    int iret = fclose(log_file);
+    assert(iret == 0);
+}
+
 static void *
 logger_multiple_messages_thread_run(void *arg)
 {
     (void)(arg);
 
     for (int i = 0; i < 50; i++) {
-        logger_log_message(false, short_message);
-        logger_log_message(false, long_message);
+        logger_log_message(short_message);
+        logger_log_message(long_message);
     }
 
     pthread_exit(NULL);
@@ -162,7 +2511,7 @@ test_logger_many_messages(void)
 {
     /*
      * Start the logger and 100 other threads, each one will submit 100 messages to the logger.
-     * Verify that all the messages have been written.
+     * Verify that all the messages have been either written or reported as dropped.
      */
 
     rename("log.txt", "log.txt.bak");
@@ -194,35 +2543,468 @@ test_logger_many_messages(void)
     iret = pthread_join(logger, NULL);
     assert(iret == 0);
 
-    FILE *log_file = fopen("log.txt", "r");
+    unsigned long n_written;
+    unsigned long n_dropped;
+    count_logged_test_messages(&n_written, &n_dropped);
+
+    /* Check that every message has either been written or accounted for as dropped */
+    assert(n_written + n_dropped == 100 * 100);
+    assert(n_written > 0);
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+test_logger_never_blocks(void)
+{
+    /*
+     * Submit far more messages than fit in the logger queue while the logger isn't running.
+     * Verify that submitting doesn't block, and that once the logger runs the queued
+     * messages get written together with the number of dropped ones.
+     */
+
+    rename("log.txt", "log.txt.bak");
+
+    int n_messages = 1000;
+
+    for (int i = 0; i < n_messages; i++) {
+        logger_log_message(long_message);
+    }
+
+    pthread_t logger;
+
+    LoggerArgs *logger_args = ecalloc(1, sizeof(*logger_args));
+
+    int iret = pthread_create(&logger, NULL, logger_run, logger_args);
+    assert(iret == 0);
+    iret = pthread_cancel(logger);
+    assert(iret == 0);
+    iret = pthread_join(logger, NULL);
+    assert(iret == 0);
+
+    unsigned long n_written;
+    unsigned long n_dropped;
+    count_logged_test_messages(&n_written, &n_dropped);
+
+    assert(n_written + n_dropped == (unsigned long)n_messages);
+    assert(n_written > 0);
+    assert(n_dropped > 0);
+
+    printf("%s OK\n", __func__);
+}
+
+/*
+ * Count the lines of a log file that are short_message, and check that there is nothing else.
+ * Returns -1 if the file doesn't exist.
+ */
+static long
+count_short_messages(const char *path, long long size[static 1])
+{
+    FILE *log_file = fopen(path, "r");
+    if (!log_file) {
+        return -1;
+    }
+
+    long n_lines = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    *size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_size, log_file)) > 0) {
+        *size += length;
+        line[strcspn(line, "\n")] = '\0';
+        assert(strcmp(line, short_message) == 0);
+        n_lines++;
+    }
+    free(line);
+
+    int iret = fclose(log_file);
+    assert(iret == 0);
+
+    return n_lines;
+}
+
+static void
+test_logger_rotation(void)
+{
+    /*
+     * Queue 1000 messages of 14 bytes before starting a logger that rotates its file at 4096 bytes
+     * and keeps 2 rotated files.
+     * Verify that the messages are written in a few batches, that every file holds as many whole
+     * messages as fit and that the oldest file is removed.
+     */
+
+    char directory[] = "test_logger_XXXXXX";
+    assert(mkdtemp(directory));
+    char path[64];
+    snprintf(path, sizeof(path), "%s/cut.log", directory);
+
+    int n_messages = 1000;
+    long max_size = 4096;
+    long messages_per_file = max_size / (long)sizeof(short_message);
+
+    for (int i = 0; i < n_messages; i++) {
+        logger_log_message(short_message);
+    }
+
+    StatsSnapshot before;
+    stats_snapshot(&before);
+
+    LoggerArgs *logger_args = ecalloc(1, sizeof(*logger_args));
+    logger_args->path = emalloc(strlen(path) + 1);
+    strcpy(logger_args->path, path);
+    logger_args->max_size = max_size;
+    logger_args->max_files = 2;
+    logger_args->sync = LOGGER_SYNC_BATCH;
+
+    pthread_t logger;
+    int iret = pthread_create(&logger, NULL, logger_run, logger_args);
+    assert(iret == 0);
+    iret = pthread_cancel(logger);
+    assert(iret == 0);
+    iret = pthread_join(logger, NULL);
+    assert(iret == 0);
+
+    StatsSnapshot after;
+    stats_snapshot(&after);
+
+    unsigned long n_writes = after.counters[STATS_COUNTER_LOG_WRITES] - before.counters[STATS_COUNTER_LOG_WRITES];
+    unsigned long n_rotations = after.counters[STATS_COUNTER_LOG_ROTATIONS] - before.counters[STATS_COUNTER_LOG_ROTATIONS];
+    long n_rotations_expected = (n_messages - 1) / messages_per_file;
+    assert(n_rotations == (unsigned long)n_rotations_expected);
+    /* One write per file at most */
+    assert(n_writes <= n_rotations + 1);
+
+    long long size;
+    long n_lines = count_short_messages(path, &size);
+    assert(n_lines == n_messages - n_rotations_expected * messages_per_file);
+    assert(size <= max_size);
+    assert(unlink(path) == 0);
+
+    for (int i = 1; i <= 3; i++) {
+        char rotated_path[80];
+        snprintf(rotated_path, sizeof(rotated_path), "%s.%d", path, i);
+        n_lines = count_short_messages(rotated_path, &size);
+        if (i <= 2) {
+            assert(n_lines == messages_per_file);
+            assert(size <= max_size);
+            assert(unlink(rotated_path) == 0);
+        } else {
+            assert(n_lines == -1);
+        }
+    }
+
+    assert(rmdir(directory) == 0);
+
+    LoggerSyncPolicy policy;
+    assert(logger_parse_sync_policy("none", &policy) && policy == LOGGER_SYNC_NONE);
+    assert(logger_parse_sync_policy("batch", &policy) && policy == LOGGER_SYNC_BATCH);
+    assert(logger_parse_sync_policy("interval", &policy) && policy == LOGGER_SYNC_INTERVAL);
+    assert(!logger_parse_sync_policy("always", &policy));
+
+    printf("%s OK\n", __func__);
+}
+
+static const char *test_logger_expected_lines[] = {
+    "test_logger_log_formats: -42 string 1.50 7",
+    "test_logger_log_formats:    right|le    |",
+    "test_logger_log_formats: 2.500000",
+    "formatted by the caller",
+};
+
+static void
+test_logger_log_formats(void)
+{
+    ELOG("%d %s %.2f %zu", -42, "string", 1.5, (size_t)7);
+    ELOG("%*s|%-*.*s|%s", 8, "right", 6, 2, "left", "");
+    /* Formatted by the caller */
+    ELOG("%Lf", 2.5L);
+    logger_log_message("formatted by the caller");
+}
+
+static void
+test_logger_run_once(const char *path, LoggerFileFormat file_format)
+{
+    LoggerArgs *logger_args = ecalloc(1, sizeof(*logger_args));
+    logger_args->path = emalloc(strlen(path) + 1);
+    strcpy(logger_args->path, path);
+    logger_args->max_files = 1;
+    logger_args->file_format = file_format;
+
+    pthread_t logger;
+    int iret = pthread_create(&logger, NULL, logger_run, logger_args);
+    assert(iret == 0);
+    iret = pthread_cancel(logger);
+    assert(iret == 0);
+    iret = pthread_join(logger, NULL);
+    assert(iret == 0);
+}
+
+/*
+ * Check that a text log holds n_runs times the expected lines.
+ */
+static void
+test_logger_check_lines(FILE *log_file, int n_runs)
+{
+    size_t n_expected = sizeof(test_logger_expected_lines) / sizeof(test_logger_expected_lines[0]);
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t n_lines = 0;
+    while (getline(&line, &line_size, log_file) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+        assert(strcmp(line, test_logger_expected_lines[n_lines % n_expected]) == 0);
+        n_lines++;
+    }
+    free(line);
+    assert(n_lines == (size_t)n_runs * n_expected);
+}
+
+static void
+test_logger_binary(void)
+{
+    /*
+     * Log the same messages with a text log file, then twice with a binary one at the same path.
+     * Verify that the text log holds the formatted messages, that it's rotated rather than
+     * appended to by the binary log, and that the binary log decodes to the same messages twice
+     * (the second run defines the formats again).
+     */
+
+    char directory[] = "test_logger_XXXXXX";
+    assert(mkdtemp(directory));
+    char path[64];
+    snprintf(path, sizeof(path), "%s/cut.log", directory);
+    char rotated_path[80];
+    snprintf(rotated_path, sizeof(rotated_path), "%s.1", path);
+
+    test_logger_log_formats();
+    test_logger_run_once(path, LOGGER_FILE_TEXT);
+
+    for (int i = 0; i < 2; i++) {
+        test_logger_log_formats();
+        test_logger_run_once(path, LOGGER_FILE_BINARY);
+    }
+
+    FILE *log_file = fopen(rotated_path, "r");
+    assert(log_file);
+    test_logger_check_lines(log_file, 1);
+    assert(fclose(log_file) == 0);
+
+    char *decoded = NULL;
+    size_t decoded_size = 0;
+    FILE *out = open_memstream(&decoded, &decoded_size);
+    assert(out);
+    log_file = fopen(path, "rb");
+    assert(log_file);
+    assert(log_file_decode(log_file, out, false));
+    assert(fclose(log_file) == 0);
+    assert(fclose(out) == 0);
+
+    FILE *in = fmemopen(decoded, decoded_size, "r");
+    assert(in);
+    test_logger_check_lines(in, 2);
+    assert(fclose(in) == 0);
+    free(decoded);
+
+    /* A text log isn't a binary log */
+    log_file = fopen(rotated_path, "rb");
     assert(log_file);
+    out = fopen("/dev/null", "w");
+    assert(out);
+    assert(!log_file_decode(log_file, out, false));
+    assert(fclose(log_file) == 0);
+    assert(fclose(out) == 0);
+
+    assert(unlink(path) == 0);
+    assert(unlink(rotated_path) == 0);
+    assert(rmdir(directory) == 0);
+
+    LoggerFileFormat file_format;
+    assert(logger_parse_file_format("text", &file_format) && file_format == LOGGER_FILE_TEXT);
+    assert(logger_parse_file_format("binary", &file_format) && file_format == LOGGER_FILE_BINARY);
+    assert(!logger_parse_file_format("json", &file_format));
+
+    printf("%s OK\n", __func__);
+}
+
+static void
+test_logger_binary_write_failure(void)
+{
+    /*
+     * Make writes to a binary log fail past 200 bytes (RLIMIT_FSIZE) while the Logger writes a batch
+     * holding the first definitions of its formats, then lift the limit and log the same messages again.
+     * Verify that the failed batch left nothing behind and that the formats are defined again,
+     * so the whole file decodes to the messages logged after the failure.
+     */
+
+    char directory[] = "test_logger_XXXXXX";
+    assert(mkdtemp(directory));
+    char path[64];
+    snprintf(path, sizeof(path), "%s/cut.log", directory);
+
+    struct sigaction ignore = { .sa_handler = SIG_IGN };
+    struct sigaction saved_action;
+    assert(sigaction(SIGXFSZ, &ignore, &saved_action) == 0);
+    struct rlimit saved_limit;
+    assert(getrlimit(RLIMIT_FSIZE, &saved_limit) == 0);
+    struct rlimit limit = { .rlim_cur = 200, .rlim_max = saved_limit.rlim_max };
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+
+    unsigned long n_dropped = logger_n_dropped_messages();
+    for (int i = 0; i < 10; i++) {
+        test_logger_log_formats();
+    }
+
+    LoggerArgs *logger_args = ecalloc(1, sizeof(*logger_args));
+    logger_args->path = emalloc(strlen(path) + 1);
+    strcpy(logger_args->path, path);
+    logger_args->file_format = LOGGER_FILE_BINARY;
+
+    pthread_t logger;
+    int iret = pthread_create(&logger, NULL, logger_run, logger_args);
+    assert(iret == 0);
+
+    /* The failed messages are counted as dropped */
+    while (logger_n_dropped_messages() < n_dropped + 10 * 4) {
+        struct timespec ts = { .tv_nsec = 1000 * 1000 };
+        nanosleep(&ts, NULL);
+    }
+
+    assert(setrlimit(RLIMIT_FSIZE, &saved_limit) == 0);
+    assert(sigaction(SIGXFSZ, &saved_action, NULL) == 0);
 
-    int lines = 0;
-    while (!feof(log_file)) {
-        char ch = fgetc(log_file);
-        if (ch == '\n') {
-            lines++;
+    test_logger_log_formats();
+
+    iret = pthread_cancel(logger);
+    assert(iret == 0);
+    iret = pthread_join(logger, NULL);
+    assert(iret == 0);
+
+    char *decoded = NULL;
+    size_t decoded_size = 0;
+    FILE *out = open_memstream(&decoded, &decoded_size);
+    assert(out);
+    FILE *log_file = fopen(path, "rb");
+    assert(log_file);
+    assert(log_file_decode(log_file, out, false));
+    assert(fclose(log_file) == 0);
+    assert(fclose(out) == 0);
+
+    /* Possibly preceded by the number of dropped messages, if it could be written */
+    FILE *in = fmemopen(decoded, decoded_size, "r");
+    assert(in);
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t n_lines = 0;
+    size_t n_expected = sizeof(test_logger_expected_lines) / sizeof(test_logger_expected_lines[0]);
+    while (getline(&line, &line_size, in) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strstr(line, "logger_write_dropped_messages: ") == line) {
+            continue;
         }
+        assert(n_lines < n_expected && strcmp(line, test_logger_expected_lines[n_lines]) == 0);
+        n_lines++;
     }
+    free(line);
+    assert(n_lines == n_expected);
+    assert(fclose(in) == 0);
+    free(decoded);
 
-    /* Check the number of lines is correct (i.e. all the messages have been written) */
-    assert(lines == 100 * 100);
+    assert(unlink(path) == 0);
+    assert(rmdir(directory) == 0);
 
-    iret = fclose(log_file);
+    printf("%s OK\n", __func__);
+}
+
+static void
+test_logger_rotation_failure(void)
+{
+    /*
+     * Queue 1000 messages for a logger that must rotate its file at 4096 bytes, but can't rename it
+     * because a directory is in the way.
+     * Verify that the logger gives up rotating, reports it and keeps appending every message to the file.
+     */
+
+    char directory[] = "test_logger_XXXXXX";
+    assert(mkdtemp(directory));
+    char path[64];
+    snprintf(path, sizeof(path), "%s/cut.log", directory);
+    char rotated_path[80];
+    snprintf(rotated_path, sizeof(rotated_path), "%s.1", path);
+    assert(mkdir(rotated_path, 0700) == 0);
+
+    int n_messages = 1000;
+    for (int i = 0; i < n_messages; i++) {
+        logger_log_message(short_message);
+    }
+
+    StatsSnapshot before;
+    stats_snapshot(&before);
+
+    LoggerArgs *logger_args = ecalloc(1, sizeof(*logger_args));
+    logger_args->path = emalloc(strlen(path) + 1);
+    strcpy(logger_args->path, path);
+    logger_args->max_size = 4096;
+    logger_args->max_files = 1;
+
+    pthread_t logger;
+    int iret = pthread_create(&logger, NULL, logger_run, logger_args);
+    assert(iret == 0);
+    iret = pthread_cancel(logger);
     assert(iret == 0);
+    iret = pthread_join(logger, NULL);
+    assert(iret == 0);
+
+    StatsSnapshot after;
+    stats_snapshot(&after);
+    assert(after.counters[STATS_COUNTER_LOG_ROTATIONS] == before.counters[STATS_COUNTER_LOG_ROTATIONS]);
+
+    FILE *log_file = fopen(path, "r");
+    assert(log_file);
+    int n_lines = 0;
+    int n_errors = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, log_file) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(line, short_message) == 0) {
+            n_lines++;
+        } else {
+            assert(strstr(line, "logger_rotate: Failed to rotate the log file") == line);
+            n_errors++;
+        }
+    }
+    free(line);
+    assert(fclose(log_file) == 0);
+    assert(n_lines == n_messages);
+    assert(n_errors == 1);
+
+    assert(unlink(path) == 0);
+    assert(rmdir(rotated_path) == 0);
+    assert(rmdir(directory) == 0);
 
     printf("%s OK\n", __func__);
 }
 
+static void
+cleanup_watchdog_unregister(void *arg)
+{
+    watchdog_unregister(arg);
+}
+
 static void *
 thread_that_hangs_run(void *arg)
 {
     (void)(arg);
 
-    watchdog_signal_active("Thread that hangs");
+    WatchdogHandle *watchdog = watchdog_register("Thread that hangs");
+    pthread_cleanup_push(cleanup_watchdog_unregister, watchdog);
+
+    watchdog_signal_active(watchdog);
 
     sleep(621);
 
+    pthread_cleanup_pop(1);
+
     pthread_exit(NULL);
 }
 
@@ -241,7 +3023,10 @@ test_watchdog_hanged_thread(void)
 
     void *retval;
 
-    int iret = pthread_create(&watchdog, NULL, watchdog_run, NULL);
+    WatchdogArgs *watchdog_args = ecalloc(1, sizeof(*watchdog_args));
+    watchdog_args->timeout_seconds = WATCHDOG_DEFAULT_TIMEOUT_SECONDS;
+
+    int iret = pthread_create(&watchdog, NULL, watchdog_run, watchdog_args);
     assert(iret == 0);
 
     iret = pthread_create(&hanging_thread, NULL, thread_that_hangs_run, NULL);
@@ -258,6 +3043,84 @@ test_watchdog_hanged_thread(void)
     printf("%s OK\n", __func__);
 }
 
+typedef struct {
+    int index;
+    bool *stop;
+} WatchedTestThreadArgs;
+
+static void *
+watched_test_thread_run(void *arg)
+{
+    WatchedTestThreadArgs *args = arg;
+
+    char name[32];
+    snprintf(name, sizeof(name), "Watched test thread %d", args->index);
+    WatchdogHandle *watchdog = watchdog_register(name);
+    pthread_cleanup_push(cleanup_watchdog_unregister, watchdog);
+
+    /* Odd threads stop reporting activity and unregister well before the timeout runs out */
+    int n_heartbeats = args->index % 2 ? 5 : -1;
+    while (!__atomic_load_n(args->stop, __ATOMIC_RELAXED) && n_heartbeats != 0) {
+        watchdog_signal_active(watchdog);
+        n_heartbeats--;
+
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+        nanosleep(&ts, NULL);
+    }
+
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+static void
+test_watchdog_many_threads(void)
+{
+    /*
+     * Register more threads than Watchdog could previously watch. Half of them keep reporting activity,
+     * the other half unregister and exit early. Verify that none of them gets cancelled
+     * for longer than the timeout.
+     */
+
+    enum { n_threads = 64 };
+
+    pthread_t watchdog;
+    pthread_t threads[n_threads];
+    WatchedTestThreadArgs args[n_threads];
+    bool stop = false;
+
+    WatchdogArgs *watchdog_args = ecalloc(1, sizeof(*watchdog_args));
+    watchdog_args->timeout_seconds = WATCHDOG_DEFAULT_TIMEOUT_SECONDS;
+
+    int iret = pthread_create(&watchdog, NULL, watchdog_run, watchdog_args);
+    assert(iret == 0);
+
+    for (int i = 0; i < n_threads; i++) {
+        args[i].index = i;
+        args[i].stop = &stop;
+        iret = pthread_create(&threads[i], NULL, watched_test_thread_run, &args[i]);
+        assert(iret == 0);
+    }
+
+    sleep(2 * (unsigned)WATCHDOG_DEFAULT_TIMEOUT_SECONDS);
+
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < n_threads; i++) {
+        void *retval;
+        iret = pthread_join(threads[i], &retval);
+        assert(iret == 0);
+        assert(retval != PTHREAD_CANCELED);
+    }
+
+    iret = pthread_cancel(watchdog);
+    assert(iret == 0);
+    iret = pthread_join(watchdog, NULL);
+    assert(iret == 0);
+
+    printf("%s OK\n", __func__);
+}
+
 static void
 test_restarting_threads(void)
 {
@@ -276,20 +3139,26 @@ test_restarting_threads(void)
         pthread_t printer;
         pthread_t logger;
 
-        ReaderArgs *reader_args = ecalloc(1, sizeof(*reader_args));
-        reader_args->max_cpu_entries = max_cpu_entries;
+        WatchdogArgs *watchdog_args = ecalloc(1, sizeof(*watchdog_args));
+        watchdog_args->timeout_seconds = WATCHDOG_DEFAULT_TIMEOUT_SECONDS;
 
+        ReaderArgs *reader_args = ecalloc(1, sizeof(*reader_args));
+        reader_args->sampling_interval_ms = READER_DEFAULT_SAMPLING_INTERVAL_MS;
+    
         AnalyzerArgs *analyzer_args = ecalloc(1, sizeof(*analyzer_args));
         analyzer_args->max_cpu_entries = max_cpu_entries;
+        analyzer_args->use_printer = true;
+        analyzer_args->use_cpu_states = true;
 
         PrinterArgs *printer_args = ecalloc(1, sizeof(*printer_args));
         printer_args->max_cpu_entries = max_cpu_entries;
+        printer_args->layout = LAYOUT_STATES;
 
         LoggerArgs *logger_args = ecalloc(1, sizeof(*logger_args));
 
         int iret;
 
-        iret = pthread_create(&watchdog, NULL, watchdog_run, NULL);
+        iret = pthread_create(&watchdog, NULL, watchdog_run, watchdog_args);
         assert(iret == 0);
         iret = pthread_create(&reader, NULL, reader_run, reader_args);
         assert(iret == 0);
@@ -335,8 +3204,35 @@ main(int argc, char **argv)
 
     test_restarting_threads();
     test_proc_stat_parse();
+    test_proc_stat_parse_fd();
+    test_cpu_usage_hotplug();
+    test_cpu_state_breakdown();
+    test_rolling_stats();
+    test_latency_histogram();
+    test_stats();
+    test_process_scanner();
+    test_process_scanner_threads();
+    test_cpu_freq();
+    test_recording_round_trip();
+    test_history();
+    test_exporter();
+    test_sample_format();
+    test_output();
+    test_server();
+    test_shm();
+    test_spsc_ring();
+    test_stage();
+    test_screen();
+    test_layouts();
+    test_log_format();
     test_logger_long_message();
     test_logger_many_messages();
+    test_logger_never_blocks();
+    test_logger_rotation();
+    test_logger_rotation_failure();
+    test_logger_binary();
+    test_logger_binary_write_failure();
+    test_watchdog_many_threads();
     test_watchdog_hanged_thread();
 
 }
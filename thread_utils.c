@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
@@ -13,15 +14,40 @@ cleanup_mutex_unlock(void *mutex)
 }
 
 void
-cond_wait_seconds(pthread_cond_t cond[static 1], pthread_mutex_t mutex[static 1], int seconds)
+cond_init_monotonic(pthread_cond_t cond[static 1])
 {
-    struct timespec ts;
-    int iret = clock_gettime(CLOCK_REALTIME, &ts);
+    pthread_condattr_t attr;
+
+    int iret = pthread_condattr_init(&attr);
+    assert(iret == 0);
+
+    iret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    assert(iret == 0);
+
+    iret = pthread_cond_init(cond, &attr);
     assert(iret == 0);
 
-    ts.tv_sec += seconds;
+    iret = pthread_condattr_destroy(&attr);
+    assert(iret == 0);
+}
 
-    iret = pthread_cond_timedwait(cond, mutex, &ts);
+void
+cond_wait_seconds(pthread_cond_t cond[static 1], pthread_mutex_t mutex[static 1], double seconds)
+{
+    struct timespec ts = ns_to_timespec(clock_now_ns(CLOCK_MONOTONIC) + (long long)(seconds * NSEC_PER_SEC));
+
+    int iret = pthread_cond_timedwait(cond, mutex, &ts);
     assert(iret != EINVAL);
     assert(iret != EPERM);
 }
+
+bool
+sem_wait_seconds(sem_t sem[static 1], double seconds)
+{
+    struct timespec ts = ns_to_timespec(clock_now_ns(CLOCK_REALTIME) + (long long)(seconds * NSEC_PER_SEC));
+
+    int iret = sem_timedwait(sem, &ts);
+    assert(iret == 0 || errno == ETIMEDOUT || errno == EINTR);
+
+    return iret == 0;
+}
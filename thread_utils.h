@@ -2,13 +2,61 @@
 #define THREAD_UTILS_H
 
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000LL
+
+static inline long long
+timespec_to_ns(const struct timespec ts[static 1])
+{
+    return (long long)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static inline struct timespec
+ns_to_timespec(long long ns)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ns / NSEC_PER_SEC);
+    ts.tv_nsec = (long)(ns % NSEC_PER_SEC);
+    return ts;
+}
+
+/*
+ * Current time of the specified clock in nanoseconds.
+ */
+static inline long long
+clock_now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    int iret = clock_gettime(clock, &ts);
+    assert(iret == 0);
+    (void)(iret);
+    return timespec_to_ns(&ts);
+}
 
 void cleanup_mutex_unlock(void *mutex);
 
-void cond_wait_seconds(pthread_cond_t cond[static 1], pthread_mutex_t mutex[static 1], int seconds);
+/*
+ * Initialize a condition variable that uses CLOCK_MONOTONIC for timed waits.
+ * Condition variables used with cond_wait_seconds() must be initialized with this function.
+ */
+void cond_init_monotonic(pthread_cond_t cond[static 1]);
+
+/*
+ * Wait on the condition variable for up to the specified (possibly fractional) number of seconds.
+ */
+void cond_wait_seconds(pthread_cond_t cond[static 1], pthread_mutex_t mutex[static 1], double seconds);
+
+/*
+ * Wait up to the specified (possibly fractional) number of seconds for the semaphore to be posted.
+ * Returns true if the semaphore was decremented and false on timeout or interruption.
+ * Note that sem_timedwait() only supports CLOCK_REALTIME timeouts.
+ */
+bool sem_wait_seconds(sem_t sem[static 1], double seconds);
 
 static inline void
 ensure_initialized(bool is_initialized[static 1], pthread_cond_t cond_on_initialized[static 1], pthread_mutex_t mutex[static 1])
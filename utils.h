@@ -30,4 +30,16 @@ calloc_or_exit(size_t num, size_t size, const char *calling_function)
 }
 #define ecalloc(num, size) calloc_or_exit(num, size, __func__)
 
+static inline void *
+realloc_or_exit(void *ptr, size_t size, const char *calling_function)
+{
+    void *mem = realloc(ptr, size);
+    if (!mem) {
+        fprintf(stderr, "%s: realloc() failed\n", calling_function);
+        exit(EXIT_FAILURE);
+    }
+    return mem;
+}
+#define erealloc(ptr, size) realloc_or_exit(ptr, size, __func__)
+
 #endif /* UTILS_H */
@@ -0,0 +1,62 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * LEB128 variable-length encoding of unsigned integers (7 bits per byte, least significant first).
+ * Signed values are mapped to unsigned ones with zigzag encoding so that small negative
+ * values also take few bytes.
+ */
+
+#define VARINT_MAX_LENGTH 10
+
+/*
+ * Encode value into out (which must have room for VARINT_MAX_LENGTH bytes).
+ * Returns the number of bytes written.
+ */
+static inline size_t
+varint_encode(uint64_t value, unsigned char out[static VARINT_MAX_LENGTH])
+{
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (unsigned char)value;
+    return length;
+}
+
+/*
+ * Decode a value starting at p without reading past end.
+ * Returns a pointer past the decoded value, or NULL if the input is truncated or malformed.
+ */
+static inline const unsigned char *
+varint_decode(const unsigned char *p, const unsigned char *end, uint64_t value[static 1])
+{
+    uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64 && p < end; shift += 7) {
+        unsigned char byte = *p++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static inline uint64_t
+zigzag_encode(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t
+zigzag_decode(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+#endif /* VARINT_H */
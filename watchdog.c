@@ -11,17 +11,51 @@
 #include "logger.h"
 #include "utils.h"
 #include "thread_utils.h"
-
-typedef struct {
-    char name[64];
+#include "latency_histogram.h"
+#include "server.h"
+#include "stats.h"
+
+#define WATCHDOG_CACHE_LINE_SIZE 64
+
+/* A thread is reported as slowing down when it takes this fraction of the timeout between reports of activity */
+#define WATCHDOG_WARNING_FRACTION 0.75
+/* Window over which the p99 interval between reports of activity is checked */
+#define WATCHDOG_WARNING_WINDOW_NS (10LL * NSEC_PER_SEC)
+
+typedef enum {
+    WATCHED_THREAD_ACTIVE,
+    /* Unregistered by its thread, freed by Watchdog */
+    WATCHED_THREAD_RETIRED,
+    /* Dropped from the list when Watchdog exited, freed by its thread when unregistering */
+    WATCHED_THREAD_ORPHANED,
+} WatchedThreadState;
+
+struct WatchdogHandle {
+    /* Written by the watched thread on every heartbeat, so it gets a cache line of its own */
+    long long last_activity_ns;
+    char pad[WATCHDOG_CACHE_LINE_SIZE - sizeof(long long)];
+    /* Read by Watchdog, written when the thread registers and unregisters */
     pthread_t id;
-    struct timespec last_activity;
-} WatchedThread;
+    WatchedThreadState state;
+    struct WatchdogHandle *next;
+    char name[64];
+    /* Written by the watched thread, intervals between its reports of activity */
+    LatencyHistogram intervals;
+    /* Only used by Watchdog: the intervals at the start of the current warning window */
+    LatencyHistogram window_start_intervals;
+    bool stall_reported;
+};
 
 static struct {
     bool watchdog_initialized;
-    WatchedThread watched_threads[10];
-    int n_watched_threads;
+    double timeout_seconds;
+    long long window_start_ns;
+    /*
+     * Watched threads, newest first.
+     * Threads are pushed onto the list with the lock held. Watchdog walks it without the lock,
+     * it's the only thread that removes entries from the list (with the lock held).
+     */
+    WatchdogHandle *watched_threads;
 } shared;
 
 static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -30,6 +64,8 @@ static pthread_cond_t cond_on_watchdog_initialized = PTHREAD_COND_INITIALIZER;
 
 static volatile sig_atomic_t signal_received;
 
+static volatile sig_atomic_t dump_requested;
+
 static void
 watchdog_handle_signal(int signum)
 {
@@ -37,66 +73,205 @@ watchdog_handle_signal(int signum)
 }
 
 static void
-watchdog_check_threads_activity(void)
+watchdog_handle_dump_signal(int signum)
+{
+    (void)(signum);
+
+    dump_requested = 1;
+}
+
+static double
+ns_to_ms(long long ns)
+{
+    return (double)ns / (1000 * 1000);
+}
+
+static void
+watchdog_log_histograms(void)
+{
+    WatchdogHandle *handle = __atomic_load_n(&shared.watched_threads, __ATOMIC_ACQUIRE);
+    for (; handle; handle = __atomic_load_n(&handle->next, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&handle->state, __ATOMIC_ACQUIRE) != WATCHED_THREAD_ACTIVE) {
+            continue;
+        }
+
+        LatencyHistogram intervals;
+        latency_histogram_load(&handle->intervals, &intervals);
+
+        ELOG("Thread \"%s\": %lu intervals between reports of activity, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, "
+                "p99.9 %.3f ms, max %.3f ms", handle->name, latency_histogram_n_recorded(&intervals),
+                ns_to_ms(latency_histogram_percentile_ns(&intervals, 0.5)),
+                ns_to_ms(latency_histogram_percentile_ns(&intervals, 0.9)),
+                ns_to_ms(latency_histogram_percentile_ns(&intervals, 0.99)),
+                ns_to_ms(latency_histogram_percentile_ns(&intervals, 0.999)),
+                ns_to_ms(latency_histogram_max_ns(&intervals)));
+
+        for (int i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; i++) {
+            if (intervals.counts[i] > 0) {
+                ELOG("Thread \"%s\": [%.3f ms, %.3f ms) %lu", handle->name,
+                        ns_to_ms(latency_histogram_bucket_lower_ns(i)), ns_to_ms(latency_histogram_bucket_upper_ns(i)),
+                        intervals.counts[i]);
+            }
+        }
+    }
+}
+
+/*
+ * Warn about a thread that is getting close to the timeout, once per stall.
+ */
+static void
+watchdog_check_stall(WatchdogHandle *handle, long long inactive_ns, long long warning_ns)
+{
+    if (inactive_ns <= warning_ns) {
+        handle->stall_reported = false;
+    } else if (!handle->stall_reported) {
+        handle->stall_reported = true;
+        ELOG("Thread \"%s\" hasn't reported activity for %.3f s (timeout %.3f s)",
+                handle->name, (double)inactive_ns / NSEC_PER_SEC, shared.timeout_seconds);
+    }
+}
+
+/*
+ * Warn about a thread whose p99 interval between reports of activity over the warning window
+ * is getting close to the timeout, and start a new window.
+ */
+static void
+watchdog_check_intervals(WatchdogHandle *handle, long long warning_ns, long long window_ns)
+{
+    LatencyHistogram intervals;
+    latency_histogram_load(&handle->intervals, &intervals);
+
+    LatencyHistogram window_intervals = intervals;
+    latency_histogram_subtract(&window_intervals, &handle->window_start_intervals);
+    handle->window_start_intervals = intervals;
+
+    long long p99_ns = latency_histogram_percentile_ns(&window_intervals, 0.99);
+    if (p99_ns > warning_ns) {
+        ELOG("Thread \"%s\" is slowing down: p99 interval between reports of activity %.3f s over the last %.0f s "
+                "(%lu reports, timeout %.3f s)", handle->name, (double)p99_ns / NSEC_PER_SEC,
+                (double)window_ns / NSEC_PER_SEC, latency_histogram_n_recorded(&window_intervals), shared.timeout_seconds);
+    }
+}
+
+static void
+watchdog_cancel_watched_threads(void)
+{
+    WatchdogHandle *handle = __atomic_load_n(&shared.watched_threads, __ATOMIC_ACQUIRE);
+    for (; handle; handle = __atomic_load_n(&handle->next, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&handle->state, __ATOMIC_ACQUIRE) == WATCHED_THREAD_ACTIVE) {
+            pthread_cancel(handle->id);
+        }
+    }
+}
+
+static void
+watchdog_remove_retired_threads(void)
 {
     int iret = pthread_mutex_lock(&watchdog_lock);
     assert(iret == 0);
     pthread_cleanup_push(cleanup_mutex_unlock, &watchdog_lock);
 
-    struct timespec now;
-    iret = clock_gettime(CLOCK_MONOTONIC, &now);
-    assert(iret == 0);
+    WatchdogHandle **link = &shared.watched_threads;
+    while (*link) {
+        WatchdogHandle *handle = *link;
+        if (__atomic_load_n(&handle->state, __ATOMIC_ACQUIRE) == WATCHED_THREAD_RETIRED) {
+            __atomic_store_n(link, handle->next, __ATOMIC_RELEASE);
+            free(handle);
+        } else {
+            link = &handle->next;
+        }
+    }
 
-    for (int i = 0; i < shared.n_watched_threads; i++) {
-        struct timespec *last_activity = &shared.watched_threads[i].last_activity;
+    pthread_cleanup_pop(1);
+}
 
-        double diff = 0;
-        diff += (double)(now.tv_sec - last_activity->tv_sec);
-        diff += (now.tv_nsec - last_activity->tv_nsec) / (1000 * 1000 * 1000);
+static void
+watchdog_check_threads_activity(void)
+{
+    long long now_ns = clock_now_ns(CLOCK_MONOTONIC);
+    long long timeout_ns = (long long)(shared.timeout_seconds * NSEC_PER_SEC);
+    long long warning_ns = (long long)(WATCHDOG_WARNING_FRACTION * (double)timeout_ns);
+    long long window_ns = now_ns - shared.window_start_ns;
+    bool window_ended = window_ns >= WATCHDOG_WARNING_WINDOW_NS;
+    bool found_retired = false;
+
+    WatchdogHandle *handle = __atomic_load_n(&shared.watched_threads, __ATOMIC_ACQUIRE);
+    for (; handle; handle = __atomic_load_n(&handle->next, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&handle->state, __ATOMIC_ACQUIRE) != WATCHED_THREAD_ACTIVE) {
+            found_retired = true;
+            continue;
+        }
 
-        if (diff > 2) {
-            EPRINT("Thread \"%s\" timed out. Exiting the program.", shared.watched_threads[i].name);
-            ELOG(true, "Thread \"%s\" timed out. Exiting the program.", shared.watched_threads[i].name);
+        long long last_activity_ns = __atomic_load_n(&handle->last_activity_ns, __ATOMIC_RELAXED);
+        if (now_ns - last_activity_ns > timeout_ns) {
+            EPRINT("Thread \"%s\" timed out. Exiting the program.", handle->name);
+            ELOG("Thread \"%s\" timed out. Exiting the program.", handle->name);
 
-            for (int j = 0; j < shared.n_watched_threads; j++) {
-                pthread_cancel(shared.watched_threads[j].id);
-            }
+            watchdog_cancel_watched_threads();
 
             pthread_exit(NULL);
         }
+
+        watchdog_check_stall(handle, now_ns - last_activity_ns, warning_ns);
+
+        if (window_ended) {
+            watchdog_check_intervals(handle, warning_ns, window_ns);
+        }
     }
 
-    pthread_cleanup_pop(1);
+    if (window_ended) {
+        shared.window_start_ns = now_ns;
+    }
+
+    if (found_retired) {
+        watchdog_remove_retired_threads();
+    }
 }
 
 static void
 watchdog_deinit(void *arg)
 {
-    (void)(arg);
+    free(arg);
 
     int iret = pthread_mutex_lock(&watchdog_lock);
     assert(iret == 0);
     pthread_cleanup_push(cleanup_mutex_unlock, &watchdog_lock);
 
+    /* The threads still registered own their handles from now on */
+    WatchdogHandle *handle = shared.watched_threads;
+    while (handle) {
+        WatchdogHandle *next = handle->next;
+        if (__atomic_exchange_n(&handle->state, WATCHED_THREAD_ORPHANED, __ATOMIC_ACQ_REL) == WATCHED_THREAD_RETIRED) {
+            free(handle);
+        }
+        handle = next;
+    }
+
     memset(&shared, 0, sizeof(shared));
 
     signal_received = 0;
+    dump_requested = 0;
 
     pthread_cleanup_pop(1);
 }
 
 static void
-watchdog_init(void)
+watchdog_init(WatchdogArgs *args)
 {
     int iret = pthread_mutex_lock(&watchdog_lock);
     assert(iret == 0);
     pthread_cleanup_push(cleanup_mutex_unlock, &watchdog_lock);
 
+    assert(args->timeout_seconds > 0);
+    shared.timeout_seconds = args->timeout_seconds;
+    shared.window_start_ns = clock_now_ns(CLOCK_MONOTONIC);
+
     shared.watchdog_initialized = true;
 
     sigset_t masked_signals;
     sigemptyset(&masked_signals);
     sigaddset(&masked_signals, SIGTERM);
+    sigaddset(&masked_signals, SIGUSR1);
     iret = pthread_sigmask(SIG_UNBLOCK, &masked_signals, NULL);
     assert(iret == 0);
 
@@ -106,7 +281,12 @@ watchdog_init(void)
     iret = sigaction(SIGTERM, &sa, NULL);
     assert(iret == 0);
 
-    iret = pthread_cond_signal(&cond_on_watchdog_initialized);
+    sa.sa_handler = watchdog_handle_dump_signal;
+
+    iret = sigaction(SIGUSR1, &sa, NULL);
+    assert(iret == 0);
+
+    iret = pthread_cond_broadcast(&cond_on_watchdog_initialized);
     assert(iret == 0);
 
     pthread_cleanup_pop(1);
@@ -118,13 +298,18 @@ watchdog_loop(void)
     while (1) {
         watchdog_check_threads_activity();
 
+        if (dump_requested) {
+            dump_requested = 0;
+            stats_log();
+            watchdog_log_histograms();
+            server_log_clients();
+        }
+
         if (signal_received) {
             EPRINT("Received signal %d. Exiting program.", signal_received);
-            ELOG(true, "Received signal %d. Exiting program.", signal_received);
+            ELOG("Received signal %d. Exiting program.", signal_received);
 
-            for (int i = 0; i < shared.n_watched_threads; i++) {
-                pthread_cancel(shared.watched_threads[i].id);
-            }
+            watchdog_cancel_watched_threads();
 
             pthread_exit(NULL);
         }
@@ -136,11 +321,11 @@ watchdog_loop(void)
 void *
 watchdog_run(void *arg)
 {
-    (void)(arg);
+    assert(arg);
 
-    watchdog_init();
+    watchdog_init(arg);
 
-    pthread_cleanup_push(watchdog_deinit, NULL);
+    pthread_cleanup_push(watchdog_deinit, arg);
 
     watchdog_loop();
 
@@ -149,49 +334,67 @@ watchdog_run(void *arg)
     pthread_exit(NULL);
 }
 
-void
-watchdog_signal_active(const char *name)
+WatchdogHandle *
+watchdog_register(const char *name)
 {
     assert(name);
 
+    void *memory;
+    if (posix_memalign(&memory, WATCHDOG_CACHE_LINE_SIZE, sizeof(WatchdogHandle)) != 0) {
+        EPRINT("posix_memalign() failed");
+        exit(EXIT_FAILURE);
+    }
+    WatchdogHandle *handle = memset(memory, 0, sizeof(WatchdogHandle));
+
+    handle->id = pthread_self();
+    handle->state = WATCHED_THREAD_ACTIVE;
+
+    size_t len = strlen(name);
+    size_t maxlen = sizeof(handle->name);
+    if (len >= maxlen) {
+        len = maxlen - 1;
+    }
+    memcpy(handle->name, name, len);
+    handle->name[len] = '\0';
+
     int iret = pthread_mutex_lock(&watchdog_lock);
     assert(iret == 0);
     pthread_cleanup_push(cleanup_mutex_unlock, &watchdog_lock);
+    /* Not leaked if the thread gets cancelled while waiting for Watchdog */
+    pthread_cleanup_push(free, handle);
 
     ensure_initialized(&shared.watchdog_initialized, &cond_on_watchdog_initialized, &watchdog_lock);
 
-    pthread_t self = pthread_self();
+    pthread_cleanup_pop(0);
 
-    int i;
-    for (i = 0; i < shared.n_watched_threads; i++) {
-        if (pthread_equal(shared.watched_threads[i].id, self)) {
-            break;
-        }
+    handle->last_activity_ns = clock_now_ns(CLOCK_MONOTONIC);
+    handle->next = shared.watched_threads;
+    __atomic_store_n(&shared.watched_threads, handle, __ATOMIC_RELEASE);
+
+    pthread_cleanup_pop(1);
+
+    return handle;
+}
+
+void
+watchdog_unregister(WatchdogHandle *handle)
+{
+    if (!handle) {
+        return;
     }
-    if (i == shared.n_watched_threads) {
-        if ((size_t)shared.n_watched_threads >= sizeof(shared.watched_threads) / sizeof(shared.watched_threads[0])) {
-            EPRINT("Exceeded maximum number of watched threads");
-            ELOG(true, "Exceeded maximum number of watched threads");
-            pthread_exit(NULL);
-        }
-        shared.n_watched_threads++;
-        shared.watched_threads[i].id = self;
 
-        size_t len = strlen(name);
-        size_t maxlen = sizeof(shared.watched_threads[0].name);
-        if (len > maxlen) {
-            len = maxlen;
-        }
-        char *dest = shared.watched_threads[i].name;
-        memcpy(dest, name, len);
-        dest[len] = '\0';
+    if (__atomic_exchange_n(&handle->state, WATCHED_THREAD_RETIRED, __ATOMIC_ACQ_REL) == WATCHED_THREAD_ORPHANED) {
+        free(handle);
     }
+}
 
-    struct timespec ts;
-    iret = clock_gettime(CLOCK_MONOTONIC, &ts);
-    assert(iret == 0);
+void
+watchdog_signal_active(WatchdogHandle *handle)
+{
+    long long now_ns = clock_now_ns(CLOCK_MONOTONIC);
 
-    shared.watched_threads[i].last_activity = ts;
+    /* Only this thread writes the timestamp, so it can read it without synchronization */
+    latency_histogram_record(&handle->intervals, now_ns - handle->last_activity_ns);
 
-    pthread_cleanup_pop(1);
+    __atomic_store_n(&handle->last_activity_ns, now_ns, __ATOMIC_RELAXED);
 }
@@ -1,21 +1,49 @@
 #ifndef WATCHDOG_H
 #define WATCHDOG_H
 
+#define WATCHDOG_DEFAULT_TIMEOUT_SECONDS 2.0
+
+typedef struct {
+    /* A watched thread that doesn't report activity for longer than this is considered hung */
+    double timeout_seconds;
+} WatchdogArgs;
+
+typedef struct WatchdogHandle WatchdogHandle;
+
 /*
  * In order for Watchdog to correctly handle signals the relevant signals
  * must be masked (blocked) in all other threads.
+ *
+ * SIGTERM: cancel all watched threads and exit.
+ * SIGUSR1: log the counters, timers and gauges of stats.h, and the histogram of the intervals between
+ *          reports of activity of every watched thread, and the counters of the Server's clients.
+ *
+ * Watchdog also logs a warning when a thread hasn't reported activity for 3/4 of the timeout,
+ * and when the p99 interval between a thread's reports over the last 10 seconds exceeds that.
  */
 void * watchdog_run(void *arg);
 
 /*
- * Signal that the thread is still active.
- * If a watched thread doesn't report activity for more than 2 seconds Watchdog
- * will cancel all watched threads and exit.
- * Using this function automatically adds the thread to the list of watched threads.
+ * Add the calling thread to the list of watched threads.
+ * Blocks until Watchdog is initialized.
+ * If a watched thread doesn't report activity for longer than the configured timeout
+ * Watchdog will cancel all watched threads and exit.
  *
  * name must be a valid C string containing the name of the thread that
  * will be logged if the thread hangs.
  */
-void watchdog_signal_active(const char *name);
+WatchdogHandle * watchdog_register(const char *name);
+
+/*
+ * Remove the thread from the list of watched threads, e.g. from its cleanup handler.
+ * The handle must not be used after this call. handle can be NULL.
+ */
+void watchdog_unregister(WatchdogHandle *handle);
+
+/*
+ * Signal that the thread is still active, and record the interval since its previous report.
+ * Lock-free, must only be called by the thread that registered the handle.
+ */
+void watchdog_signal_active(WatchdogHandle *handle);
 
 #endif /* WATCHDOG_H */